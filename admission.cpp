@@ -0,0 +1,124 @@
+#include "admission.hpp"
+
+namespace Socks {
+
+// ==========================
+// Lane
+// ==========================
+
+void AdmissionQueue::Lane::grow() {
+    std::vector<PendingRequest> slots(slots_.empty() ? 16
+                                                     : slots_.size() * 2);
+    for (std::size_t i = 0; i < size_; ++i) {
+        slots[i] = std::move(slots_[(head_ + i) & (slots_.size() - 1)]);
+    }
+    slots_.swap(slots);
+    head_ = 0;
+}
+
+void AdmissionQueue::Lane::push_back(PendingRequest request) {
+    if (size_ == slots_.size()) {
+        grow();
+    }
+    slots_[(head_ + size_) & (slots_.size() - 1)] = std::move(request);
+    ++size_;
+}
+
+PendingRequest AdmissionQueue::Lane::pop_front() {
+    PendingRequest request = std::move(slots_[head_]);
+    head_ = (head_ + 1) & (slots_.size() - 1);
+    --size_;
+    return request;
+}
+
+// ==========================
+// AdmissionQueue
+// ==========================
+
+void AdmissionQueue::configure(std::size_t capacity, Overflow overflow) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        capacity_ = capacity;
+        overflow_ = overflow;
+    }
+    not_full_.notify_all();
+}
+
+AdmissionQueue::Admit
+AdmissionQueue::push(PendingRequest &request, Priority priority,
+                     std::optional<PendingRequest> &evicted) {
+    auto lane = static_cast<std::size_t>(priority);
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (closed_)
+        return Admit::Rejected;
+
+    if (full()) {
+        switch (overflow_) {
+        case Overflow::Block:
+            not_full_.wait(lock, [this] { return closed_ || !full(); });
+            if (closed_)
+                return Admit::Rejected;
+            break;
+        case Overflow::Reject:
+            return Admit::Rejected;
+        case Overflow::DropOldest: {
+            // The least urgent lane pays, never one more urgent than the
+            // newcomer.
+            std::size_t victim = kPriorityCount - 1;
+            while (victim > lane && lanes_[victim].empty())
+                --victim;
+            if (lanes_[victim].empty())
+                return Admit::Rejected;
+            evicted.emplace(lanes_[victim].pop_front());
+            --size_;
+            break;
+        }
+        }
+    }
+
+    lanes_[lane].push_back(std::move(request));
+    ++size_;
+    return Admit::Queued;
+}
+
+bool AdmissionQueue::pop(PendingRequest &request) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (size_ == 0)
+            return false;
+        for (Lane &lane : lanes_) {
+            if (!lane.empty()) {
+                request = lane.pop_front();
+                break;
+            }
+        }
+        --size_;
+    }
+    not_full_.notify_one();
+    return true;
+}
+
+void AdmissionQueue::close() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+    }
+    not_full_.notify_all();
+}
+
+void AdmissionQueue::open() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = false;
+}
+
+std::size_t AdmissionQueue::size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return size_;
+}
+
+std::size_t AdmissionQueue::capacity() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return capacity_;
+}
+
+} // namespace Socks
@@ -0,0 +1,146 @@
+#pragma once
+
+#include "buffer.hpp"
+#include "commands.hpp"
+
+#include <array>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+/**
+ * @file admission.hpp
+ * @brief Bounded, prioritized queue of requests waiting for a worker.
+ *
+ * The server puts every request it routes to its ThreadPool in an
+ * AdmissionQueue rather than in the pool itself, and each pool job takes
+ * the most urgent request waiting. The queue can be bounded, so that a
+ * burst sheds load according to an Overflow policy instead of growing the
+ * queue, and every request's latency with it, without limit.
+ */
+
+namespace Socks {
+
+class CommandTable;
+class Transport;
+
+/**
+ * @brief What happens to a request arriving at a full AdmissionQueue.
+ */
+enum class Overflow {
+    /// Wait for room. The receiving thread stalls, so clients see
+    /// backpressure from the transport (TCP windows, socket buffers).
+    Block,
+    /// Turn the new request away at once with an error response.
+    Reject,
+    /// Make room by turning away the oldest request of the lowest priority
+    /// queued, unless all are more urgent than the new one, which is then
+    /// turned away instead.
+    DropOldest,
+};
+
+/**
+ * @brief A request received and routed, waiting for a worker.
+ */
+struct PendingRequest {
+    Buffer data;
+    Transport *transport = nullptr; ///< Received on, and answered on
+    std::string client_id;
+    std::shared_ptr<const CommandTable> table; ///< Table it was routed with
+    const Command *command = nullptr;    ///< Null if `_cmd` must be parsed
+    std::int64_t received = -1;          ///< See Server::handle_request()
+    std::int64_t deadline = -1; ///< Steady-clock ns, or negative for none
+};
+
+/**
+ * @class AdmissionQueue
+ * @brief One FIFO lane per Priority, with an optional bound on the total.
+ *
+ * Thread-safe. pop() serves lanes strictly by priority.
+ */
+class AdmissionQueue {
+  public:
+    /**
+     * @brief Outcome of push().
+     */
+    enum class Admit {
+        Queued,   ///< The request waits in the queue
+        Rejected, ///< The queue was full (or closed); the request was not
+                  ///< queued and is handed back
+    };
+
+    /**
+     * @brief An unbounded queue.
+     */
+    AdmissionQueue() = default;
+
+    /**
+     * @brief Set the bound; 0 means unbounded. Takes effect for the next
+     * push(); requests already queued stay.
+     */
+    void configure(std::size_t capacity, Overflow overflow);
+
+    /**
+     * @brief Queue a request according to the Overflow policy.
+     *
+     * @param request Moved from only when queued.
+     * @param priority Lane of the request.
+     * @param evicted Receives the request dropped to make room, under
+     * Overflow::DropOldest.
+     */
+    Admit push(PendingRequest &request, Priority priority,
+               std::optional<PendingRequest> &evicted);
+
+    /**
+     * @brief Take the oldest request of the most urgent non-empty lane.
+     * @return false if the queue is empty.
+     */
+    bool pop(PendingRequest &request);
+
+    /**
+     * @brief Stop admitting: blocked and later push() calls return
+     * Admit::Rejected. Queued requests can still be popped.
+     */
+    void close();
+
+    /**
+     * @brief Admit requests again after close().
+     */
+    void open();
+
+    std::size_t size() const;
+    std::size_t capacity() const;
+
+  private:
+    /// Growable ring buffer; like ThreadPool's, it stops allocating once
+    /// it has grown to the working-set size.
+    class Lane {
+      public:
+        bool empty() const { return size_ == 0; }
+        void push_back(PendingRequest request);
+        PendingRequest pop_front();
+
+      private:
+        void grow();
+
+        std::vector<PendingRequest> slots_; ///< Power-of-two capacity
+        std::size_t head_ = 0;
+        std::size_t size_ = 0;
+    };
+
+    bool full() const { return capacity_ != 0 && size_ >= capacity_; }
+
+    mutable std::mutex mutex_;
+    std::condition_variable not_full_; ///< Signals Overflow::Block pushers
+    std::array<Lane, kPriorityCount> lanes_;
+    std::size_t size_ = 0;
+    std::size_t capacity_ = 0;
+    Overflow overflow_ = Overflow::Reject;
+    bool closed_ = false;
+};
+
+} // namespace Socks
@@ -0,0 +1,126 @@
+#include "affinity.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+
+namespace Socks {
+
+namespace {
+
+/// Parse a kernel CPU list such as "0-3,8,10-11".
+std::vector<int> parse_cpu_list(const std::string &text) {
+    std::vector<int> cpus;
+    const char *p = text.c_str();
+    while (*p) {
+        char *end;
+        long first = std::strtol(p, &end, 10);
+        if (end == p)
+            break;
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            last = std::strtol(p + 1, &end, 10);
+            p = end;
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu)
+            cpus.push_back(static_cast<int>(cpu));
+        if (*p != ',')
+            break;
+        ++p;
+    }
+    return cpus;
+}
+
+} // namespace
+
+CpuAffinity CpuAffinity::cores(const std::vector<int> &cpus) {
+    CpuAffinity affinity;
+    for (int cpu : cpus)
+        affinity.sets.push_back({cpu});
+    return affinity;
+}
+
+CpuAffinity CpuAffinity::all_cores() { return cores(allowed_cpus()); }
+
+CpuAffinity CpuAffinity::numa_nodes(const std::vector<int> &nodes) {
+    CpuAffinity affinity;
+    for (int node : nodes) {
+        std::vector<int> cpus = numa_node_cpus(node);
+        if (!cpus.empty())
+            affinity.sets.push_back(std::move(cpus));
+    }
+    return affinity;
+}
+
+const std::vector<int> &CpuAffinity::cpus_of(std::size_t index) const {
+    static const std::vector<int> none;
+    return sets.empty() ? none : sets[index % sets.size()];
+}
+
+int CpuAffinity::cpu_of(std::size_t index) const {
+    const std::vector<int> &cpus = cpus_of(index);
+    return cpus.size() == 1 ? cpus[0] : -1;
+}
+
+bool pin_current_thread(const std::vector<int> &cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &set);
+    }
+    if (CPU_COUNT(&set) == 0)
+        return false;
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+int current_cpu() { return sched_getcpu(); }
+
+std::vector<int> allowed_cpus() {
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+        return cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &set))
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+std::vector<int> numa_node_cpus(int node) {
+    std::ifstream file("/sys/devices/system/node/node" +
+                       std::to_string(node) + "/cpulist");
+    std::string text;
+    if (!file || !std::getline(file, text)) {
+        // Without NUMA support everything is node 0.
+        return node == 0 ? allowed_cpus() : std::vector<int>();
+    }
+    return parse_cpu_list(text);
+}
+
+int numa_node_of_cpu(int cpu) {
+    // The CPU's sysfs directory links to its node as "node<N>".
+    std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+    DIR *dir = opendir(path.c_str());
+    if (!dir)
+        return 0;
+    int node = 0;
+    while (dirent *entry = readdir(dir)) {
+        if (std::strncmp(entry->d_name, "node", 4) == 0 &&
+            entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+            node = std::atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+} // namespace Socks
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+/**
+ * @file affinity.hpp
+ * @brief Pin threads to CPUs and NUMA nodes.
+ *
+ * On a multi-socket machine a request handled by an unpinned thread may be
+ * received on one node, run on another and answered from a third, with its
+ * buffers crossing the interconnect each time. A CpuAffinity says where a
+ * group of threads (ThreadPool workers, epoll reactors) may run; pinned
+ * threads then allocate their own state after pinning, so that the
+ * kernel's first-touch policy places it on their node.
+ *
+ * NUMA topology is read from /sys/devices/system/node; a machine without
+ * it is treated as a single node.
+ */
+
+namespace Socks {
+
+/**
+ * @brief The CPUs each thread of a group may run on.
+ *
+ * Thread `i` gets `sets[i % sets.size()]`. An empty CpuAffinity leaves
+ * threads unpinned.
+ */
+struct CpuAffinity {
+    std::vector<std::vector<int>> sets;
+
+    /**
+     * @brief One CPU per thread: thread `i` runs on `cpus[i % size]`.
+     */
+    static CpuAffinity cores(const std::vector<int> &cpus);
+
+    /**
+     * @brief Every CPU the process may use, one per thread, in order.
+     */
+    static CpuAffinity all_cores();
+
+    /**
+     * @brief Spread threads over NUMA nodes: thread `i` may run on any CPU
+     * of `nodes[i % size]`. Nodes without CPUs are skipped.
+     */
+    static CpuAffinity numa_nodes(const std::vector<int> &nodes);
+
+    bool empty() const { return sets.empty(); }
+
+    /**
+     * @brief The CPUs thread `index` may run on; empty if unpinned.
+     */
+    const std::vector<int> &cpus_of(std::size_t index) const;
+
+    /**
+     * @brief The one CPU thread `index` is pinned to, or -1 if it is
+     * unpinned or may run on several.
+     */
+    int cpu_of(std::size_t index) const;
+};
+
+/**
+ * @brief Pin the calling thread to `cpus`.
+ * @return false if the CPUs are not usable (e.g. outside the process's
+ * cpuset); the thread's affinity is then unchanged.
+ */
+bool pin_current_thread(const std::vector<int> &cpus);
+
+/**
+ * @brief The CPU the calling thread is running on, or -1 if unknown.
+ */
+int current_cpu();
+
+/**
+ * @brief The CPUs the calling thread may run on.
+ */
+std::vector<int> allowed_cpus();
+
+/**
+ * @brief The CPUs of NUMA node `node`; empty if there is no such node.
+ */
+std::vector<int> numa_node_cpus(int node);
+
+/**
+ * @brief The NUMA node of `cpu`, or 0 if unknown.
+ */
+int numa_node_of_cpu(int cpu);
+
+} // namespace Socks
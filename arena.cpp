@@ -0,0 +1,74 @@
+#include "arena.hpp"
+
+#include <algorithm>
+
+namespace Socks {
+
+thread_local Arena *Arena::current_ = nullptr;
+
+Arena::Arena(std::size_t chunk_bytes)
+    : chunk_bytes_(std::max<std::size_t>(chunk_bytes, 256)) {}
+
+Arena::~Arena() { free_chunks(); }
+
+void *Arena::allocate_slow(std::size_t size, std::size_t align) {
+    // Each chunk at least doubles the arena, so a request that outgrows the
+    // first chunk needs only a few more.
+    std::size_t want = std::max(chunk_bytes_, capacity_);
+    add_chunk(std::max(want, size + align));
+    char *p = align_up(cursor_, align);
+    cursor_ = p + size;
+    return p;
+}
+
+void Arena::add_chunk(std::size_t size) {
+    void *memory = ::operator new(sizeof(Chunk) + size);
+    Chunk *chunk = static_cast<Chunk *>(memory);
+    chunk->next = chunks_;
+    chunk->size = size;
+    chunks_ = chunk;
+    cursor_ = chunk->bytes();
+    end_ = cursor_ + size;
+    capacity_ += size;
+}
+
+bool Arena::owns(const void *p) const noexcept {
+    auto *byte = static_cast<const char *>(p);
+    for (Chunk *chunk = chunks_; chunk; chunk = chunk->next) {
+        const char *begin = chunk->bytes();
+        if (byte >= begin && byte < begin + chunk->size)
+            return true;
+    }
+    return false;
+}
+
+void Arena::reset() noexcept {
+    if (!chunks_)
+        return;
+    if (!chunks_->next &&
+        chunks_->size <= std::max(max_retained_, chunk_bytes_)) {
+        cursor_ = chunks_->bytes();
+        return;
+    }
+    // Replace several chunks by one that holds them all, so the next
+    // request of this size is served from a single chunk.
+    std::size_t retained = std::min(capacity_, max_retained_);
+    free_chunks();
+    try {
+        add_chunk(std::max(retained, chunk_bytes_));
+    } catch (const std::bad_alloc &) {
+        // Start empty; the next allocate() tries again.
+    }
+}
+
+void Arena::free_chunks() noexcept {
+    while (chunks_) {
+        Chunk *next = chunks_->next;
+        ::operator delete(chunks_);
+        chunks_ = next;
+    }
+    cursor_ = end_ = nullptr;
+    capacity_ = 0;
+}
+
+} // namespace Socks
@@ -0,0 +1,255 @@
+#pragma once
+
+#include "nlohmann/json.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <new>
+#include <string>
+#include <vector>
+
+/**
+ * @file arena.hpp
+ * @brief Monotonic per-thread arenas for request-scoped JSON values.
+ *
+ * nlohmann::json allocates every object node, string and array separately
+ * and frees them one by one when the value is destroyed. For a value that
+ * lives exactly as long as one request, those allocations can come from an
+ * Arena instead: a bump allocator that hands out memory from a few large
+ * chunks and releases it all at once.
+ *
+ * ArenaJson is nlohmann::basic_json with ArenaAllocator. It allocates from
+ * the arena installed on the calling thread by an ArenaScope, and from the
+ * global heap if there is none:
+ *
+ * @code
+ * Arena arena;
+ * {
+ *     ArenaScope scope(arena);
+ *     ArenaJson value = ArenaJson::parse(text); // no malloc per node
+ *     ...
+ * } // every allocation made inside the scope is released here
+ * @endcode
+ *
+ * An arena-backed value must be destroyed before its scope ends, on the same
+ * thread. Copy it into a plain json to keep it longer.
+ */
+
+namespace Socks {
+
+/**
+ * @class Arena
+ * @brief Monotonic allocator over a list of chunks, released by reset().
+ *
+ * allocate() bumps a pointer through the current chunk and starts a bigger
+ * chunk when it runs out. deallocate() does nothing, except that freeing the
+ * most recent allocation hands its bytes back, which makes a growing vector
+ * or string mostly reuse its own space. reset() frees everything at once and
+ * keeps a single chunk as large as everything the arena held, so a thread
+ * that handles similar requests settles on one chunk and stops allocating.
+ *
+ * An Arena is not thread-safe; each thread uses its own.
+ */
+class Arena {
+  public:
+    /**
+     * @brief Construct an empty arena; memory is allocated on first use.
+     * @param chunk_bytes Size of the first chunk.
+     */
+    explicit Arena(std::size_t chunk_bytes = 64 * 1024);
+
+    /**
+     * @brief Free all chunks.
+     */
+    ~Arena();
+
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    /**
+     * @brief Allocate `size` bytes aligned to `align` (a power of two).
+     * @throws std::bad_alloc if a new chunk cannot be allocated.
+     */
+    void *allocate(std::size_t size,
+                   std::size_t align = alignof(std::max_align_t)) {
+        char *p = align_up(cursor_, align);
+        if (static_cast<std::size_t>(end_ - p) < size || !cursor_)
+            return allocate_slow(size, align);
+        cursor_ = p + size;
+        return p;
+    }
+
+    /**
+     * @brief Give back the most recent allocation; anything else is a no-op
+     * until reset().
+     */
+    void deallocate(void *p, std::size_t size) noexcept {
+        if (static_cast<char *>(p) + size == cursor_)
+            cursor_ = static_cast<char *>(p);
+    }
+
+    /**
+     * @brief Whether `p` points into memory handed out by this arena.
+     */
+    bool owns(const void *p) const noexcept;
+
+    /**
+     * @brief Release every allocation at once.
+     *
+     * Keeps one chunk sized to what the arena held (up to max_retained()),
+     * so the next round of allocations fits in it.
+     */
+    void reset() noexcept;
+
+    /**
+     * @brief Bytes held in chunks, including unused space.
+     */
+    std::size_t capacity() const noexcept { return capacity_; }
+
+    /**
+     * @brief Largest chunk kept across reset() (default 4 MiB).
+     */
+    std::size_t max_retained() const noexcept { return max_retained_; }
+    void set_max_retained(std::size_t bytes) noexcept {
+        max_retained_ = bytes;
+    }
+
+    /**
+     * @brief The calling thread's current arena, or nullptr.
+     *
+     * Set by ArenaScope; ArenaAllocator allocates from it.
+     */
+    static Arena *current() noexcept { return current_; }
+
+  private:
+    friend class ArenaScope;
+
+    /// Header of a chunk; its bytes follow it in memory.
+    struct Chunk {
+        Chunk *next;
+        std::size_t size; ///< Usable bytes after the header
+        char *bytes() noexcept { return reinterpret_cast<char *>(this + 1); }
+    };
+
+    static char *align_up(char *p, std::size_t align) noexcept {
+        auto bits = reinterpret_cast<std::uintptr_t>(p);
+        return p + ((align - bits % align) % align);
+    }
+
+    void *allocate_slow(std::size_t size, std::size_t align);
+    void add_chunk(std::size_t size);
+    void free_chunks() noexcept;
+
+    Chunk *chunks_ = nullptr; ///< Most recent first
+    char *cursor_ = nullptr;
+    char *end_ = nullptr;
+    std::size_t capacity_ = 0;
+    std::size_t chunk_bytes_;
+    std::size_t max_retained_ = 4 * 1024 * 1024;
+
+    static thread_local Arena *current_;
+};
+
+/**
+ * @class ArenaScope
+ * @brief Installs an arena as the calling thread's current one.
+ *
+ * On destruction, restores the previously current arena and resets this
+ * one, releasing everything allocated from it within the scope.
+ */
+class ArenaScope {
+  public:
+    explicit ArenaScope(Arena &arena) noexcept
+        : arena_(arena), previous_(Arena::current_) {
+        Arena::current_ = &arena;
+    }
+
+    ~ArenaScope() {
+        Arena::current_ = previous_;
+        arena_.reset();
+    }
+
+    ArenaScope(const ArenaScope &) = delete;
+    ArenaScope &operator=(const ArenaScope &) = delete;
+
+  private:
+    Arena &arena_;
+    Arena *previous_;
+};
+
+/**
+ * @brief Stateless allocator drawing from Arena::current().
+ *
+ * nlohmann::json default-constructs its allocators, so the arena cannot be
+ * carried in the allocator and is looked up per thread instead. Without a
+ * current arena, memory comes from the global heap; deallocate() tells the
+ * two apart, so heap-allocated values may be destroyed inside a scope.
+ */
+template <typename T> struct ArenaAllocator {
+    using value_type = T;
+
+    ArenaAllocator() noexcept = default;
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U> &) noexcept {}
+
+    T *allocate(std::size_t n) {
+        if (Arena *arena = Arena::current())
+            return static_cast<T *>(arena->allocate(n * sizeof(T), alignof(T)));
+        return static_cast<T *>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T *p, std::size_t n) noexcept {
+        Arena *arena = Arena::current();
+        if (arena && arena->owns(p)) {
+            arena->deallocate(p, n * sizeof(T));
+        } else {
+            ::operator delete(p);
+        }
+    }
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U> &) const noexcept {
+        return true;
+    }
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U> &) const noexcept {
+        return false;
+    }
+};
+
+/**
+ * @brief std::string drawing from the current arena.
+ *
+ * A thin subclass rather than an alias: nlohmann's binary reader passes a
+ * std::string where it expects the json's string type (for UBJSON
+ * high-precision numbers), so this must be constructible from one.
+ */
+class ArenaString
+    : public std::basic_string<char, std::char_traits<char>,
+                               ArenaAllocator<char>> {
+    using Base =
+        std::basic_string<char, std::char_traits<char>, ArenaAllocator<char>>;
+
+  public:
+    using Base::Base;
+    ArenaString() = default;
+    ArenaString(const Base &other) : Base(other) {}
+    ArenaString(Base &&other) noexcept : Base(std::move(other)) {}
+    ArenaString(const std::string &other)
+        : Base(other.data(), other.size()) {}
+};
+
+/**
+ * @brief nlohmann::json whose nodes, strings and arrays come from the
+ * current arena.
+ *
+ * Converts to and from json implicitly (by deep copy), so existing helpers
+ * taking `const json&` still accept it.
+ */
+using ArenaJson = nlohmann::basic_json<
+    std::map, std::vector, ArenaString, bool, std::int64_t, std::uint64_t,
+    double, ArenaAllocator, nlohmann::adl_serializer,
+    std::vector<std::uint8_t, ArenaAllocator<std::uint8_t>>>;
+
+} // namespace Socks
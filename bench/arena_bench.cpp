@@ -0,0 +1,52 @@
+#include "../codec.hpp"
+
+#include <benchmark/benchmark.h>
+
+using namespace Socks;
+
+/**
+ * @file arena_bench.cpp
+ * @brief Parsing and building a request with json vs ArenaJson.
+ *
+ * Each iteration decodes a request, builds a response from it and encodes
+ * that, as a handler would. The argument is the number of array elements.
+ */
+
+static std::string request_of(int elements) {
+    json request = {{"_cmd", "sum"}, {"tag", "a tag longer than sso"}};
+    for (int i = 0; i < elements; ++i)
+        request["items"].push_back({{"id", i}, {"name", "item name"}});
+    return encode(request, Codec::Json);
+}
+
+template <typename Json> static Json respond_to(const Json &request) {
+    Json response;
+    for (const auto &item : request["items"])
+        response["ids"].push_back(item["id"]);
+    response["_success"] = true;
+    return response;
+}
+
+static void BM_RequestJson(benchmark::State &state) {
+    std::string wire = request_of(static_cast<int>(state.range(0)));
+    for (auto _ : state) {
+        json request = decode(wire);
+        Buffer out;
+        encode(respond_to(request), Codec::Json, out);
+        benchmark::DoNotOptimize(out.data());
+    }
+}
+BENCHMARK(BM_RequestJson)->Arg(4)->Arg(64)->Arg(1024);
+
+static void BM_RequestArena(benchmark::State &state) {
+    std::string wire = request_of(static_cast<int>(state.range(0)));
+    Arena arena;
+    for (auto _ : state) {
+        ArenaScope scope(arena);
+        ArenaJson request = decode_arena(wire);
+        Buffer out;
+        encode(respond_to(request), Codec::Json, out);
+        benchmark::DoNotOptimize(out.data());
+    }
+}
+BENCHMARK(BM_RequestArena)->Arg(4)->Arg(64)->Arg(1024);
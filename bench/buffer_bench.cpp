@@ -0,0 +1,80 @@
+#include "../codec.hpp"
+#include "../server.hpp"
+
+#include <benchmark/benchmark.h>
+
+using namespace Socks;
+
+/**
+ * @file buffer_bench.cpp
+ * @brief Compares the string-based message path with pooled Buffers.
+ *
+ * Each benchmark takes the payload size in bytes as its argument. The
+ * `String` variants do what the server did before Buffer existed: a fresh
+ * std::string per received message and per encoded response.
+ */
+
+static json response_of(std::size_t bytes) {
+    return {{"_success", true}, {"data", std::string(bytes, 'x')}};
+}
+
+static void BM_ReceiveString(benchmark::State &state) {
+    std::string wire(static_cast<std::size_t>(state.range(0)), 'x');
+    for (auto _ : state) {
+        std::string message(wire.data(), wire.size());
+        benchmark::DoNotOptimize(message.data());
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ReceiveString)->Arg(256)->Arg(64 << 10)->Arg(1 << 20);
+
+static void BM_ReceiveBuffer(benchmark::State &state) {
+    std::string wire(static_cast<std::size_t>(state.range(0)), 'x');
+    for (auto _ : state) {
+        Buffer message(wire.data(), wire.size());
+        benchmark::DoNotOptimize(message.data());
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ReceiveBuffer)->Arg(256)->Arg(64 << 10)->Arg(1 << 20);
+
+static void BM_EncodeString(benchmark::State &state) {
+    json response = response_of(static_cast<std::size_t>(state.range(0)));
+    for (auto _ : state) {
+        std::string out = encode(response, Codec::Json);
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_EncodeString)->Arg(256)->Arg(64 << 10)->Arg(1 << 20);
+
+static void BM_EncodeBuffer(benchmark::State &state) {
+    json response = response_of(static_cast<std::size_t>(state.range(0)));
+    for (auto _ : state) {
+        Buffer out;
+        encode(response, Codec::Json, out);
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_EncodeBuffer)->Arg(256)->Arg(64 << 10)->Arg(1 << 20);
+
+static void BM_OkayCopy(benchmark::State &state) {
+    json result = {{"data", std::string(state.range(0), 'x')}};
+    for (auto _ : state) {
+        json response = okay(result);
+        benchmark::DoNotOptimize(response);
+    }
+}
+BENCHMARK(BM_OkayCopy)->Arg(256)->Arg(64 << 10);
+
+static void BM_OkayMove(benchmark::State &state) {
+    for (auto _ : state) {
+        state.PauseTiming();
+        json result = {{"data", std::string(state.range(0), 'x')}};
+        state.ResumeTiming();
+        json response = okay(std::move(result));
+        benchmark::DoNotOptimize(response);
+    }
+}
+BENCHMARK(BM_OkayMove)->Arg(256)->Arg(64 << 10);
@@ -0,0 +1,59 @@
+#include "../cache.hpp"
+#include "../server.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <chrono>
+
+using namespace Socks;
+
+/**
+ * @file cache_bench.cpp
+ * @brief What a ResponseCache hit costs next to the work it skips:
+ * building the key from a parsed request and looking it up, against
+ * running a trivial handler's okay() and encoding its response.
+ *
+ * Multi-threaded hits spread over the shards; the working set is 1024
+ * distinct requests.
+ */
+
+static json request_of(int n) {
+    return {{"_cmd", "fibo"}, {"n", n}, {"mode", "exact"}};
+}
+
+static void BM_CacheKey(benchmark::State &state) {
+    json request = request_of(42);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(ResponseCache::key_of(request, Codec::Json));
+    }
+}
+BENCHMARK(BM_CacheKey);
+
+static void BM_CacheHit(benchmark::State &state) {
+    static ResponseCache cache(4096, std::chrono::milliseconds(0));
+    std::vector<json> requests;
+    for (int n = 0; n < 1024; ++n) {
+        Buffer out;
+        encode(okay({{"result", n}}), Codec::Json, out);
+        cache.insert(ResponseCache::key_of(request_of(n), Codec::Json), out);
+        requests.push_back(request_of(n));
+    }
+    std::size_t i = static_cast<std::size_t>(state.thread_index()) * 97;
+    for (auto _ : state) {
+        Buffer out;
+        bool hit = cache.find(
+            ResponseCache::key_of(requests[i++ & 1023], Codec::Json), out);
+        benchmark::DoNotOptimize(hit);
+    }
+}
+BENCHMARK(BM_CacheHit)->Threads(1)->Threads(4);
+
+static void BM_HandlerAndEncode(benchmark::State &state) {
+    json request = request_of(42);
+    for (auto _ : state) {
+        Buffer out;
+        encode(okay({{"result", request["n"].get<int>()}}), Codec::Json, out);
+        benchmark::DoNotOptimize(out.data());
+    }
+}
+BENCHMARK(BM_HandlerAndEncode);
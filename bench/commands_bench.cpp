@@ -0,0 +1,89 @@
+#include "../commands.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <map>
+#include <string>
+#include <unordered_map>
+
+using namespace Socks;
+
+/**
+ * @file commands_bench.cpp
+ * @brief Command lookup: CommandTable by name and by ID vs std::map and
+ * std::unordered_map keyed by std::string.
+ *
+ * The argument is the number of registered commands. Lookups cycle through
+ * all of them, starting from a string_view as the scanner produces it.
+ */
+
+static std::vector<std::string> names_of(int count) {
+    std::vector<std::string> names;
+    for (int i = 0; i < count; ++i)
+        names.push_back("command_" + std::to_string(i));
+    return names;
+}
+
+static CommandTable table_of(const std::vector<std::string> &names) {
+    std::vector<Command> commands;
+    for (const std::string &name : names) {
+        Command command;
+        command.name = name;
+        command.id = CommandTable::id_of(name);
+        command.handler = [](const json &request) { return request; };
+        commands.push_back(std::move(command));
+    }
+    return CommandTable(std::move(commands));
+}
+
+static void BM_MapLookup(benchmark::State &state) {
+    auto names = names_of(static_cast<int>(state.range(0)));
+    std::map<std::string, Handler> handlers;
+    for (const std::string &name : names)
+        handlers[name] = [](const json &request) { return request; };
+    size_t i = 0;
+    for (auto _ : state) {
+        std::string_view scanned = names[i++ % names.size()];
+        auto it = handlers.find(std::string(scanned));
+        benchmark::DoNotOptimize(it);
+    }
+}
+BENCHMARK(BM_MapLookup)->Arg(4)->Arg(32)->Arg(256);
+
+static void BM_UnorderedMapLookup(benchmark::State &state) {
+    auto names = names_of(static_cast<int>(state.range(0)));
+    std::unordered_map<std::string, Handler> handlers;
+    for (const std::string &name : names)
+        handlers[name] = [](const json &request) { return request; };
+    size_t i = 0;
+    for (auto _ : state) {
+        std::string_view scanned = names[i++ % names.size()];
+        auto it = handlers.find(std::string(scanned));
+        benchmark::DoNotOptimize(it);
+    }
+}
+BENCHMARK(BM_UnorderedMapLookup)->Arg(4)->Arg(32)->Arg(256);
+
+static void BM_TableFindName(benchmark::State &state) {
+    auto names = names_of(static_cast<int>(state.range(0)));
+    CommandTable table = table_of(names);
+    size_t i = 0;
+    for (auto _ : state) {
+        std::string_view scanned = names[i++ % names.size()];
+        benchmark::DoNotOptimize(table.find(scanned));
+    }
+}
+BENCHMARK(BM_TableFindName)->Arg(4)->Arg(32)->Arg(256);
+
+static void BM_TableFindId(benchmark::State &state) {
+    auto names = names_of(static_cast<int>(state.range(0)));
+    CommandTable table = table_of(names);
+    std::vector<std::uint32_t> ids;
+    for (const std::string &name : names)
+        ids.push_back(CommandTable::id_of(name));
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(table.find_id(ids[i++ % ids.size()]));
+    }
+}
+BENCHMARK(BM_TableFindId)->Arg(4)->Arg(32)->Arg(256);
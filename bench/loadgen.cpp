@@ -0,0 +1,333 @@
+#include "../client.hpp"
+#include "../eventloop.hpp"
+#include "../metrics.hpp"
+#include "../server.hpp"
+#include "../shm.hpp"
+#include "../transport.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace Socks;
+
+/**
+ * @file loadgen.cpp
+ * @brief socks_loadgen: drive a Server over a transport and report
+ * throughput and latency percentiles.
+ *
+ * By default an in-process server with an `echo` handler is started on the
+ * chosen transport, so runs are repeatable on one machine; `--connect`
+ * drives an external server instead. Each of `--concurrency` worker
+ * threads has its own Client and sends requests back to back, or on a
+ * fixed schedule with `--rate`. With a rate, latency is measured from when
+ * a request was due rather than when it was sent, so a stalled server is
+ * not hidden by the clients slowing down with it.
+ *
+ * @code
+ * socks_loadgen --transport tcp-framed --concurrency 8 --payload 256
+ * socks_loadgen --transport udp --rate 20000 --duration 10 --json
+ * socks_loadgen --transport udp-batched --sockets 4 --server-threads 0
+ * @endcode
+ */
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    std::string transport = "tcp-framed";
+    std::string codec = "json";
+    std::string host = "127.0.0.1";
+    int port = 9555;
+    std::string path = "/tmp/socks_loadgen.sock";
+    std::string command = "echo";
+    size_t concurrency = 4;
+    size_t requests = 20000; ///< Total, unless duration is set
+    double duration = 0;     ///< Seconds
+    size_t payload = 64;     ///< Bytes of payload per request
+    double rate = 0;         ///< Requests per second, 0 for unbounded
+    size_t server_threads = 4;
+    size_t sockets = 1; ///< BatchedUdpTransport sockets
+    bool connect = false; ///< Drive an external server
+    bool json_output = false;
+};
+
+void usage() {
+    std::cout
+        << "Usage: socks_loadgen [options]\n"
+           "  --transport NAME   unix, unix-framed, udp, udp-batched, tcp,\n"
+           "                     tcp-framed, epoll-tcp, epoll-unix, shm\n"
+           "                     (default tcp-framed)\n"
+           "  --codec NAME       json, msgpack, cbor (default json)\n"
+           "  --concurrency N    client threads (default 4)\n"
+           "  --requests N       total requests (default 20000)\n"
+           "  --duration S       run for S seconds instead\n"
+           "  --payload BYTES    payload string per request (default 64)\n"
+           "  --rate R           requests per second over all threads\n"
+           "  --server-threads N server ThreadPool size (default 4)\n"
+           "  --sockets N        udp-batched server sockets (default 1)\n"
+           "  --host, --port, --path  endpoint (TCP/UDP, Unix socket or\n"
+           "                     shared-memory segment name)\n"
+           "  --command NAME     _cmd to send (default echo)\n"
+           "  --connect          drive an external server\n"
+           "  --json             print the report as JSON\n";
+}
+
+Options parse_options(int argc, char **argv) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc)
+                throw std::invalid_argument("Missing value for " + arg);
+            return argv[++i];
+        };
+        if (arg == "--transport") {
+            options.transport = value();
+        } else if (arg == "--codec") {
+            options.codec = value();
+        } else if (arg == "--host") {
+            options.host = value();
+        } else if (arg == "--port") {
+            options.port = std::stoi(value());
+        } else if (arg == "--path") {
+            options.path = value();
+        } else if (arg == "--command") {
+            options.command = value();
+        } else if (arg == "--concurrency") {
+            options.concurrency = std::stoul(value());
+        } else if (arg == "--requests") {
+            options.requests = std::stoul(value());
+        } else if (arg == "--duration") {
+            options.duration = std::stod(value());
+        } else if (arg == "--payload") {
+            options.payload = std::stoul(value());
+        } else if (arg == "--rate") {
+            options.rate = std::stod(value());
+        } else if (arg == "--server-threads") {
+            options.server_threads = std::stoul(value());
+        } else if (arg == "--sockets") {
+            options.sockets = std::stoul(value());
+        } else if (arg == "--connect") {
+            options.connect = true;
+        } else if (arg == "--json") {
+            options.json_output = true;
+        } else if (arg == "--help" || arg == "-h") {
+            usage();
+            std::exit(0);
+        } else {
+            throw std::invalid_argument("Unknown option " + arg);
+        }
+    }
+    if (options.concurrency == 0)
+        throw std::invalid_argument("--concurrency must be at least 1");
+    return options;
+}
+
+Codec codec_of(const std::string &name) {
+    if (name == "json")
+        return Codec::Json;
+    if (name == "msgpack")
+        return Codec::MessagePack;
+    if (name == "cbor")
+        return Codec::Cbor;
+    throw std::invalid_argument("Unknown codec " + name);
+}
+
+std::unique_ptr<Transport> server_transport(const Options &o) {
+    if (o.transport == "unix")
+        return std::make_unique<UnixSocketTransport>(o.path);
+    if (o.transport == "unix-framed")
+        return std::make_unique<UnixSocketTransport>(o.path,
+                                                     Framing::LengthPrefixed);
+    if (o.transport == "udp")
+        return std::make_unique<UdpTransport>(o.port);
+    if (o.transport == "udp-batched")
+        return std::make_unique<BatchedUdpTransport>(o.port, o.sockets);
+    if (o.transport == "tcp")
+        return std::make_unique<TcpTransport>(o.port);
+    if (o.transport == "tcp-framed")
+        return std::make_unique<TcpTransport>(o.port, Framing::LengthPrefixed);
+    if (o.transport == "epoll-tcp")
+        return std::make_unique<EpollTcpTransport>(o.port);
+    if (o.transport == "epoll-unix")
+        return std::make_unique<EpollUnixTransport>(o.path);
+    if (o.transport == "shm")
+        return std::make_unique<SharedMemoryTransport>(
+            o.path.substr(o.path.rfind('/') + 1), o.concurrency + 1);
+    throw std::invalid_argument("Unknown transport " + o.transport);
+}
+
+std::unique_ptr<Transport> client_transport(const Options &o) {
+    if (o.transport == "unix")
+        return std::make_unique<UnixSocketTransport>(o.path);
+    if (o.transport == "unix-framed" || o.transport == "epoll-unix")
+        return std::make_unique<UnixSocketTransport>(o.path,
+                                                     Framing::LengthPrefixed);
+    if (o.transport == "udp" || o.transport == "udp-batched")
+        return std::make_unique<UdpTransport>(o.host, o.port);
+    if (o.transport == "tcp")
+        return std::make_unique<TcpTransport>(o.host, o.port);
+    if (o.transport == "tcp-framed" || o.transport == "epoll-tcp")
+        return std::make_unique<TcpTransport>(o.host, o.port,
+                                              Framing::LengthPrefixed);
+    if (o.transport == "shm")
+        return std::make_unique<SharedMemoryTransport>(
+            o.path.substr(o.path.rfind('/') + 1));
+    throw std::invalid_argument("Unknown transport " + o.transport);
+}
+
+/// What one worker thread saw.
+struct WorkerResult {
+    LatencyHistogram latency;
+    size_t errors = 0;
+    std::string first_error;
+};
+
+void run_worker(const Options &o, size_t index, Clock::time_point start,
+                Clock::time_point stop, WorkerResult &result) {
+    Client client(client_transport(o), codec_of(o.codec), 1);
+    json request = {{"payload", std::string(o.payload, 'x')}};
+
+    size_t quota = o.requests / o.concurrency +
+                   (index < o.requests % o.concurrency ? 1 : 0);
+    auto interval = o.rate > 0 ? std::chrono::duration<double>(
+                                     o.concurrency / o.rate)
+                               : std::chrono::duration<double>(0);
+    // Stagger the schedules so the threads do not fire in lockstep.
+    auto due = start + std::chrono::duration_cast<Clock::duration>(
+                           interval * index / o.concurrency);
+
+    for (size_t sent = 0;; ++sent) {
+        if (o.duration > 0 ? Clock::now() >= stop : sent >= quota)
+            break;
+        if (o.rate > 0) {
+            std::this_thread::sleep_until(due);
+        } else {
+            due = Clock::now();
+        }
+        try {
+            client.send_request(o.command, request);
+        } catch (const std::exception &e) {
+            if (result.errors++ == 0)
+                result.first_error = e.what();
+        }
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            Clock::now() - due);
+        result.latency.record(static_cast<std::uint64_t>(ns.count()));
+        due += std::chrono::duration_cast<Clock::duration>(interval);
+    }
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    Options o;
+    try {
+        o = parse_options(argc, argv);
+        codec_of(o.codec);
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << "\n\n";
+        usage();
+        return 2;
+    }
+    set_log_level(LogLevel::Warning);
+
+    std::unique_ptr<Server> server;
+    std::thread server_thread;
+    if (!o.connect) {
+        auto pool = o.server_threads > 0
+                        ? std::make_shared<ThreadPool>(o.server_threads)
+                        : nullptr;
+        server = std::make_unique<Server>(server_transport(o), pool);
+        server->add_handler("echo", [](const json &request) {
+            return okay({{"payload", request.value("payload", "")}});
+        });
+        server_thread = std::thread([&] { server->start(); });
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    }
+
+    std::vector<WorkerResult> results(o.concurrency);
+    std::vector<std::thread> workers;
+    auto start = Clock::now();
+    auto stop = start + std::chrono::duration_cast<Clock::duration>(
+                            std::chrono::duration<double>(o.duration));
+    for (size_t i = 0; i < o.concurrency; ++i) {
+        workers.emplace_back([&, i] {
+            try {
+                run_worker(o, i, start, stop, results[i]);
+            } catch (const std::exception &e) {
+                results[i].errors++;
+                results[i].first_error = e.what();
+            }
+        });
+    }
+    for (std::thread &worker : workers)
+        worker.join();
+    double elapsed =
+        std::chrono::duration<double>(Clock::now() - start).count();
+
+    if (server) {
+        server->stop();
+        server_thread.join();
+    }
+
+    LatencyHistogram latency;
+    size_t errors = 0;
+    std::string first_error;
+    for (const WorkerResult &result : results) {
+        latency.merge(result.latency);
+        errors += result.errors;
+        if (first_error.empty())
+            first_error = result.first_error;
+    }
+    auto us = [](std::uint64_t ns) { return ns / 1000.0; };
+    double throughput = elapsed > 0 ? latency.count() / elapsed : 0;
+
+    if (o.json_output) {
+        json report = {{"transport", o.transport},
+                       {"codec", o.codec},
+                       {"concurrency", o.concurrency},
+                       {"payload", o.payload},
+                       {"rate", o.rate},
+                       {"requests", latency.count()},
+                       {"errors", errors},
+                       {"elapsed_s", elapsed},
+                       {"throughput_rps", throughput},
+                       {"latency_us",
+                        {{"mean", latency.mean() / 1000.0},
+                         {"p50", us(latency.percentile(0.50))},
+                         {"p90", us(latency.percentile(0.90))},
+                         {"p99", us(latency.percentile(0.99))},
+                         {"p999", us(latency.percentile(0.999))},
+                         {"max", us(latency.max())}}}};
+        if (!first_error.empty())
+            report["first_error"] = first_error;
+        std::cout << report.dump(2) << "\n";
+    } else {
+        std::printf("transport %s, codec %s, concurrency %zu, payload %zu B",
+                    o.transport.c_str(), o.codec.c_str(), o.concurrency,
+                    o.payload);
+        if (o.rate > 0)
+            std::printf(", rate %.0f/s", o.rate);
+        std::printf("\nrequests %llu, errors %zu, %.2f s, %.0f req/s\n",
+                    static_cast<unsigned long long>(latency.count()), errors,
+                    elapsed, throughput);
+        std::printf("latency us: mean %.1f  p50 %.1f  p90 %.1f  p99 %.1f  "
+                    "p999 %.1f  max %.1f\n",
+                    latency.mean() / 1000.0, us(latency.percentile(0.50)),
+                    us(latency.percentile(0.90)), us(latency.percentile(0.99)),
+                    us(latency.percentile(0.999)), us(latency.max()));
+        if (!first_error.empty())
+            std::printf("first error: %s\n", first_error.c_str());
+    }
+    return errors == 0 ? 0 : 1;
+}
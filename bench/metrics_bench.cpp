@@ -0,0 +1,50 @@
+#include "../metrics.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <chrono>
+
+using namespace Socks;
+
+/**
+ * @file metrics_bench.cpp
+ * @brief Cost of recording a request in a CommandMetrics, and of reading
+ * the clock as the server does for each stage.
+ *
+ * Multi-threaded runs record into the same CommandMetrics; each thread
+ * lands in its own shard.
+ */
+
+static void BM_RecordRequest(benchmark::State &state) {
+    static CommandMetrics metrics;
+    RequestTiming timing;
+    std::int64_t ns = 1000;
+    for (auto _ : state) {
+        timing[Stage::Queue] = ns;
+        timing[Stage::Parse] = ns * 2;
+        timing[Stage::Handler] = ns * 5;
+        timing[Stage::Send] = ns * 3;
+        timing[Stage::Total] = ns * 11;
+        metrics.record(timing);
+        ns = (ns * 7 + 13) % 100000;
+    }
+}
+BENCHMARK(BM_RecordRequest)->Threads(1)->Threads(4);
+
+static void BM_SteadyClock(benchmark::State &state) {
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(std::chrono::steady_clock::now());
+    }
+}
+BENCHMARK(BM_SteadyClock);
+
+static void BM_Snapshot(benchmark::State &state) {
+    CommandMetrics metrics;
+    RequestTiming timing;
+    timing[Stage::Total] = 1000;
+    metrics.record(timing);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(metrics.snapshot());
+    }
+}
+BENCHMARK(BM_Snapshot);
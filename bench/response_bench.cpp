@@ -0,0 +1,45 @@
+#include "../server.hpp"
+
+#include <benchmark/benchmark.h>
+
+using namespace Socks;
+
+/**
+ * @file response_bench.cpp
+ * @brief Cost of building typical handler responses with okay() and
+ * error(), the part of every request that bench/buffer_bench.cpp leaves
+ * out (its okay() benchmarks wrap one large payload).
+ */
+
+static void BM_OkayEmpty(benchmark::State &state) {
+    for (auto _ : state) {
+        json response = okay({});
+        benchmark::DoNotOptimize(response);
+    }
+}
+BENCHMARK(BM_OkayEmpty);
+
+static void BM_OkayFields(benchmark::State &state) {
+    for (auto _ : state) {
+        json response = okay({{"x", 1.0}, {"y", 2.0}, {"mode", "idle"}});
+        benchmark::DoNotOptimize(response);
+    }
+}
+BENCHMARK(BM_OkayFields);
+
+static void BM_ErrorEmpty(benchmark::State &state) {
+    for (auto _ : state) {
+        json response = error({}, "Unknown command: unknown");
+        benchmark::DoNotOptimize(response);
+    }
+}
+BENCHMARK(BM_ErrorEmpty);
+
+static void BM_ErrorFields(benchmark::State &state) {
+    for (auto _ : state) {
+        json response = error({{"field", "pose.x"}, {"expected", "number"}},
+                              "Parameter 'pose.x' has the wrong type");
+        benchmark::DoNotOptimize(response);
+    }
+}
+BENCHMARK(BM_ErrorFields);
@@ -0,0 +1,42 @@
+#include "../codec.hpp"
+#include "../scan.hpp"
+
+#include <benchmark/benchmark.h>
+
+using namespace Socks;
+
+/**
+ * @file scan_bench.cpp
+ * @brief Reading `_cmd` with the scanner vs a full parse.
+ *
+ * The argument is the number of keys before `_cmd` in the encoded message
+ * (keys sort before "_cmd" when they start with an upper-case letter), so
+ * the scanner has to skip over them.
+ */
+
+static std::string message_of(int keys, Codec codec) {
+    json request = {{"_cmd", "compute"}, {"payload", std::string(256, 'x')}};
+    for (int i = 0; i < keys; ++i)
+        request["K" + std::to_string(i)] = {{"values", {1, 2, 3}}, {"s", "v"}};
+    return encode(request, codec);
+}
+
+static void BM_ParseCommand(benchmark::State &state) {
+    std::string message = message_of(static_cast<int>(state.range(0)),
+                                      static_cast<Codec>(state.range(1)));
+    for (auto _ : state) {
+        std::string command = decode(message).value("_cmd", "");
+        benchmark::DoNotOptimize(command.data());
+    }
+}
+BENCHMARK(BM_ParseCommand)->ArgsProduct({{0, 16, 256}, {0, 1, 2}});
+
+static void BM_ScanCommand(benchmark::State &state) {
+    std::string message = message_of(static_cast<int>(state.range(0)),
+                                      static_cast<Codec>(state.range(1)));
+    for (auto _ : state) {
+        auto command = scan_command(message);
+        benchmark::DoNotOptimize(command);
+    }
+}
+BENCHMARK(BM_ScanCommand)->ArgsProduct({{0, 16, 256}, {0, 1, 2}});
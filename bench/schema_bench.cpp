@@ -0,0 +1,55 @@
+#include "../schema.hpp"
+
+#include <benchmark/benchmark.h>
+
+using namespace Socks;
+
+/**
+ * @file schema_bench.cpp
+ * @brief Compares assert_parameters() with a precompiled CompiledSchema.
+ *
+ * `BM_AssertParametersInline` rebuilds the schema map on every call, as
+ * the fibo example used to do inside its handler.
+ */
+
+static ParamSchemaMap request_schema() {
+    return {{"n", types({json::value_t::number_integer,
+                         json::value_t::number_unsigned})},
+            {"name", json::value_t::string},
+            {"pose", ParamSchemaMap{{"x", json::value_t::number_float},
+                                    {"y", json::value_t::number_float},
+                                    {"theta", json::value_t::number_float}}}};
+}
+
+static json valid_request() {
+    return {{"_cmd", "move"},
+            {"n", 3},
+            {"name", "arm"},
+            {"pose", {{"x", 1.0}, {"y", 2.0}, {"theta", 0.5}}}};
+}
+
+static void BM_AssertParametersInline(benchmark::State &state) {
+    json request = valid_request();
+    for (auto _ : state) {
+        assert_parameters(request, request_schema());
+    }
+}
+BENCHMARK(BM_AssertParametersInline);
+
+static void BM_AssertParameters(benchmark::State &state) {
+    json request = valid_request();
+    ParamSchemaMap schema = request_schema();
+    for (auto _ : state) {
+        assert_parameters(request, schema);
+    }
+}
+BENCHMARK(BM_AssertParameters);
+
+static void BM_CompiledSchema(benchmark::State &state) {
+    json request = valid_request();
+    CompiledSchema schema(request_schema());
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(schema.validate(request));
+    }
+}
+BENCHMARK(BM_CompiledSchema);
@@ -0,0 +1,130 @@
+#include "../threadpool.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+
+using namespace Socks;
+
+/**
+ * @file task_bench.cpp
+ * @brief Measures the per-task cost of queueing work on ThreadPool.
+ *
+ * Global operator new is replaced to count heap allocations, and every
+ * benchmark reports `allocs_per_task` next to its throughput. The
+ * `Baseline` cases reproduce the previous design (std::function wrapping a
+ * shared_ptr<packaged_task> built with std::bind) so the difference is
+ * visible on the same machine.
+ */
+
+static std::atomic<int64_t> allocations{0};
+
+void *operator new(std::size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(size == 0 ? 1 : size))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+static void wait_for(const std::atomic<int64_t> &done, int64_t target) {
+    while (done.load(std::memory_order_acquire) < target) {
+        std::this_thread::yield();
+    }
+}
+
+static void report(benchmark::State &state, int64_t tasks, int64_t allocs) {
+    state.SetItemsProcessed(tasks);
+    state.counters["allocs_per_task"] =
+        tasks == 0 ? 0.0 : static_cast<double>(allocs) / tasks;
+}
+
+constexpr int64_t kBatch = 256;
+
+/// Fire-and-forget lambda capturing two strings, the shape of a server job.
+static void BM_EnqueueRequestJob(benchmark::State &state) {
+    ThreadPool pool(1);
+    std::atomic<int64_t> done{0};
+    int64_t target = 0;
+    // Long enough to defeat the small-string optimization; the copies made
+    // below are part of the request, not of the queueing cost.
+    const std::string data(64, 'x'), client_id = "1:7";
+
+    int64_t allocs = 0;
+    for (auto _ : state) {
+        for (int64_t i = 0; i < kBatch; ++i) {
+            std::string d = data, c = client_id;
+            int64_t before = allocations.load(std::memory_order_relaxed);
+            pool.enqueue([&done, d = std::move(d), c = std::move(c)] {
+                benchmark::DoNotOptimize(d.size() + c.size());
+                done.fetch_add(1, std::memory_order_release);
+            });
+            allocs += allocations.load(std::memory_order_relaxed) - before;
+        }
+        target += kBatch;
+        wait_for(done, target);
+    }
+    report(state, state.iterations() * kBatch, allocs);
+}
+BENCHMARK(BM_EnqueueRequestJob)->UseRealTime();
+
+/// Future-returning submission through the pool.
+static void BM_SubmitAsync(benchmark::State &state) {
+    ThreadPool pool(1);
+    std::vector<std::future<int>> results;
+    results.reserve(kBatch);
+
+    int64_t allocs = 0;
+    for (auto _ : state) {
+        int64_t before = allocations.load(std::memory_order_relaxed);
+        for (int64_t i = 0; i < kBatch; ++i) {
+            results.push_back(
+                pool.submit_async([](int x) { return x * 2; }, int(i)));
+        }
+        allocs += allocations.load(std::memory_order_relaxed) - before;
+        for (auto &r : results) {
+            benchmark::DoNotOptimize(r.get());
+        }
+        results.clear();
+    }
+    report(state, state.iterations() * kBatch, allocs);
+}
+BENCHMARK(BM_SubmitAsync)->UseRealTime();
+
+/// The previous submit_async: bind + shared_ptr<packaged_task> + a
+/// std::function wrapper, handed to the pool as an already-built job.
+static void BM_SubmitAsyncBaseline(benchmark::State &state) {
+    ThreadPool pool(1);
+    std::vector<std::future<int>> results;
+    results.reserve(kBatch);
+
+    int64_t allocs = 0;
+    for (auto _ : state) {
+        int64_t before = allocations.load(std::memory_order_relaxed);
+        for (int64_t i = 0; i < kBatch; ++i) {
+            auto task = std::make_shared<std::packaged_task<int()>>(
+                std::bind([](int x) { return x * 2; }, int(i)));
+            results.push_back(task->get_future());
+            std::function<void()> wrapped = [task] { (*task)(); };
+            std::function<void()> guarded = [func = std::move(wrapped)] {
+                func();
+            };
+            pool.enqueue(std::move(guarded));
+        }
+        allocs += allocations.load(std::memory_order_relaxed) - before;
+        for (auto &r : results) {
+            benchmark::DoNotOptimize(r.get());
+        }
+        results.clear();
+    }
+    report(state, state.iterations() * kBatch, allocs);
+}
+BENCHMARK(BM_SubmitAsyncBaseline)->UseRealTime();
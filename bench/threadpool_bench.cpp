@@ -0,0 +1,141 @@
+#include "../threadpool.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <atomic>
+#include <thread>
+
+using namespace Socks;
+
+/**
+ * @file threadpool_bench.cpp
+ * @brief Compares ThreadPool scheduling strategies.
+ *
+ * Each benchmark takes the scheduler as its first argument
+ * (0 = SharedQueue, 1 = WorkStealing) and reports completed tasks per
+ * second in `items_per_second`.
+ */
+
+static size_t worker_count() {
+    size_t n = std::thread::hardware_concurrency();
+    return n == 0 ? 4 : n;
+}
+
+static Scheduler scheduler_arg(const benchmark::State &state) {
+    return state.range(0) == 0 ? Scheduler::SharedQueue
+                               : Scheduler::WorkStealing;
+}
+
+static void wait_for(const std::atomic<int64_t> &done, int64_t target) {
+    while (done.load(std::memory_order_acquire) < target) {
+        std::this_thread::yield();
+    }
+}
+
+/// One external producer submitting batches of tiny tasks.
+static void BM_ExternalSubmit(benchmark::State &state) {
+    ThreadPool pool(worker_count(), scheduler_arg(state));
+    const int64_t batch = state.range(1);
+    std::atomic<int64_t> done{0};
+    int64_t target = 0;
+
+    for (auto _ : state) {
+        for (int64_t i = 0; i < batch; ++i) {
+            pool.enqueue(
+                [&done] { done.fetch_add(1, std::memory_order_release); });
+        }
+        target += batch;
+        wait_for(done, target);
+    }
+    state.SetItemsProcessed(state.iterations() * batch);
+}
+BENCHMARK(BM_ExternalSubmit)
+    ->ArgsProduct({{0, 1}, {1000}})
+    ->ArgNames({"sched", "batch"})
+    ->UseRealTime();
+
+/// Tasks that fan out into subtasks from inside the pool, the case work
+/// stealing keeps on the submitting worker's own deque.
+static void BM_NestedSubmit(benchmark::State &state) {
+    ThreadPool pool(worker_count(), scheduler_arg(state));
+    const int64_t seeds = 16;
+    const int64_t fanout = state.range(1);
+    std::atomic<int64_t> done{0};
+    int64_t target = 0;
+
+    for (auto _ : state) {
+        for (int64_t s = 0; s < seeds; ++s) {
+            pool.enqueue([&pool, &done, fanout] {
+                for (int64_t i = 0; i < fanout; ++i) {
+                    pool.enqueue([&done] {
+                        done.fetch_add(1, std::memory_order_release);
+                    });
+                }
+            });
+        }
+        target += seeds * fanout;
+        wait_for(done, target);
+    }
+    state.SetItemsProcessed(state.iterations() * seeds * fanout);
+}
+BENCHMARK(BM_NestedSubmit)
+    ->ArgsProduct({{0, 1}, {64}})
+    ->ArgNames({"sched", "fanout"})
+    ->UseRealTime();
+
+/// Several producers hammering one pool, as the server's reactors do.
+static void BM_ConcurrentProducers(benchmark::State &state) {
+    static ThreadPool shared(worker_count(), Scheduler::SharedQueue);
+    static ThreadPool stealing(worker_count(), Scheduler::WorkStealing);
+    ThreadPool &pool = state.range(0) == 0 ? shared : stealing;
+
+    const int64_t batch = 256;
+    std::atomic<int64_t> done{0};
+    int64_t target = 0;
+
+    for (auto _ : state) {
+        for (int64_t i = 0; i < batch; ++i) {
+            pool.enqueue(
+                [&done] { done.fetch_add(1, std::memory_order_release); });
+        }
+        target += batch;
+        wait_for(done, target);
+    }
+    state.SetItemsProcessed(state.iterations() * batch);
+}
+BENCHMARK(BM_ConcurrentProducers)
+    ->Arg(0)
+    ->Arg(1)
+    ->ArgName("sched")
+    ->ThreadRange(1, 8)
+    ->UseRealTime();
+
+/// A producer handing each task to the worker on the core it runs on, as
+/// a server with a pinned pool does with requests. Arg: 0 = unpinned
+/// enqueue(), 1 = pinned enqueue_near().
+static void BM_NearSubmit(benchmark::State &state) {
+    bool pinned = state.range(0) == 1;
+    ThreadPool pool(worker_count(), Scheduler::WorkStealing,
+                    pinned ? CpuAffinity::all_cores() : CpuAffinity{});
+    const int64_t batch = 1000;
+    std::atomic<int64_t> done{0};
+    int64_t target = 0;
+
+    for (auto _ : state) {
+        int cpu = current_cpu();
+        for (int64_t i = 0; i < batch; ++i) {
+            auto task = [&done] {
+                done.fetch_add(1, std::memory_order_release);
+            };
+            if (pinned) {
+                pool.enqueue_near(cpu, task);
+            } else {
+                pool.enqueue(task);
+            }
+        }
+        target += batch;
+        wait_for(done, target);
+    }
+    state.SetItemsProcessed(state.iterations() * batch);
+}
+BENCHMARK(BM_NearSubmit)->Arg(0)->Arg(1)->ArgName("pinned")->UseRealTime();
@@ -0,0 +1,98 @@
+#include "../server.hpp"
+
+#include <benchmark/benchmark.h>
+
+using namespace Socks;
+
+/**
+ * @file typed_bench.cpp
+ * @brief Typed requests and responses against the json tree they replace:
+ * decoding a request and reading its fields, and encoding a response.
+ */
+
+namespace {
+
+struct Pose {
+    double x;
+    double y;
+};
+SOCKS_FIELDS(Pose, x, y)
+
+struct MoveRequest {
+    std::string robot;
+    Pose target;
+    std::optional<double> speed;
+    std::vector<int> waypoints;
+};
+SOCKS_FIELDS(MoveRequest, robot, target, speed, waypoints)
+
+struct MoveResponse {
+    std::string robot;
+    double eta;
+    std::vector<int> route;
+};
+SOCKS_FIELDS(MoveResponse, robot, eta, route)
+
+const std::string kRequest =
+    R"({"_cmd":"move","robot":"r2-d2","target":{"x":1.5,"y":-2.25},)"
+    R"("speed":0.8,"waypoints":[3,1,4,1,5,9,2,6]})";
+
+const CompiledSchema &move_schema() {
+    static const CompiledSchema schema{
+        {"robot", types({json::value_t::string})},
+        {"target", ParamSchemaMap{{"x", json::value_t::number_float},
+                                  {"y", json::value_t::number_float}}},
+        {"waypoints", json::value_t::array}};
+    return schema;
+}
+
+} // namespace
+
+static void BM_RequestDom(benchmark::State &state) {
+    for (auto _ : state) {
+        json request = decode(kRequest);
+        benchmark::DoNotOptimize(move_schema().validate(request));
+        MoveRequest out;
+        out.robot = request["robot"].get<std::string>();
+        out.target = {request["target"]["x"].get<double>(),
+                      request["target"]["y"].get<double>()};
+        out.speed = request.value("speed", 1.0);
+        out.waypoints = request["waypoints"].get<std::vector<int>>();
+        benchmark::DoNotOptimize(out);
+    }
+}
+BENCHMARK(BM_RequestDom);
+
+static void BM_RequestTyped(benchmark::State &state) {
+    std::string error;
+    for (auto _ : state) {
+        MoveRequest out;
+        bool ok = decode_typed(kRequest, out, error);
+        benchmark::DoNotOptimize(ok);
+        benchmark::DoNotOptimize(out);
+    }
+}
+BENCHMARK(BM_RequestTyped);
+
+static void BM_ResponseDom(benchmark::State &state) {
+    MoveResponse response{"r2-d2", 12.5, {3, 1, 4, 1, 5, 9, 2, 6}};
+    for (auto _ : state) {
+        Buffer out;
+        encode(okay({{"robot", response.robot},
+                     {"eta", response.eta},
+                     {"route", response.route}}),
+               Codec::Json, out);
+        benchmark::DoNotOptimize(out.data());
+    }
+}
+BENCHMARK(BM_ResponseDom);
+
+static void BM_ResponseTyped(benchmark::State &state) {
+    MoveResponse response{"r2-d2", 12.5, {3, 1, 4, 1, 5, 9, 2, 6}};
+    for (auto _ : state) {
+        Buffer out;
+        encode_typed(response, Codec::Json, out);
+        benchmark::DoNotOptimize(out.data());
+    }
+}
+BENCHMARK(BM_ResponseTyped);
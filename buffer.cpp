@@ -0,0 +1,166 @@
+#include "buffer.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace Socks {
+
+// ==========================
+// Block pool
+// ==========================
+
+namespace {
+
+constexpr unsigned kMinClassShift = 8;  ///< Smallest block: 256 bytes
+constexpr unsigned kMaxClassShift = 24; ///< Largest pooled block: 16 MiB
+constexpr unsigned kClassCount = kMaxClassShift - kMinClassShift + 1;
+constexpr std::uint32_t kUnpooled = kClassCount;
+
+/// Bytes of idle blocks kept per size class (at least one block).
+constexpr std::size_t kIdleBytesPerClass = 8 * 1024 * 1024;
+
+/// Most idle blocks kept per size class.
+constexpr std::size_t kMaxIdlePerClass = 256;
+
+struct SizeClass {
+    std::mutex mutex;
+    std::vector<void *> idle;
+};
+
+SizeClass &size_class(std::uint32_t index) {
+    // Leaked on purpose: buffers may be released during static destruction.
+    static SizeClass *classes = new SizeClass[kClassCount];
+    return classes[index];
+}
+
+std::uint32_t class_for(std::size_t capacity) {
+    unsigned shift = kMinClassShift;
+    while (shift <= kMaxClassShift && (std::size_t(1) << shift) < capacity)
+        ++shift;
+    return shift > kMaxClassShift ? kUnpooled : shift - kMinClassShift;
+}
+
+std::size_t idle_limit(std::uint32_t index) {
+    std::size_t capacity = std::size_t(1) << (index + kMinClassShift);
+    return std::clamp<std::size_t>(kIdleBytesPerClass / capacity, 1,
+                                   kMaxIdlePerClass);
+}
+
+} // namespace
+
+Buffer::Block *Buffer::allocate(std::size_t capacity) {
+    std::uint32_t index = class_for(capacity);
+    void *memory = nullptr;
+    if (index != kUnpooled) {
+        capacity = std::size_t(1) << (index + kMinClassShift);
+        SizeClass &pool = size_class(index);
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        if (!pool.idle.empty()) {
+            memory = pool.idle.back();
+            pool.idle.pop_back();
+        }
+    }
+    if (!memory)
+        memory = ::operator new(sizeof(Block) + capacity);
+
+    Block *block = static_cast<Block *>(memory);
+    block->refs.store(1, std::memory_order_relaxed);
+    block->size_class = index;
+    block->capacity = capacity;
+    return block;
+}
+
+void Buffer::release(Block *block) noexcept {
+    if (!block || block->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+    if (block->size_class != kUnpooled) {
+        SizeClass &pool = size_class(block->size_class);
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        if (pool.idle.size() < idle_limit(block->size_class)) {
+            try {
+                pool.idle.push_back(block);
+                return;
+            } catch (const std::bad_alloc &) {
+                // Fall through and free the block instead.
+            }
+        }
+    }
+    ::operator delete(block);
+}
+
+void Buffer::copy_bytes(char *dst, const char *src, std::size_t n) {
+    if (n > 0)
+        std::memcpy(dst, src, n);
+}
+
+// ==========================
+// Buffer
+// ==========================
+
+Buffer::Buffer(std::size_t capacity) : block_(allocate(capacity)) {}
+
+Buffer::Buffer(const char *data, std::size_t size)
+    : block_(allocate(size)), size_(size) {
+    copy_bytes(block_->bytes(), data, size);
+}
+
+Buffer::Buffer(const Buffer &other) noexcept
+    : block_(other.block_), size_(other.size_) {
+    if (block_)
+        block_->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+Buffer::Buffer(Buffer &&other) noexcept
+    : block_(other.block_), size_(other.size_) {
+    other.block_ = nullptr;
+    other.size_ = 0;
+}
+
+Buffer &Buffer::operator=(const Buffer &other) noexcept {
+    if (other.block_)
+        other.block_->refs.fetch_add(1, std::memory_order_relaxed);
+    release(block_);
+    block_ = other.block_;
+    size_ = other.size_;
+    return *this;
+}
+
+Buffer &Buffer::operator=(Buffer &&other) noexcept {
+    if (this != &other) {
+        release(block_);
+        block_ = other.block_;
+        size_ = other.size_;
+        other.block_ = nullptr;
+        other.size_ = 0;
+    }
+    return *this;
+}
+
+void Buffer::grow(std::size_t min_capacity) {
+    // Double when growing in place so repeated appends stay amortized O(1);
+    // a private copy of shared storage only needs the requested size.
+    std::size_t target = std::max(min_capacity, size_);
+    if (unique())
+        target = std::max(min_capacity, 2 * capacity());
+    Block *fresh = allocate(target);
+    copy_bytes(fresh->bytes(), data(), size_);
+    release(block_);
+    block_ = fresh;
+}
+
+void Buffer::consume(std::size_t n) {
+    n = std::min(n, size_);
+    if (!unique()) {
+        Buffer rest(data() + n, size_ - n);
+        *this = std::move(rest);
+        return;
+    }
+    if (n > 0 && n < size_)
+        std::memmove(data(), data() + n, size_ - n);
+    size_ -= n;
+}
+
+} // namespace Socks
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+/**
+ * @file buffer.hpp
+ * @brief Pooled, reference-counted byte buffers for the message path.
+ *
+ * A transport reads a request straight into a Buffer. The server moves it
+ * into the task that handles the request. The codec then serializes the
+ * response into another Buffer, which the transport writes out with writev.
+ * Storage comes from a process-wide pool of power-of-two blocks, so the
+ * steady state of a busy server allocates nothing on this path.
+ */
+
+namespace Socks {
+
+/**
+ * @class Buffer
+ * @brief Growable byte buffer backed by pooled, reference-counted storage.
+ *
+ * Copying a Buffer shares the storage instead of duplicating it; each copy
+ * has its own size. Functions that modify the buffer (resize(), append(),
+ * push_back(), consume()) first give it private storage if the current
+ * storage is shared, so copies never observe each other's changes. Writes
+ * through data() bypass that check and must only be made while the buffer
+ * is not shared, typically right after resize().
+ *
+ * When the last Buffer referring to a block goes away, the block returns to
+ * the pool. Blocks of up to 16 MiB are pooled; larger ones are freed.
+ */
+class Buffer {
+  public:
+    /**
+     * @brief An empty buffer that owns no storage.
+     */
+    Buffer() noexcept = default;
+
+    /**
+     * @brief An empty buffer with room for at least `capacity` bytes.
+     */
+    explicit Buffer(std::size_t capacity);
+
+    /**
+     * @brief A buffer holding a copy of `size` bytes from `data`.
+     */
+    Buffer(const char *data, std::size_t size);
+
+    Buffer(const Buffer &other) noexcept;
+    Buffer(Buffer &&other) noexcept;
+    Buffer &operator=(const Buffer &other) noexcept;
+    Buffer &operator=(Buffer &&other) noexcept;
+    ~Buffer() { release(block_); }
+
+    char *data() noexcept { return block_ ? block_->bytes() : nullptr; }
+    const char *data() const noexcept {
+        return block_ ? block_->bytes() : nullptr;
+    }
+
+    std::size_t size() const noexcept { return size_; }
+    bool empty() const noexcept { return size_ == 0; }
+    std::size_t capacity() const noexcept {
+        return block_ ? block_->capacity : 0;
+    }
+
+    /**
+     * @brief The contents as a string view (valid while the buffer lives
+     * and is not modified).
+     */
+    std::string_view view() const noexcept { return {data(), size_}; }
+
+    /**
+     * @brief Whether no other Buffer shares this storage.
+     */
+    bool unique() const noexcept {
+        return !block_ || block_->refs.load(std::memory_order_acquire) == 1;
+    }
+
+    /**
+     * @brief Ensure room for at least `n` bytes without reallocating.
+     */
+    void reserve(std::size_t n) {
+        if (n > capacity() || !unique())
+            grow(n);
+    }
+
+    /**
+     * @brief Set the size; new bytes are uninitialized.
+     */
+    void resize(std::size_t n) {
+        reserve(n);
+        size_ = n;
+    }
+
+    void append(const char *bytes, std::size_t n) {
+        std::size_t used = size_;
+        resize(used + n);
+        copy_bytes(data() + used, bytes, n);
+    }
+
+    void push_back(char c) {
+        if (size_ == capacity() || !unique())
+            grow(size_ + 1);
+        block_->bytes()[size_++] = c;
+    }
+
+    /**
+     * @brief Remove the first `n` bytes, moving the rest to the front.
+     */
+    void consume(std::size_t n);
+
+    /**
+     * @brief Drop the contents but keep the storage.
+     */
+    void clear() noexcept { size_ = 0; }
+
+  private:
+    /// Header of a pooled block; the bytes follow it in memory.
+    struct Block {
+        std::atomic<std::uint32_t> refs;
+        std::uint32_t size_class; ///< Pool index, or kUnpooled
+        std::size_t capacity;
+
+        char *bytes() noexcept { return reinterpret_cast<char *>(this + 1); }
+    };
+
+    static Block *allocate(std::size_t capacity);
+    static void release(Block *block) noexcept;
+    static void copy_bytes(char *dst, const char *src, std::size_t n);
+
+    void grow(std::size_t min_capacity);
+
+    Block *block_ = nullptr;
+    std::size_t size_ = 0;
+};
+
+} // namespace Socks
@@ -0,0 +1,110 @@
+#include "cache.hpp"
+
+#include <algorithm>
+#include <functional>
+
+namespace Socks {
+
+namespace {
+
+constexpr std::size_t kMaxShards = 16;
+constexpr std::size_t kMinShardEntries = 8;
+
+std::int64_t steady_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+} // namespace
+
+ResponseCache::ResponseCache(std::size_t capacity,
+                             std::chrono::milliseconds ttl)
+    : capacity_(std::max<std::size_t>(capacity, 1)), ttl_(ttl) {
+    // A small cache gets fewer shards, so that LRU order still means
+    // something within each one. The shards' bounds add up to capacity_.
+    shard_count_ = 1;
+    while (shard_count_ < kMaxShards &&
+           shard_count_ * 2 * kMinShardEntries <= capacity_)
+        shard_count_ *= 2;
+    shards_ = std::make_unique<Shard[]>(shard_count_);
+    for (std::size_t i = 0; i < shard_count_; ++i) {
+        shards_[i].capacity = capacity_ / shard_count_ +
+                              (i < capacity_ % shard_count_ ? 1 : 0);
+    }
+}
+
+ResponseCache::Shard &ResponseCache::shard_of(std::string_view key) const {
+    std::size_t hash = std::hash<std::string_view>{}(key);
+    return shards_[hash & (shard_count_ - 1)];
+}
+
+bool ResponseCache::find(const std::string &key, Buffer &response) {
+    Shard &shard = shard_of(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto found = shard.index.find(key);
+    if (found == shard.index.end()) {
+        ++shard.misses;
+        return false;
+    }
+    auto entry = found->second;
+    if (entry->expires >= 0 && steady_ns() > entry->expires) {
+        shard.index.erase(found);
+        shard.entries.erase(entry);
+        ++shard.misses;
+        return false;
+    }
+    shard.entries.splice(shard.entries.begin(), shard.entries, entry);
+    response = entry->response;
+    ++shard.hits;
+    return true;
+}
+
+void ResponseCache::insert(std::string key, const Buffer &response) {
+    std::int64_t expires =
+        ttl_.count() > 0
+            ? steady_ns() +
+                  std::chrono::duration_cast<std::chrono::nanoseconds>(ttl_)
+                      .count()
+            : -1;
+    Shard &shard = shard_of(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto found = shard.index.find(key);
+    if (found != shard.index.end()) {
+        // Another thread answered the same request meanwhile.
+        auto entry = found->second;
+        entry->response = response;
+        entry->expires = expires;
+        shard.entries.splice(shard.entries.begin(), shard.entries, entry);
+        return;
+    }
+    if (shard.entries.size() >= shard.capacity) {
+        shard.index.erase(shard.entries.back().key);
+        shard.entries.pop_back();
+        ++shard.evictions;
+    }
+    shard.entries.push_front(Entry{std::move(key), response, expires});
+    shard.index.emplace(shard.entries.front().key, shard.entries.begin());
+}
+
+void ResponseCache::clear() {
+    for (std::size_t i = 0; i < shard_count_; ++i) {
+        std::lock_guard<std::mutex> lock(shards_[i].mutex);
+        shards_[i].index.clear();
+        shards_[i].entries.clear();
+    }
+}
+
+ResponseCache::Stats ResponseCache::stats() const {
+    Stats stats;
+    for (std::size_t i = 0; i < shard_count_; ++i) {
+        std::lock_guard<std::mutex> lock(shards_[i].mutex);
+        stats.hits += shards_[i].hits;
+        stats.misses += shards_[i].misses;
+        stats.evictions += shards_[i].evictions;
+        stats.entries += shards_[i].entries.size();
+    }
+    return stats;
+}
+
+} // namespace Socks
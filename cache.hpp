@@ -0,0 +1,149 @@
+#pragma once
+
+#include "buffer.hpp"
+#include "codec.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+/**
+ * @file cache.hpp
+ * @brief Per-command cache of encoded responses for idempotent commands.
+ *
+ * A command registered with a cache (see CacheOptions and
+ * Server::set_options()) answers a request it has answered before from the
+ * encoded response it sent then: the handler does not run and nothing is
+ * serialized. Only successful responses are kept.
+ */
+
+namespace Socks {
+
+/**
+ * @class ResponseCache
+ * @brief Sharded LRU map from canonical requests to encoded responses,
+ * with an optional time to live.
+ *
+ * Keys come from key_of(), which lists the request's fields apart from the
+ * reserved ones (`_cmd`, `_deadline_ms`, ...) in a canonical order, so
+ * requests that differ only in member order, whitespace, or `_cmd` given
+ * by name or ID share an entry; answers in different codecs do not. Each
+ * key picks one of up to 16 shards, each a mutex-guarded LRU list, so
+ * threads looking up different keys rarely contend.
+ *
+ * Thread-safe.
+ */
+class ResponseCache {
+  public:
+    /**
+     * @brief Hit and miss counts and the current size.
+     */
+    struct Stats {
+        std::uint64_t hits = 0;
+        std::uint64_t misses = 0;
+        std::uint64_t evictions = 0; ///< Dropped for room, not expiry
+        std::size_t entries = 0;
+    };
+
+    /**
+     * @brief An empty cache.
+     * @param capacity Most entries kept (at least 1), split evenly over
+     * the shards; the least recently used entry of a full shard makes room
+     * for a new one.
+     * @param ttl How long an entry may be served; zero keeps entries until
+     * they are evicted.
+     */
+    ResponseCache(std::size_t capacity, std::chrono::milliseconds ttl);
+
+    /**
+     * @brief The cache key of a request to be answered in `codec`.
+     *
+     * Fields whose names start with `_` are left out. Each remaining field
+     * contributes its length-prefixed name and its compact dump, in name
+     * order (objects keep their members sorted).
+     *
+     * @param request A parsed request object (json or ArenaJson).
+     */
+    template <typename Json>
+    static std::string key_of(const Json &request, Codec codec);
+
+    /**
+     * @brief Look up a response.
+     * @param key From key_of().
+     * @param response Set to the cached response on a hit; the storage is
+     * shared with the cache, not copied.
+     * @return Whether there was a live entry.
+     */
+    bool find(const std::string &key, Buffer &response);
+
+    /**
+     * @brief Add or refresh an entry.
+     * @param key From key_of().
+     * @param response The encoded response; shared, not copied, so it must
+     * not be modified afterwards.
+     */
+    void insert(std::string key, const Buffer &response);
+
+    /**
+     * @brief Drop every entry.
+     */
+    void clear();
+
+    Stats stats() const;
+
+    std::size_t capacity() const { return capacity_; }
+    std::chrono::milliseconds ttl() const { return ttl_; }
+
+  private:
+    struct Entry {
+        std::string key;
+        Buffer response;
+        std::int64_t expires; ///< Steady-clock ns, or negative for never
+    };
+
+    /// One LRU list, most recently used first, and its index.
+    struct Shard {
+        std::mutex mutex;
+        std::list<Entry> entries;
+        std::unordered_map<std::string_view, std::list<Entry>::iterator>
+            index; ///< Keys point into the entries
+        std::uint64_t hits = 0;
+        std::uint64_t misses = 0;
+        std::uint64_t evictions = 0;
+        std::size_t capacity = 0;
+    };
+
+    Shard &shard_of(std::string_view key) const;
+
+    std::size_t capacity_;
+    std::chrono::milliseconds ttl_;
+    std::size_t shard_count_; ///< Power of two
+    std::unique_ptr<Shard[]> shards_;
+};
+
+template <typename Json>
+std::string ResponseCache::key_of(const Json &request, Codec codec) {
+    std::string key(1, static_cast<char>(codec));
+    for (auto it = request.begin(); it != request.end(); ++it) {
+        const auto &name = it.key();
+        if (!name.empty() && name[0] == '_')
+            continue;
+        // The name is length-prefixed and a compact dump never holds a
+        // raw newline, so distinct requests cannot produce the same key.
+        key += std::to_string(name.size());
+        key += ':';
+        key.append(name.data(), name.size());
+        auto value = it.value().dump();
+        key.append(value.data(), value.size());
+        key += '\n';
+    }
+    return key;
+}
+
+} // namespace Socks
@@ -1,55 +1,790 @@
 #include "client.hpp"
+#include "logger.hpp"
+#include "timer.hpp"
 
+#include <algorithm>
+#include <optional>
+#include <stdexcept>
 #include <thread>
+#include <unordered_map>
 
 namespace Socks {
 
-Client::Client(std::unique_ptr<Transport> transport)
-    : transport_(std::move(transport)) {}
+/// Workers in the pool that runs callbacks and non-pipelined requests.
+constexpr size_t kCompletionThreads = 2;
+
+namespace {
+
+/// The connection died before the response arrived.
+struct ConnectionLost : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+} // namespace
+
+static bool connection_lost(const std::exception_ptr &error) {
+    try {
+        std::rethrow_exception(error);
+    } catch (const ConnectionLost &) {
+        return true;
+    } catch (...) {
+        return false;
+    }
+}
+
+static std::runtime_error client_closed() {
+    return std::runtime_error("Client destroyed before the request completed");
+}
+
+/// Decode a response and turn `_success: false` into an exception.
+static json checked_response(const std::string &response_str) {
+    json response = decode(response_str);
+
+    if (!response.value("_success", false)) {
+        std::string msg = response.value("_msg", "Unknown server error.");
+        throw std::runtime_error("Request failed: " + msg);
+    }
+
+    return response;
+}
+
+/// What a background callback receives when the request fails.
+static json error_response(const std::exception_ptr &error) {
+    try {
+        std::rethrow_exception(error);
+    } catch (const std::exception &e) {
+        return json{{"_success", false}, {"_msg", e.what()}};
+    } catch (...) {
+        return json{{"_success", false}, {"_msg", "Unknown error"}};
+    }
+}
+
+/**
+ * One subscription's frames on their way to its callback. The reader
+ * leaves the newest frame here and a completion pool job delivers it.
+ */
+struct Client::Subscription::State {
+    std::function<void(json)> callback;
+    ThreadPool *pool = nullptr;           ///< The client's completion pool
+    std::weak_ptr<Connection> connection; ///< Where the cancel goes
+    std::uint32_t tag = 0;
+    std::string cancel_request; ///< Encoded `_unsubscribe`
+
+    std::mutex mutex;                ///< Protects everything below
+    std::optional<json> latest;      ///< Newest frame not delivered yet
+    std::optional<json> last;        ///< The final frame, once received
+    bool scheduled = false;          ///< A delivery job is queued or running
+    bool cancelled = false;
+    bool finished = false; ///< The final frame has been received
+};
+
+/**
+ * One pooled connection: the channel, its reader thread, the requests
+ * still waiting for a response and the open subscriptions, keyed by frame
+ * tag.
+ */
+struct Client::Connection {
+    explicit Connection(std::unique_ptr<FramedChannel> channel)
+        : channel(std::move(channel)) {}
+
+    ~Connection() {
+        closed_locally = true;
+        channel->shutdown();
+        if (reader.joinable())
+            reader.join();
+    }
+
+    std::unique_ptr<FramedChannel> channel;
+    std::thread reader;
+    std::atomic<size_t> in_flight = 0;
+    std::atomic<bool> closed_locally = false; ///< Shut down by the client
+
+    std::mutex mutex; ///< Protects everything below
+    std::unordered_map<std::uint32_t, Completion> pending;
+    /// Deadline jobs of pending requests on `timer`, cancelled when the
+    /// request completes first.
+    std::unordered_map<std::uint32_t, Timer::Handle> deadlines;
+    Timer *timer = nullptr; ///< The client's, once a request has a deadline
+    std::unordered_map<std::uint32_t, std::shared_ptr<Subscription::State>>
+        streams;
+    std::uint32_t next_tag = 0;
+    std::uint64_t completed = 0; ///< Responses received so far
+    bool alive = true;
+
+    /// Remove request `tag`'s deadline job, returning it for cancel() (id
+    /// zero if it has none). Caller holds mutex.
+    Timer::Handle take_deadline(std::uint32_t tag) {
+        Timer::Handle handle;
+        auto it = deadlines.find(tag);
+        if (it != deadlines.end()) {
+            handle = it->second;
+            deadlines.erase(it);
+        }
+        return handle;
+    }
+};
+
+Client::Client(std::unique_ptr<Transport> transport, Codec codec,
+               size_t max_connections)
+    : transport_(std::move(transport)), codec_(codec),
+      max_connections_(std::max<size_t>(max_connections, 1)) {
+    if (codec_ != Codec::Json && !transport_->binary_safe()) {
+        throw std::invalid_argument(
+            std::string("Codec '") + codec_name(codec_) +
+            "' requires a binary-safe transport (UDP or length-prefixed)");
+    }
+}
 
 Client::~Client() {
+    // Closing the connections joins their readers, which fail every
+    // pending request; the completion pool then runs what is left. Once
+    // closing_ is set no new connection or pool can be created. The timer
+    // goes after the connections, whose readers cancel deadlines on it.
+    std::vector<std::shared_ptr<Connection>> connections;
+    std::unique_ptr<ThreadPool> completions;
+    std::unique_ptr<Timer> timer;
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex_);
+        closing_ = true;
+        connections.swap(pool_);
+        timer = std::move(timer_);
+    }
+    connections.clear();
+    timer.reset();
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex_);
+        completions = std::move(completions_);
+    }
+    if (completions) {
+        completions->wait();
+    }
+
     if (transport_) {
         transport_->close();
     }
 }
 
-json Client::send_request(const std::string &endpoint, const json &request) {
-    std::lock_guard<std::mutex> lock(mutex_);
+ThreadPool &Client::completions() {
+    std::lock_guard<std::mutex> lock(pool_mutex_);
+    if (closing_)
+        throw client_closed();
+    if (!completions_) {
+        completions_ = std::make_unique<ThreadPool>(kCompletionThreads);
+    }
+    return *completions_;
+}
+
+Timer &Client::timer() {
+    std::lock_guard<std::mutex> lock(pool_mutex_);
+    if (closing_)
+        throw client_closed();
+    if (!timer_) {
+        timer_ = std::make_unique<Timer>();
+    }
+    return *timer_;
+}
+
+void Client::read_responses(Connection &conn) {
+    std::exception_ptr failure;
+    try {
+        std::uint32_t tag;
+        std::string payload;
+        while (conn.channel->read(tag, payload)) {
+            Completion done;
+            Timer::Handle deadline;
+            std::shared_ptr<Subscription::State> sub;
+            {
+                std::lock_guard<std::mutex> lock(conn.mutex);
+                auto it = conn.pending.find(tag);
+                if (it != conn.pending.end()) {
+                    done = std::move(it->second);
+                    conn.pending.erase(it);
+                    deadline = conn.take_deadline(tag);
+                    ++conn.completed;
+                } else {
+                    auto stream = conn.streams.find(tag);
+                    if (stream == conn.streams.end())
+                        continue; // abandoned request or ended stream
+                    sub = stream->second;
+                }
+            }
+            if (sub) {
+                json frame;
+                try {
+                    frame = decode(payload);
+                } catch (...) {
+                    frame = error_response(std::current_exception());
+                }
+                bool final = frame.value("_end", false) ||
+                             !frame.value("_success", false);
+                if (final) {
+                    std::lock_guard<std::mutex> lock(conn.mutex);
+                    conn.streams.erase(tag);
+                }
+                Subscription::deliver(sub, std::move(frame), final);
+                continue;
+            }
+            if (deadline.id != 0)
+                conn.timer->cancel(deadline);
+            conn.in_flight.fetch_sub(1, std::memory_order_relaxed);
+            done(std::move(payload), nullptr);
+        }
+        failure = conn.closed_locally
+                      ? std::make_exception_ptr(client_closed())
+                      : std::make_exception_ptr(
+                            ConnectionLost("Connection closed by server"));
+    } catch (...) {
+        failure = std::current_exception();
+    }
+
+    // Fail whatever is still waiting; the connection will not be reused.
+    std::unordered_map<std::uint32_t, Completion> orphans;
+    std::unordered_map<std::uint32_t, Timer::Handle> deadlines;
+    std::unordered_map<std::uint32_t, std::shared_ptr<Subscription::State>>
+        streams;
+    {
+        std::lock_guard<std::mutex> lock(conn.mutex);
+        conn.alive = false;
+        orphans.swap(conn.pending);
+        deadlines.swap(conn.deadlines);
+        streams.swap(conn.streams);
+    }
+    for (auto &[tag, deadline] : deadlines) {
+        conn.timer->cancel(deadline);
+    }
+    for (auto &[tag, done] : orphans) {
+        done(std::string(), failure);
+    }
+    for (auto &[tag, sub] : streams) {
+        Subscription::deliver(sub, error_response(failure), true);
+    }
+}
 
+void Client::Subscription::run_callbacks(const std::shared_ptr<State> &sub) {
+    while (true) {
+        json frame;
+        {
+            std::lock_guard<std::mutex> lock(sub->mutex);
+            if (sub->cancelled || (!sub->latest && !sub->last)) {
+                sub->scheduled = false;
+                return;
+            }
+            std::optional<json> &next = sub->latest ? sub->latest : sub->last;
+            frame = std::move(*next);
+            next.reset();
+        }
+        try {
+            sub->callback(std::move(frame));
+        } catch (const std::exception &e) {
+            log_error("[Socks] Subscription callback threw: ", e.what());
+        }
+    }
+}
+
+void Client::Subscription::deliver(const std::shared_ptr<State> &sub,
+                                   json frame, bool final) {
+    {
+        std::lock_guard<std::mutex> lock(sub->mutex);
+        if (sub->cancelled)
+            return;
+        if (final) {
+            sub->last = std::move(frame);
+            sub->finished = true;
+        } else {
+            sub->latest = std::move(frame); // replaces one not delivered
+        }
+        if (sub->scheduled)
+            return;
+        sub->scheduled = true;
+    }
+    // As for background callbacks: during destruction the pool may refuse
+    // new jobs, and the frame is delivered here instead.
+    try {
+        sub->pool->enqueue([sub]() { run_callbacks(sub); });
+    } catch (const std::exception &) {
+        run_callbacks(sub);
+    }
+}
+
+Client::Subscription &
+Client::Subscription::operator=(Subscription &&other) noexcept {
+    if (this != &other) {
+        cancel();
+        state_ = std::move(other.state_);
+    }
+    return *this;
+}
+
+void Client::Subscription::cancel() {
+    std::shared_ptr<State> state = std::move(state_);
+    if (!state)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->cancelled = true;
+        state->latest.reset();
+        state->last.reset();
+        if (state->finished)
+            return;
+    }
+    // Anything sent on the subscription's tag cancels it. The server's
+    // final frame then removes it from the connection.
+    if (auto conn = state->connection.lock()) {
+        try {
+            conn->channel->write(state->tag, state->cancel_request);
+        } catch (const std::exception &) {
+            // The connection is failing, which ends the subscription too.
+        }
+    }
+}
+
+bool Client::Subscription::active() const {
+    if (!state_)
+        return false;
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    return !state_->cancelled && !state_->finished;
+}
+
+Client::Subscription
+Client::subscribe(const std::string &endpoint, const json &request,
+                  std::function<void(json frame)> callback) {
+    if (!transport_->supports_channels()) {
+        throw std::invalid_argument("Subscriptions need a transport with "
+                                    "channels (Framing::LengthPrefixed)");
+    }
+    json body = request;
+    body["_subscribe"] = true;
+    std::string payload = encode_request(endpoint, body);
+
+    auto state = std::make_shared<Subscription::State>();
+    state->callback = std::move(callback);
+    state->pool = &completions();
+    state->cancel_request = encode_request("_unsubscribe", json::object());
+
+    std::shared_ptr<Connection> conn;
+    while (true) {
+        conn = acquire();
+        std::lock_guard<std::mutex> lock(conn->mutex);
+        if (!conn->alive)
+            continue; // died after acquire(); it is pruned on the next pass
+        state->tag = ++conn->next_tag;
+        state->connection = conn;
+        conn->streams.emplace(state->tag, state);
+        break;
+    }
+
+    bool written;
+    try {
+        written = conn->channel->write(state->tag, payload);
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(conn->mutex);
+        conn->streams.erase(state->tag);
+        throw;
+    }
+    if (!written) {
+        // The reader fails the subscription along with the connection.
+        conn->channel->shutdown();
+    }
+    return Subscription(std::move(state));
+}
+
+std::shared_ptr<Client::Connection> Client::acquire(Deadline deadline) {
+    std::vector<std::shared_ptr<Connection>> dead;
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex_);
+        if (closing_)
+            throw client_closed();
+
+        std::shared_ptr<Connection> best;
+        for (auto it = pool_.begin(); it != pool_.end();) {
+            bool alive;
+            {
+                std::lock_guard<std::mutex> conn_lock((*it)->mutex);
+                alive = (*it)->alive;
+            }
+            if (!alive) {
+                // Joined once the lock is released.
+                dead.push_back(std::move(*it));
+                it = pool_.erase(it);
+                continue;
+            }
+            if (!best || (*it)->in_flight < best->in_flight)
+                best = *it;
+            ++it;
+        }
+
+        // Connections being opened count towards the limit, so concurrent
+        // callers exceed it only while there is none to share yet.
+        if (best && (best->in_flight == 0 ||
+                     pool_.size() + connecting_ >= max_connections_))
+            return best;
+        ++connecting_;
+    }
+
+    // Connect without the lock: requests on the pooled connections carry
+    // on meanwhile, and a slow connect delays only its own caller.
+    std::shared_ptr<Connection> conn;
+    try {
+        conn = std::make_shared<Connection>(transport_->open_channel(deadline));
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(pool_mutex_);
+        --connecting_;
+        throw;
+    }
+
+    std::lock_guard<std::mutex> lock(pool_mutex_);
+    --connecting_;
+    if (closing_)
+        throw client_closed(); // ~Client has taken the pool already
+    conn->reader = std::thread(read_responses, std::ref(*conn));
+    pool_.push_back(conn);
+    return conn;
+}
+
+void Client::start_request(std::shared_ptr<const std::string> payload,
+                           Completion &&done, Deadline deadline,
+                           bool retried) {
+    if (deadline != kNoDeadline &&
+        std::chrono::steady_clock::now() >= deadline) {
+        // Expired while waiting (e.g. for a retry): not worth sending.
+        done(std::string(), std::make_exception_ptr(RequestTimeout()));
+        return;
+    }
+
+    // Taken before any connection lock: timer() locks pool_mutex_, which
+    // acquire() holds while it locks connections.
+    Timer *deadlines = nullptr;
+    if (deadline != kNoDeadline) {
+        try {
+            deadlines = &timer();
+        } catch (const std::exception &) {
+            // Closing: the reader fails the request with its connection.
+        }
+    }
+
+    std::shared_ptr<Connection> conn;
+    std::uint32_t tag;
+    while (true) {
+        try {
+            conn = acquire(deadline);
+        } catch (const RequestTimeout &) {
+            throw;
+        } catch (const std::runtime_error &e) {
+            // A retry follows a write on a connection the server closed, so
+            // only a first attempt is known never to have left.
+            if (retried)
+                throw;
+            throw RequestNotSent(e.what());
+        }
+        std::lock_guard<std::mutex> lock(conn->mutex);
+        if (!conn->alive)
+            continue; // died after acquire(); it is pruned on the next pass
+
+        // A pooled connection may have been closed by the server while
+        // idle; in that case the request is retried once on a fresh one, as
+        // the keep-alive transport does. The retry runs on the completion
+        // pool: the reader thread that reports the failure must not wait
+        // for its own connection to be torn down.
+        bool reused = conn->completed > 0;
+        tag = ++conn->next_tag;
+        conn->pending.emplace(
+            tag, [this, payload, done = std::move(done), deadline, reused,
+                  retried](std::string response,
+                           std::exception_ptr error) mutable {
+                if (error && reused && !retried && !closing_ &&
+                    connection_lost(error)) {
+                    try {
+                        completions().enqueue(
+                            [this, payload = std::move(payload),
+                             done = std::move(done), deadline]() mutable {
+                                try {
+                                    start_request(std::move(payload),
+                                                  std::move(done), deadline,
+                                                  true);
+                                } catch (...) {
+                                    done(std::string(),
+                                         std::current_exception());
+                                }
+                            });
+                        return;
+                    } catch (...) {
+                        error = std::current_exception();
+                    }
+                }
+                done(std::move(response), error);
+            });
+        if (deadlines) {
+            // Scheduled under the lock, so that the reader finds the job
+            // to cancel however soon the response arrives.
+            conn->timer = deadlines;
+            conn->deadlines.emplace(
+                tag, deadlines->schedule(
+                         deadline, [weak = std::weak_ptr<Connection>(conn),
+                                    tag] { expire(weak, tag); }));
+        }
+        conn->in_flight.fetch_add(1, std::memory_order_relaxed);
+        break;
+    }
+
+    bool written;
+    try {
+        written = conn->channel->write(tag, *payload);
+    } catch (...) {
+        Completion rejected;
+        Timer::Handle expiry;
+        {
+            std::lock_guard<std::mutex> lock(conn->mutex);
+            auto it = conn->pending.find(tag);
+            if (it == conn->pending.end())
+                return; // the reader already failed it
+            rejected = std::move(it->second);
+            conn->pending.erase(it);
+            expiry = conn->take_deadline(tag);
+        }
+        if (expiry.id != 0)
+            conn->timer->cancel(expiry);
+        conn->in_flight.fetch_sub(1, std::memory_order_relaxed);
+        rejected(std::string(), std::current_exception());
+        return;
+    }
+    if (!written) {
+        // Wake the reader, which fails this and any other pending request
+        // on the connection.
+        conn->channel->shutdown();
+    }
+}
+
+void Client::expire(const std::weak_ptr<Connection> &weak,
+                    std::uint32_t tag) {
+    std::shared_ptr<Connection> conn = weak.lock();
+    if (!conn)
+        return;
+    Completion done;
+    {
+        std::lock_guard<std::mutex> lock(conn->mutex);
+        auto it = conn->pending.find(tag);
+        if (it == conn->pending.end())
+            return; // answered, or failed with the connection
+        done = std::move(it->second);
+        conn->pending.erase(it);
+        conn->deadlines.erase(tag); // this job, running now
+    }
+    // A late response finds no pending request and is skipped, so the
+    // connection stays usable.
+    conn->in_flight.fetch_sub(1, std::memory_order_relaxed);
+    done(std::string(), std::make_exception_ptr(RequestTimeout()));
+}
+
+std::string Client::round_trip(const std::string &payload,
+                               Deadline deadline) {
+    if (!transport_->supports_channels()) {
+        std::unique_lock<std::timed_mutex> lock(mutex_, std::defer_lock);
+        if (deadline == kNoDeadline)
+            lock.lock();
+        else if (!lock.try_lock_until(deadline))
+            throw RequestTimeout();
+        return transport_->send_until(payload, deadline);
+    }
+
+    std::promise<std::string> reply;
+    std::future<std::string> result = reply.get_future();
+    start_request(std::make_shared<const std::string>(payload),
+                  [reply = std::move(reply)](std::string response,
+                                             std::exception_ptr error) mutable {
+                      if (error)
+                          reply.set_exception(error);
+                      else
+                          reply.set_value(std::move(response));
+                  },
+                  deadline);
+    return result.get();
+}
+
+void Client::send_encoded(std::string payload, Completion done,
+                          Deadline deadline) {
+    if (!transport_->supports_channels()) {
+        completions().enqueue([this, payload = std::move(payload),
+                               done = std::move(done), deadline]() mutable {
+            std::string response;
+            std::exception_ptr error;
+            try {
+                if (closing_)
+                    throw client_closed();
+                response = round_trip(payload, deadline);
+            } catch (...) {
+                error = std::current_exception();
+            }
+            done(std::move(response), error);
+        });
+        return;
+    }
+    start_request(std::make_shared<const std::string>(std::move(payload)),
+                  std::move(done), deadline);
+}
+
+std::string Client::encode_request(const std::string &endpoint,
+                                   const json &request,
+                                   Deadline deadline) const {
     // Construct full request JSON with "_cmd" field
     json full_request = request;
-    full_request["_cmd"] = endpoint;
+    full_request["_cmd"] = command_field(endpoint);
+    if (deadline != kNoDeadline && !full_request.contains("_deadline_ms")) {
+        // A budget rather than a time: the server's clock is not ours.
+        auto left = std::chrono::ceil<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now());
+        full_request["_deadline_ms"] =
+            static_cast<std::uint64_t>(std::max<std::int64_t>(left.count(), 0));
+    }
+    return encode(full_request, codec_);
+}
 
-    // Use new Transport::send(data) to send and receive in one go
-    std::string response_str = transport_->send(full_request.dump());
+Deadline Client::deadline_for(std::chrono::milliseconds timeout) const {
+    if (timeout.count() <= 0)
+        timeout = this->timeout();
+    if (timeout.count() <= 0)
+        return kNoDeadline;
+    return std::chrono::steady_clock::now() + timeout;
+}
 
-    json response = json::parse(response_str);
+json Client::command_field(const std::string &endpoint) const {
+    if (codec_ != Codec::Json) {
+        std::lock_guard<std::mutex> lock(ids_mutex_);
+        auto id = command_ids_.find(endpoint);
+        if (id != command_ids_.end())
+            return id->second;
+    }
+    return endpoint;
+}
 
-    if (!response.value("_success", false)) {
-        std::string msg = response.value("_msg", "Unknown server error.");
-        throw std::runtime_error("Request failed: " + msg);
+std::vector<json>
+Client::send_batch(const std::vector<std::pair<std::string, json>> &requests) {
+    json entries = json::array();
+    for (const auto &[endpoint, request] : requests) {
+        json entry = request;
+        entry["_cmd"] = command_field(endpoint);
+        entries.push_back(std::move(entry));
     }
+    json response = send_request("_batch", {{"requests", std::move(entries)}});
+    return response.at("responses").get<std::vector<json>>();
+}
 
-    return response;
+size_t Client::fetch_command_ids() {
+    json response = send_request("_commands", json::object());
+    std::unordered_map<std::string, std::uint64_t> ids;
+    for (auto &[name, id] : response.at("commands").items()) {
+        ids.emplace(name, id.get<std::uint64_t>());
+    }
+    std::lock_guard<std::mutex> lock(ids_mutex_);
+    command_ids_ = std::move(ids);
+    return command_ids_.size();
 }
 
-std::future<json> Client::send_request_async(const std::string &endpoint,
-                                             const json &request) {
-    return std::async(std::launch::async, [this, endpoint, request]() {
-        return send_request(endpoint, request);
-    });
+json Client::send_request(const std::string &endpoint, const json &request,
+                          std::chrono::milliseconds timeout) {
+    Deadline deadline = deadline_for(timeout);
+    return checked_response(
+        round_trip(encode_request(endpoint, request, deadline), deadline));
+}
+
+std::future<json>
+Client::send_request_async(const std::string &endpoint, const json &request,
+                           std::chrono::milliseconds timeout) {
+    std::promise<json> promise;
+    std::future<json> result = promise.get_future();
+    Deadline deadline = deadline_for(timeout);
+    std::string payload = encode_request(endpoint, request, deadline);
+
+    if (!transport_->supports_channels()) {
+        completions().enqueue(
+            [this, payload = std::move(payload), promise = std::move(promise),
+             deadline]() mutable {
+                try {
+                    if (closing_)
+                        throw client_closed();
+                    promise.set_value(
+                        checked_response(round_trip(payload, deadline)));
+                } catch (...) {
+                    promise.set_exception(std::current_exception());
+                }
+            });
+        return result;
+    }
+
+    // Decoded on the reader thread; no other thread is involved.
+    start_request(std::make_shared<const std::string>(std::move(payload)),
+                  [promise = std::move(promise)](
+                      std::string response, std::exception_ptr error) mutable {
+                      try {
+                          if (error)
+                              std::rethrow_exception(error);
+                          promise.set_value(checked_response(response));
+                      } catch (...) {
+                          promise.set_exception(std::current_exception());
+                      }
+                  },
+                  deadline);
+    return result;
 }
 
 void Client::send_request_bg(const std::string &endpoint, const json &request,
-                             std::function<void(json)> callback) {
-    std::thread([this, endpoint, request, callback]() {
-        try {
-            json response = send_request(endpoint, request);
-            callback(response);
-        } catch (const std::exception &e) {
-            callback(json{{"_success", false}, {"_msg", e.what()}});
-        }
-    }).detach();
+                             std::function<void(json)> callback,
+                             std::chrono::milliseconds timeout) {
+    Deadline deadline = deadline_for(timeout);
+    std::string payload = encode_request(endpoint, request, deadline);
+
+    if (!transport_->supports_channels()) {
+        completions().enqueue([this, payload = std::move(payload),
+                               callback = std::move(callback), deadline]() {
+            json response;
+            try {
+                if (closing_)
+                    throw client_closed();
+                response = checked_response(round_trip(payload, deadline));
+            } catch (...) {
+                response = error_response(std::current_exception());
+            }
+            callback(std::move(response));
+        });
+        return;
+    }
+
+    // The callback is user code that may block, so it runs on the
+    // completion pool rather than on the connection's reader (or timer)
+    // thread. During destruction, or when already on the pool (a retried
+    // request), it runs where it is: the pool may be draining and refuse
+    // new jobs.
+    completions(); // throws now, rather than later, if the client is closing
+    start_request(
+        std::make_shared<const std::string>(std::move(payload)),
+        [this, callback = std::move(callback)](
+            std::string response, std::exception_ptr error) mutable {
+            auto deliver = [callback = std::move(callback),
+                            response = std::move(response), error]() {
+                json result;
+                try {
+                    if (error)
+                        std::rethrow_exception(error);
+                    result = checked_response(response);
+                } catch (...) {
+                    result = error_response(std::current_exception());
+                }
+                callback(std::move(result));
+            };
+            // completions() refuses once the client is closing. Otherwise
+            // the pool is running: ~Client stops it only after the reader
+            // and timer threads that complete requests are gone.
+            ThreadPool *pool = nullptr;
+            try {
+                if (!closing_)
+                    pool = &completions();
+            } catch (const std::exception &) {
+            }
+            if (pool && !pool->on_worker_thread())
+                pool->enqueue(std::move(deliver));
+            else
+                deliver();
+        },
+        deadline);
 }
 
 } // namespace Socks
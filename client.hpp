@@ -1,12 +1,22 @@
 #pragma once
 
+#include "codec.hpp"
+#include "function.hpp"
 #include "nlohmann/json.hpp"
+#include "threadpool.hpp"
 #include "transport.hpp"
+#include <atomic>
+#include <chrono>
+#include <exception>
 #include <functional>
 #include <future>
 #include <memory>
 #include <mutex>
+#include <stdexcept>
 #include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 /**
  * @file client.hpp
@@ -21,6 +31,8 @@ namespace Socks {
 
 using json = nlohmann::json;
 
+class Timer;
+
 /**
  * @class Client
  * @brief Client for sending JSON requests over a pluggable transport.
@@ -29,8 +41,25 @@ using json = nlohmann::json;
  * - Synchronous blocking requests
  * - Asynchronous requests returning futures
  * - Background requests with callback on completion
+ * - Awaitable requests in C++20 coroutines (request() in coro.hpp)
  * - Automatic error checking (_success field)
+ * - Per-request timeouts, passed on to the server as `_deadline_ms`
+ * - JSON, MessagePack or CBOR on the wire
  * - Thread-safe
+ *
+ * On transports that support channels (stream transports with
+ * Framing::LengthPrefixed) the client keeps a small pool of persistent
+ * connections. Each request gets its own frame tag, so concurrent callers
+ * pipeline requests on a connection and responses are matched out of
+ * order; a new connection is opened only when every pooled one is busy
+ * and the pool is below its limit. On other transports requests are
+ * serialized, one round trip at a time.
+ *
+ * Asynchronous and background requests never create threads: pipelined
+ * requests complete from the connection reader threads, and callbacks (and
+ * requests on non-pipelined transports) run on a small internal
+ * ThreadPool. Destroying the client fails requests that are still pending
+ * instead of leaving threads behind.
  */
 class Client {
   public:
@@ -38,11 +67,21 @@ class Client {
      * @brief Constructs a Client with the specified transport.
      * @param transport Unique pointer to a transport backend (Unix, UDP, TCP,
      * etc.).
+     * @param codec Encoding used for requests. Binary codecs need a
+     * binary-safe transport (UDP or Framing::LengthPrefixed).
+     * @param max_connections Upper bound on pooled connections when the
+     * transport supports channels.
+     * @throws std::invalid_argument if the codec cannot be carried by the
+     * transport.
      */
-    explicit Client(std::unique_ptr<Transport> transport);
+    explicit Client(std::unique_ptr<Transport> transport,
+                    Codec codec = Codec::Json, size_t max_connections = 4);
 
     /**
      * @brief Destroys the client, closing the transport.
+     *
+     * Pending asynchronous requests fail with std::runtime_error and pending
+     * background callbacks receive an error response before this returns.
      */
     ~Client();
 
@@ -51,34 +90,247 @@ class Client {
      * @param endpoint Target endpoint identifier (not always used depending on
      * transport).
      * @param request JSON object containing the request.
+     * @param timeout How long to wait for the response; zero uses
+     * timeout(). The request carries the budget as `_deadline_ms`, so the
+     * server drops it if it cannot start it in time.
      * @return JSON object containing the response.
+     * @throws RequestTimeout if no response arrived in time.
      * @throws std::runtime_error if an error response is received or
      * communication fails.
      */
-    json send_request(const std::string &endpoint, const json &request);
+    json send_request(const std::string &endpoint, const json &request,
+                      std::chrono::milliseconds timeout = {});
 
     /**
      * @brief Sends a request asynchronously.
      * @param endpoint Target endpoint identifier.
      * @param request JSON object containing the request.
+     * @param timeout As for send_request().
      * @return std::future<json> which will hold the response or throw an error.
+     * @throws std::runtime_error if the client is being destroyed.
      */
-    std::future<json> send_request_async(const std::string &endpoint,
-                                         const json &request);
+    std::future<json>
+    send_request_async(const std::string &endpoint, const json &request,
+                       std::chrono::milliseconds timeout = {});
 
     /**
      * @brief Sends a request in the background and invokes a callback upon
      * completion.
      * @param endpoint Target endpoint identifier.
      * @param request JSON object containing the request.
-     * @param callback Function to call with the response.
+     * @param callback Function to call with the response, or with
+     * `{"_success": false, "_msg": ...}` on failure. Runs on the client's
+     * completion pool.
+     * @param timeout As for send_request().
+     * @throws std::runtime_error if the client is being destroyed.
      */
     void send_request_bg(const std::string &endpoint, const json &request,
-                         std::function<void(json)> callback);
+                         std::function<void(json)> callback,
+                         std::chrono::milliseconds timeout = {});
+
+    /**
+     * @brief Give every request a deadline `timeout` after it is sent,
+     * unless the call passes its own. Zero, the default, waits for ever.
+     *
+     * Without channels a request also waits, within its deadline, for the
+     * requests ahead of it, since those go one at a time.
+     */
+    void set_timeout(std::chrono::milliseconds timeout) {
+        timeout_ms_ = timeout.count();
+    }
+
+    /**
+     * @brief The timeout set with set_timeout().
+     */
+    std::chrono::milliseconds timeout() const {
+        return std::chrono::milliseconds(timeout_ms_.load());
+    }
+
+    /**
+     * @class Subscription
+     * @brief Handle to a subscription started with subscribe().
+     *
+     * Destroying the handle, or calling cancel(), ends the subscription.
+     * Move-only.
+     */
+    class Subscription {
+      public:
+        Subscription() = default;
+        Subscription(Subscription &&other) noexcept = default;
+        Subscription &operator=(Subscription &&other) noexcept;
+        ~Subscription() { cancel(); }
+
+        /**
+         * @brief Ask the server to stop sending and stop the callback.
+         *
+         * Once this returns the callback does not start again; a call
+         * already running on the completion pool finishes.
+         */
+        void cancel();
+
+        /**
+         * @brief Whether frames may still arrive: not cancelled, and the
+         * final frame has not been received.
+         */
+        bool active() const;
+
+      private:
+        friend class Client;
+        struct State;
+
+        explicit Subscription(std::shared_ptr<State> state)
+            : state_(std::move(state)) {}
+
+        /// Reader thread: hand a frame to the callback, replacing one not
+        /// delivered yet. `final` ends the subscription.
+        static void deliver(const std::shared_ptr<State> &sub, json frame,
+                            bool final);
+
+        /// Completion pool: run the callback until no frame is waiting.
+        static void run_callbacks(const std::shared_ptr<State> &sub);
+
+        std::shared_ptr<State> state_;
+    };
+
+    /**
+     * @brief Subscribe to a stream command (see Server::add_stream_handler()).
+     *
+     * The request goes out with `"_subscribe": true` on a pooled
+     * connection, and every frame the server pushes for it is passed to
+     * `callback` on the client's completion pool, one call at a time.
+     * Frames that arrive while the callback runs coalesce: it is next
+     * called with the newest. The last frame it receives has `"_end":
+     * true` if the server ended the stream, or `"_success": false` if the
+     * request failed or the connection was lost; subscriptions are not
+     * renewed on a new connection.
+     *
+     * @param endpoint The stream command.
+     * @param request JSON object containing the request.
+     * @param callback Receives each frame.
+     * @return The handle that keeps the subscription open.
+     * @throws std::invalid_argument if the transport has no channels
+     * (Framing::LengthPrefixed).
+     * @throws std::runtime_error if the request cannot be sent.
+     */
+    Subscription subscribe(const std::string &endpoint, const json &request,
+                           std::function<void(json frame)> callback);
+
+    /**
+     * @brief Sends several requests in one message and blocks until all
+     * are answered.
+     *
+     * The server runs them concurrently (see `_batch`), which saves a round
+     * trip per request. One failing request does not fail the others.
+     *
+     * @param requests Pairs of `_cmd` and request body.
+     * @return One response per request, in order, each with its own
+     * `_success`; errors are not thrown.
+     * @throws std::runtime_error if the batch itself fails or
+     * communication fails.
+     */
+    std::vector<json>
+    send_batch(const std::vector<std::pair<std::string, json>> &requests);
+
+    /**
+     * @brief Ask the server for its numeric command IDs.
+     *
+     * Once known, requests in a binary codec carry the command's ID as
+     * `_cmd` instead of its name, which the server routes on without
+     * comparing strings. JSON requests keep the name. Commands the server
+     * did not list, e.g. registered later, are still sent by name; call
+     * again to pick them up.
+     *
+     * @return The number of IDs now known.
+     * @throws std::runtime_error if the request fails.
+     */
+    size_t fetch_command_ids();
+
+    /**
+     * @brief The encoding used for requests.
+     */
+    Codec codec() const { return codec_; }
 
   private:
+    friend class ClusterClient;
+    struct Connection;
+
+    /// Receives the encoded response, or the error that prevented it.
+    using Completion =
+        UniqueFunction<void(std::string response, std::exception_ptr error)>;
+
+    /**
+     * Send an encoded request (see encode_request()) without waiting.
+     * `done` runs on a connection's reader thread, on the timer thread
+     * when the deadline passes, or on the completion pool on transports
+     * without channels. An error means no response arrived; a response
+     * with `_success: false` is not an error here. Throws instead, without
+     * calling `done`, if no connection can be opened (RequestNotSent on
+     * transports with channels).
+     */
+    void send_encoded(std::string payload, Completion done,
+                      Deadline deadline = kNoDeadline);
+
+    /// Encode a request, adding the "_cmd" field and, with a deadline, the
+    /// `_deadline_ms` left until it.
+    std::string encode_request(const std::string &endpoint,
+                               const json &request,
+                               Deadline deadline = kNoDeadline) const;
+
+    /// The deadline of a request sent now with `timeout` (see
+    /// send_request()).
+    Deadline deadline_for(std::chrono::milliseconds timeout) const;
+
+    /// The value to send as `_cmd`: the command's ID if known and the codec
+    /// is binary, else its name.
+    json command_field(const std::string &endpoint) const;
+
+    /// Send an encoded request and wait for the encoded response.
+    std::string round_trip(const std::string &payload,
+                           Deadline deadline = kNoDeadline);
+
+    /**
+     * Send an encoded request on a pooled connection. `done` runs on the
+     * connection's reader thread, on the completion pool when the request
+     * is retried, or on the timer thread if the deadline passes first.
+     * `done` is only moved from once the request is registered: if this
+     * throws, the caller still holds it.
+     */
+    void start_request(std::shared_ptr<const std::string> payload,
+                       Completion &&done, Deadline deadline = kNoDeadline,
+                       bool retried = false);
+
+    /// Timer thread: fail request `tag` on `conn` if it is still waiting.
+    static void expire(const std::weak_ptr<Connection> &conn,
+                       std::uint32_t tag);
+
+    /// Pick the least busy pooled connection, opening one if worthwhile.
+    std::shared_ptr<Connection> acquire(Deadline deadline = kNoDeadline);
+
+    /// The pool running callbacks and non-pipelined requests.
+    ThreadPool &completions();
+
+    /// The timer failing pipelined requests at their deadline.
+    Timer &timer();
+
+    /// Reader thread: completes pending requests as responses arrive.
+    static void read_responses(Connection &conn);
+
     std::unique_ptr<Transport> transport_; ///< Communication backend
-    std::mutex mutex_;                     ///< Ensures thread-safe send/receive
+    Codec codec_;                          ///< Wire encoding of requests
+    size_t max_connections_;               ///< Pool size limit
+    std::timed_mutex mutex_; ///< Serializes round trips without channels
+    std::atomic<bool> closing_ = false; ///< Set once destruction begins
+    std::atomic<std::chrono::milliseconds::rep> timeout_ms_ = 0;
+
+    mutable std::mutex ids_mutex_; ///< Protects command_ids_
+    std::unordered_map<std::string, std::uint64_t> command_ids_;
+
+    std::mutex pool_mutex_; ///< Protects pool_, connecting_, completions_
+                            ///< and timer_
+    std::vector<std::shared_ptr<Connection>> pool_;
+    size_t connecting_ = 0; ///< Connections acquire() is opening
+    std::unique_ptr<ThreadPool> completions_; ///< Created on first use
+    std::unique_ptr<Timer> timer_;            ///< Created on first use
 };
 
 } // namespace Socks
@@ -0,0 +1,446 @@
+#include "cluster.hpp"
+#include "logger.hpp"
+#include "timer.hpp"
+
+#include <algorithm>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+
+namespace Socks {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+std::int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               Clock::now().time_since_epoch())
+        .count();
+}
+
+} // namespace
+
+/// Decode a response and turn `_success: false` into an exception.
+static json checked_response(const std::string &response_str) {
+    json response = decode(response_str);
+
+    if (!response.value("_success", false)) {
+        std::string msg = response.value("_msg", "Unknown server error.");
+        throw std::runtime_error("Request failed: " + msg);
+    }
+
+    return response;
+}
+
+/// Whether `error` shows the request never reached its server.
+static bool not_sent(const std::exception_ptr &error) {
+    try {
+        std::rethrow_exception(error);
+    } catch (const RequestNotSent &) {
+        return true;
+    } catch (...) {
+        return false;
+    }
+}
+
+/// What a background callback receives when the request fails.
+static json error_response(const std::exception_ptr &error) {
+    try {
+        std::rethrow_exception(error);
+    } catch (const std::exception &e) {
+        return json{{"_success", false}, {"_msg", e.what()}};
+    } catch (...) {
+        return json{{"_success", false}, {"_msg", "Unknown error"}};
+    }
+}
+
+/**
+ * One server: its Client and what is known of its health.
+ */
+struct ClusterClient::Node {
+    std::unique_ptr<Client> client;
+    std::atomic<size_t> outstanding = 0;
+    std::atomic<size_t> consecutive_failures = 0;
+    std::atomic<std::int64_t> ejected_until = 0; ///< now_ns() time; 0 if not
+    std::atomic<std::uint64_t> requests = 0;
+    std::atomic<std::uint64_t> failures = 0;
+
+    bool healthy(std::int64_t now) const { return ejected_until <= now; }
+};
+
+/**
+ * One request on its way through the cluster: retried on another server
+ * when one fails, and possibly hedged, until it finishes once.
+ */
+struct ClusterClient::Call {
+    std::string endpoint;
+    json request;
+    Deadline deadline = kNoDeadline;
+
+    std::mutex mutex; ///< Protects everything below
+    std::function<void(std::string, std::exception_ptr)> done;
+    std::vector<bool> tried;     ///< By server index
+    std::vector<size_t> running; ///< Servers whose answer is awaited
+    std::vector<Timer::Handle> timers; ///< Timeout and hedge, if any
+    std::exception_ptr last_error;
+    bool finished = false;
+};
+
+// ==================== Construction ====================
+
+ClusterClient::ClusterClient(std::vector<std::unique_ptr<Transport>> transports,
+                             ClusterOptions options)
+    : options_(options) {
+    if (transports.empty())
+        throw std::invalid_argument("ClusterClient needs at least one server");
+
+    for (auto &transport : transports) {
+        auto node = std::make_unique<Node>();
+        node->client = std::make_unique<Client>(
+            std::move(transport), options_.codec, options_.max_connections);
+        nodes_.push_back(std::move(node));
+    }
+    home_ = nodes_.front()->client.get();
+}
+
+ClusterClient::~ClusterClient() {
+    {
+        std::unique_lock<std::shared_mutex> lock(clients_mutex_);
+        closing_ = true;
+    }
+
+    // Each client fails its pending requests; with closing_ set they do not
+    // fail over, so their calls finish with that error. The first goes last:
+    // its timer and pool, which the cluster shares, stay until the others
+    // are done, and it waits for the callbacks queued there.
+    for (size_t i = nodes_.size(); i-- > 0;)
+        nodes_[i]->client.reset();
+}
+
+// ==================== Requests ====================
+
+void ClusterClient::start(
+    const std::string &endpoint, const json &request,
+    std::function<void(std::string, std::exception_ptr)> done) {
+    auto call = std::make_shared<Call>();
+    call->endpoint = endpoint;
+    call->request = request;
+    call->done = std::move(done);
+    call->tried.assign(nodes_.size(), false);
+
+    // The timer holds the call weakly: one that finished is dropped.
+    // finish() cancels the jobs still waiting.
+    std::weak_ptr<Call> weak = call;
+    std::vector<Timer::Handle> timers;
+    Clock::time_point now = Clock::now();
+    try {
+        if (options_.timeout.count() > 0) {
+            // Each Client also fails its attempt at the deadline, which
+            // charges the server; this only makes sure the call ends then.
+            call->deadline = now + options_.timeout;
+            timers.push_back(home_->timer().schedule(
+                call->deadline, [this, weak] {
+                    if (std::shared_ptr<Call> call = weak.lock()) {
+                        finish(call, {},
+                               std::make_exception_ptr(RequestTimeout()));
+                    }
+                }));
+        }
+        if (options_.hedge_after.count() > 0 && nodes_.size() > 1) {
+            auto hedge = [this, weak] {
+                std::shared_ptr<Call> call = weak.lock();
+                if (!call)
+                    return;
+                try {
+                    home_->completions().enqueue(
+                        [this, call] { attempt(call); });
+                } catch (...) {
+                    // Closing: the first attempt is all there will be.
+                }
+            };
+            timers.push_back(
+                home_->timer().schedule(now + options_.hedge_after, hedge));
+        }
+    } catch (const std::exception &) {
+        // Closing: the first attempt fails on its own.
+    }
+    if (!timers.empty()) {
+        std::lock_guard<std::mutex> lock(call->mutex);
+        call->timers = std::move(timers);
+    }
+
+    attempt(call);
+}
+
+void ClusterClient::attempt(const std::shared_ptr<Call> &call) {
+    size_t index;
+    std::exception_ptr exhausted;
+    {
+        std::lock_guard<std::mutex> lock(call->mutex);
+        if (call->finished)
+            return;
+        index = pick(call->tried);
+        if (index == nodes_.size()) {
+            // Every server was tried; wait for those still running.
+            if (!call->running.empty())
+                return;
+            exhausted = call->last_error
+                            ? call->last_error
+                            : std::make_exception_ptr(
+                                  std::runtime_error("No server available"));
+        } else {
+            call->tried[index] = true;
+            call->running.push_back(index);
+        }
+    }
+    if (exhausted) {
+        finish(call, {}, exhausted);
+        return;
+    }
+
+    Node &node = *nodes_[index];
+    ++node.outstanding;
+    ++node.requests;
+
+    // complete() never calls attempt() directly (failovers go through the
+    // pool), so the shared lock is not taken twice on this thread.
+    std::shared_lock<std::shared_mutex> lock(clients_mutex_);
+    try {
+        if (closing_) {
+            throw std::runtime_error(
+                "ClusterClient destroyed before the request completed");
+        }
+        node.client->send_encoded(
+            node.client->encode_request(call->endpoint, call->request,
+                                        call->deadline),
+            [this, call, index](std::string response,
+                                std::exception_ptr error) {
+                complete(call, index, std::move(response), error);
+            },
+            call->deadline);
+    } catch (...) {
+        complete(call, index, {}, std::current_exception());
+    }
+}
+
+void ClusterClient::complete(const std::shared_ptr<Call> &call, size_t index,
+                             std::string response, std::exception_ptr error) {
+    --nodes_[index]->outstanding;
+    record(index, !error);
+    {
+        std::lock_guard<std::mutex> lock(call->mutex);
+        auto running = std::find(call->running.begin(), call->running.end(),
+                                 index);
+        if (running != call->running.end())
+            call->running.erase(running);
+        if (call->finished)
+            return;
+        if (error)
+            call->last_error = error;
+    }
+
+    // Any answer is final, `_success: false` included. A request that was
+    // written may have run even if its connection dropped before the
+    // answer, so only one that never left is tried elsewhere, unless the
+    // requests are idempotent.
+    if (!error) {
+        finish(call, std::move(response), nullptr);
+        return;
+    }
+    if (closing_ || Clock::now() >= call->deadline ||
+        !(options_.idempotent || not_sent(error))) {
+        finish(call, {}, error);
+        return;
+    }
+    try {
+        home_->completions().enqueue([this, call] { attempt(call); });
+    } catch (...) {
+        finish(call, {}, error);
+    }
+}
+
+void ClusterClient::finish(const std::shared_ptr<Call> &call,
+                           std::string response, std::exception_ptr error) {
+    std::function<void(std::string, std::exception_ptr)> done;
+    std::vector<Timer::Handle> timers;
+    {
+        std::lock_guard<std::mutex> lock(call->mutex);
+        if (call->finished)
+            return;
+        call->finished = true;
+        done = std::move(call->done);
+        timers.swap(call->timers);
+    }
+    if (!timers.empty()) {
+        try {
+            Timer &timer = home_->timer();
+            for (const Timer::Handle &handle : timers)
+                timer.cancel(handle);
+        } catch (const std::exception &) {
+            // Closing: the timer drops its jobs anyway.
+        }
+    }
+    done(std::move(response), error);
+}
+
+// ==================== Balancing & Health ====================
+
+size_t ClusterClient::pick(const std::vector<bool> &tried) {
+    const size_t count = nodes_.size();
+    const std::int64_t now = now_ns();
+
+    // Ejected servers are only used once no healthy one is left.
+    for (bool healthy_only : {true, false}) {
+        auto usable = [&](size_t i) {
+            return !tried[i] && (!healthy_only || nodes_[i]->healthy(now));
+        };
+
+        if (options_.balance == Balance::PowerOfTwoChoices) {
+            // Reservoir-sample two usable servers, keep the less busy.
+            thread_local std::minstd_rand rng(std::random_device{}());
+            size_t first = count, second = count, seen = 0;
+            for (size_t i = 0; i < count; ++i) {
+                if (!usable(i))
+                    continue;
+                ++seen;
+                if (seen == 1) {
+                    first = i;
+                } else if (seen == 2) {
+                    second = i;
+                } else {
+                    size_t slot = rng() % seen;
+                    if (slot == 0)
+                        first = i;
+                    else if (slot == 1)
+                        second = i;
+                }
+            }
+            if (second == count) {
+                if (first != count)
+                    return first;
+                continue;
+            }
+            return nodes_[second]->outstanding < nodes_[first]->outstanding
+                       ? second
+                       : first;
+        }
+
+        // Start where the previous pick did, so that ties rotate.
+        size_t start = next_.fetch_add(1, std::memory_order_relaxed) % count;
+        size_t best = count;
+        for (size_t n = 0; n < count; ++n) {
+            size_t i = (start + n) % count;
+            if (usable(i) && (best == count || nodes_[i]->outstanding <
+                                                   nodes_[best]->outstanding))
+                best = i;
+        }
+        if (best != count)
+            return best;
+    }
+    return count;
+}
+
+void ClusterClient::record(size_t index, bool ok) {
+    Node &node = *nodes_[index];
+    if (ok) {
+        node.consecutive_failures = 0;
+        if (node.ejected_until != 0 && node.ejected_until.exchange(0) != 0)
+            log_info("[Socks] Cluster server ", index, " is back.");
+        return;
+    }
+
+    ++node.failures;
+    size_t failures = ++node.consecutive_failures;
+    if (failures >= options_.failures_to_eject) {
+        node.ejected_until =
+            now_ns() +
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                options_.eject_for)
+                .count();
+        if (failures == options_.failures_to_eject) {
+            log_warning("[Socks] Cluster server ", index, " ejected after ",
+                        failures, " consecutive failures.");
+        }
+    }
+}
+
+json ClusterClient::stats() const {
+    const std::int64_t now = now_ns();
+    json servers = json::array();
+    for (const auto &node : nodes_) {
+        servers.push_back({
+            {"outstanding", node->outstanding.load()},
+            {"requests", node->requests.load()},
+            {"failures", node->failures.load()},
+            {"consecutive_failures", node->consecutive_failures.load()},
+            {"healthy", node->healthy(now)},
+        });
+    }
+    return servers;
+}
+
+// ==================== Public API ====================
+
+json ClusterClient::send_request(const std::string &endpoint,
+                                 const json &request) {
+    return send_request_async(endpoint, request).get();
+}
+
+std::future<json> ClusterClient::send_request_async(const std::string &endpoint,
+                                                    const json &request) {
+    auto promise = std::make_shared<std::promise<json>>();
+    std::future<json> result = promise->get_future();
+    start(endpoint, request,
+          [promise](std::string response, std::exception_ptr error) {
+              try {
+                  if (error)
+                      std::rethrow_exception(error);
+                  promise->set_value(checked_response(response));
+              } catch (...) {
+                  promise->set_exception(std::current_exception());
+              }
+          });
+    return result;
+}
+
+void ClusterClient::send_request_bg(const std::string &endpoint,
+                                    const json &request,
+                                    std::function<void(json)> callback) {
+    // As with Client, the callback runs on a pool rather than on a reader
+    // thread, except during destruction or when already on that pool.
+    start(endpoint, request,
+          [this, callback = std::move(callback)](std::string response,
+                                                 std::exception_ptr error) {
+              auto deliver = [callback, response = std::move(response),
+                              error]() {
+                  json result;
+                  try {
+                      if (error)
+                          std::rethrow_exception(error);
+                      result = checked_response(response);
+                  } catch (...) {
+                      result = error_response(std::current_exception());
+                  }
+                  callback(std::move(result));
+              };
+              ThreadPool *pool = nullptr;
+              try {
+                  if (!closing_)
+                      pool = &home_->completions();
+              } catch (...) {
+                  // The first server's Client is closing.
+              }
+              if (!pool || pool->on_worker_thread()) {
+                  deliver();
+                  return;
+              }
+              try {
+                  pool->enqueue(deliver);
+              } catch (...) {
+                  deliver();
+              }
+          });
+}
+
+} // namespace Socks
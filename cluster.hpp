@@ -0,0 +1,194 @@
+#pragma once
+
+#include "client.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+/**
+ * @file cluster.hpp
+ * @brief Client-side load balancing and failover over several servers.
+ *
+ * A ClusterClient keeps one Client, with its pooled and pipelined
+ * connections, per server, and sends each request to one of them:
+ *
+ * @code
+ * std::vector<std::unique_ptr<Transport>> nodes;
+ * nodes.push_back(std::make_unique<TcpTransport>("10.0.0.2", 8080,
+ *                                                Framing::LengthPrefixed));
+ * nodes.push_back(std::make_unique<TcpTransport>("10.0.0.3", 8080,
+ *                                                Framing::LengthPrefixed));
+ * ClusterOptions options;
+ * options.timeout = std::chrono::milliseconds(200);
+ * options.hedge_after = std::chrono::milliseconds(20);
+ * ClusterClient cluster(std::move(nodes), options);
+ * json pose = cluster.send_request("pose", json::object());
+ * @endcode
+ *
+ * A server that answers, even with `_success: false`, is healthy and its
+ * answer is final. A request whose server cannot be reached fails over to
+ * another server; one whose connection drops after it was written may
+ * already have run, and only fails over if ClusterOptions::idempotent is
+ * set. A server failing several
+ * requests in a row is ejected for a while; after that, requests try it
+ * again, and the first success brings it back.
+ */
+
+namespace Socks {
+
+/**
+ * @brief How ClusterClient picks a server for a request.
+ */
+enum class Balance {
+    /// The healthy server with the fewest requests outstanding. Best with
+    /// few clients, since each sees only its own requests.
+    LeastOutstanding,
+    /// The less busy of two healthy servers chosen at random. Avoids many
+    /// clients piling onto the same "least busy" server at once.
+    PowerOfTwoChoices,
+};
+
+/**
+ * @brief Settings of a ClusterClient.
+ */
+struct ClusterOptions {
+    Balance balance = Balance::LeastOutstanding;
+
+    /// Give up on a request after this long; zero waits for ever. Servers
+    /// get the time left as `_deadline_ms`. A request that times out counts
+    /// as a failure of the servers it was waiting on.
+    std::chrono::milliseconds timeout{0};
+
+    /// Send a second copy of a request to another server if the first has
+    /// not answered after this long, and take whichever answer comes
+    /// first; zero never hedges. Only for requests that are safe to run
+    /// twice.
+    std::chrono::milliseconds hedge_after{0};
+
+    /// Requests are safe to run twice: fail over on any failure to get an
+    /// answer, not only when the request was never sent. Needed for
+    /// failover on transports without channels, which cannot tell.
+    bool idempotent = false;
+
+    /// Consecutive failures after which a server is ejected.
+    std::size_t failures_to_eject = 3;
+
+    /// How long an ejected server gets no requests (while others are
+    /// healthy).
+    std::chrono::milliseconds eject_for{1000};
+
+    /// Wire encoding (see Client).
+    Codec codec = Codec::Json;
+
+    /// Pooled connections per server (see Client).
+    std::size_t max_connections = 4;
+};
+
+/**
+ * @class ClusterClient
+ * @brief Sends requests to one of several servers offering the same
+ * commands.
+ *
+ * Thread-safe. Background callbacks, failovers and hedges run on the
+ * completion pool and timer of the first server's Client. Destroying the
+ * cluster fails requests still pending.
+ */
+class ClusterClient {
+  public:
+    /**
+     * @brief Connect to a set of servers, one transport each.
+     * @throws std::invalid_argument if there are no transports, or the
+     * codec cannot be carried by one of them.
+     */
+    explicit ClusterClient(std::vector<std::unique_ptr<Transport>> transports,
+                           ClusterOptions options = {});
+
+    /**
+     * @brief Fails pending requests and closes every connection.
+     */
+    ~ClusterClient();
+
+    ClusterClient(const ClusterClient &) = delete;
+    ClusterClient &operator=(const ClusterClient &) = delete;
+
+    /**
+     * @brief Send a request to one server and wait for the response.
+     * @throws std::runtime_error if the response is an error, or no server
+     * answered in time.
+     */
+    json send_request(const std::string &endpoint, const json &request);
+
+    /**
+     * @brief Send a request without waiting.
+     * @return The response, or the error send_request() would throw.
+     */
+    std::future<json> send_request_async(const std::string &endpoint,
+                                         const json &request);
+
+    /**
+     * @brief Send a request and pass the response, or
+     * `{"_success": false, "_msg": ...}`, to `callback` on the first
+     * server's completion pool.
+     */
+    void send_request_bg(const std::string &endpoint, const json &request,
+                         std::function<void(json)> callback);
+
+    /**
+     * @brief Number of servers.
+     */
+    std::size_t size() const { return nodes_.size(); }
+
+    /**
+     * @brief Per-server state: `outstanding` requests, `requests` and
+     * `failures` so far, `consecutive_failures` and `healthy` (not
+     * ejected), in the order of the transports.
+     */
+    json stats() const;
+
+  private:
+    struct Node;
+    struct Call;
+
+    /// Send `call` to a server it has not tried yet; fails it when there
+    /// is none left and no attempt is running.
+    void attempt(const std::shared_ptr<Call> &call);
+
+    /// Handle one server's answer (or failure) to `call`.
+    void complete(const std::shared_ptr<Call> &call, std::size_t index,
+                  std::string response, std::exception_ptr error);
+
+    /// Pick a server not in `tried`, or size() if every one was tried.
+    std::size_t pick(const std::vector<bool> &tried);
+
+    /// Record the outcome of a request to server `index`.
+    void record(std::size_t index, bool ok);
+
+    /// Finish `call` with a response or an error, once.
+    void finish(const std::shared_ptr<Call> &call, std::string response,
+                std::exception_ptr error);
+
+    /// Start a call that reports to `done`.
+    void start(const std::string &endpoint, const json &request,
+               std::function<void(std::string, std::exception_ptr)> done);
+
+    ClusterOptions options_;
+    std::vector<std::unique_ptr<Node>> nodes_; ///< One per server
+    /// Held shared while a request is handed to a Client; the destructor
+    /// takes it exclusively, so that none is in progress once closing_ is set.
+    std::shared_mutex clients_mutex_;
+    std::atomic<std::size_t> next_{0}; ///< Where LeastOutstanding starts
+    std::atomic<bool> closing_ = false;
+    /// The first server's Client, whose pool and timer run callbacks,
+    /// failovers, timeouts and hedges. Destroyed last.
+    Client *home_ = nullptr;
+};
+
+} // namespace Socks
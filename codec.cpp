@@ -0,0 +1,128 @@
+#include "codec.hpp"
+
+namespace Socks {
+
+namespace {
+
+/**
+ * Lets nlohmann's serializers write into a Buffer. This uses the library's
+ * detail output-adapter interface (stable across 3.x), which is what its
+ * own dump() and to_msgpack() are built on.
+ */
+class BufferOutput : public nlohmann::detail::output_adapter_protocol<char> {
+  public:
+    explicit BufferOutput(Buffer &out) : out_(out) {}
+
+    void write_character(char c) override { out_.push_back(c); }
+
+    void write_characters(const char *s, std::size_t length) override {
+        out_.append(s, length);
+    }
+
+  private:
+    Buffer &out_;
+};
+
+template <typename Json>
+void encode_into(const Json &value, Codec codec, Buffer &out) {
+    BufferOutput output(out);
+    // The serializers want a shared_ptr; alias the stack adapter instead of
+    // allocating one per message.
+    nlohmann::detail::output_adapter_t<char> adapter(
+        std::shared_ptr<void>(), &output);
+
+    switch (codec) {
+    case Codec::Json:
+        nlohmann::detail::serializer<Json>(adapter, ' ')
+            .dump(value, false, false, 0);
+        return;
+    case Codec::MessagePack:
+        out.push_back(static_cast<char>(kMessagePackMarker));
+        nlohmann::detail::binary_writer<Json, char>(adapter).write_msgpack(
+            value);
+        return;
+    case Codec::Cbor:
+        out.push_back(static_cast<char>(kCborMarker));
+        nlohmann::detail::binary_writer<Json, char>(adapter).write_cbor(value);
+        return;
+    }
+}
+
+template <typename Json> Json decode_as(std::string_view data, Codec *codec) {
+    Codec detected = detect_codec(data);
+    if (codec != nullptr) {
+        *codec = detected;
+    }
+    switch (detected) {
+    case Codec::MessagePack:
+        return Json::from_msgpack(data.begin() + 1, data.end());
+    case Codec::Cbor:
+        return Json::from_cbor(data.begin() + 1, data.end());
+    case Codec::Json:
+        break;
+    }
+    return Json::parse(data);
+}
+
+} // namespace
+
+Codec detect_codec(std::string_view data) {
+    if (data.empty()) {
+        return Codec::Json;
+    }
+    switch (static_cast<unsigned char>(data[0])) {
+    case kMessagePackMarker:
+        return Codec::MessagePack;
+    case kCborMarker:
+        return Codec::Cbor;
+    default:
+        return Codec::Json;
+    }
+}
+
+std::string encode(const json &value, Codec codec) {
+    std::string out;
+    switch (codec) {
+    case Codec::Json:
+        return value.dump();
+    case Codec::MessagePack:
+        out.push_back(static_cast<char>(kMessagePackMarker));
+        json::to_msgpack(value, out);
+        return out;
+    case Codec::Cbor:
+        out.push_back(static_cast<char>(kCborMarker));
+        json::to_cbor(value, out);
+        return out;
+    }
+    return value.dump();
+}
+
+void encode(const json &value, Codec codec, Buffer &out) {
+    encode_into(value, codec, out);
+}
+
+void encode(const ArenaJson &value, Codec codec, Buffer &out) {
+    encode_into(value, codec, out);
+}
+
+json decode(std::string_view data, Codec *codec) {
+    return decode_as<json>(data, codec);
+}
+
+ArenaJson decode_arena(std::string_view data, Codec *codec) {
+    return decode_as<ArenaJson>(data, codec);
+}
+
+const char *codec_name(Codec codec) {
+    switch (codec) {
+    case Codec::Json:
+        return "json";
+    case Codec::MessagePack:
+        return "msgpack";
+    case Codec::Cbor:
+        return "cbor";
+    }
+    return "unknown";
+}
+
+} // namespace Socks
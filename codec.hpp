@@ -0,0 +1,108 @@
+#pragma once
+
+#include "arena.hpp"
+#include "buffer.hpp"
+#include "nlohmann/json.hpp"
+
+#include <string>
+#include <string_view>
+
+/**
+ * @file codec.hpp
+ * @brief Wire encodings for Socks messages.
+ *
+ * Messages are JSON text by default. MessagePack and CBOR payloads are
+ * prefixed with a single marker byte, which can never start a JSON text, so
+ * a server can tell the encodings apart by the first byte and accept all of
+ * them on the same endpoint:
+ *
+ * @code
+ * {"_cmd": ...}            JSON text
+ * 0x01 <msgpack bytes>     MessagePack
+ * 0x02 <cbor bytes>        CBOR
+ * @endcode
+ *
+ * Binary encodings contain arbitrary bytes, so they need a transport that
+ * delimits messages itself: UDP or a length-prefixed stream transport (see
+ * Transport::binary_safe()).
+ */
+
+namespace Socks {
+
+using json = nlohmann::json;
+
+/**
+ * @brief Encoding of a message on the wire.
+ */
+enum class Codec {
+    Json,        ///< UTF-8 JSON text, no prefix
+    MessagePack, ///< kMessagePackMarker followed by MessagePack
+    Cbor,        ///< kCborMarker followed by CBOR
+};
+
+/// First byte of a MessagePack-encoded message.
+constexpr unsigned char kMessagePackMarker = 0x01;
+
+/// First byte of a CBOR-encoded message.
+constexpr unsigned char kCborMarker = 0x02;
+
+/**
+ * @brief Determine the encoding of a message from its first byte.
+ * @param data The message as received.
+ * @return The codec; anything without a binary marker is treated as JSON.
+ */
+Codec detect_codec(std::string_view data);
+
+/**
+ * @brief Encode a value, including the marker byte for binary codecs.
+ * @param value The value to encode.
+ * @param codec Encoding to use.
+ * @return The message bytes.
+ */
+std::string encode(const json &value, Codec codec);
+
+/**
+ * @brief Encode a value by appending it to a buffer.
+ *
+ * Serializes directly into `out` with no intermediate string, so a response
+ * can be handed to Transport::send_buffer() as it is.
+ *
+ * @param value The value to encode.
+ * @param codec Encoding to use.
+ * @param[out] out Buffer the message bytes are appended to.
+ */
+void encode(const json &value, Codec codec, Buffer &out);
+
+/**
+ * @brief Encode an arena-backed value by appending it to a buffer.
+ */
+void encode(const ArenaJson &value, Codec codec, Buffer &out);
+
+/**
+ * @brief Decode a message in any supported encoding.
+ * @param data The message bytes.
+ * @param[out] codec If non-null, receives the detected encoding.
+ * @return The decoded value.
+ * @throws json::exception if the payload is malformed.
+ */
+json decode(std::string_view data, Codec *codec = nullptr);
+
+/**
+ * @brief Decode a message into a value backed by the current arena.
+ *
+ * Like decode(), but the nodes are allocated from Arena::current() (see
+ * ArenaScope), or from the heap if no arena is installed.
+ *
+ * @param data The message bytes.
+ * @param[out] codec If non-null, receives the detected encoding.
+ * @return The decoded value.
+ * @throws json::exception if the payload is malformed.
+ */
+ArenaJson decode_arena(std::string_view data, Codec *codec = nullptr);
+
+/**
+ * @brief Human-readable codec name ("json", "msgpack", "cbor").
+ */
+const char *codec_name(Codec codec);
+
+} // namespace Socks
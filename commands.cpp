@@ -0,0 +1,121 @@
+#include "commands.hpp"
+
+#include <algorithm>
+#include <atomic>
+
+namespace Socks {
+
+/// Index slots per command are grown up to this factor to avoid probing.
+constexpr std::size_t kMaxSlotsPerCommand = 16;
+
+struct Reply::State {
+    Send send;
+    std::atomic<bool> sent{false};
+
+    ~State() {
+        if (!sent.load())
+            send(json{{"_success", false},
+                      {"_msg", "Handler finished without a response"}});
+    }
+};
+
+Reply::Reply(Send send) : state_(std::make_shared<State>()) {
+    state_->send = std::move(send);
+}
+
+void Reply::operator()(json response) const {
+    if (!state_->sent.exchange(true))
+        state_->send(std::move(response));
+}
+
+std::uint32_t CommandTable::id_of(std::string_view name) {
+    std::uint32_t hash = 2166136261u;
+    for (char c : name) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 16777619u;
+    }
+    return hash == 0 ? 1 : hash;
+}
+
+CommandTable::CommandTable(std::vector<Command> commands) {
+    // Keep the last registration of each name.
+    std::stable_sort(commands.begin(), commands.end(),
+                     [](const Command &a, const Command &b) {
+                         return a.name < b.name;
+                     });
+    for (auto &command : commands) {
+        command.id = id_of(command.name);
+        if (!commands_.empty() && commands_.back().name == command.name) {
+            commands_.back() = std::move(command);
+        } else {
+            commands_.push_back(std::move(command));
+        }
+    }
+
+    // Find IDs shared by two names; those can only be looked up by name.
+    std::vector<std::pair<std::uint32_t, std::size_t>> ids;
+    for (std::size_t i = 0; i < commands_.size(); ++i) {
+        ids.emplace_back(commands_[i].id, i);
+        uses_arena_ = uses_arena_ || commands_[i].arena_handler;
+    }
+    std::sort(ids.begin(), ids.end());
+    unique_id_.assign(commands_.size(), true);
+    for (std::size_t i = 1; i < ids.size(); ++i) {
+        if (ids[i].first == ids[i - 1].first)
+            unique_id_[ids[i].second] = unique_id_[ids[i - 1].second] = false;
+    }
+
+    // At least two slots per command, doubled until no two commands share
+    // a home slot (or the index gets too sparse to be worth it).
+    unsigned bits = 3;
+    while ((std::size_t(1) << bits) < 2 * commands_.size())
+        ++bits;
+    while (build_index(bits) > 1 &&
+           (std::size_t(1) << bits) < kMaxSlotsPerCommand * commands_.size())
+        ++bits;
+}
+
+std::size_t CommandTable::build_index(unsigned bits) {
+    index_.assign(std::size_t(1) << bits, kEmpty);
+    shift_ = 32 - bits;
+    std::size_t longest = 0;
+    for (std::size_t i = 0; i < commands_.size(); ++i) {
+        std::size_t slot = home(commands_[i].id);
+        std::size_t length = 1;
+        while (index_[slot] != kEmpty) {
+            slot = (slot + 1) & (index_.size() - 1);
+            ++length;
+        }
+        index_[slot] = static_cast<std::uint32_t>(i);
+        longest = std::max(longest, length);
+    }
+    return longest;
+}
+
+const Command *CommandTable::find(std::string_view name) const {
+    if (commands_.empty())
+        return nullptr;
+    std::uint32_t id = id_of(name);
+    for (std::size_t slot = home(id); index_[slot] != kEmpty;
+         slot = (slot + 1) & (index_.size() - 1)) {
+        const Command &command = commands_[index_[slot]];
+        if (command.id == id && command.name == name)
+            return &command;
+    }
+    return nullptr;
+}
+
+const Command *CommandTable::find_id(std::uint64_t id) const {
+    if (commands_.empty() || id == 0 || id > 0xffffffffu)
+        return nullptr;
+    auto id32 = static_cast<std::uint32_t>(id);
+    for (std::size_t slot = home(id32); index_[slot] != kEmpty;
+         slot = (slot + 1) & (index_.size() - 1)) {
+        std::uint32_t i = index_[slot];
+        if (commands_[i].id == id32)
+            return unique_id_[i] ? &commands_[i] : nullptr;
+    }
+    return nullptr;
+}
+
+} // namespace Socks
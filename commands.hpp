@@ -0,0 +1,252 @@
+#pragma once
+
+#include "arena.hpp"
+#include "buffer.hpp"
+#include "cache.hpp"
+#include "codec.hpp"
+#include "metrics.hpp"
+#include "schema.hpp"
+#include "stream.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * @file commands.hpp
+ * @brief Handler types and the immutable table the server dispatches on.
+ *
+ * The server routes each request through a CommandTable. A table is built
+ * once and never modified. Registering a handler builds a new table and
+ * publishes it in place of the old one, so lookups need no lock (see
+ * Server::add_handler()).
+ *
+ * Every command also has a numeric ID: a 32-bit hash of its name, so the
+ * same name has the same ID on every server and across restarts. Clients
+ * can send the ID as `_cmd` instead of the name (see
+ * Client::fetch_command_ids()).
+ */
+
+namespace Socks {
+
+using json = nlohmann::json;
+
+/**
+ * @brief Type alias for a handler that receives and returns a JSON object.
+ */
+using Handler = ::std::function<json(const json &)>;
+
+/**
+ * @brief Handler that receives and returns arena-backed JSON.
+ *
+ * Registered with Server::add_arena_handler(). The request, the response and
+ * any ArenaJson the handler builds along the way are allocated from the
+ * worker thread's arena, which is reset once the response has been encoded,
+ * so such a handler makes no per-node heap allocations. Nothing arena-backed
+ * may outlive the call; copy into a plain json to keep it.
+ */
+using ArenaHandler = ::std::function<ArenaJson(const ArenaJson &)>;
+
+/**
+ * @brief Type alias for a handler that receives the request unparsed.
+ *
+ * Registered with Server::add_raw_handler(). The server reads only `_cmd`
+ * (see scan.hpp) and leaves the message to the handler, which can decode
+ * it with any parser or read only the fields it needs.
+ *
+ * `request` is the message as received, including the marker byte of a
+ * binary codec, and `codec` is its encoding. The handler returns a complete
+ * response message in the same encoding, e.g. built with encode(), and the
+ * server sends it unchanged. If the handler throws, the client receives an
+ * error response instead.
+ */
+using RawHandler =
+    ::std::function<Buffer(std::string_view request, Codec codec)>;
+
+/**
+ * @class Reply
+ * @brief Sends the response to a request an AsyncHandler accepted.
+ *
+ * Copies refer to the same request. The first call sends the response and
+ * later ones are ignored. If the last copy goes away without a call, the
+ * client receives an error response, so a request is never left without
+ * an answer. May be called from any thread.
+ */
+class Reply {
+  public:
+    /// Encodes and sends a response; must not throw.
+    using Send = ::std::function<void(json response)>;
+
+    explicit Reply(Send send);
+
+    /**
+     * @brief Send `response`, e.g. built with okay() or error(), unless a
+     * response was already sent.
+     */
+    void operator()(json response) const;
+
+  private:
+    struct State;
+    std::shared_ptr<State> state_;
+};
+
+/**
+ * @brief Handler that answers later, through a Reply.
+ *
+ * Registered with Server::add_async_handler(). The handler starts whatever
+ * produces the response and returns, which frees the worker; the response
+ * goes out when `reply` is called, from any thread. `request` is only
+ * valid during the call. If the handler throws before replying, the client
+ * receives an error response instead.
+ */
+using AsyncHandler = ::std::function<void(const json &request, Reply reply)>;
+
+/**
+ * @brief Handler that answers with a stream of frames (see stream.hpp).
+ *
+ * Registered with Server::add_stream_handler(). The handler keeps `stream`
+ * (e.g. in a list of a topic's subscribers) and pushes frames into it for
+ * as long as it is open; dropping every copy ends the stream. `request` is
+ * only valid during the call. If the handler throws, the subscriber
+ * receives an error frame and the stream ends.
+ */
+using StreamHandler =
+    ::std::function<void(const json &request, Stream stream)>;
+
+/**
+ * @brief Scheduling lane of a command. When requests queue up for the
+ * thread pool, every High request runs before any Normal one, and every
+ * Normal one before any Low one.
+ */
+enum class Priority {
+    High,   ///< Control and health-check commands
+    Normal, ///< The default
+    Low,    ///< Bulk work that may wait
+};
+
+/// Number of Priority values.
+constexpr std::size_t kPriorityCount = 3;
+
+/**
+ * @brief Response caching for an idempotent command (see cache.hpp).
+ *
+ * Only for commands whose response depends on nothing but the request:
+ * a request equal to one answered successfully before, apart from
+ * reserved `_` fields, gets that response again without the handler.
+ * Applies to handlers that take a parsed request, not to raw handlers or
+ * to requests inside a `_batch`.
+ */
+struct CacheOptions {
+    std::size_t capacity = 0; ///< Most responses kept; 0 disables caching
+    std::chrono::milliseconds ttl{0}; ///< Entry lifetime; 0 for no expiry
+};
+
+/**
+ * @brief Per-command settings (see Server::set_options()).
+ */
+struct HandlerOptions {
+    Priority priority = Priority::Normal;
+    CacheOptions cache;
+};
+
+/**
+ * @brief A registered command: its name, ID and handler.
+ *
+ * Exactly one of handler, arena_handler, raw_handler, async_handler and
+ * stream_handler is set.
+ */
+struct Command {
+    std::string name;
+    std::uint32_t id = 0; ///< CommandTable::id_of(name)
+    Handler handler;
+    ArenaHandler arena_handler;
+    RawHandler raw_handler;
+    AsyncHandler async_handler;
+    StreamHandler stream_handler;
+    std::shared_ptr<const CompiledSchema> schema; ///< May be null
+    std::shared_ptr<CommandMetrics> metrics;      ///< May be null
+    std::shared_ptr<ResponseCache> cache;         ///< Null unless enabled
+    HandlerOptions options;
+};
+
+/**
+ * @class CommandTable
+ * @brief Immutable lookup table from command names and IDs to handlers.
+ *
+ * The commands live in a flat vector sorted by name. An open-addressed
+ * index over their IDs is sized so that, in practice, every ID has a slot
+ * of its own. A lookup by name hashes the string_view once, probes the
+ * index and compares the name; a lookup by ID skips the hash. Neither
+ * allocates.
+ */
+class CommandTable {
+  public:
+    /**
+     * @brief An empty table.
+     */
+    CommandTable() = default;
+
+    /**
+     * @brief Build a table; a later command replaces an earlier one with
+     * the same name.
+     */
+    explicit CommandTable(std::vector<Command> commands);
+
+    /**
+     * @brief The command registered under `name`, or nullptr.
+     */
+    const Command *find(std::string_view name) const;
+
+    /**
+     * @brief The command with numeric ID `id`, or nullptr.
+     *
+     * An ID shared by two registered names (a hash collision) is not
+     * usable; both commands are still reachable by name.
+     */
+    const Command *find_id(std::uint64_t id) const;
+
+    /**
+     * @brief All commands, sorted by name.
+     */
+    const std::vector<Command> &commands() const { return commands_; }
+
+    /**
+     * @brief Whether `command`'s ID can be used to reach it.
+     */
+    bool id_usable(const Command &command) const {
+        return find_id(command.id) == &command;
+    }
+
+    /**
+     * @brief Whether any command has an arena handler.
+     */
+    bool uses_arena() const { return uses_arena_; }
+
+    /**
+     * @brief The numeric ID of a command name (32-bit FNV-1a, never 0).
+     */
+    static std::uint32_t id_of(std::string_view name);
+
+  private:
+    static constexpr std::uint32_t kEmpty = 0xffffffff;
+
+    /// First slot for an ID (Fibonacci hashing into the top bits).
+    std::size_t home(std::uint32_t id) const {
+        return static_cast<std::uint32_t>(id * 0x9e3779b1u) >> shift_;
+    }
+
+    /// Fill index_ with 2^bits slots; returns the longest probe sequence.
+    std::size_t build_index(unsigned bits);
+
+    std::vector<Command> commands_;    ///< Sorted by name
+    std::vector<bool> unique_id_;      ///< Parallel to commands_
+    std::vector<std::uint32_t> index_; ///< Slot -> commands_ index
+    unsigned shift_ = 32;
+    bool uses_arena_ = false;
+};
+
+} // namespace Socks
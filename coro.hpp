@@ -0,0 +1,340 @@
+#pragma once
+
+#include "client.hpp"
+#include "eventloop.hpp"
+#include "server.hpp"
+#include "threadpool.hpp"
+
+#include <exception>
+#include <functional>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+/// Defined when the coroutine API (Task, request(),
+/// add_coroutine_handler()) is available: C++20 and later.
+#define SOCKS_HAVE_COROUTINES 1
+#endif
+
+/**
+ * @file coro.hpp
+ * @brief C++20 coroutines over the callback-based client and server.
+ *
+ * A handler that calls another service with Client::send_request() holds a
+ * worker for a whole round trip. Written as a coroutine instead, it
+ * suspends at each `co_await request(client, ...)` and its worker goes back
+ * to the pool; the coroutine continues on the client's completion pool
+ * once the response arrives, or wherever resume_on() moves it.
+ *
+ * The library itself builds as C++17; this header adds nothing unless the
+ * including file is compiled as C++20, so only code that uses coroutines
+ * needs the newer standard. For the same reason the coroutine API is made
+ * of free functions rather than members of Client and Server: those
+ * classes must look the same to every translation unit, whichever standard
+ * it is compiled with.
+ */
+
+#ifdef SOCKS_HAVE_COROUTINES
+
+namespace Socks {
+
+template <typename T = void> class Task;
+
+namespace coro_detail {
+
+struct PromiseBase {
+    /// Resumes whoever awaits the task when it finishes.
+    struct FinalAwaiter {
+        bool await_ready() const noexcept { return false; }
+
+        template <typename Promise>
+        std::coroutine_handle<>
+        await_suspend(std::coroutine_handle<Promise> done) noexcept {
+            return done.promise().continuation;
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    FinalAwaiter final_suspend() const noexcept { return {}; }
+    void unhandled_exception() noexcept { error = std::current_exception(); }
+
+    std::coroutine_handle<> continuation = std::noop_coroutine();
+    std::exception_ptr error;
+};
+
+template <typename T> struct Promise : PromiseBase {
+    Task<T> get_return_object() noexcept;
+
+    template <typename U> void return_value(U &&result) {
+        value.emplace(std::forward<U>(result));
+    }
+
+    T take() {
+        if (error)
+            std::rethrow_exception(error);
+        return std::move(*value);
+    }
+
+    std::optional<T> value;
+};
+
+template <> struct Promise<void> : PromiseBase {
+    Task<void> get_return_object() noexcept;
+
+    void return_void() const noexcept {}
+
+    void take() const {
+        if (error)
+            std::rethrow_exception(error);
+    }
+};
+
+/// Fire-and-forget coroutine: starts at once and frees itself.
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() const noexcept { return {}; }
+        std::suspend_never initial_suspend() const noexcept { return {}; }
+        std::suspend_never final_suspend() const noexcept { return {}; }
+        void return_void() const noexcept {}
+        void unhandled_exception() const noexcept { std::terminate(); }
+    };
+};
+
+} // namespace coro_detail
+
+/**
+ * @class Task
+ * @brief A lazily started coroutine producing a `T`.
+ *
+ * The body runs once the task is awaited, on the awaiting thread, and the
+ * awaiter continues on whatever thread the task finishes on. An exception
+ * escaping the body is rethrown from the `co_await`. Move-only; to run a
+ * task from ordinary code, pass it to spawn().
+ */
+template <typename T> class Task {
+  public:
+    using promise_type = coro_detail::Promise<T>;
+
+    Task(Task &&other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+
+    Task &operator=(Task &&other) noexcept {
+        if (this != &other) {
+            if (handle_)
+                handle_.destroy();
+            handle_ = std::exchange(other.handle_, {});
+        }
+        return *this;
+    }
+
+    ~Task() {
+        if (handle_)
+            handle_.destroy();
+    }
+
+    auto operator co_await() const noexcept {
+        struct Awaiter {
+            std::coroutine_handle<promise_type> task;
+
+            bool await_ready() const noexcept { return task.done(); }
+
+            std::coroutine_handle<>
+            await_suspend(std::coroutine_handle<> awaiting) const noexcept {
+                task.promise().continuation = awaiting;
+                return task;
+            }
+
+            T await_resume() const { return task.promise().take(); }
+        };
+        return Awaiter{handle_};
+    }
+
+  private:
+    friend promise_type;
+
+    explicit Task(std::coroutine_handle<promise_type> handle)
+        : handle_(handle) {}
+
+    std::coroutine_handle<promise_type> handle_;
+};
+
+namespace coro_detail {
+
+template <typename T> Task<T> Promise<T>::get_return_object() noexcept {
+    return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> Promise<void>::get_return_object() noexcept {
+    return Task<void>(
+        std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+template <typename T, typename Done> Detached run(Task<T> task, Done done) {
+    std::exception_ptr error;
+    if constexpr (std::is_void_v<T>) {
+        try {
+            co_await task;
+        } catch (...) {
+            error = std::current_exception();
+        }
+        done(error);
+    } else {
+        std::optional<T> result;
+        try {
+            result.emplace(co_await task);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        done(std::move(result), error);
+    }
+}
+
+} // namespace coro_detail
+
+/**
+ * @brief Start a task from ordinary code and report how it ends.
+ *
+ * The task runs on the calling thread until it first suspends, then
+ * spawn() returns. `done` runs where the task finishes, with the result
+ * (empty if it threw) and the exception, if any: `done(std::optional<T>,
+ * std::exception_ptr)`, or `done(std::exception_ptr)` for Task<void>. It
+ * must not throw.
+ */
+template <typename T, typename Done> void spawn(Task<T> task, Done done) {
+    coro_detail::run(std::move(task), std::move(done));
+}
+
+/**
+ * @brief `co_await resume_on(pool)` continues the coroutine on one of
+ * `pool`'s workers, e.g. to do CPU work off the client's completion pool.
+ * @throws std::runtime_error from the co_await if the pool is stopping.
+ */
+inline auto resume_on(ThreadPool &pool) {
+    struct Awaiter {
+        ThreadPool &pool;
+
+        bool await_ready() const noexcept { return false; }
+
+        void await_suspend(std::coroutine_handle<> awaiting) const {
+            pool.enqueue([awaiting]() { awaiting.resume(); });
+        }
+
+        void await_resume() const noexcept {}
+    };
+    return Awaiter{pool};
+}
+
+/**
+ * @brief `co_await resume_on(reactor)` continues the coroutine on the
+ * reactor's thread, through Reactor::post(). Whatever runs there holds up
+ * the reactor's other connections, so keep it short.
+ */
+inline auto resume_on(Reactor &reactor) {
+    struct Awaiter {
+        Reactor &reactor;
+
+        bool await_ready() const noexcept { return false; }
+
+        void await_suspend(std::coroutine_handle<> awaiting) const {
+            reactor.post([awaiting]() { awaiting.resume(); });
+        }
+
+        void await_resume() const noexcept {}
+    };
+    return Awaiter{reactor};
+}
+
+/**
+ * @class RequestAwaiter
+ * @brief Awaitable form of Client::send_request() (see request()).
+ */
+class RequestAwaiter {
+  public:
+    RequestAwaiter(Client &client, std::string endpoint, json request)
+        : client_(client), endpoint_(std::move(endpoint)),
+          request_(std::move(request)) {}
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> awaiting) {
+        client_.send_request_bg(endpoint_, request_,
+                                [this, awaiting](json response) {
+                                    response_ = std::move(response);
+                                    awaiting.resume();
+                                });
+    }
+
+    json await_resume() {
+        if (!response_.value("_success", false)) {
+            throw std::runtime_error(
+                response_.value("_msg", "Unknown error"));
+        }
+        return std::move(response_);
+    }
+
+  private:
+    Client &client_;
+    std::string endpoint_;
+    json request_;
+    json response_;
+};
+
+/**
+ * @brief Send a request from a coroutine.
+ *
+ * `co_await request(client, endpoint, body)` suspends the coroutine
+ * without blocking its thread and yields the response, or throws
+ * std::runtime_error like send_request(). The coroutine continues on the
+ * client's completion pool. On transports without channels the round trip
+ * itself occupies a completion pool thread, so only pipelined transports
+ * wait without any thread.
+ */
+inline RequestAwaiter request(Client &client, std::string endpoint,
+                              json body) {
+    return RequestAwaiter(client, std::move(endpoint), std::move(body));
+}
+
+/**
+ * @brief Register a coroutine handler with `server`.
+ *
+ * The coroutine starts on the worker and, once it suspends (e.g. on
+ * `co_await request(client, ...)`), releases it; its co_returned json is
+ * the response. An exception escaping it becomes an error response. The
+ * request is passed by value so that it lives in the coroutine.
+ *
+ * @code
+ * add_coroutine_handler(server, "total", [&](json req) -> Task<json> {
+ *     json price = co_await request(prices, "price", req);
+ *     co_return okay({{"total", price["value"].get<int>() * 2}});
+ * });
+ * @endcode
+ */
+inline void add_coroutine_handler(Server &server, const std::string &command,
+                                  std::function<Task<json>(json)> handler) {
+    server.add_async_handler(command, [handler = std::move(handler)](
+                                          const json &request, Reply reply) {
+        spawn(handler(request), [reply](std::optional<json> response,
+                                        std::exception_ptr failure) {
+            if (!failure) {
+                reply(std::move(*response));
+                return;
+            }
+            try {
+                std::rethrow_exception(failure);
+            } catch (const std::exception &e) {
+                reply(error({}, "Internal error: " + std::string(e.what())));
+            } catch (...) {
+                reply(error({}, "Internal error"));
+            }
+        });
+    });
+}
+
+} // namespace Socks
+
+#endif // SOCKS_HAVE_COROUTINES
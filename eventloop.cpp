@@ -0,0 +1,988 @@
+#include "eventloop.hpp"
+#include "handoff.hpp"
+#include "logger.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdexcept>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace Socks {
+
+// ==========================
+// Reactor
+// ==========================
+
+Reactor::Reactor() {
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd_ == -1)
+        throw std::runtime_error("Failed to create epoll instance");
+
+    wake_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wake_fd_ == -1) {
+        ::close(epoll_fd_);
+        throw std::runtime_error("Failed to create reactor eventfd");
+    }
+
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = wake_fd_;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev);
+}
+
+Reactor::~Reactor() {
+    ::close(wake_fd_);
+    ::close(epoll_fd_);
+}
+
+void Reactor::add(int fd, std::uint32_t events, Callback callback) {
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) == -1)
+        throw std::runtime_error("Failed to register fd with epoll: " +
+                                 std::string(std::strerror(errno)));
+    callbacks_[fd] = std::make_shared<Callback>(std::move(callback));
+}
+
+void Reactor::modify(int fd, std::uint32_t events) {
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.fd = fd;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &ev);
+}
+
+void Reactor::remove(int fd) {
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+    callbacks_.erase(fd);
+}
+
+void Reactor::post(std::function<void()> fn) {
+    {
+        std::lock_guard<std::mutex> lock(posted_mutex_);
+        posted_.push_back(std::move(fn));
+    }
+    wake();
+}
+
+void Reactor::wake() {
+    std::uint64_t one = 1;
+    (void)!::write(wake_fd_, &one, sizeof(one));
+}
+
+void Reactor::run_posted() {
+    std::vector<std::function<void()>> posted;
+    {
+        std::lock_guard<std::mutex> lock(posted_mutex_);
+        posted.swap(posted_);
+    }
+    for (auto &fn : posted)
+        fn();
+}
+
+void Reactor::run() {
+    epoll_event events[64];
+    while (!stopping_) {
+        int n = epoll_wait(epoll_fd_, events, 64, -1);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error("epoll_wait failed");
+        }
+
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == wake_fd_) {
+                std::uint64_t count;
+                (void)!::read(wake_fd_, &count, sizeof(count));
+                continue;
+            }
+            auto it = callbacks_.find(fd);
+            if (it == callbacks_.end())
+                continue; // removed earlier in this batch
+            auto callback = it->second; // keep alive if it removes itself
+            (*callback)(events[i].events);
+        }
+        run_posted();
+    }
+}
+
+void Reactor::stop() {
+    stopping_ = true;
+    wake();
+}
+
+// ==========================
+// EventTransport
+// ==========================
+
+std::string EventTransport::receive(std::string &) {
+    throw std::logic_error(
+        "Event-driven transports deliver messages through run()");
+}
+
+// ==========================
+// EpollStreamTransport
+// ==========================
+
+struct EpollStreamTransport::Connection {
+    Connection(int fd, std::uint64_t id) : fd(fd), id(id) {}
+    ~Connection() {
+        if (fd != -1)
+            ::close(fd);
+    }
+
+    int fd; ///< -1 once drop() has closed it
+    std::uint64_t id;
+
+    // Reactor thread only.
+    Buffer in;              ///< Bytes received but not yet delivered
+    size_t scanned = 0;     ///< Raw mode: bytes already fed to the scanner
+    RawMessageScanner scanner;
+    bool reading = true;    ///< Raw mode stops reading after one request
+
+    std::uint32_t read_events() const {
+        return reading ? static_cast<std::uint32_t>(EPOLLIN) : 0;
+    }
+
+    // Shared between the reactor and send() callers.
+    std::mutex out_mutex;
+    std::string out;        ///< Response bytes not yet written
+    bool want_write = false; ///< EPOLLOUT is armed
+    bool closed = false;
+    std::vector<std::function<void()>> drained; ///< See notify_drained()
+};
+
+struct EpollStreamTransport::Loop {
+    explicit Loop(size_t index) : index(index) {}
+
+    size_t index;
+    Reactor reactor;
+    std::thread thread;
+    std::vector<int> listen_fds; ///< Reactor thread only; not owned
+
+    std::mutex connections_mutex; ///< Protects connections for send()
+    std::unordered_map<std::uint64_t, std::shared_ptr<Connection>>
+        connections;
+    std::uint64_t next_id = 1;
+};
+
+EpollStreamTransport::EpollStreamTransport(Framing framing, size_t reactors)
+    : framing_(framing) {
+    loops_.resize(reactors == 0 ? 1 : reactors);
+}
+
+EpollStreamTransport::~EpollStreamTransport() {
+    close();
+    release_listeners();
+    for (int fd : adopted_)
+        ::close(fd);
+}
+
+void EpollStreamTransport::release_listeners() {
+    std::lock_guard<std::mutex> lock(listeners_mutex_);
+    for (int fd : listeners_)
+        ::close(fd);
+    listeners_.clear();
+}
+
+void EpollStreamTransport::bind() {
+    release_listeners();
+    closed_ = false;
+    shared_ = false;
+    for (size_t i = 0; i < loops_.size(); ++i)
+        loops_[i] = std::make_unique<Loop>(i);
+
+    std::vector<int> listeners;
+    listeners.swap(adopted_);
+    if (listeners.empty()) {
+        for (size_t i = 0; i < loops_.size(); ++i) {
+            int fd = open_listener(i);
+            if (fd != -1)
+                listeners.push_back(fd);
+        }
+    }
+    for (int fd : listeners)
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK); // if adopted
+
+    // Every reactor watches at least one socket, and every socket is
+    // watched; a socket watched by several wakes only one reactor per
+    // connection.
+    size_t count = std::max(listeners.size(), loops_.size());
+    for (size_t i = 0; i < count; ++i) {
+        loops_[i % loops_.size()]->listen_fds.push_back(
+            listeners[i % listeners.size()]);
+    }
+    std::uint32_t events = EPOLLIN;
+    if (listeners.size() < loops_.size())
+        events |= EPOLLEXCLUSIVE;
+    for (auto &loop : loops_) {
+        Loop &ref = *loop;
+        for (int fd : loop->listen_fds) {
+            loop->reactor.add(fd, events, [this, &ref, fd](std::uint32_t) {
+                on_accept(ref, fd);
+            });
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(listeners_mutex_);
+    listeners_ = std::move(listeners);
+}
+
+std::vector<int> EpollStreamTransport::share_listeners() {
+    std::lock_guard<std::mutex> lock(listeners_mutex_);
+    std::vector<int> fds = duplicate_sockets(listeners_);
+    shared_ = true;
+    return fds;
+}
+
+void EpollStreamTransport::adopt_listeners(std::vector<int> fds) {
+    for (int fd : adopted_)
+        ::close(fd);
+    adopted_ = std::move(fds);
+}
+
+void EpollStreamTransport::stop_listening() {
+    // Each reactor lets go of its sockets on its own thread; the last one
+    // to do so closes them.
+    auto remaining = std::make_shared<std::atomic<size_t>>(loops_.size());
+    for (auto &loop : loops_) {
+        if (!loop)
+            return; // never bound
+        Loop &ref = *loop;
+        loop->reactor.post([this, &ref, remaining] {
+            pause(ref);
+            if (remaining->fetch_sub(1) == 1)
+                release_listeners();
+        });
+    }
+}
+
+void EpollStreamTransport::pause(Loop &loop) {
+    for (int fd : loop.listen_fds)
+        loop.reactor.remove(fd);
+    loop.listen_fds.clear();
+
+    std::vector<std::shared_ptr<Connection>> connections;
+    {
+        std::lock_guard<std::mutex> lock(loop.connections_mutex);
+        for (const auto &[id, conn] : loop.connections)
+            connections.push_back(conn);
+    }
+    // Responses still go out; anything else the client sends stays in the
+    // socket. A hangup is still reported, and then drops the connection.
+    for (const auto &conn : connections) {
+        conn->reading = false;
+        std::lock_guard<std::mutex> lock(conn->out_mutex);
+        if (!conn->closed) {
+            loop.reactor.modify(conn->fd, conn->want_write
+                                              ? static_cast<std::uint32_t>(
+                                                    EPOLLOUT)
+                                              : 0);
+        }
+    }
+}
+
+void EpollStreamTransport::run(MessageHandler on_message) {
+    on_message_ = std::move(on_message);
+    if (closed_)
+        return;
+
+    // Pinned reactors all run on threads of their own, leaving the
+    // caller's affinity alone; otherwise the first one runs right here.
+    size_t first = reactor_affinity_.empty() ? 1 : 0;
+    for (size_t i = first; i < loops_.size(); ++i) {
+        Loop &loop = *loops_[i];
+        const std::vector<int> &cpus = reactor_affinity_.cpus_of(i);
+        loop.thread = std::thread([&loop, &cpus] {
+            if (!cpus.empty() && !pin_current_thread(cpus))
+                log_warning("[Socks] Could not pin reactor ", loop.index,
+                            "; it runs unpinned.");
+            loop.reactor.run();
+        });
+    }
+    if (first == 1)
+        loops_[0]->reactor.run();
+    for (size_t i = 0; i < loops_.size(); ++i) {
+        if (loops_[i]->thread.joinable())
+            loops_[i]->thread.join();
+    }
+
+    // Callbacks still posted to a reactor hold on to their connections;
+    // dropping closes each socket now rather than when those go away.
+    release_listeners();
+    for (auto &loop : loops_) {
+        std::vector<std::shared_ptr<Connection>> connections;
+        {
+            std::lock_guard<std::mutex> lock(loop->connections_mutex);
+            for (const auto &[id, conn] : loop->connections)
+                connections.push_back(conn);
+        }
+        for (const auto &conn : connections)
+            drop(*loop, conn);
+    }
+}
+
+void EpollStreamTransport::on_accept(Loop &loop, int listener) {
+    while (true) {
+        int fd = accept4(listener, nullptr, nullptr,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            return; // EAGAIN: drained (or another reactor won the race)
+        }
+        configure_socket(fd);
+
+        std::shared_ptr<Connection> conn;
+        {
+            std::lock_guard<std::mutex> lock(loop.connections_mutex);
+            conn = std::make_shared<Connection>(fd, loop.next_id++);
+            loop.connections.emplace(conn->id, conn);
+        }
+
+        loop.reactor.add(fd, EPOLLIN, [this, &loop, conn](std::uint32_t ev) {
+            if (ev & EPOLLERR) {
+                drop(loop, conn);
+                return;
+            }
+            if (ev & (EPOLLIN | EPOLLHUP))
+                on_readable(loop, conn);
+            if ((ev & EPOLLOUT) && !conn->closed)
+                on_writable(loop, conn);
+        });
+    }
+}
+
+void EpollStreamTransport::on_readable(
+    Loop &loop, const std::shared_ptr<Connection> &conn) {
+    if (!conn->reading) {
+        drop(loop, conn); // raw client hung up before its response
+        return;
+    }
+
+    constexpr size_t chunk = 64 * 1024;
+    while (true) {
+        size_t used = conn->in.size();
+        conn->in.resize(used + chunk);
+        ssize_t n = ::read(conn->fd, conn->in.data() + used, chunk);
+        conn->in.resize(used + (n > 0 ? static_cast<size_t>(n) : 0));
+
+        if (n > 0) {
+            if (static_cast<size_t>(n) < chunk)
+                break; // likely drained; avoid an extra EAGAIN round trip
+            continue;
+        }
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+
+        // EOF or error. A raw client may half-close after its request, so
+        // deliver what arrived; otherwise the connection is finished.
+        if (n == 0 && framing_ == Framing::Raw && !conn->in.empty()) {
+            conn->reading = false;
+            loop.reactor.modify(conn->fd, 0);
+            deliver(loop, conn, std::move(conn->in),
+                    std::to_string(loop.index) + ":" +
+                        std::to_string(conn->id));
+            return;
+        }
+        drop(loop, conn);
+        return;
+    }
+
+    extract_messages(loop, conn);
+}
+
+void EpollStreamTransport::extract_messages(
+    Loop &loop, const std::shared_ptr<Connection> &conn) {
+    Buffer &in = conn->in;
+
+    if (framing_ == Framing::Raw) {
+        bool complete = conn->scanner.feed(in.data() + conn->scanned,
+                                           in.size() - conn->scanned);
+        conn->scanned = in.size();
+        if (in.size() > max_message_size_) {
+            drop(loop, conn);
+            return;
+        }
+        if (!complete)
+            return;
+
+        conn->reading = false;
+        loop.reactor.modify(conn->fd, 0);
+        deliver(loop, conn, std::move(in),
+                std::to_string(loop.index) + ":" + std::to_string(conn->id));
+        return;
+    }
+
+    size_t pos = 0;
+    while (in.size() - pos >= kFrameHeaderSize) {
+        FrameHeader header = decode_frame_header(
+            reinterpret_cast<const unsigned char *>(in.data() + pos));
+        if (header.length > max_message_size_) {
+            drop(loop, conn); // cannot resynchronise past an oversized frame
+            return;
+        }
+
+        size_t end = pos + kFrameHeaderSize + header.length;
+        if (in.size() < end) {
+            in.reserve(end - pos); // room for the rest after compaction
+            break;
+        }
+
+        std::string client_id = std::to_string(loop.index) + ":" +
+                                std::to_string(conn->id) + ":" +
+                                std::to_string(header.tag);
+        if (!deliver(loop, conn,
+                     Buffer(in.data() + pos + kFrameHeaderSize,
+                            header.length),
+                     std::move(client_id)))
+            return;
+        pos = end;
+    }
+    in.consume(pos);
+}
+
+bool EpollStreamTransport::deliver(Loop &loop,
+                                   const std::shared_ptr<Connection> &conn,
+                                   Buffer data, std::string client_id) {
+    try {
+        on_message_(std::move(data), std::move(client_id));
+        return true;
+    } catch (const std::exception &) {
+        drop(loop, conn); // the server could not take it; don't stall
+        return false;
+    }
+}
+
+void EpollStreamTransport::flush(Loop &loop,
+                                 const std::shared_ptr<Connection> &conn) {
+    // Called with conn->out_mutex held.
+    size_t written = 0;
+    while (written < conn->out.size()) {
+        ssize_t n = ::send(conn->fd, conn->out.data() + written,
+                           conn->out.size() - written, MSG_NOSIGNAL);
+        if (n > 0) {
+            written += static_cast<size_t>(n);
+            continue;
+        }
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        conn->out.clear();
+        loop.reactor.post([this, &loop, conn] { drop(loop, conn); });
+        return;
+    }
+    conn->out.erase(0, written);
+}
+
+void EpollStreamTransport::on_writable(
+    Loop &loop, const std::shared_ptr<Connection> &conn) {
+    bool done;
+    std::vector<std::function<void()>> drained;
+    {
+        std::lock_guard<std::mutex> lock(conn->out_mutex);
+        flush(loop, conn);
+        done = conn->out.empty();
+        if (done && conn->want_write) {
+            conn->want_write = false;
+            loop.reactor.modify(conn->fd, conn->read_events());
+        }
+        if (done)
+            drained.swap(conn->drained);
+    }
+    for (auto &callback : drained)
+        callback();
+    if (done && framing_ == Framing::Raw)
+        drop(loop, conn);
+}
+
+void EpollStreamTransport::send(const std::string &data,
+                                const std::string &client_id) {
+    send_bytes(data.data(), data.size(), client_id);
+}
+
+void EpollStreamTransport::send_buffer(const Buffer &data,
+                                       const std::string &client_id) {
+    send_bytes(data.data(), data.size(), client_id);
+}
+
+void EpollStreamTransport::send_bytes(const char *data, size_t size,
+                                      const std::string &client_id) {
+    if (size > max_message_size_ || size > UINT32_MAX)
+        throw std::runtime_error("Response exceeds max message size");
+
+    Loop *target = nullptr;
+    std::uint32_t tag = 0;
+    std::shared_ptr<Connection> conn = connection_of(client_id, target, tag);
+    if (!conn)
+        throw std::runtime_error("Connection " + client_id +
+                                 " is no longer open");
+    Loop &loop = *target;
+
+    unsigned char header[kFrameHeaderSize];
+    bool framed = framing_ == Framing::LengthPrefixed;
+    if (framed)
+        encode_frame_header({static_cast<std::uint32_t>(size), tag}, header);
+
+    std::lock_guard<std::mutex> lock(conn->out_mutex);
+    if (conn->closed)
+        throw std::runtime_error("Connection " + client_id + " was closed");
+
+    size_t total = (framed ? kFrameHeaderSize : 0) + size;
+    size_t written = 0;
+
+    // Fast path: nothing queued, so try to write straight from the caller.
+    if (conn->out.empty()) {
+        iovec iov[2];
+        int count = 0;
+        if (framed)
+            iov[count++] = {header, kFrameHeaderSize};
+        iov[count++] = {const_cast<char *>(data), size};
+
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t n;
+        do {
+            n = ::sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        } while (n == -1 && errno == EINTR);
+
+        if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            loop.reactor.post([this, &loop, conn] { drop(loop, conn); });
+            throw std::runtime_error("Failed to write response");
+        }
+        written = n > 0 ? static_cast<size_t>(n) : 0;
+    }
+
+    if (written == total) {
+        if (!framed)
+            loop.reactor.post([this, &loop, conn] { drop(loop, conn); });
+        return;
+    }
+
+    // Queue whatever is left and let the reactor finish it.
+    if (framed && written < kFrameHeaderSize) {
+        conn->out.append(reinterpret_cast<char *>(header) + written,
+                         kFrameHeaderSize - written);
+        written = 0;
+    } else if (framed) {
+        written -= kFrameHeaderSize;
+    }
+    conn->out.append(data + written, size - written);
+
+    if (!conn->want_write) {
+        conn->want_write = true;
+        loop.reactor.post([&loop, conn] {
+            std::lock_guard<std::mutex> lock(conn->out_mutex);
+            if (!conn->closed)
+                loop.reactor.modify(conn->fd, conn->read_events() | EPOLLOUT);
+        });
+    }
+}
+
+std::shared_ptr<EpollStreamTransport::Connection>
+EpollStreamTransport::connection_of(const std::string &client_id,
+                                    Loop *&loop, std::uint32_t &tag) {
+    const char *cursor = client_id.c_str();
+    char *end = nullptr;
+    size_t loop_index = std::strtoull(cursor, &end, 10);
+    std::uint64_t conn_id = std::strtoull(end + 1, &end, 10);
+    tag = 0;
+    if (*end == ':')
+        tag = static_cast<std::uint32_t>(std::strtoul(end + 1, nullptr, 10));
+
+    if (loop_index >= loops_.size())
+        throw std::runtime_error("Invalid client id: " + client_id);
+    loop = loops_[loop_index].get();
+
+    std::lock_guard<std::mutex> lock(loop->connections_mutex);
+    auto it = loop->connections.find(conn_id);
+    return it != loop->connections.end() ? it->second : nullptr;
+}
+
+bool EpollStreamTransport::notify_drained(const std::string &client_id,
+                                          std::function<void()> callback) {
+    Loop *loop = nullptr;
+    std::uint32_t tag = 0;
+    std::shared_ptr<Connection> conn = connection_of(client_id, loop, tag);
+    if (!conn)
+        return false;
+    std::lock_guard<std::mutex> lock(conn->out_mutex);
+    if (conn->closed || conn->out.empty())
+        return false;
+    conn->drained.push_back(std::move(callback));
+    return true;
+}
+
+std::string EpollStreamTransport::send(const std::string &) {
+    throw std::logic_error("Epoll transports are server-side only; connect "
+                           "with UnixSocketTransport or TcpTransport");
+}
+
+void EpollStreamTransport::drop(Loop &loop,
+                                const std::shared_ptr<Connection> &conn) {
+    std::vector<std::function<void()>> drained;
+    {
+        std::lock_guard<std::mutex> lock(conn->out_mutex);
+        if (conn->closed)
+            return;
+        conn->closed = true;
+        drained.swap(conn->drained);
+    }
+    // Everything else checks `closed` before touching the socket, so it
+    // can go now even if the connection is still referenced.
+    loop.reactor.remove(conn->fd);
+    ::close(conn->fd);
+    conn->fd = -1;
+    {
+        std::lock_guard<std::mutex> lock(loop.connections_mutex);
+        loop.connections.erase(conn->id);
+    }
+    for (auto &callback : drained)
+        callback();
+}
+
+void EpollStreamTransport::close() {
+    closed_ = true;
+    for (auto &loop : loops_) {
+        if (loop)
+            loop->reactor.stop();
+    }
+}
+
+// ==========================
+// EpollUnixTransport
+// ==========================
+
+EpollUnixTransport::EpollUnixTransport(const std::string &socket_path,
+                                       Framing framing, size_t reactors)
+    : EpollStreamTransport(framing, reactors), socket_path_(socket_path) {}
+
+int EpollUnixTransport::open_listener(size_t index) {
+    if (index > 0)
+        return -1; // every reactor shares the first socket
+    return listen_unix(socket_path_, SOCK_NONBLOCK | SOCK_CLOEXEC, SOMAXCONN,
+                       inode_);
+}
+
+void EpollUnixTransport::adopt_listeners(std::vector<int> fds) {
+    EpollStreamTransport::adopt_listeners(std::move(fds));
+    inode_ = unix_path_inode(socket_path_); // now this server's to remove
+}
+
+void EpollUnixTransport::close() {
+    EpollStreamTransport::close();
+    // Left in place for the process the socket was handed to.
+    if (!shared())
+        remove_unix_path(socket_path_, inode_);
+    inode_ = 0;
+}
+
+// ==========================
+// EpollTcpTransport
+// ==========================
+
+EpollTcpTransport::EpollTcpTransport(int port, Framing framing,
+                                     size_t reactors)
+    : EpollStreamTransport(framing, reactors), port_(port) {}
+
+int EpollTcpTransport::open_listener(size_t index) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        throw std::runtime_error("Failed to create TCP socket");
+
+    // Every reactor binds its own socket to the same port; the kernel then
+    // balances new connections across them.
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    // Prefer this socket, and so this reactor, for connections whose
+    // packets arrive on the reactor's CPU.
+    int cpu = reactor_cpu(index);
+    if (cpu >= 0)
+        setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+
+    sockaddr_in server_addr{};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(port_);
+
+    if (::bind(fd, (sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+        ::close(fd);
+        throw std::runtime_error("Failed to bind TCP socket");
+    }
+
+    if (listen(fd, SOMAXCONN) == -1) {
+        ::close(fd);
+        throw std::runtime_error("Failed to listen on TCP socket");
+    }
+    return fd;
+}
+
+void EpollTcpTransport::configure_socket(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// ==========================
+// BatchedUdpTransport
+// ==========================
+
+namespace {
+
+constexpr size_t kMaxDatagram = 65507;
+constexpr size_t kPeerIdSize = 7; // socket index, IPv4 address, port
+
+/// The loop whose batch is being delivered on this thread, if any.
+thread_local const void *delivering_loop = nullptr;
+
+} // namespace
+
+struct BatchedUdpTransport::Loop {
+    Loop(size_t index, size_t batch, size_t slot_size)
+        : index(index), slot_size(slot_size), slots(batch * slot_size),
+          headers(batch), iov(batch), peers(batch) {}
+
+    ~Loop() {
+        if (thread.joinable())
+            thread.join();
+        if (fd != -1)
+            ::close(fd);
+    }
+
+    size_t index;
+    int fd = -1;
+    std::thread thread;
+
+    // Receive side: `batch` slots of slot_size bytes, one per mmsghdr.
+    size_t slot_size;
+    std::vector<char> slots;
+    std::vector<mmsghdr> headers;
+    std::vector<iovec> iov;
+    std::vector<sockaddr_in> peers;
+
+    // Responses produced on this loop's thread during a batch; only that
+    // thread touches them.
+    std::vector<Buffer> out;
+    std::vector<sockaddr_in> out_peers;
+    std::vector<mmsghdr> out_headers;
+    std::vector<iovec> out_iov;
+};
+
+BatchedUdpTransport::BatchedUdpTransport(int port, size_t sockets,
+                                         size_t batch)
+    : port_(port), batch_(std::min<size_t>(std::max<size_t>(batch, 1),
+                                           UIO_MAXIOV)) {
+    loops_.resize(std::min<size_t>(std::max<size_t>(sockets, 1), 256));
+}
+
+BatchedUdpTransport::~BatchedUdpTransport() { close(); }
+
+void BatchedUdpTransport::bind() {
+    // After a stop the previous loops are done: replacing them closes
+    // their sockets, which would otherwise stay in the SO_REUSEPORT group
+    // and take datagrams nobody reads.
+    closed_ = false;
+    size_t slot_size = std::min(max_message_size_, kMaxDatagram) + 1;
+    for (size_t i = 0; i < loops_.size(); ++i) {
+        loops_[i].reset();
+        auto loop = std::make_unique<Loop>(i, batch_, slot_size);
+        loop->fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (loop->fd == -1)
+            throw std::runtime_error("Failed to create UDP socket");
+        loops_[i] = std::move(loop);
+        int fd = loops_[i]->fd;
+
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+
+        sockaddr_in server_addr{};
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_addr.s_addr = INADDR_ANY;
+        server_addr.sin_port = htons(port_);
+        if (::bind(fd, (sockaddr *)&server_addr, sizeof(server_addr)) == -1)
+            throw std::runtime_error("Failed to bind UDP socket");
+    }
+}
+
+void BatchedUdpTransport::run(MessageHandler on_message) {
+    on_message_ = std::move(on_message);
+    if (closed_)
+        return;
+
+    for (size_t i = 1; i < loops_.size(); ++i) {
+        Loop &loop = *loops_[i];
+        loop.thread = std::thread([this, &loop] { serve(loop); });
+    }
+    serve(*loops_[0]);
+    for (size_t i = 1; i < loops_.size(); ++i) {
+        if (loops_[i]->thread.joinable())
+            loops_[i]->thread.join();
+    }
+}
+
+void BatchedUdpTransport::serve(Loop &loop) {
+    for (size_t i = 0; i < batch_; ++i) {
+        loop.iov[i] = {loop.slots.data() + i * loop.slot_size,
+                       loop.slot_size};
+        msghdr &header = loop.headers[i].msg_hdr;
+        header = {};
+        header.msg_iov = &loop.iov[i];
+        header.msg_iovlen = 1;
+        header.msg_name = &loop.peers[i];
+    }
+
+    delivering_loop = &loop;
+    while (!closed_) {
+        for (mmsghdr &header : loop.headers) {
+            header.msg_hdr.msg_namelen = sizeof(sockaddr_in);
+            header.msg_hdr.msg_flags = 0;
+        }
+        // Block for the first datagram, then take whatever else is already
+        // queued. MSG_TRUNC reports full lengths, as in UdpTransport.
+        int n = recvmmsg(loop.fd, loop.headers.data(),
+                         static_cast<unsigned>(batch_),
+                         MSG_WAITFORONE | MSG_TRUNC, nullptr);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0 || closed_)
+            break;
+
+        for (int i = 0; i < n; ++i) {
+            size_t len = loop.headers[i].msg_len;
+            if (len == 0 || len > max_message_size_ ||
+                len >= loop.slot_size)
+                continue; // empty, or cut short; nothing to answer
+
+            const sockaddr_in &peer = loop.peers[i];
+            std::string client_id(kPeerIdSize, '\0');
+            client_id[0] = static_cast<char>(loop.index);
+            std::memcpy(&client_id[1], &peer.sin_addr, 4);
+            std::memcpy(&client_id[5], &peer.sin_port, 2);
+            try {
+                on_message_(Buffer(loop.slots.data() + i * loop.slot_size,
+                                   len),
+                            std::move(client_id));
+            } catch (const std::exception &) {
+                // The server could not take it; the client will time out.
+            }
+        }
+        if (!loop.out.empty())
+            flush(loop);
+    }
+    delivering_loop = nullptr;
+}
+
+void BatchedUdpTransport::flush(Loop &loop) {
+    size_t n = loop.out.size();
+    loop.out_headers.resize(n);
+    loop.out_iov.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+        loop.out_iov[i] = {loop.out[i].data(), loop.out[i].size()};
+        msghdr &header = loop.out_headers[i].msg_hdr;
+        header = {};
+        header.msg_iov = &loop.out_iov[i];
+        header.msg_iovlen = 1;
+        header.msg_name = &loop.out_peers[i];
+        header.msg_namelen = sizeof(sockaddr_in);
+    }
+
+    size_t sent = 0;
+    while (sent < n) {
+        int r = sendmmsg(loop.fd, loop.out_headers.data() + sent,
+                         static_cast<unsigned>(n - sent), 0);
+        if (r > 0) {
+            sent += static_cast<size_t>(r);
+        } else if (r == -1 && errno == EINTR) {
+            continue;
+        } else {
+            ++sent; // skip the datagram that failed, as sendto() would
+        }
+    }
+    loop.out.clear();
+    loop.out_peers.clear();
+}
+
+BatchedUdpTransport::Loop *
+BatchedUdpTransport::route(const std::string &client_id,
+                           sockaddr_in &peer) const {
+    if (client_id.size() != kPeerIdSize)
+        return nullptr;
+    auto index = static_cast<unsigned char>(client_id[0]);
+    if (index >= loops_.size() || !loops_[index])
+        return nullptr;
+
+    peer = {};
+    peer.sin_family = AF_INET;
+    std::memcpy(&peer.sin_addr, &client_id[1], 4);
+    std::memcpy(&peer.sin_port, &client_id[5], 2);
+    return loops_[index].get();
+}
+
+void BatchedUdpTransport::send(const std::string &data,
+                               const std::string &client_id) {
+    sockaddr_in peer;
+    Loop *loop = route(client_id, peer);
+    if (!loop)
+        return;
+    if (delivering_loop == loop) {
+        send_buffer(Buffer(data.data(), data.size()), client_id);
+        return;
+    }
+    if (data.size() > max_message_size_ || data.size() > kMaxDatagram)
+        throw std::runtime_error("Response exceeds max message size");
+    sendto(loop->fd, data.data(), data.size(), 0, (sockaddr *)&peer,
+           sizeof(peer));
+}
+
+void BatchedUdpTransport::send_buffer(const Buffer &data,
+                                      const std::string &client_id) {
+    if (data.size() > max_message_size_ || data.size() > kMaxDatagram)
+        throw std::runtime_error("Response exceeds max message size");
+
+    sockaddr_in peer;
+    Loop *loop = route(client_id, peer);
+    if (!loop)
+        return;
+    if (delivering_loop != loop) {
+        sendto(loop->fd, data.data(), data.size(), 0, (sockaddr *)&peer,
+               sizeof(peer));
+        return;
+    }
+    // Sharing the Buffer keeps it alive until flush() without a copy.
+    loop->out.push_back(data);
+    loop->out_peers.push_back(peer);
+    if (loop->out.size() >= batch_)
+        flush(*loop);
+}
+
+std::string BatchedUdpTransport::send(const std::string &) {
+    throw std::logic_error("BatchedUdpTransport is server-side only; "
+                           "connect with UdpTransport");
+}
+
+void BatchedUdpTransport::close() {
+    closed_ = true;
+    // shutdown() wakes a thread blocked in recvmmsg(). The sockets stay
+    // open until destruction, so late sends from workers cannot reach a
+    // reused descriptor.
+    for (auto &loop : loops_) {
+        if (loop && loop->fd != -1)
+            ::shutdown(loop->fd, SHUT_RDWR);
+    }
+}
+
+} // namespace Socks
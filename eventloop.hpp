@@ -0,0 +1,407 @@
+#pragma once
+
+#include "affinity.hpp"
+#include "transport.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <netinet/in.h>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @file eventloop.hpp
+ * @brief epoll-based reactor and event-driven server transports.
+ *
+ * The blocking transports in transport.hpp serve one message per receive()
+ * call on the server thread, so a client that connects and then stalls
+ * holds up everyone else. The transports here instead run one or more epoll
+ * reactors over non-blocking sockets, buffer partial reads per connection,
+ * and hand only complete messages to the server. BatchedUdpTransport
+ * applies the same model to datagrams, without epoll: each of its threads
+ * blocks in recvmmsg() on a socket of its own.
+ */
+
+namespace Socks {
+
+/**
+ * @class Reactor
+ * @brief A single-threaded epoll event loop.
+ *
+ * File descriptors are registered with a callback that receives the ready
+ * epoll event mask. Callbacks always run on the thread that called run().
+ * add(), modify() and remove() must be called from that thread (or before
+ * run() starts); post() and stop() are safe from any thread.
+ */
+class Reactor {
+  public:
+    using Callback = std::function<void(std::uint32_t events)>;
+
+    /**
+     * @brief Create the epoll instance and its wakeup eventfd.
+     * @throws std::runtime_error if either cannot be created.
+     */
+    Reactor();
+
+    /**
+     * @brief Close the epoll instance. The loop must no longer be running.
+     */
+    ~Reactor();
+
+    Reactor(const Reactor &) = delete;
+    Reactor &operator=(const Reactor &) = delete;
+
+    /**
+     * @brief Register a file descriptor.
+     * @param fd The descriptor to watch.
+     * @param events epoll event mask (e.g. EPOLLIN).
+     * @param callback Invoked with the ready events.
+     * @throws std::runtime_error if epoll_ctl fails.
+     */
+    void add(int fd, std::uint32_t events, Callback callback);
+
+    /**
+     * @brief Change the event mask of a registered descriptor.
+     */
+    void modify(int fd, std::uint32_t events);
+
+    /**
+     * @brief Unregister a descriptor. Does not close it.
+     */
+    void remove(int fd);
+
+    /**
+     * @brief Run a function on the reactor thread.
+     * @param fn The function to run on the next loop iteration.
+     */
+    void post(std::function<void()> fn);
+
+    /**
+     * @brief Dispatch events until stop() is called.
+     */
+    void run();
+
+    /**
+     * @brief Ask run() to return after the current iteration.
+     */
+    void stop();
+
+  private:
+    void wake();
+    void run_posted();
+
+    int epoll_fd_ = -1;
+    int wake_fd_ = -1;
+    std::atomic<bool> stopping_ = false;
+    std::unordered_map<int, std::shared_ptr<Callback>>
+        callbacks_; ///< Reactor thread only
+
+    std::mutex posted_mutex_; ///< Protects posted_
+    std::vector<std::function<void()>> posted_;
+};
+
+/**
+ * @class EventTransport
+ * @brief Server-side transport driven by its own event loop.
+ *
+ * Instead of being polled with receive(), an EventTransport is started with
+ * run(), which blocks until close() and invokes a callback for every
+ * complete message. Responses go back through send(data, client_id) from
+ * any thread. Server detects this interface and switches to event-driven
+ * serving; the blocking receive() path is not available.
+ */
+class EventTransport : public Transport {
+  public:
+    /**
+     * @brief Callback receiving a complete message and its client identity.
+     */
+    using MessageHandler =
+        std::function<void(Buffer data, std::string client_id)>;
+
+    /**
+     * @brief Serve connections until close() is called.
+     *
+     * bind() must have been called first. The handler may be invoked from
+     * several reactor threads at once.
+     *
+     * @param on_message Invoked for every complete message.
+     */
+    virtual void run(MessageHandler on_message) = 0;
+
+    /**
+     * @brief Not supported: event transports deliver messages through run().
+     * @throws std::logic_error always.
+     */
+    std::string receive(std::string &client_id) override;
+};
+
+/**
+ * @class EpollStreamTransport
+ * @brief Shared implementation of the epoll-driven stream transports.
+ *
+ * Each reactor thread owns its connections: it accepts, reads into a
+ * per-connection buffer until a complete message (frame or raw JSON
+ * document) is available, and flushes queued responses when the socket is
+ * writable. send() writes directly when nothing is queued, so most
+ * responses are written by the worker that produced them without waking
+ * the reactor.
+ *
+ * These transports are server-side only; clients connect with
+ * UnixSocketTransport or TcpTransport using the same Framing.
+ */
+class EpollStreamTransport : public EventTransport {
+  public:
+    ~EpollStreamTransport() override;
+
+    void bind() override;
+    void run(MessageHandler on_message) override;
+    void send(const std::string &data, const std::string &client_id) override;
+    void send_buffer(const Buffer &data,
+                     const std::string &client_id) override;
+
+    /**
+     * @brief Not supported: connect with the blocking transports instead.
+     * @throws std::logic_error always.
+     */
+    std::string send(const std::string &data) override;
+
+    void close() override;
+
+    /**
+     * @brief The framing mode this transport was constructed with.
+     */
+    Framing framing() const { return framing_; }
+
+    bool binary_safe() const override {
+        return framing_ == Framing::LengthPrefixed;
+    }
+
+    bool supports_streams() const override {
+        return framing_ == Framing::LengthPrefixed;
+    }
+
+    /**
+     * @brief Runs `callback` on the reactor thread once the connection's
+     * queued bytes are written, or when it closes.
+     */
+    bool notify_drained(const std::string &client_id,
+                        std::function<void()> callback) override;
+
+    std::vector<int> share_listeners() override;
+
+    /**
+     * @brief With more sockets than reactors, reactors take several;
+     * with fewer, reactors share them.
+     */
+    void adopt_listeners(std::vector<int> fds) override;
+
+    void stop_listening() override;
+
+    /**
+     * @brief Pin the reactor threads: reactor `i` runs on the CPUs of
+     * `affinity.cpus_of(i)` (see affinity.hpp). Call before run().
+     *
+     * Pinned reactors all get threads of their own, so the thread calling
+     * run() keeps its affinity. With one CPU per reactor,
+     * EpollTcpTransport also sets SO_INCOMING_CPU on each reactor's
+     * listening socket, so that kernels honouring it in SO_REUSEPORT
+     * selection hand a connection to the reactor on the CPU that processed
+     * its packets. Together with a pinned ThreadPool, a request then stays
+     * on one core from receive to send.
+     */
+    void set_reactor_affinity(CpuAffinity affinity) {
+        reactor_affinity_ = std::move(affinity);
+    }
+
+  protected:
+    /**
+     * @brief Construct the shared reactor machinery.
+     * @param framing Wire framing used on every connection.
+     * @param reactors Number of reactor threads (at least 1).
+     */
+    EpollStreamTransport(Framing framing, size_t reactors);
+
+    /**
+     * @brief Create a non-blocking listening socket.
+     * @param index Index of the reactor the socket is for.
+     * @return The listening descriptor, or -1 to share reactor 0's socket.
+     * @throws std::runtime_error on failure.
+     */
+    virtual int open_listener(size_t index) = 0;
+
+    /**
+     * @brief Hook to apply socket options to accepted sockets.
+     */
+    virtual void configure_socket(int fd) { (void)fd; }
+
+    /**
+     * @brief Whether share_listeners() has been called.
+     */
+    bool shared() const { return shared_; }
+
+    /**
+     * @brief The one CPU reactor `index` is pinned to, or -1.
+     */
+    int reactor_cpu(size_t index) const {
+        return reactor_affinity_.cpu_of(index);
+    }
+
+  private:
+    struct Connection;
+    struct Loop;
+
+    void release_listeners();
+    /// Stop accepting and reading on `loop`'s thread (see
+    /// stop_listening()).
+    void pause(Loop &loop);
+    void on_accept(Loop &loop, int listener);
+    void on_readable(Loop &loop, const std::shared_ptr<Connection> &conn);
+    void on_writable(Loop &loop, const std::shared_ptr<Connection> &conn);
+    void extract_messages(Loop &loop, const std::shared_ptr<Connection> &conn);
+    bool deliver(Loop &loop, const std::shared_ptr<Connection> &conn,
+                 Buffer data, std::string client_id);
+    void send_bytes(const char *data, size_t size,
+                    const std::string &client_id);
+    /// The open connection a client_id names and its frame tag; null if
+    /// it has closed.
+    std::shared_ptr<Connection> connection_of(const std::string &client_id,
+                                              Loop *&loop,
+                                              std::uint32_t &tag);
+    void flush(Loop &loop, const std::shared_ptr<Connection> &conn);
+    void drop(Loop &loop, const std::shared_ptr<Connection> &conn);
+
+    Framing framing_;
+    std::vector<std::unique_ptr<Loop>> loops_;
+    CpuAffinity reactor_affinity_; ///< Empty: reactors are not pinned
+    std::mutex listeners_mutex_;  ///< Protects listeners_
+    std::vector<int> listeners_;  ///< Listening sockets, shared by loops
+    std::vector<int> adopted_;    ///< Taken over; used by the next bind()
+    MessageHandler on_message_;
+    std::atomic<bool> closed_ = false;
+    std::atomic<bool> shared_ = false;
+};
+
+/**
+ * @class EpollUnixTransport
+ * @brief Event-driven UNIX domain socket server transport.
+ *
+ * All reactors share one listening socket registered with EPOLLEXCLUSIVE,
+ * so each new connection wakes a single reactor.
+ */
+class EpollUnixTransport : public EpollStreamTransport {
+  public:
+    /**
+     * @brief Construct an event-driven UNIX socket server.
+     * @param socket_path Filesystem path for the UNIX socket.
+     * @param framing Raw or length-prefixed connections.
+     * @param reactors Number of reactor threads.
+     */
+    explicit EpollUnixTransport(const std::string &socket_path,
+                                Framing framing = Framing::LengthPrefixed,
+                                size_t reactors = 1);
+
+    void adopt_listeners(std::vector<int> fds) override;
+    void close() override;
+
+  protected:
+    int open_listener(size_t index) override;
+
+  private:
+    std::string socket_path_;
+    std::uint64_t inode_ = 0; ///< Socket file to remove on close(), if any
+};
+
+/**
+ * @class EpollTcpTransport
+ * @brief Event-driven TCP server transport.
+ *
+ * With more than one reactor, each opens its own listening socket with
+ * SO_REUSEPORT and the kernel spreads incoming connections across them.
+ */
+class EpollTcpTransport : public EpollStreamTransport {
+  public:
+    /**
+     * @brief Construct an event-driven TCP server.
+     * @param port Port number to bind.
+     * @param framing Raw or length-prefixed connections.
+     * @param reactors Number of reactor threads.
+     */
+    explicit EpollTcpTransport(int port,
+                               Framing framing = Framing::LengthPrefixed,
+                               size_t reactors = 1);
+
+  protected:
+    int open_listener(size_t index) override;
+    void configure_socket(int fd) override;
+
+  private:
+    int port_;
+};
+
+/**
+ * @class BatchedUdpTransport
+ * @brief Multi-threaded UDP server transport that receives and replies in
+ * batches.
+ *
+ * Each of `sockets` threads owns its own socket bound to the port with
+ * SO_REUSEPORT, so the kernel spreads clients across them, and drains it
+ * with recvmmsg(): up to `batch` datagrams per system call. Responses
+ * produced on that thread while a batch is being delivered (a Server
+ * without a ThreadPool, or with work run inline) are collected and written
+ * with one sendmmsg() after the batch; responses from other threads are
+ * sent at once with sendto().
+ *
+ * Client identities are opaque 7-byte strings holding the socket index and
+ * the peer address in network byte order, so replying neither formats nor
+ * parses an "ip:port" string. Each socket reserves `batch` slots of the
+ * largest datagram accepted (64 KiB by default) for receiving.
+ *
+ * Server-side only; clients use UdpTransport. IPv4 only, like UdpTransport.
+ */
+class BatchedUdpTransport : public EventTransport {
+  public:
+    /**
+     * @brief Construct a batched UDP server.
+     * @param port Port number to bind.
+     * @param sockets Number of sockets, each with its own thread (1 to
+     * 256).
+     * @param batch Datagrams received per recvmmsg() call (1 to 1024).
+     */
+    explicit BatchedUdpTransport(int port, size_t sockets = 1,
+                                 size_t batch = 32);
+    ~BatchedUdpTransport() override;
+
+    void bind() override;
+    void run(MessageHandler on_message) override;
+    void send(const std::string &data, const std::string &client_id) override;
+    void send_buffer(const Buffer &data,
+                     const std::string &client_id) override;
+
+    /**
+     * @brief Not supported: connect with UdpTransport instead.
+     * @throws std::logic_error always.
+     */
+    std::string send(const std::string &data) override;
+
+    void close() override;
+
+  private:
+    struct Loop;
+
+    void serve(Loop &loop);
+    void flush(Loop &loop);
+    Loop *route(const std::string &client_id, sockaddr_in &peer) const;
+
+    int port_;
+    size_t batch_;
+    std::vector<std::unique_ptr<Loop>> loops_;
+    MessageHandler on_message_;
+    std::atomic<bool> closed_ = false;
+};
+
+} // namespace Socks
@@ -6,9 +6,12 @@ set -e
 mkdir -p build
 
 # Compile server
-g++ -std=c++17 examples/fibo_server.cpp server.cpp transport.cpp schema.cpp threadpool.cpp client.cpp -I. -o build/fibo_server
+g++ -std=c++17 examples/fibo_server.cpp admission.cpp affinity.cpp arena.cpp buffer.cpp cache.cpp cluster.cpp server.cpp codec.cpp commands.cpp transport.cpp typed.cpp framing.cpp handoff.cpp eventloop.cpp logger.cpp metrics.cpp scan.cpp schema.cpp shm.cpp stream.cpp threadpool.cpp timer.cpp client.cpp -I. -o build/fibo_server
 
 # Compile client
-g++ -std=c++17 examples/fibo_client.cpp server.cpp transport.cpp schema.cpp threadpool.cpp client.cpp -I. -o build/fibo_client
+g++ -std=c++17 examples/fibo_client.cpp admission.cpp affinity.cpp arena.cpp buffer.cpp cache.cpp cluster.cpp server.cpp codec.cpp commands.cpp transport.cpp typed.cpp framing.cpp handoff.cpp eventloop.cpp logger.cpp metrics.cpp scan.cpp schema.cpp shm.cpp stream.cpp threadpool.cpp timer.cpp client.cpp -I. -o build/fibo_client
+
+# Compile the coroutine gateway (needs C++20)
+g++ -std=c++20 examples/fibo_gateway.cpp admission.cpp affinity.cpp arena.cpp buffer.cpp cache.cpp cluster.cpp server.cpp codec.cpp commands.cpp transport.cpp typed.cpp framing.cpp handoff.cpp eventloop.cpp logger.cpp metrics.cpp scan.cpp schema.cpp shm.cpp stream.cpp threadpool.cpp timer.cpp client.cpp -I. -o build/fibo_gateway
 
 echo "Build successful. Binaries are in ./build/"
@@ -0,0 +1,33 @@
+#include "../client.hpp"
+#include "../coro.hpp"
+#include "../server.hpp"
+#include "../threadpool.hpp"
+#include "../transport.hpp"
+
+#include <memory>
+
+using namespace Socks;
+
+// Needs C++20 (see coro.hpp). Answers "fibo_pair" with fib(n) and fib(n+1),
+// asking fibo_server for each in turn. The handler is a coroutine, so while
+// a request is in flight it holds no worker: two workers serve any number
+// of concurrent clients.
+int main() {
+  auto transport = std::make_unique<UdpTransport>(8081);
+  auto pool = std::make_shared<ThreadPool>(2);
+  Server server(std::move(transport), pool);
+
+  Client fibo(std::make_unique<UdpTransport>("127.0.0.1", 8080));
+
+  add_coroutine_handler(server, "fibo_pair", [&](json req) -> Task<json> {
+    json body = {{"n", req.value("n", 0)}};
+    json a = co_await request(fibo, "fibo", body);
+    body["n"] = body["n"].get<int>() + 1;
+    json b = co_await request(fibo, "fibo", body);
+    json result = json::array({a["result"], b["result"]});
+    co_return okay({{"result", result}});
+  });
+
+  server.start(); // Blocking
+  return 0;
+}
@@ -2,28 +2,21 @@
 #include "../threadpool.hpp"
 #include "../transport.hpp"
 
+#include <chrono>
 #include <iostream>
 #include <memory>
-#include <mutex>
-#include <unordered_map>
 
 using namespace Socks;
 
-std::unordered_map<int, int> memo;
-std::mutex memo_mutex;
-
 int compute_fibo(int n) {
   std::cout << "CALC " << n << std::endl;
-  if (n <= 1)
-    return n;
-  if (memo.count(n))
-    return memo[n];
-  int value = compute_fibo(n - 1) + compute_fibo(n - 2);
-  {
-    std::lock_guard<std::mutex> lock(memo_mutex);
-    memo[n] = value;
+  int a = 0, b = 1;
+  for (int i = 0; i < n; ++i) {
+    int next = a + b;
+    a = b;
+    b = next;
   }
-  return value;
+  return a;
 }
 
 int main() {
@@ -35,18 +28,27 @@ int main() {
   auto pool = std::make_shared<ThreadPool>(4);
   Server server(std::move(transport), pool);
 
-  server.add_handler("fibo", [](const json &req) {
-    try {
-      assert_parameters(req, {{"n", types({json::value_t::number_integer,
-                                           json::value_t::number_unsigned})}});
-
-      int n = static_cast<int>(req.at("n").get<int>());
-      int result = compute_fibo(n);
-      return okay({{"result", result}});
-    } catch (const std::exception &e) {
-      return error({}, e.what());
-    }
-  });
+  // The schema is compiled once and checked before the handler runs.
+  CompiledSchema fibo_schema{{"n", types({json::value_t::number_integer,
+                                          json::value_t::number_unsigned})}};
+
+  // fibo is a pure function of its request, so the server caches its
+  // responses: a repeated request is answered without calling the handler.
+  HandlerOptions fibo_options;
+  fibo_options.cache = {1024, std::chrono::minutes(10)};
+
+  server.add_handler(
+      "fibo", fibo_schema,
+      [](const json &req) {
+        try {
+          int n = static_cast<int>(req.at("n").get<int>());
+          int result = compute_fibo(n);
+          return okay({{"result", result}});
+        } catch (const std::exception &e) {
+          return error({}, e.what());
+        }
+      },
+      fibo_options);
 
   server.start(); // Blocking
   return 0;
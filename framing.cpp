@@ -0,0 +1,63 @@
+#include "framing.hpp"
+
+namespace Socks {
+
+static void put_u32(std::uint32_t value, unsigned char *out) {
+    out[0] = static_cast<unsigned char>(value >> 24);
+    out[1] = static_cast<unsigned char>(value >> 16);
+    out[2] = static_cast<unsigned char>(value >> 8);
+    out[3] = static_cast<unsigned char>(value);
+}
+
+static std::uint32_t get_u32(const unsigned char *in) {
+    return (static_cast<std::uint32_t>(in[0]) << 24) |
+           (static_cast<std::uint32_t>(in[1]) << 16) |
+           (static_cast<std::uint32_t>(in[2]) << 8) |
+           static_cast<std::uint32_t>(in[3]);
+}
+
+void encode_frame_header(const FrameHeader &header, unsigned char *out) {
+    put_u32(header.length, out);
+    put_u32(header.tag, out + 4);
+}
+
+FrameHeader decode_frame_header(const unsigned char *in) {
+    FrameHeader header;
+    header.length = get_u32(in);
+    header.tag = get_u32(in + 4);
+    return header;
+}
+
+bool RawMessageScanner::feed(const char *data, std::size_t len) {
+    for (std::size_t i = 0; i < len && !complete_; ++i) {
+        char c = data[i];
+        if (in_string_) {
+            if (escaped_)
+                escaped_ = false;
+            else if (c == '\\')
+                escaped_ = true;
+            else if (c == '"')
+                in_string_ = false;
+            continue;
+        }
+        switch (c) {
+        case '"':
+            in_string_ = true;
+            break;
+        case '{':
+        case '[':
+            ++depth_;
+            break;
+        case '}':
+        case ']':
+            if (depth_ > 0 && --depth_ == 0)
+                complete_ = true;
+            break;
+        default:
+            break;
+        }
+    }
+    return complete_;
+}
+
+} // namespace Socks
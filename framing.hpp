@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @file framing.hpp
+ * @brief Wire framing used by the stream transports (Unix, TCP).
+ *
+ * In length-prefixed mode every message on a connection is preceded by a
+ * fixed-size header:
+ *
+ * @code
+ * +----------------+----------------+-------------------+
+ * | length (u32be) |  tag (u32be)   | payload (length)  |
+ * +----------------+----------------+-------------------+
+ * @endcode
+ *
+ * The tag is chosen by the client and echoed verbatim in the response, so a
+ * client can match responses to the requests it sent on the connection.
+ */
+
+namespace Socks {
+
+/**
+ * @brief How messages are delimited on a stream connection.
+ */
+enum class Framing {
+    /// One request per connection, delimited by the connection itself.
+    /// This is the original protocol spoken by the Python clients.
+    Raw,
+    /// Persistent connection carrying many length-prefixed frames.
+    LengthPrefixed,
+};
+
+/// Size in bytes of an encoded frame header.
+constexpr std::size_t kFrameHeaderSize = 8;
+
+/**
+ * @brief Decoded frame header.
+ */
+struct FrameHeader {
+    std::uint32_t length = 0; ///< Payload length in bytes
+    std::uint32_t tag = 0;    ///< Client-chosen tag, echoed in the response
+};
+
+/**
+ * @class RawMessageScanner
+ * @brief Finds the end of a JSON document on a Framing::Raw connection.
+ *
+ * Raw connections carry a single JSON value with no length prefix, and the
+ * client keeps its socket open while waiting for the reply, so the server
+ * cannot wait for EOF. The scanner tracks nesting depth and string/escape
+ * state across reads and reports when the top-level object or array closes.
+ */
+class RawMessageScanner {
+  public:
+    /**
+     * @brief Scan the next chunk of the message.
+     * @param data Chunk start.
+     * @param len Chunk length in bytes.
+     * @return true once the top-level value is complete.
+     */
+    bool feed(const char *data, std::size_t len);
+
+    /**
+     * @brief Whether the top-level value has been closed.
+     */
+    bool complete() const { return complete_; }
+
+  private:
+    std::size_t depth_ = 0;
+    bool in_string_ = false;
+    bool escaped_ = false;
+    bool complete_ = false;
+};
+
+/**
+ * @brief Encode a frame header into network byte order.
+ * @param header The header to encode.
+ * @param out Destination buffer of at least kFrameHeaderSize bytes.
+ */
+void encode_frame_header(const FrameHeader &header, unsigned char *out);
+
+/**
+ * @brief Decode a frame header from network byte order.
+ * @param in Source buffer of at least kFrameHeaderSize bytes.
+ * @return The decoded header.
+ */
+FrameHeader decode_frame_header(const unsigned char *in);
+
+} // namespace Socks
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/**
+ * @file function.hpp
+ * @brief Move-only callable wrapper with inline (small-buffer) storage.
+ *
+ * UniqueFunction plays the role of std::function for tasks that are created,
+ * moved into a queue and invoked once. Unlike std::function it accepts
+ * move-only callables (e.g. lambdas capturing a std::promise) and stores any
+ * callable up to `InlineSize` bytes inside the object itself, so wrapping
+ * and queueing a small lambda performs no heap allocation.
+ */
+
+namespace Socks {
+
+template <typename Signature, std::size_t InlineSize = 56> class UniqueFunction;
+
+/**
+ * @class UniqueFunction
+ * @brief Type-erased, move-only callable with small-buffer optimization.
+ *
+ * Callables no larger than `InlineSize` bytes (and nothrow-move-constructible)
+ * live in the inline buffer; larger ones fall back to a single heap
+ * allocation. The default size keeps the whole object within one 64-byte
+ * cache line.
+ *
+ * @tparam R Return type.
+ * @tparam Args Argument types.
+ * @tparam InlineSize Bytes of inline storage.
+ */
+template <typename R, typename... Args, std::size_t InlineSize>
+class UniqueFunction<R(Args...), InlineSize> {
+  public:
+    UniqueFunction() noexcept = default;
+    UniqueFunction(std::nullptr_t) noexcept {}
+
+    /**
+     * @brief Wrap a callable, inline when it fits.
+     * @param f Callable invocable as R(Args...).
+     */
+    template <typename F,
+              typename = std::enable_if_t<
+                  !std::is_same_v<std::decay_t<F>, UniqueFunction> &&
+                  std::is_invocable_r_v<R, std::decay_t<F> &, Args...>>>
+    UniqueFunction(F &&f) {
+        using Fn = std::decay_t<F>;
+        if constexpr (stored_inline<Fn>) {
+            ::new (static_cast<void *>(storage_)) Fn(std::forward<F>(f));
+        } else {
+            Fn *heap = new Fn(std::forward<F>(f));
+            ::new (static_cast<void *>(storage_)) Fn *(heap);
+        }
+        ops_ = &ops_for<Fn>;
+    }
+
+    UniqueFunction(UniqueFunction &&other) noexcept { take(other); }
+
+    UniqueFunction &operator=(UniqueFunction &&other) noexcept {
+        if (this != &other) {
+            reset();
+            take(other);
+        }
+        return *this;
+    }
+
+    UniqueFunction &operator=(std::nullptr_t) noexcept {
+        reset();
+        return *this;
+    }
+
+    UniqueFunction(const UniqueFunction &) = delete;
+    UniqueFunction &operator=(const UniqueFunction &) = delete;
+
+    ~UniqueFunction() { reset(); }
+
+    /**
+     * @brief Invoke the stored callable. Must not be empty.
+     */
+    R operator()(Args... args) {
+        return ops_->invoke(storage_, std::forward<Args>(args)...);
+    }
+
+    /**
+     * @brief Whether a callable is stored.
+     */
+    explicit operator bool() const noexcept { return ops_ != nullptr; }
+
+    /**
+     * @brief Whether a callable of type F would be stored without allocating.
+     */
+    template <typename F>
+    static constexpr bool stored_inline =
+        sizeof(F) <= InlineSize &&
+        alignof(F) <= alignof(std::max_align_t) &&
+        std::is_nothrow_move_constructible_v<F>;
+
+  private:
+    struct Ops {
+        R (*invoke)(void *self, Args &&...args);
+        void (*relocate)(void *dst, void *src) noexcept;
+        void (*destroy)(void *self) noexcept;
+    };
+
+    template <typename Fn> static R invoke_inline(void *self, Args &&...args) {
+        return (*static_cast<Fn *>(self))(std::forward<Args>(args)...);
+    }
+
+    template <typename Fn>
+    static void relocate_inline(void *dst, void *src) noexcept {
+        Fn *from = static_cast<Fn *>(src);
+        ::new (dst) Fn(std::move(*from));
+        from->~Fn();
+    }
+
+    template <typename Fn> static void destroy_inline(void *self) noexcept {
+        static_cast<Fn *>(self)->~Fn();
+    }
+
+    template <typename Fn> static R invoke_heap(void *self, Args &&...args) {
+        return (**static_cast<Fn **>(self))(std::forward<Args>(args)...);
+    }
+
+    static void relocate_heap(void *dst, void *src) noexcept {
+        ::new (dst) void *(*static_cast<void **>(src));
+    }
+
+    template <typename Fn> static void destroy_heap(void *self) noexcept {
+        delete *static_cast<Fn **>(self);
+    }
+
+    template <typename Fn>
+    static constexpr Ops ops_for =
+        stored_inline<Fn> ? Ops{&invoke_inline<Fn>, &relocate_inline<Fn>,
+                                &destroy_inline<Fn>}
+                          : Ops{&invoke_heap<Fn>, &relocate_heap,
+                                &destroy_heap<Fn>};
+
+    void take(UniqueFunction &other) noexcept {
+        if (other.ops_) {
+            other.ops_->relocate(storage_, other.storage_);
+            ops_ = other.ops_;
+            other.ops_ = nullptr;
+        }
+    }
+
+    void reset() noexcept {
+        if (ops_) {
+            ops_->destroy(storage_);
+            ops_ = nullptr;
+        }
+    }
+
+    static_assert(InlineSize >= sizeof(void *),
+                  "InlineSize must hold at least a pointer");
+
+    alignas(std::max_align_t) unsigned char storage_[InlineSize];
+    const Ops *ops_ = nullptr;
+};
+
+} // namespace Socks
@@ -0,0 +1,205 @@
+#include "handoff.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace Socks {
+
+namespace {
+
+/// Leads every handoff message; also tells the receiver how many sockets
+/// to expect in the ancillary data.
+struct HandoffHeader {
+    char magic[4];
+    std::uint32_t count;
+};
+
+constexpr char kHandoffMagic[4] = {'S', 'K', 'S', '1'};
+
+bool fill_address(const std::string &path, sockaddr_un &addr) {
+    addr = sockaddr_un{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+        return false;
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+void close_all(const std::vector<int> &fds) {
+    for (int fd : fds)
+        ::close(fd);
+}
+
+} // namespace
+
+int listen_unix(const std::string &path, int flags, int backlog,
+                std::uint64_t &inode) {
+    sockaddr_un addr;
+    if (!fill_address(path, addr))
+        throw std::runtime_error("UNIX socket path too long: " + path);
+
+    // Bound under a temporary name and renamed into place, so clients of
+    // the server being replaced never find the path missing.
+    std::string temporary =
+        path + "." + std::to_string(::getpid()) + ".tmp";
+    sockaddr_un bound;
+    bool renamed = fill_address(temporary, bound);
+    if (renamed)
+        unlink(temporary.c_str()); // left behind by a crash
+    else
+        unlink(path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | flags, 0);
+    if (fd == -1)
+        throw std::runtime_error("Failed to create UNIX socket");
+
+    if (::bind(fd, (sockaddr *)(renamed ? &bound : &addr), sizeof(addr)) ==
+        -1) {
+        ::close(fd);
+        throw std::runtime_error("Failed to bind UNIX socket");
+    }
+
+    if (listen(fd, backlog) == -1) {
+        ::close(fd);
+        if (renamed)
+            unlink(temporary.c_str());
+        throw std::runtime_error("Failed to listen on UNIX socket");
+    }
+
+    if (renamed && rename(temporary.c_str(), path.c_str()) == -1) {
+        ::close(fd);
+        unlink(temporary.c_str());
+        throw std::runtime_error("Failed to move UNIX socket to " + path);
+    }
+    inode = unix_path_inode(path);
+    return fd;
+}
+
+std::uint64_t unix_path_inode(const std::string &path) {
+    struct stat st{};
+    if (stat(path.c_str(), &st) == -1)
+        return 0;
+    return static_cast<std::uint64_t>(st.st_ino);
+}
+
+void remove_unix_path(const std::string &path, std::uint64_t inode) {
+    if (inode != 0 && unix_path_inode(path) == inode)
+        unlink(path.c_str());
+}
+
+int connect_unix(const std::string &path) {
+    sockaddr_un addr;
+    if (!fill_address(path, addr)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+    if (connect(fd, (sockaddr *)&addr, sizeof(addr)) == -1) {
+        int saved = errno;
+        ::close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+std::vector<int> duplicate_sockets(const std::vector<int> &fds) {
+    std::vector<int> copies;
+    for (int fd : fds) {
+        int copy = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        if (copy == -1) {
+            close_all(copies);
+            throw std::runtime_error("Failed to duplicate listening socket");
+        }
+        copies.push_back(copy);
+    }
+    return copies;
+}
+
+bool send_sockets(int channel, const std::vector<int> &fds) {
+    if (fds.size() > kMaxHandoffSockets)
+        throw std::runtime_error("Too many sockets to hand off");
+
+    HandoffHeader header;
+    std::memcpy(header.magic, kHandoffMagic, sizeof(header.magic));
+    header.count = static_cast<std::uint32_t>(fds.size());
+    iovec iov{&header, sizeof(header)};
+
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) *
+                                             kMaxHandoffSockets)];
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (!fds.empty()) {
+        std::size_t bytes = sizeof(int) * fds.size();
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(bytes);
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(bytes);
+        std::memcpy(CMSG_DATA(cmsg), fds.data(), bytes);
+    }
+
+    ssize_t n;
+    do {
+        n = sendmsg(channel, &msg, MSG_NOSIGNAL);
+    } while (n == -1 && errno == EINTR);
+    return n == static_cast<ssize_t>(sizeof(header));
+}
+
+std::vector<int> receive_sockets(int channel) {
+    HandoffHeader header{};
+    iovec iov{&header, sizeof(header)};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) *
+                                             kMaxHandoffSockets)];
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    do {
+        n = recvmsg(channel, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    } while (n == -1 && errno == EINTR);
+    // Without data the control buffer was never filled in: no sockets.
+    if (n == -1) {
+        throw std::runtime_error(std::string("Failed to receive handoff: ") +
+                                 std::strerror(errno));
+    }
+    if (n == 0)
+        throw std::runtime_error("Handoff peer closed the connection");
+
+    std::vector<int> fds;
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        std::size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        std::size_t offset = fds.size();
+        fds.resize(offset + count);
+        std::memcpy(fds.data() + offset, CMSG_DATA(cmsg),
+                    count * sizeof(int));
+    }
+
+    if (n != static_cast<ssize_t>(sizeof(header)) ||
+        std::memcmp(header.magic, kHandoffMagic, sizeof(header.magic)) != 0 ||
+        (msg.msg_flags & MSG_CTRUNC) || header.count != fds.size()) {
+        close_all(fds);
+        throw std::runtime_error("Malformed socket handoff");
+    }
+    return fds;
+}
+
+} // namespace Socks
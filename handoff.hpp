@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * @file handoff.hpp
+ * @brief Socket plumbing for restarting a server without dropping clients.
+ *
+ * A replacement process takes over the listening sockets of the one it
+ * replaces instead of binding its own: the old process sends them over a
+ * Unix socket with SCM_RIGHTS (see Server::hand_off() and
+ * Server::take_over()). Both processes then hold the same sockets. The
+ * kernel's accept queue and datagram buffer are never closed, so clients
+ * connecting during the restart simply wait for whichever process accepts
+ * first.
+ *
+ * Unix socket paths are replaced the same way: a new socket is bound next
+ * to the path and renamed over it, so the path never disappears, and a
+ * server only removes the path while it still names its own socket.
+ */
+
+namespace Socks {
+
+/// Most sockets one handoff carries.
+constexpr std::size_t kMaxHandoffSockets = 64;
+
+/**
+ * @brief Create a Unix stream socket listening on `path`.
+ *
+ * The socket is bound to a temporary name beside `path` and renamed over
+ * it, replacing whatever was there (e.g. the socket of the server being
+ * replaced) without a moment in which connecting fails. Paths too long for
+ * the temporary name are unlinked and bound directly.
+ *
+ * @param path Filesystem path for the socket.
+ * @param flags Extra socket() type flags, e.g. SOCK_NONBLOCK.
+ * @param backlog Length of the accept queue.
+ * @param[out] inode The socket file's inode, for remove_unix_path().
+ * @return The listening descriptor.
+ * @throws std::runtime_error if any step fails.
+ */
+int listen_unix(const std::string &path, int flags, int backlog,
+                std::uint64_t &inode);
+
+/**
+ * @brief Inode of the file at `path`, or 0 if there is none.
+ */
+std::uint64_t unix_path_inode(const std::string &path);
+
+/**
+ * @brief Remove `path` if it is still the socket file with `inode`.
+ *
+ * A newer server may have replaced it (see listen_unix()), in which case
+ * the path is left alone.
+ */
+void remove_unix_path(const std::string &path, std::uint64_t inode);
+
+/**
+ * @brief Connect a stream socket to the Unix socket at `path`.
+ * @return The connected descriptor, or -1 (with errno set) on failure.
+ */
+int connect_unix(const std::string &path);
+
+/**
+ * @brief Duplicate descriptors, e.g. to hand them off while still using
+ * them. The copies are close-on-exec and owned by the caller.
+ * @throws std::runtime_error if a descriptor cannot be duplicated.
+ */
+std::vector<int> duplicate_sockets(const std::vector<int> &fds);
+
+/**
+ * @brief Send descriptors over a connected Unix socket.
+ *
+ * The receiver gets duplicates; the caller still owns `fds`. An empty
+ * list is sent as well, to tell the receiver there is nothing to take.
+ *
+ * @return false if the message could not be sent.
+ * @throws std::runtime_error if there are more than kMaxHandoffSockets.
+ */
+bool send_sockets(int channel, const std::vector<int> &fds);
+
+/**
+ * @brief Receive descriptors sent with send_sockets().
+ * @return The descriptors, close-on-exec, owned by the caller.
+ * @throws std::runtime_error if the peer closed or sent something else.
+ */
+std::vector<int> receive_sockets(int channel);
+
+} // namespace Socks
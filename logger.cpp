@@ -0,0 +1,188 @@
+#include "logger.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+
+namespace Socks {
+
+static LogLevel level_from_environment() {
+    const char *value = std::getenv("SOCKS_LOG_LEVEL");
+    if (value == nullptr) {
+        return LogLevel::Info;
+    }
+    std::string name(value);
+    std::transform(name.begin(), name.end(), name.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    if (name == "debug")
+        return LogLevel::Debug;
+    if (name == "info")
+        return LogLevel::Info;
+    if (name == "success")
+        return LogLevel::Success;
+    if (name == "warning" || name == "warn")
+        return LogLevel::Warning;
+    if (name == "error")
+        return LogLevel::Error;
+    if (name == "off" || name == "none")
+        return LogLevel::Off;
+    return LogLevel::Info;
+}
+
+namespace detail {
+std::atomic<int> log_threshold{static_cast<int>(level_from_environment())};
+} // namespace detail
+
+static std::mutex sink_mutex;
+static std::shared_ptr<LogSink> current_sink;
+
+void set_log_level(LogLevel level) {
+    detail::log_threshold.store(static_cast<int>(level),
+                                std::memory_order_relaxed);
+}
+
+LogLevel log_level() {
+    return static_cast<LogLevel>(
+        detail::log_threshold.load(std::memory_order_relaxed));
+}
+
+void set_log_sink(std::shared_ptr<LogSink> sink) {
+    std::lock_guard<std::mutex> lock(sink_mutex);
+    current_sink = std::move(sink);
+}
+
+void log_write(LogLevel level, const std::string &message) {
+    std::shared_ptr<LogSink> sink;
+    {
+        std::lock_guard<std::mutex> lock(sink_mutex);
+        if (!current_sink) {
+            current_sink = std::make_shared<ConsoleSink>();
+        }
+        sink = current_sink;
+    }
+    sink->write(level, message);
+}
+
+// ==========================
+// ConsoleSink
+// ==========================
+
+void ConsoleSink::write(LogLevel level, const std::string &message) {
+    const char *tag = "";
+    switch (level) {
+    case LogLevel::Debug:
+        tag = "\033[1;36mDEBUG\033[0m "; // cyan
+        break;
+    case LogLevel::Info:
+        tag = "\033[1;34mINFO\033[0m "; // blue
+        break;
+    case LogLevel::Success:
+        tag = "\033[1;32mSUCCESS\033[0m "; // green
+        break;
+    case LogLevel::Warning:
+        tag = "\033[1;33mWARNING\033[0m "; // yellow
+        break;
+    case LogLevel::Error:
+    case LogLevel::Off:
+        tag = "\033[1;31mERROR\033[0m "; // red
+        break;
+    }
+
+    // One fwrite per line keeps concurrent messages from interleaving.
+    std::string line = tag;
+    line += message;
+    line += '\n';
+    std::FILE *stream = level >= LogLevel::Error ? stderr : stdout;
+    std::fwrite(line.data(), 1, line.size(), stream);
+}
+
+void ConsoleSink::flush() {
+    std::fflush(stdout);
+    std::fflush(stderr);
+}
+
+// ==========================
+// AsyncLogSink
+// ==========================
+
+AsyncLogSink::AsyncLogSink(std::shared_ptr<LogSink> target, size_t capacity)
+    : target_(std::move(target)), ring_(std::max<size_t>(capacity, 1)) {
+    thread_ = std::thread([this] { drain(); });
+}
+
+AsyncLogSink::~AsyncLogSink() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    ready_.notify_one();
+    thread_.join();
+}
+
+void AsyncLogSink::write(LogLevel level, const std::string &message) {
+    bool was_empty;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (size_ == ring_.size()) {
+            ++dropped_;
+            dropped_total_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        Record &slot = ring_[(head_ + size_) % ring_.size()];
+        slot.level = level;
+        slot.message = message;
+        was_empty = size_++ == 0;
+        ++accepted_;
+    }
+    if (was_empty) {
+        ready_.notify_one();
+    }
+}
+
+void AsyncLogSink::flush() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    std::uint64_t target = accepted_;
+    flushed_.wait(lock, [this, target] { return delivered_ >= target; });
+}
+
+void AsyncLogSink::drain() {
+    std::vector<Record> batch;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        ready_.wait(lock, [this] { return stop_ || size_ > 0; });
+        if (size_ == 0 && stop_) {
+            break;
+        }
+
+        // Swap records out so their string buffers are reused by the next
+        // writers instead of being freed here.
+        batch.resize(size_);
+        for (auto &record : batch) {
+            std::swap(record, ring_[head_]);
+            head_ = (head_ + 1) % ring_.size();
+        }
+        size_ = 0;
+        size_t dropped = dropped_;
+        dropped_ = 0;
+        lock.unlock();
+
+        for (const auto &record : batch) {
+            target_->write(record.level, record.message);
+        }
+        if (dropped > 0) {
+            target_->write(LogLevel::Warning,
+                           "[Logger] Dropped " + std::to_string(dropped) +
+                               " messages (ring buffer full)");
+        }
+        target_->flush();
+
+        lock.lock();
+        delivered_ += batch.size();
+        flushed_.notify_all();
+    }
+    lock.unlock();
+    target_->flush();
+}
+
+} // namespace Socks
@@ -0,0 +1,212 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @file logger.hpp
+ * @brief Level-filtered logging with pluggable sinks.
+ *
+ * Messages below the current level are discarded before any formatting
+ * takes place: `log_debug("x = ", x)` costs one relaxed atomic load when
+ * debug logging is off. The initial level is read from the
+ * `SOCKS_LOG_LEVEL` environment variable (`debug`, `info`, `success`,
+ * `warning`, `error` or `off`) and defaults to `info`, which keeps
+ * per-request messages (logged at debug) out of production output.
+ *
+ * Output goes to a LogSink, by default a ConsoleSink. Wrapping a sink in an
+ * AsyncLogSink moves the write itself onto a background thread.
+ */
+
+namespace Socks {
+
+/**
+ * @brief Message severity, in increasing order.
+ */
+enum class LogLevel : int {
+    Debug,
+    Info,
+    Success,
+    Warning,
+    Error,
+    Off, ///< Only meaningful as a threshold: disables all output
+};
+
+/**
+ * @class LogSink
+ * @brief Destination for formatted log messages.
+ *
+ * write() may be called from several threads at once.
+ */
+class LogSink {
+  public:
+    virtual ~LogSink() = default;
+
+    /**
+     * @brief Emit one message.
+     * @param level Severity of the message.
+     * @param message Formatted message text, without a trailing newline.
+     */
+    virtual void write(LogLevel level, const std::string &message) = 0;
+
+    /**
+     * @brief Push buffered output to its destination.
+     */
+    virtual void flush() {}
+};
+
+/**
+ * @class ConsoleSink
+ * @brief Writes colored, level-tagged lines to stdout (errors to stderr).
+ */
+class ConsoleSink : public LogSink {
+  public:
+    void write(LogLevel level, const std::string &message) override;
+    void flush() override;
+};
+
+/**
+ * @class AsyncLogSink
+ * @brief Queues messages in a bounded ring buffer drained by a background
+ * thread into another sink.
+ *
+ * Logging threads only take a short lock to move the message into the
+ * ring. When the ring is full new messages are dropped rather than
+ * blocking the caller; the number dropped is reported through the target
+ * sink once there is room again.
+ */
+class AsyncLogSink : public LogSink {
+  public:
+    /**
+     * @brief Start the drain thread.
+     * @param target Sink that receives the messages.
+     * @param capacity Maximum number of queued messages.
+     */
+    explicit AsyncLogSink(std::shared_ptr<LogSink> target,
+                          size_t capacity = 4096);
+
+    /**
+     * @brief Drain the remaining messages and stop the thread.
+     */
+    ~AsyncLogSink() override;
+
+    AsyncLogSink(const AsyncLogSink &) = delete;
+    AsyncLogSink &operator=(const AsyncLogSink &) = delete;
+
+    void write(LogLevel level, const std::string &message) override;
+
+    /**
+     * @brief Block until everything queued so far has reached the target.
+     */
+    void flush() override;
+
+    /**
+     * @brief Total number of messages dropped because the ring was full.
+     */
+    size_t dropped() const { return dropped_total_.load(); }
+
+  private:
+    struct Record {
+        LogLevel level = LogLevel::Info;
+        std::string message;
+    };
+
+    void drain();
+
+    std::shared_ptr<LogSink> target_;
+    std::vector<Record> ring_; ///< Fixed capacity, indexed modulo size
+    size_t head_ = 0;
+    size_t size_ = 0;
+    size_t dropped_ = 0;              ///< Dropped since the last report
+    std::uint64_t accepted_ = 0;      ///< Records accepted into the ring
+    std::uint64_t delivered_ = 0;     ///< Records handed to the target
+    std::atomic<size_t> dropped_total_ = 0;
+    bool stop_ = false;
+
+    std::mutex mutex_;                ///< Protects everything above
+    std::condition_variable ready_;   ///< Signals the drain thread
+    std::condition_variable flushed_; ///< Signals flush() waiters
+    std::thread thread_;
+};
+
+/**
+ * @brief Set the minimum level that is emitted.
+ */
+void set_log_level(LogLevel level);
+
+/**
+ * @brief Current minimum level.
+ */
+LogLevel log_level();
+
+/**
+ * @brief Replace the sink that receives all messages.
+ * @param sink New sink; nullptr restores the default ConsoleSink.
+ */
+void set_log_sink(std::shared_ptr<LogSink> sink);
+
+/**
+ * @brief Send an already formatted message to the sink, bypassing the
+ * level check.
+ */
+void log_write(LogLevel level, const std::string &message);
+
+namespace detail {
+
+extern std::atomic<int> log_threshold; ///< Defined in logger.cpp
+
+template <typename... Args> std::string log_format(const Args &...args) {
+    std::ostringstream out;
+    (out << ... << args);
+    return out.str();
+}
+
+} // namespace detail
+
+/**
+ * @brief Whether messages at the given level are currently emitted.
+ */
+inline bool log_enabled(LogLevel level) {
+    return static_cast<int>(level) >=
+           detail::log_threshold.load(std::memory_order_relaxed);
+}
+
+/**
+ * @brief Log the concatenation of the arguments at the given level.
+ *
+ * Arguments are streamed with operator<< only if the level is enabled.
+ */
+template <typename... Args> void log_at(LogLevel level, const Args &...args) {
+    if (log_enabled(level)) {
+        log_write(level, detail::log_format(args...));
+    }
+}
+
+template <typename... Args> void log_debug(const Args &...args) {
+    log_at(LogLevel::Debug, args...);
+}
+
+template <typename... Args> void log_info(const Args &...args) {
+    log_at(LogLevel::Info, args...);
+}
+
+template <typename... Args> void log_success(const Args &...args) {
+    log_at(LogLevel::Success, args...);
+}
+
+template <typename... Args> void log_warning(const Args &...args) {
+    log_at(LogLevel::Warning, args...);
+}
+
+template <typename... Args> void log_error(const Args &...args) {
+    log_at(LogLevel::Error, args...);
+}
+
+} // namespace Socks
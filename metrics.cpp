@@ -0,0 +1,328 @@
+#include "metrics.hpp"
+
+#include "threadpool.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+namespace Socks {
+
+namespace {
+
+/// Bits below the leading one that pick a sub-bucket: log2(kSubBuckets).
+constexpr unsigned kLinearBits = 3;
+constexpr unsigned kMaxExponent = 40;
+
+/// Shard of the calling thread: threads are numbered as they first record.
+std::size_t thread_shard() {
+    static std::atomic<std::size_t> next{0};
+    thread_local std::size_t shard =
+        next.fetch_add(1, std::memory_order_relaxed) %
+        CommandMetrics::kShards;
+    return shard;
+}
+
+void atomic_max(std::atomic<std::uint64_t> &target, std::uint64_t value) {
+    std::uint64_t seen = target.load(std::memory_order_relaxed);
+    while (seen < value && !target.compare_exchange_weak(
+                               seen, value, std::memory_order_relaxed)) {
+    }
+}
+
+json summary_of(const LatencyHistogram &histogram) {
+    auto us = [](double ns) { return std::round(ns / 10.0) / 100.0; };
+    return {{"count", histogram.count()},
+            {"mean", us(histogram.mean())},
+            {"p50", us(histogram.percentile(0.50))},
+            {"p90", us(histogram.percentile(0.90))},
+            {"p99", us(histogram.percentile(0.99))},
+            {"p999", us(histogram.percentile(0.999))},
+            {"max", us(histogram.max())}};
+}
+
+} // namespace
+
+const char *stage_name(Stage stage) {
+    switch (stage) {
+    case Stage::Queue:
+        return "queue";
+    case Stage::Parse:
+        return "parse";
+    case Stage::Handler:
+        return "handler";
+    case Stage::Send:
+        return "send";
+    case Stage::Total:
+        return "total";
+    }
+    return "unknown";
+}
+
+std::string prometheus_label(const std::string &value) {
+    std::string out;
+    for (char c : value) {
+        if (c == '\\' || c == '"') {
+            out += '\\';
+            out += c;
+        } else if (c == '\n') {
+            out += "\\n";
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+// ==========================
+// LatencyHistogram
+// ==========================
+
+std::size_t LatencyHistogram::bucket_of(std::uint64_t ns) noexcept {
+    if (ns < kSubBuckets)
+        return static_cast<std::size_t>(ns);
+    unsigned exponent = 63 - static_cast<unsigned>(__builtin_clzll(ns));
+    if (exponent >= kMaxExponent)
+        return kBuckets - 1;
+    std::size_t sub = (ns >> (exponent - kLinearBits)) & (kSubBuckets - 1);
+    return (exponent - kLinearBits + 1) * kSubBuckets + sub;
+}
+
+std::uint64_t LatencyHistogram::bucket_floor(std::size_t bucket) noexcept {
+    if (bucket < kSubBuckets)
+        return bucket;
+    unsigned exponent =
+        static_cast<unsigned>(bucket / kSubBuckets) + kLinearBits - 1;
+    std::uint64_t sub = bucket % kSubBuckets;
+    return (kSubBuckets + sub) << (exponent - kLinearBits);
+}
+
+void LatencyHistogram::record(std::uint64_t ns) noexcept {
+    ++counts_[bucket_of(ns)];
+    ++count_;
+    sum_ += ns;
+    max_ = std::max(max_, ns);
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other) noexcept {
+    for (std::size_t i = 0; i < kBuckets; ++i)
+        counts_[i] += other.counts_[i];
+    count_ += other.count_;
+    sum_ += other.sum_;
+    max_ = std::max(max_, other.max_);
+}
+
+double LatencyHistogram::mean() const noexcept {
+    return count_ ? static_cast<double>(sum_) / count_ : 0.0;
+}
+
+std::uint64_t LatencyHistogram::percentile(double q) const noexcept {
+    if (count_ == 0)
+        return 0;
+    auto rank = static_cast<std::uint64_t>(std::ceil(q * count_));
+    rank = std::clamp<std::uint64_t>(rank, 1, count_);
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i + 1 < kBuckets; ++i) {
+        seen += counts_[i];
+        if (seen >= rank)
+            return std::min(bucket_floor(i + 1) - 1, max_);
+    }
+    return max_;
+}
+
+std::uint64_t LatencyHistogram::count_below(std::uint64_t ns) const noexcept {
+    std::uint64_t below = 0;
+    for (std::size_t i = 0; i + 1 < kBuckets && bucket_floor(i + 1) <= ns;
+         ++i)
+        below += counts_[i];
+    return below;
+}
+
+// ==========================
+// CommandMetrics
+// ==========================
+
+CommandMetrics::~CommandMetrics() {
+    for (auto &shard : shards_)
+        delete shard.load();
+}
+
+CommandMetrics::Shard &CommandMetrics::shard() {
+    std::atomic<Shard *> &slot = shards_[thread_shard()];
+    Shard *shard = slot.load(std::memory_order_acquire);
+    if (shard)
+        return *shard;
+    // Two threads of the same shard may race to create it; one wins.
+    auto *created = new Shard();
+    if (slot.compare_exchange_strong(shard, created,
+                                     std::memory_order_acq_rel)) {
+        return *created;
+    }
+    delete created;
+    return *shard;
+}
+
+void CommandMetrics::record(const RequestTiming &timing) {
+    Shard &shard = this->shard();
+    shard.requests.fetch_add(1, std::memory_order_relaxed);
+    if (!timing.ok)
+        shard.errors.fetch_add(1, std::memory_order_relaxed);
+    for (std::size_t stage = 0; stage < kStageCount; ++stage) {
+        if (timing.ns[stage] < 0)
+            continue;
+        auto ns = static_cast<std::uint64_t>(timing.ns[stage]);
+        AtomicHistogram &histogram = shard.stages[stage];
+        histogram.counts[LatencyHistogram::bucket_of(ns)].fetch_add(
+            1, std::memory_order_relaxed);
+        histogram.sum.fetch_add(ns, std::memory_order_relaxed);
+        atomic_max(histogram.max, ns);
+    }
+}
+
+CommandStats CommandMetrics::snapshot() const {
+    CommandStats stats;
+    for (const auto &slot : shards_) {
+        const Shard *shard = slot.load(std::memory_order_acquire);
+        if (!shard)
+            continue;
+        stats.requests += shard->requests.load(std::memory_order_relaxed);
+        stats.errors += shard->errors.load(std::memory_order_relaxed);
+        for (std::size_t stage = 0; stage < kStageCount; ++stage) {
+            const AtomicHistogram &from = shard->stages[stage];
+            LatencyHistogram &to = stats.stages[stage];
+            for (std::size_t i = 0; i < LatencyHistogram::kBuckets; ++i) {
+                auto n = from.counts[i].load(std::memory_order_relaxed);
+                to.counts_[i] += n;
+                to.count_ += n;
+            }
+            to.sum_ += from.sum.load(std::memory_order_relaxed);
+            to.max_ =
+                std::max(to.max_, from.max.load(std::memory_order_relaxed));
+        }
+    }
+    return stats;
+}
+
+// ==========================
+// Metrics
+// ==========================
+
+std::shared_ptr<CommandMetrics> Metrics::command(const std::string &name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto &metrics = commands_[name];
+    if (!metrics)
+        metrics = std::make_shared<CommandMetrics>();
+    return metrics;
+}
+
+std::map<std::string, CommandStats> Metrics::snapshot() const {
+    std::map<std::string, std::shared_ptr<CommandMetrics>> commands;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        commands = commands_;
+    }
+    std::map<std::string, CommandStats> stats;
+    for (const auto &[name, metrics] : commands)
+        stats.emplace(name, metrics->snapshot());
+    return stats;
+}
+
+json Metrics::to_json(const ThreadPool *pool) const {
+    json commands = json::object();
+    for (const auto &[name, stats] : snapshot()) {
+        json latency = json::object();
+        for (std::size_t stage = 0; stage < kStageCount; ++stage) {
+            if (stats.stages[stage].count() > 0)
+                latency[stage_name(static_cast<Stage>(stage))] =
+                    summary_of(stats.stages[stage]);
+        }
+        commands[name] = {{"requests", stats.requests},
+                          {"errors", stats.errors},
+                          {"latency_us", std::move(latency)}};
+    }
+
+    json result = {{"commands", std::move(commands)},
+                   {"unknown_commands", unknown_.load()},
+                   {"shed_requests", shed_.load()},
+                   {"expired_requests", expired_.load()}};
+    if (pool) {
+        result["pool"] = {{"workers", pool->size()},
+                          {"queued", pool->queued()},
+                          {"active", pool->active()}};
+    }
+    return result;
+}
+
+std::string Metrics::to_prometheus(const ThreadPool *pool) const {
+    auto stats = snapshot();
+    std::ostringstream out;
+    out.precision(12);
+
+    out << "# HELP socks_requests_total Requests handled, by command.\n"
+        << "# TYPE socks_requests_total counter\n";
+    for (const auto &[name, command] : stats) {
+        out << "socks_requests_total{command=\"" << prometheus_label(name)
+            << "\"} " << command.requests << '\n';
+    }
+    out << "# HELP socks_request_errors_total Requests answered with "
+           "_success false, by command.\n"
+        << "# TYPE socks_request_errors_total counter\n";
+    for (const auto &[name, command] : stats) {
+        out << "socks_request_errors_total{command=\"" << prometheus_label(name)
+            << "\"} " << command.errors << '\n';
+    }
+    out << "# HELP socks_unknown_commands_total Requests for commands that "
+           "are not registered.\n"
+        << "# TYPE socks_unknown_commands_total counter\n"
+        << "socks_unknown_commands_total " << unknown_.load() << '\n'
+        << "# HELP socks_shed_requests_total Requests turned away because "
+           "the queue was full.\n"
+        << "# TYPE socks_shed_requests_total counter\n"
+        << "socks_shed_requests_total " << shed_.load() << '\n'
+        << "# HELP socks_expired_requests_total Requests skipped because "
+           "their deadline passed.\n"
+        << "# TYPE socks_expired_requests_total counter\n"
+        << "socks_expired_requests_total " << expired_.load() << '\n';
+
+    out << "# HELP socks_request_duration_seconds Time spent per request, "
+           "by command and stage.\n"
+        << "# TYPE socks_request_duration_seconds histogram\n";
+    for (const auto &[name, command] : stats) {
+        for (std::size_t stage = 0; stage < kStageCount; ++stage) {
+            const LatencyHistogram &histogram = command.stages[stage];
+            if (histogram.count() == 0)
+                continue;
+            std::string labels = "command=\"" + prometheus_label(name) +
+                                 "\",stage=\"" +
+                                 stage_name(static_cast<Stage>(stage)) + '"';
+            // Powers of two are bucket edges, so these counts are exact.
+            for (unsigned bits = 10; bits <= 34; bits += 2) {
+                std::uint64_t edge = std::uint64_t(1) << bits;
+                out << "socks_request_duration_seconds_bucket{" << labels
+                    << ",le=\"" << edge / 1e9 << "\"} "
+                    << histogram.count_below(edge) << '\n';
+            }
+            out << "socks_request_duration_seconds_bucket{" << labels
+                << ",le=\"+Inf\"} " << histogram.count() << '\n'
+                << "socks_request_duration_seconds_sum{" << labels << "} "
+                << histogram.sum() / 1e9 << '\n'
+                << "socks_request_duration_seconds_count{" << labels << "} "
+                << histogram.count() << '\n';
+        }
+    }
+
+    if (pool) {
+        out << "# HELP socks_pool_workers Worker threads in the pool.\n"
+            << "# TYPE socks_pool_workers gauge\n"
+            << "socks_pool_workers " << pool->size() << '\n'
+            << "# HELP socks_pool_queued_tasks Tasks waiting for a worker.\n"
+            << "# TYPE socks_pool_queued_tasks gauge\n"
+            << "socks_pool_queued_tasks " << pool->queued() << '\n'
+            << "# HELP socks_pool_active_workers Workers running a task.\n"
+            << "# TYPE socks_pool_active_workers gauge\n"
+            << "socks_pool_active_workers " << pool->active() << '\n';
+    }
+    return out.str();
+}
+
+} // namespace Socks
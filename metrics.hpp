@@ -0,0 +1,263 @@
+#pragma once
+
+#include "nlohmann/json.hpp"
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+/**
+ * @file metrics.hpp
+ * @brief Per-command request counters and latency histograms.
+ *
+ * Every request the server routes to a command is timed stage by stage (see
+ * Stage) and recorded in that command's CommandMetrics. Recording touches
+ * only one shard, picked by the calling thread, with relaxed atomic
+ * increments: no lock and no allocation once the thread's shard exists.
+ * Reading merges the shards into plain CommandStats.
+ *
+ * The server exposes everything through the reserved `_stats` command and
+ * as Prometheus text (see Server::stats() and Server::metrics_text()).
+ */
+
+namespace Socks {
+
+using json = nlohmann::json;
+
+class ThreadPool;
+
+/**
+ * @brief The stages a request is timed in.
+ */
+enum class Stage {
+    Queue,   ///< Received, waiting for a worker
+    Parse,   ///< Decoding the request
+    Handler, ///< Running the handler, including schema validation
+    Send,    ///< Encoding and sending the response
+    Total,   ///< Received to sent
+};
+
+/// Number of Stage values.
+constexpr std::size_t kStageCount = 5;
+
+/**
+ * @brief Lower-case name of a stage ("queue", "parse", ...).
+ */
+const char *stage_name(Stage stage);
+
+/**
+ * @brief A Prometheus label value, with backslash, quote and newline
+ * escaped.
+ */
+std::string prometheus_label(const std::string &value);
+
+/**
+ * @class LatencyHistogram
+ * @brief Log-linear histogram of durations in nanoseconds.
+ *
+ * Like an HDR histogram: every power of two is split into eight equal
+ * buckets, so a recorded value is known to within 12.5% whatever its
+ * magnitude. Durations of 2^40 ns (about 18 minutes) or more share the last
+ * bucket.
+ */
+class LatencyHistogram {
+  public:
+    /// Buckets per power of two.
+    static constexpr std::size_t kSubBuckets = 8;
+    /// Number of buckets.
+    static constexpr std::size_t kBuckets = 38 * kSubBuckets;
+
+    /**
+     * @brief The bucket a duration falls into.
+     */
+    static std::size_t bucket_of(std::uint64_t ns) noexcept;
+
+    /**
+     * @brief Smallest duration counted in `bucket`.
+     */
+    static std::uint64_t bucket_floor(std::size_t bucket) noexcept;
+
+    void record(std::uint64_t ns) noexcept;
+
+    /**
+     * @brief Add another histogram's counts to this one.
+     */
+    void merge(const LatencyHistogram &other) noexcept;
+
+    std::uint64_t count() const noexcept { return count_; }
+    std::uint64_t sum() const noexcept { return sum_; }
+    std::uint64_t max() const noexcept { return max_; }
+    std::uint64_t bucket_count(std::size_t bucket) const noexcept {
+        return counts_[bucket];
+    }
+
+    /**
+     * @brief Mean duration, or 0 if empty.
+     */
+    double mean() const noexcept;
+
+    /**
+     * @brief Duration below which a fraction `q` (0 to 1) of the samples
+     * fall; the upper edge of the bucket holding that sample, capped at
+     * max(). 0 if empty.
+     */
+    std::uint64_t percentile(double q) const noexcept;
+
+    /**
+     * @brief Samples shorter than `ns`. Exact when `ns` is a power of two.
+     */
+    std::uint64_t count_below(std::uint64_t ns) const noexcept;
+
+  private:
+    friend class CommandMetrics;
+
+    std::array<std::uint64_t, kBuckets> counts_{};
+    std::uint64_t count_ = 0;
+    std::uint64_t sum_ = 0;
+    std::uint64_t max_ = 0;
+};
+
+/**
+ * @brief How long one request spent in each stage.
+ */
+struct RequestTiming {
+    /// Nanoseconds per Stage; negative for a stage that did not run.
+    std::array<std::int64_t, kStageCount> ns;
+    bool ok = true; ///< The response reported `_success`
+
+    RequestTiming() { ns.fill(-1); }
+
+    std::int64_t &operator[](Stage stage) {
+        return ns[static_cast<std::size_t>(stage)];
+    }
+};
+
+/**
+ * @brief A command's metrics, merged over all shards.
+ */
+struct CommandStats {
+    std::uint64_t requests = 0;
+    std::uint64_t errors = 0; ///< Responses with `_success: false`
+    std::array<LatencyHistogram, kStageCount> stages;
+
+    const LatencyHistogram &operator[](Stage stage) const {
+        return stages[static_cast<std::size_t>(stage)];
+    }
+};
+
+/**
+ * @class CommandMetrics
+ * @brief Sharded counters and histograms for one command.
+ *
+ * Threads are spread over kShards shards, each allocated the first time a
+ * thread using it records, and written with relaxed atomics. Threads that
+ * share a shard therefore never lose a count, and threads that do not share
+ * one never contend.
+ */
+class CommandMetrics {
+  public:
+    /// Shards per command.
+    static constexpr std::size_t kShards = 16;
+
+    CommandMetrics() = default;
+    ~CommandMetrics();
+
+    CommandMetrics(const CommandMetrics &) = delete;
+    CommandMetrics &operator=(const CommandMetrics &) = delete;
+
+    /**
+     * @brief Count one request and its timings.
+     */
+    void record(const RequestTiming &timing);
+
+    /**
+     * @brief Merge the shards.
+     */
+    CommandStats snapshot() const;
+
+  private:
+    struct AtomicHistogram {
+        std::array<std::atomic<std::uint64_t>, LatencyHistogram::kBuckets>
+            counts{};
+        std::atomic<std::uint64_t> sum{0};
+        std::atomic<std::uint64_t> max{0};
+    };
+
+    struct alignas(64) Shard {
+        std::atomic<std::uint64_t> requests{0};
+        std::atomic<std::uint64_t> errors{0};
+        std::array<AtomicHistogram, kStageCount> stages;
+    };
+
+    /// The calling thread's shard, allocated on first use.
+    Shard &shard();
+
+    std::array<std::atomic<Shard *>, kShards> shards_{};
+};
+
+/**
+ * @class Metrics
+ * @brief The metrics of a server: one CommandMetrics per command name.
+ */
+class Metrics {
+  public:
+    /**
+     * @brief The metrics of `name`, created on first use. The same name
+     * always gets the same object, so re-registering a command keeps its
+     * history.
+     */
+    std::shared_ptr<CommandMetrics> command(const std::string &name);
+
+    /**
+     * @brief Requests for commands that are not registered.
+     */
+    void count_unknown() noexcept {
+        unknown_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Requests turned away because the queue was full.
+     */
+    void count_shed() noexcept {
+        shed_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Requests skipped because their deadline passed in the queue.
+     */
+    void count_expired() noexcept {
+        expired_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Everything as JSON: per-command counters and latency summaries
+     * in microseconds, plus `pool` gauges if `pool` is given.
+     */
+    json to_json(const ThreadPool *pool = nullptr) const;
+
+    /**
+     * @brief Everything in the Prometheus text exposition format.
+     *
+     * Latencies are exported as `socks_request_duration_seconds` histograms
+     * labelled by command and stage, with buckets at powers of four
+     * nanoseconds from about 1 µs to 17 s.
+     */
+    std::string to_prometheus(const ThreadPool *pool = nullptr) const;
+
+  private:
+    /// A snapshot of every command, by name.
+    std::map<std::string, CommandStats> snapshot() const;
+
+    mutable std::mutex mutex_; ///< Protects commands_
+    std::map<std::string, std::shared_ptr<CommandMetrics>> commands_;
+    std::atomic<std::uint64_t> unknown_{0};
+    std::atomic<std::uint64_t> shed_{0};
+    std::atomic<std::uint64_t> expired_{0};
+};
+
+} // namespace Socks
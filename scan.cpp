@@ -0,0 +1,531 @@
+#include "scan.hpp"
+
+#include "codec.hpp"
+
+#include <cstdint>
+#include <cstring>
+
+namespace Socks {
+
+namespace {
+
+/// Deepest nesting the binary skippers follow before giving up.
+constexpr int kMaxScanDepth = 128;
+
+/// Read position in a message; every read is bounds-checked.
+struct Cursor {
+    const char *p;
+    const char *end;
+
+    std::size_t left() const { return static_cast<std::size_t>(end - p); }
+
+    bool read_byte(std::uint8_t &out) {
+        if (p == end)
+            return false;
+        out = static_cast<std::uint8_t>(*p++);
+        return true;
+    }
+
+    /// Read an n-byte big-endian unsigned integer (n <= 8).
+    bool read_be(std::size_t n, std::uint64_t &out) {
+        if (left() < n)
+            return false;
+        out = 0;
+        for (std::size_t i = 0; i < n; ++i)
+            out = (out << 8) | static_cast<std::uint8_t>(p[i]);
+        p += n;
+        return true;
+    }
+
+    bool skip(std::uint64_t n) {
+        if (left() < n)
+            return false;
+        p += n;
+        return true;
+    }
+
+    bool take(std::uint64_t n, std::string_view &out) {
+        if (left() < n)
+            return false;
+        out = std::string_view(p, static_cast<std::size_t>(n));
+        p += n;
+        return true;
+    }
+};
+
+// ==========================
+// JSON text
+// ==========================
+
+bool is_json_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+void skip_json_space(Cursor &in) {
+    while (in.p != in.end && is_json_space(*in.p))
+        ++in.p;
+}
+
+/// Read a string starting at its opening quote; `escaped` reports whether
+/// it contains any backslash.
+bool read_json_string(Cursor &in, std::string_view &out, bool &escaped) {
+    if (in.p == in.end || *in.p != '"')
+        return false;
+    const char *begin = ++in.p;
+    while (in.p != in.end) {
+        const char *hit = static_cast<const char *>(
+            std::memchr(in.p, '"', in.left()));
+        if (!hit)
+            return false;
+        // The quote closes the string unless preceded by an odd number of
+        // backslashes.
+        const char *back = hit;
+        while (back > begin && back[-1] == '\\')
+            --back;
+        in.p = hit + 1;
+        if ((hit - back) % 2 == 0) {
+            out = std::string_view(begin, hit - begin);
+            escaped = out.find('\\') != std::string_view::npos;
+            return true;
+        }
+    }
+    return false;
+}
+
+/// Skip one value: a string, an object or array (by bracket depth), or a
+/// literal or number (up to the next delimiter).
+bool skip_json_value(Cursor &in) {
+    if (in.p == in.end)
+        return false;
+    std::string_view ignored;
+    bool escaped;
+    if (*in.p == '"')
+        return read_json_string(in, ignored, escaped);
+    if (*in.p == '{' || *in.p == '[') {
+        int depth = 0;
+        while (in.p != in.end) {
+            char c = *in.p;
+            if (c == '"') {
+                if (!read_json_string(in, ignored, escaped))
+                    return false;
+                continue;
+            }
+            ++in.p;
+            if (c == '{' || c == '[') {
+                ++depth;
+            } else if (c == '}' || c == ']') {
+                if (--depth == 0)
+                    return true;
+            }
+        }
+        return false;
+    }
+    const char *start = in.p;
+    while (in.p != in.end && *in.p != ',' && *in.p != '}' && *in.p != ']' &&
+           !is_json_space(*in.p))
+        ++in.p;
+    return in.p != start;
+}
+
+/// Read a string without escapes, or a plain non-negative integer.
+std::optional<ScannedField> read_json_field(Cursor &in) {
+    ScannedField field;
+    bool escaped;
+    if (in.p != in.end && *in.p == '"') {
+        if (!read_json_string(in, field.text, escaped) || escaped)
+            return std::nullopt;
+        return field;
+    }
+    const char *start = in.p;
+    std::uint64_t number = 0;
+    while (in.p != in.end && *in.p >= '0' && *in.p <= '9') {
+        unsigned digit = static_cast<unsigned>(*in.p++ - '0');
+        if (number > (UINT64_MAX - digit) / 10)
+            return std::nullopt;
+        number = number * 10 + digit;
+    }
+    std::size_t digits = static_cast<std::size_t>(in.p - start);
+    // Fractions, exponents and leading zeros are left to the parser.
+    if (digits == 0 || (digits > 1 && *start == '0'))
+        return std::nullopt;
+    if (in.p != in.end && *in.p != ',' && *in.p != '}' &&
+        !is_json_space(*in.p))
+        return std::nullopt;
+    field.kind = ScannedField::Kind::Unsigned;
+    field.number = number;
+    return field;
+}
+
+std::optional<ScannedField> scan_json(Cursor in, std::string_view key) {
+    skip_json_space(in);
+    if (in.p == in.end || *in.p++ != '{')
+        return std::nullopt;
+    skip_json_space(in);
+    if (in.p != in.end && *in.p == '}')
+        return std::nullopt;
+
+    std::optional<ScannedField> found;
+    while (true) {
+        std::string_view name;
+        bool escaped;
+        skip_json_space(in);
+        if (!read_json_string(in, name, escaped))
+            return std::nullopt;
+        // An escaped key might spell `key`; only a full parse can tell.
+        if (escaped)
+            return std::nullopt;
+        skip_json_space(in);
+        if (in.p == in.end || *in.p++ != ':')
+            return std::nullopt;
+        skip_json_space(in);
+
+        if (name == key) {
+            if (found) // repeated: the parser keeps the last value
+                return std::nullopt;
+            found = read_json_field(in);
+            if (!found)
+                return std::nullopt;
+        } else if (!skip_json_value(in)) {
+            return std::nullopt;
+        }
+        skip_json_space(in);
+        if (in.p == in.end)
+            return std::nullopt;
+        char next = *in.p++;
+        if (next == '}')
+            return found;
+        if (next != ',')
+            return std::nullopt;
+    }
+}
+
+// ==========================
+// MessagePack
+// ==========================
+
+/// If the next item is a string, read it; `is_string` reports whether it
+/// was one (the cursor is unchanged if not).
+bool read_msgpack_string(Cursor &in, std::string_view &out,
+                         bool &is_string) {
+    Cursor start = in;
+    std::uint8_t b;
+    if (!in.read_byte(b))
+        return false;
+    std::uint64_t n;
+    is_string = true;
+    if ((b & 0xe0) == 0xa0) {
+        n = b & 0x1f;
+    } else if (b == 0xd9 || b == 0xda || b == 0xdb) {
+        if (!in.read_be(std::size_t(1) << (b - 0xd9), n))
+            return false;
+    } else {
+        is_string = false;
+        in = start;
+        return true;
+    }
+    return in.take(n, out);
+}
+
+bool skip_msgpack(Cursor &in, int depth) {
+    if (depth > kMaxScanDepth)
+        return false;
+    std::uint8_t b;
+    if (!in.read_byte(b))
+        return false;
+    std::uint64_t n = 0;
+
+    if (b <= 0x7f || b >= 0xe0)
+        return true; // positive / negative fixint
+    if ((b & 0xf0) == 0x80 || (b & 0xf0) == 0x90) {
+        n = (b & 0x0f) * ((b & 0xf0) == 0x80 ? 2 : 1);
+        for (std::uint64_t i = 0; i < n; ++i)
+            if (!skip_msgpack(in, depth + 1))
+                return false;
+        return true;
+    }
+    if ((b & 0xe0) == 0xa0)
+        return in.skip(b & 0x1f); // fixstr
+
+    switch (b) {
+    case 0xc0: // nil
+    case 0xc2: // false
+    case 0xc3: // true
+        return true;
+    case 0xc4: // bin 8/16/32
+    case 0xc5:
+    case 0xc6:
+        return in.read_be(std::size_t(1) << (b - 0xc4), n) && in.skip(n);
+    case 0xc7: // ext 8/16/32: length, type, data
+    case 0xc8:
+    case 0xc9:
+        return in.read_be(std::size_t(1) << (b - 0xc7), n) && in.skip(n + 1);
+    case 0xca: // float 32/64
+        return in.skip(4);
+    case 0xcb:
+        return in.skip(8);
+    case 0xcc: // uint 8..64
+    case 0xcd:
+    case 0xce:
+    case 0xcf:
+        return in.skip(std::size_t(1) << (b - 0xcc));
+    case 0xd0: // int 8..64
+    case 0xd1:
+    case 0xd2:
+    case 0xd3:
+        return in.skip(std::size_t(1) << (b - 0xd0));
+    case 0xd4: // fixext 1..16: type, data
+    case 0xd5:
+    case 0xd6:
+    case 0xd7:
+    case 0xd8:
+        return in.skip(1 + (std::size_t(1) << (b - 0xd4)));
+    case 0xd9: // str 8/16/32
+    case 0xda:
+    case 0xdb:
+        return in.read_be(std::size_t(1) << (b - 0xd9), n) && in.skip(n);
+    case 0xdc: // array 16/32
+    case 0xdd:
+    case 0xde: // map 16/32
+    case 0xdf: {
+        bool is_map = b >= 0xde;
+        std::size_t width = (b == 0xdc || b == 0xde) ? 2 : 4;
+        // Every item takes at least a byte; this also bounds the loop.
+        if (!in.read_be(width, n) || n > in.left())
+            return false;
+        if (is_map)
+            n *= 2;
+        for (std::uint64_t i = 0; i < n; ++i)
+            if (!skip_msgpack(in, depth + 1))
+                return false;
+        return true;
+    }
+    default: // 0xc1 is never used
+        return false;
+    }
+}
+
+/// Read a string or an unsigned integer.
+std::optional<ScannedField> read_msgpack_field(Cursor &in) {
+    ScannedField field;
+    bool is_string;
+    if (!read_msgpack_string(in, field.text, is_string))
+        return std::nullopt;
+    if (is_string)
+        return field;
+    std::uint8_t b;
+    if (!in.read_byte(b))
+        return std::nullopt;
+    if (b <= 0x7f) {
+        field.number = b;
+    } else if (b >= 0xcc && b <= 0xcf) {
+        if (!in.read_be(std::size_t(1) << (b - 0xcc), field.number))
+            return std::nullopt;
+    } else {
+        return std::nullopt;
+    }
+    field.kind = ScannedField::Kind::Unsigned;
+    return field;
+}
+
+std::optional<ScannedField> scan_msgpack(Cursor in, std::string_view key) {
+    std::uint8_t b;
+    if (!in.read_byte(b))
+        return std::nullopt;
+    std::uint64_t pairs;
+    if ((b & 0xf0) == 0x80) {
+        pairs = b & 0x0f;
+    } else if (b == 0xde || b == 0xdf) {
+        if (!in.read_be(b == 0xde ? 2 : 4, pairs))
+            return std::nullopt;
+    } else {
+        return std::nullopt;
+    }
+
+    std::optional<ScannedField> found;
+    for (std::uint64_t i = 0; i < pairs; ++i) {
+        std::string_view name;
+        bool is_string;
+        if (!read_msgpack_string(in, name, is_string))
+            return std::nullopt;
+        if (!is_string && !skip_msgpack(in, 1))
+            return std::nullopt;
+        if (is_string && name == key) {
+            if (found) // repeated: the parser keeps the last value
+                return std::nullopt;
+            found = read_msgpack_field(in);
+            if (!found)
+                return std::nullopt;
+        } else if (!skip_msgpack(in, 1)) {
+            return std::nullopt;
+        }
+    }
+    return found;
+}
+
+// ==========================
+// CBOR
+// ==========================
+
+constexpr std::uint8_t kCborBreak = 0xff;
+constexpr std::uint8_t kCborIndefinite = 31;
+
+/// Read an item head: major type, and its argument unless indefinite.
+bool read_cbor_head(Cursor &in, std::uint8_t &major, std::uint64_t &arg,
+                    bool &indefinite) {
+    std::uint8_t b;
+    if (!in.read_byte(b))
+        return false;
+    major = b >> 5;
+    std::uint8_t info = b & 0x1f;
+    indefinite = false;
+    if (info < 24) {
+        arg = info;
+        return true;
+    }
+    if (info <= 27)
+        return in.read_be(std::size_t(1) << (info - 24), arg);
+    if (info == kCborIndefinite && major >= 2 && major != 6) {
+        indefinite = true; // major 7 with info 31 is the break code
+        return true;
+    }
+    return false;
+}
+
+bool at_cbor_break(Cursor &in) {
+    if (in.p != in.end && static_cast<std::uint8_t>(*in.p) == kCborBreak) {
+        ++in.p;
+        return true;
+    }
+    return false;
+}
+
+bool skip_cbor(Cursor &in, int depth) {
+    if (depth > kMaxScanDepth)
+        return false;
+    std::uint8_t major;
+    std::uint64_t arg;
+    bool indefinite;
+    if (!read_cbor_head(in, major, arg, indefinite))
+        return false;
+
+    switch (major) {
+    case 0: // unsigned and negative integers
+    case 1:
+        return true;
+    case 2: // byte and text strings
+    case 3:
+        if (!indefinite)
+            return in.skip(arg);
+        while (!at_cbor_break(in))
+            if (!skip_cbor(in, depth + 1))
+                return false;
+        return true;
+    case 4: // arrays and maps
+    case 5: {
+        std::uint64_t per_entry = major == 5 ? 2 : 1;
+        if (indefinite) {
+            while (!at_cbor_break(in))
+                for (std::uint64_t i = 0; i < per_entry; ++i)
+                    if (!skip_cbor(in, depth + 1))
+                        return false;
+            return true;
+        }
+        if (arg > in.left())
+            return false; // every item takes at least a byte
+        for (std::uint64_t i = 0; i < arg * per_entry; ++i)
+            if (!skip_cbor(in, depth + 1))
+                return false;
+        return true;
+    }
+    case 6: // tag, followed by the tagged item
+        return skip_cbor(in, depth + 1);
+    default: // simple values and floats; the argument was their payload
+        return !indefinite;
+    }
+}
+
+std::optional<ScannedField> scan_cbor(Cursor in, std::string_view key) {
+    std::uint8_t major;
+    std::uint64_t pairs;
+    bool indefinite;
+    if (!read_cbor_head(in, major, pairs, indefinite) || major != 5)
+        return std::nullopt;
+
+    std::optional<ScannedField> found;
+    for (std::uint64_t i = 0; indefinite || i < pairs; ++i) {
+        if (indefinite && at_cbor_break(in))
+            return found;
+        // Only definite-length text keys can be compared in place; an
+        // indefinite-length one might spell `key`.
+        Cursor key_start = in;
+        std::uint8_t key_major;
+        std::uint64_t length;
+        bool key_indefinite;
+        if (!read_cbor_head(in, key_major, length, key_indefinite))
+            return std::nullopt;
+        std::string_view name;
+        if (key_major == 3 && key_indefinite)
+            return std::nullopt;
+        bool is_text = key_major == 3;
+        if (is_text) {
+            if (!in.take(length, name))
+                return std::nullopt;
+        } else {
+            in = key_start;
+            if (!skip_cbor(in, 1))
+                return std::nullopt;
+        }
+
+        if (is_text && name == key) {
+            if (found) // repeated: the parser keeps the last value
+                return std::nullopt;
+            ScannedField field;
+            std::uint8_t value_major;
+            bool value_indefinite;
+            if (!read_cbor_head(in, value_major, length, value_indefinite) ||
+                value_indefinite)
+                return std::nullopt;
+            if (value_major == 3) {
+                if (!in.take(length, field.text))
+                    return std::nullopt;
+            } else if (value_major == 0) {
+                field.kind = ScannedField::Kind::Unsigned;
+                field.number = length;
+            } else {
+                return std::nullopt;
+            }
+            found = field;
+        } else if (!skip_cbor(in, 1)) {
+            return std::nullopt;
+        }
+    }
+    return found;
+}
+
+} // namespace
+
+std::optional<ScannedField> scan_field(std::string_view message,
+                                       std::string_view key) {
+    Cursor in{message.data(), message.data() + message.size()};
+    switch (detect_codec(message)) {
+    case Codec::MessagePack:
+        ++in.p;
+        return scan_msgpack(in, key);
+    case Codec::Cbor:
+        ++in.p;
+        return scan_cbor(in, key);
+    case Codec::Json:
+        break;
+    }
+    return scan_json(in, key);
+}
+
+std::optional<std::string_view> scan_string_field(std::string_view message,
+                                                  std::string_view key) {
+    auto field = scan_field(message, key);
+    if (!field || field->kind != ScannedField::Kind::String)
+        return std::nullopt;
+    return field->text;
+}
+
+} // namespace Socks
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+/**
+ * @file scan.hpp
+ * @brief Read a top-level field of a message without parsing it.
+ *
+ * Building a json DOM costs an allocation per node. Routing a request only
+ * needs its `_cmd`, however, and rejecting an unknown command needs nothing
+ * else. scan_field() walks the encoded message (JSON text, MessagePack or
+ * CBOR, as detected by codec.hpp) and returns the requested string (as a
+ * view into the message) or unsigned integer. Other keys and their values,
+ * however deeply nested, are skipped over without being decoded.
+ *
+ * The scanner does not validate the message. It succeeds only when the
+ * answer is certain, and returns std::nullopt in every other case: the key
+ * is missing, repeated or possibly escaped, the value is of another type,
+ * or the message is malformed or truncated. Callers then fall back to a
+ * full parse, which reports the real problem.
+ */
+
+namespace Socks {
+
+/**
+ * @brief A top-level value found by scan_field().
+ */
+struct ScannedField {
+    enum class Kind {
+        String,   ///< `text` views the string's bytes in the message
+        Unsigned, ///< `number` holds a non-negative integer
+    };
+
+    Kind kind = Kind::String;
+    std::string_view text;
+    std::uint64_t number = 0;
+};
+
+/**
+ * @brief Find a top-level string or unsigned integer field in an encoded
+ * message.
+ *
+ * The rest of the object is scanned as well. If the key occurs more than
+ * once, std::nullopt is returned, and the caller's full parse picks the
+ * last occurrence as nlohmann::json does. JSON string values containing
+ * escape sequences are not returned, because the view could not be passed
+ * on unchanged, and neither are JSON numbers written with a fraction or
+ * exponent.
+ *
+ * @param message The message as received, including any codec marker.
+ * @param key The key to look for.
+ * @return The value, or std::nullopt.
+ */
+std::optional<ScannedField> scan_field(std::string_view message,
+                                       std::string_view key);
+
+/**
+ * @brief Find a top-level string field in an encoded message.
+ *
+ * Like scan_field(), but only for string values.
+ *
+ * @param message The message as received, including any codec marker.
+ * @param key The key to look for.
+ * @return A view into `message` holding the string value, or std::nullopt.
+ */
+std::optional<std::string_view> scan_string_field(std::string_view message,
+                                                  std::string_view key);
+
+/**
+ * @brief The request's `_cmd`: a command name, or a numeric command ID
+ * (see CommandTable).
+ */
+inline std::optional<ScannedField> scan_command(std::string_view message) {
+    return scan_field(message, "_cmd");
+}
+
+} // namespace Socks
@@ -1,5 +1,8 @@
 #include "schema.hpp"
 
+#include <algorithm>
+#include <stdexcept>
+
 namespace Socks {
 
 ParamSchema::ParamSchema(json::value_t type) : value(type) {}
@@ -44,26 +47,43 @@ static const char *value_t_to_string(json::value_t type) {
     }
 }
 
+static std::string type_list(const std::vector<json::value_t> &types) {
+    std::string list;
+    for (size_t i = 0; i < types.size(); ++i) {
+        if (i > 0)
+            list += ", ";
+        list += value_t_to_string(types[i]);
+    }
+    return list;
+}
+
+static std::uint32_t type_bit(json::value_t type) {
+    return 1u << static_cast<std::uint8_t>(type);
+}
+
+static std::string join_path(const std::string &path, const std::string &key) {
+    return path.empty() ? key : path + "." + key;
+}
+
 static void assert_parameters_impl(const json &obj,
                                    const ParamSchemaMap &schema,
                                    const std::string &path = "") {
     for (const auto &[key, schema_val] : schema) {
-        std::string full_path = path.empty() ? key : path + "." + key;
-
-        if (!obj.contains(key)) {
-            throw std::runtime_error("Missing key: " + full_path);
+        auto found = obj.find(key);
+        if (found == obj.end()) {
+            throw std::runtime_error("Missing key: " + join_path(path, key));
         }
 
-        const auto &json_val = obj.at(key);
+        const auto &json_val = *found;
 
         if (std::holds_alternative<json::value_t>(schema_val.value)) {
             json::value_t expected_type =
                 std::get<json::value_t>(schema_val.value);
             if (json_val.type() != expected_type) {
                 throw std::runtime_error(
-                    "Wrong type for key '" + full_path + "' (expected " +
-                    value_t_to_string(expected_type) + ", got " +
-                    value_t_to_string(json_val.type()) + ")");
+                    "Wrong type for key '" + join_path(path, key) +
+                    "' (expected " + value_t_to_string(expected_type) +
+                    ", got " + value_t_to_string(json_val.type()) + ")");
             }
         } else if (std::holds_alternative<std::vector<json::value_t>>(
                        schema_val.value)) {
@@ -77,26 +97,20 @@ static void assert_parameters_impl(const json &obj,
                 }
             }
             if (!match) {
-                std::string expected_list;
-                for (size_t i = 0; i < expected_types.size(); ++i) {
-                    if (i > 0)
-                        expected_list += ", ";
-                    expected_list += value_t_to_string(expected_types[i]);
-                }
                 throw std::runtime_error(
-                    "Wrong type for key '" + full_path +
-                    "' (expected one of [" + expected_list + "], got " +
-                    value_t_to_string(json_val.type()) + ")");
+                    "Wrong type for key '" + join_path(path, key) +
+                    "' (expected one of [" + type_list(expected_types) +
+                    "], got " + value_t_to_string(json_val.type()) + ")");
             }
         } else {
             if (!json_val.is_object()) {
                 throw std::runtime_error("Expected object at key: " +
-                                         full_path);
+                                         join_path(path, key));
             }
             const auto &nested = *std::get<
                 std::shared_ptr<std::unordered_map<std::string, ParamSchema>>>(
                 schema_val.value);
-            assert_parameters_impl(json_val, nested, full_path);
+            assert_parameters_impl(json_val, nested, join_path(path, key));
         }
     }
 }
@@ -108,4 +122,127 @@ void assert_parameters(const json &obj, const ParamSchemaMap &schema) {
     assert_parameters_impl(obj, schema);
 }
 
+// ==========================
+// CompiledSchema
+// ==========================
+
+/// Nesting depth handled without allocating during validation.
+constexpr std::uint32_t kInlineSchemaDepth = 16;
+
+CompiledSchema::CompiledSchema(const ParamSchemaMap &schema) {
+    compile(schema, 0, "");
+}
+
+CompiledSchema::CompiledSchema(
+    std::initializer_list<ParamSchemaMap::value_type> schema)
+    : CompiledSchema(ParamSchemaMap(schema)) {}
+
+void CompiledSchema::compile(const ParamSchemaMap &schema,
+                             std::uint32_t depth, const std::string &path) {
+    max_depth_ = std::max(max_depth_, depth);
+    for (const auto &[key, rule] : schema) {
+        Check check;
+        check.key = key;
+        check.depth = depth;
+        Detail detail;
+        detail.path = join_path(path, key);
+
+        const ParamSchemaMap *nested = nullptr;
+        if (auto *type = std::get_if<json::value_t>(&rule.value)) {
+            check.mask = type_bit(*type);
+            detail.types = {*type};
+            detail.single = true;
+        } else if (auto *types =
+                       std::get_if<std::vector<json::value_t>>(&rule.value)) {
+            for (auto t : *types)
+                check.mask |= type_bit(t);
+            detail.types = *types;
+        } else {
+            check.mask = type_bit(json::value_t::object);
+            check.nested = true;
+            nested = std::get<std::shared_ptr<ParamSchemaMap>>(rule.value)
+                         .get();
+        }
+
+        std::string child_path = detail.path;
+        checks_.push_back(std::move(check));
+        details_.push_back(std::move(detail));
+        if (nested) {
+            compile(*nested, depth + 1, child_path);
+        }
+    }
+}
+
+std::string CompiledSchema::describe(std::size_t index,
+                                     const json::value_t *found) const {
+    const Detail &detail = details_[index];
+    if (found == nullptr)
+        return "Missing key: " + detail.path;
+    if (checks_[index].nested)
+        return "Expected object at key: " + detail.path;
+    if (detail.single)
+        return "Wrong type for key '" + detail.path + "' (expected " +
+               value_t_to_string(detail.types.front()) + ", got " +
+               value_t_to_string(*found) + ")";
+    return "Wrong type for key '" + detail.path + "' (expected one of [" +
+           type_list(detail.types) + "], got " + value_t_to_string(*found) +
+           ")";
+}
+
+template <typename Json>
+bool CompiledSchema::validate_as(const Json &obj, std::string *error) const {
+    if (!obj.is_object()) {
+        if (error)
+            *error = "Top-level JSON must be an object.";
+        return false;
+    }
+
+    // parents[d] is the object that checks at depth d look their key up in.
+    // Checks are in depth-first order and a nested check precedes its
+    // children, so the slot is always filled before it is read.
+    const Json *inline_parents[kInlineSchemaDepth];
+    std::vector<const Json *> heap_parents;
+    const Json **parents = inline_parents;
+    if (max_depth_ >= kInlineSchemaDepth) {
+        heap_parents.resize(max_depth_ + 1);
+        parents = heap_parents.data();
+    }
+    parents[0] = &obj;
+
+    for (std::size_t i = 0; i < checks_.size(); ++i) {
+        const Check &check = checks_[i];
+        const Json &parent = *parents[check.depth];
+        auto found = parent.find(std::string_view(check.key));
+        if (found == parent.end()) {
+            if (error)
+                *error = describe(i, nullptr);
+            return false;
+        }
+        json::value_t type = found->type();
+        if ((check.mask & type_bit(type)) == 0) {
+            if (error)
+                *error = describe(i, &type);
+            return false;
+        }
+        if (check.nested)
+            parents[check.depth + 1] = &*found;
+    }
+    return true;
+}
+
+bool CompiledSchema::validate(const json &obj, std::string *error) const {
+    return validate_as(obj, error);
+}
+
+bool CompiledSchema::validate(const ArenaJson &obj, std::string *error) const {
+    return validate_as(obj, error);
+}
+
+void CompiledSchema::check(const json &obj) const {
+    std::string error;
+    if (!validate(obj, &error)) {
+        throw std::runtime_error(error);
+    }
+}
+
 } // namespace Socks
@@ -1,6 +1,9 @@
 #pragma once
 
+#include "arena.hpp"
 #include "nlohmann/json.hpp"
+#include <cstdint>
+#include <initializer_list>
 #include <string>
 #include <unordered_map>
 #include <variant>
@@ -83,6 +86,95 @@ using ParamSchemaMap = std::unordered_map<std::string, ParamSchema>;
  */
 void assert_parameters(const json &obj, const ParamSchemaMap &schema);
 
+/**
+ * @class CompiledSchema
+ * @brief A ParamSchemaMap flattened once into a list of checks.
+ *
+ * assert_parameters() walks the schema's hash maps on every call. A
+ * CompiledSchema is built once (typically at add_handler() time) into a
+ * flat vector of checks in depth-first order, each holding its key, depth
+ * and a bitmask of allowed types; validating a request is then one object
+ * lookup and one mask test per key. Paths and error messages are only
+ * assembled when a check fails, and the messages match assert_parameters().
+ *
+ * @code
+ * CompiledSchema schema{{"n", types({json::value_t::number_integer,
+ *                                    json::value_t::number_unsigned})}};
+ * schema.check(request); // throws std::runtime_error on mismatch
+ * @endcode
+ */
+class CompiledSchema {
+  public:
+    /**
+     * @brief An empty schema, accepting any object.
+     */
+    CompiledSchema() = default;
+
+    /**
+     * @brief Compile a schema.
+     * @param schema The expected structure and type rules.
+     */
+    CompiledSchema(const ParamSchemaMap &schema);
+
+    /**
+     * @brief Compile a schema written inline.
+     * @param schema Key-to-rule pairs, as for ParamSchemaMap.
+     */
+    CompiledSchema(std::initializer_list<ParamSchemaMap::value_type> schema);
+
+    /**
+     * @brief Validate without throwing.
+     * @param obj The JSON object to validate.
+     * @param[out] error If non-null, receives the reason on failure.
+     * @return true if the object conforms to the schema.
+     */
+    bool validate(const json &obj, std::string *error = nullptr) const;
+
+    /**
+     * @brief Validate an arena-backed request without copying it.
+     */
+    bool validate(const ArenaJson &obj, std::string *error = nullptr) const;
+
+    /**
+     * @brief Validate, throwing like assert_parameters().
+     * @param obj The JSON object to validate.
+     * @throws std::runtime_error on the first mismatch.
+     */
+    void check(const json &obj) const;
+
+    /**
+     * @brief Whether the schema has no checks.
+     */
+    bool empty() const { return checks_.empty(); }
+
+  private:
+    /// Hot data visited on every validation.
+    struct Check {
+        std::string key;
+        std::uint32_t depth = 0; ///< 0 for top-level keys
+        std::uint32_t mask = 0;  ///< Bit per allowed json::value_t
+        bool nested = false;     ///< Value must be an object; children follow
+    };
+
+    /// Cold data used only to describe a failure.
+    struct Detail {
+        std::string path;                  ///< Dotted path of the key
+        std::vector<json::value_t> types;  ///< Allowed types, in schema order
+        bool single = false;               ///< Declared as one type
+    };
+
+    void compile(const ParamSchemaMap &schema, std::uint32_t depth,
+                 const std::string &path);
+    template <typename Json>
+    bool validate_as(const Json &obj, std::string *error) const;
+    std::string describe(std::size_t index,
+                         const json::value_t *found) const;
+
+    std::vector<Check> checks_;
+    std::vector<Detail> details_;  ///< Parallel to checks_
+    std::uint32_t max_depth_ = 0;
+};
+
 /**
  * @brief Helper function to create a ParamSchema that accepts multiple JSON
  * types.
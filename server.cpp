@@ -1,115 +1,1344 @@
 #include "server.hpp"
-#include <iostream>
+#include "handoff.hpp"
 
-void log_success(const std::string &message) {
-    std::cout << "\033[1;32mSUCCESS\033[0m " << message << std::endl; // green
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <future>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+namespace Socks {
+
+namespace {
+
+/// Sent by the replacement process once it serves (see Server::hand_off()).
+constexpr char kTakeoverReady = 'R';
+
+/// Arena for requests handled on the calling thread.
+Arena &thread_arena() {
+    thread_local Arena arena;
+    return arena;
 }
 
-void log_info(const std::string &message) {
-    std::cout << "\033[1;34mINFO\033[0m " << message << std::endl; // blue
+template <typename Request> Request parse_request(std::string_view data) {
+    if constexpr (std::is_same_v<Request, ArenaJson>) {
+        return decode_arena(data);
+    } else {
+        return decode(data);
+    }
 }
 
-void log_warning(const std::string &message) {
-    std::cout << "\033[1;33mWARNING\033[0m " << message << std::endl; // yellow
+/// The request itself, or a json copy of an arena-backed one.
+const json &as_json(const json &request) { return request; }
+json as_json(const ArenaJson &request) { return json(request); }
+
+template <typename Json> std::string command_of(const Json &request) {
+    auto command = request.value("_cmd", "<no _cmd>");
+    return std::string(command.data(), command.size());
 }
 
-void log_error(const std::string &message) {
-    std::cerr << "\033[1;31mERROR\033[0m " << message << std::endl; // red
+/// Longest `_deadline_ms` honoured; larger budgets are clamped to it.
+constexpr std::uint64_t kMaxDeadlineMs = std::uint64_t(1) << 32;
+
+/// Monotonic time in nanoseconds, for request timings and deadlines.
+std::int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
 }
 
-namespace Socks {
+/// Deadline (now_ns() time) set by a request's `_deadline_ms`, counted from
+/// `received` (or now if negative); negative if it has none.
+std::int64_t request_deadline(std::string_view data, std::int64_t received) {
+    auto budget = scan_field(data, "_deadline_ms");
+    if (!budget || budget->kind != ScannedField::Kind::Unsigned)
+        return -1;
+    std::int64_t ms = static_cast<std::int64_t>(
+        std::min<std::uint64_t>(budget->number, kMaxDeadlineMs));
+    return (received >= 0 ? received : now_ns()) + ms * 1000000;
+}
+
+/// Deadline (now_ns() time) of the request this thread is handling, or
+/// negative; the `_batch` handler has no other way to learn it.
+thread_local std::int64_t handled_deadline = -1;
+
+template <typename Json> bool succeeded(const Json &response) {
+    auto it = response.find("_success");
+    return it != response.end() && it->is_boolean() &&
+           it->template get<bool>();
+}
+
+/// The cache `options` ask for, or null for none.
+std::shared_ptr<ResponseCache> make_cache(const CacheOptions &options) {
+    if (options.capacity == 0)
+        return nullptr;
+    return std::make_shared<ResponseCache>(options.capacity, options.ttl);
+}
+
+template <typename Json>
+void log_outcome(const std::string &command, const Json &response) {
+    // Per-request outcomes are debug output; check the level first so the
+    // response is not inspected when nobody is listening.
+    if (!log_enabled(LogLevel::Debug))
+        return;
+    if (response.value("_success", false)) {
+        log_debug("[Socks] Command '", command, "' handled successfully.");
+    } else {
+        log_debug("[Socks] Command '", command, "' failed: ",
+                  response.value("_msg", "No error message"));
+    }
+}
+
+} // namespace
 
-json okay(const json &result) {
-    json res = result;
-    res["_success"] = true;
-    return res;
+json okay(json result) {
+    result["_success"] = true;
+    return result;
 }
 
-json error(const json &result, const std::string &message) {
-    json res = result;
-    res["_success"] = false;
-    res["_msg"] = message;
-    return res;
+json error(json result, const std::string &message) {
+    result["_success"] = false;
+    result["_msg"] = message;
+    return result;
 }
 
 Server::Server(std::unique_ptr<Transport> transport,
                std::shared_ptr<ThreadPool> thread_pool)
-    : transport_(std::move(transport)), thread_pool_(thread_pool) {}
+    : Server(std::vector<std::unique_ptr<Transport>>(), thread_pool) {
+    add_transport(std::move(transport));
+}
+
+Server::Server(std::vector<std::unique_ptr<Transport>> transports,
+               std::shared_ptr<ThreadPool> thread_pool)
+    : thread_pool_(thread_pool) {
+    for (auto &transport : transports)
+        add_transport(std::move(transport));
+
+    // Built-in commands answer monitoring, so they skip the queue.
+    options_["_commands"].priority = Priority::High;
+    options_["_stats"].priority = Priority::High;
+    options_["_unsubscribe"].priority = Priority::High;
+
+    // Lists the commands with usable IDs, so that clients can send the ID
+    // instead of the name (see Client::fetch_command_ids()).
+    add_handler("_commands", [this](const json &) {
+        json ids = json::object();
+        std::shared_ptr<const CommandTable> table = commands();
+        for (const Command &command : table->commands()) {
+            if (table->id_usable(command))
+                ids[command.name] = command.id;
+        }
+        return okay({{"commands", std::move(ids)}});
+    });
+    add_handler("_stats", [this](const json &request) {
+        if (request.value("format", "") == "prometheus")
+            return okay({{"text", metrics_text()}});
+        return okay({{"stats", stats()}});
+    });
+    // An open subscription is cancelled before routing (see
+    // cancel_stream()); this only answers one that has already ended.
+    add_handler("_unsubscribe",
+                [](const json &) { return okay({{"_end", true}}); });
+    add_handler("_batch", [this](const json &request) {
+        auto requests = request.find("requests");
+        if (requests == request.end() || !requests->is_array())
+            return error({}, "_batch needs an array of requests");
+        return okay({{"responses", run_batch(*requests, *commands(),
+                                             handled_deadline)}});
+    });
+}
 
-Server::~Server() { stop(); }
+Server::~Server() {
+    stop();
+    if (takeover_channel_ != -1)
+        ::close(takeover_channel_); // never served: the old server goes on
+
+    // A shared pool outlives the server, and so may the jobs it still has
+    // for it; every one of them counts as in flight until it returns.
+    end_streams();
+    std::unique_lock<std::mutex> lock(drain_mutex_);
+    drained_.wait(lock, [this] { return in_flight_ == 0; });
+}
+
+void Server::add_transport(std::unique_ptr<Transport> transport) {
+    if (!transport)
+        throw std::invalid_argument("Server needs a transport");
+    std::lock_guard<std::mutex> lock(registry_mutex_);
+    if (started_)
+        throw std::logic_error("Transports must be added before start()");
+    transports_.push_back(std::move(transport));
+}
 
 void Server::add_handler(const std::string &command, Handler handler) {
-    handlers_[command] = std::move(handler);
+    Command entry;
+    entry.name = command;
+    entry.handler = std::move(handler);
+    add_command(std::move(entry));
+}
+
+void Server::add_handler(const std::string &command, CompiledSchema schema,
+                         Handler handler) {
+    Command entry;
+    entry.name = command;
+    entry.handler = std::move(handler);
+    entry.schema = std::make_shared<const CompiledSchema>(std::move(schema));
+    add_command(std::move(entry));
+}
+
+void Server::add_handler(const std::string &command, Handler handler,
+                         HandlerOptions options) {
+    set_options(command, options);
+    add_handler(command, std::move(handler));
+}
+
+void Server::add_handler(const std::string &command, CompiledSchema schema,
+                         Handler handler, HandlerOptions options) {
+    set_options(command, options);
+    add_handler(command, std::move(schema), std::move(handler));
+}
+
+void Server::add_arena_handler(const std::string &command,
+                               ArenaHandler handler) {
+    Command entry;
+    entry.name = command;
+    entry.arena_handler = std::move(handler);
+    add_command(std::move(entry));
+}
+
+void Server::add_arena_handler(const std::string &command,
+                               CompiledSchema schema, ArenaHandler handler) {
+    Command entry;
+    entry.name = command;
+    entry.arena_handler = std::move(handler);
+    entry.schema = std::make_shared<const CompiledSchema>(std::move(schema));
+    add_command(std::move(entry));
+}
+
+void Server::add_raw_handler(const std::string &command,
+                             RawHandler handler) {
+    Command entry;
+    entry.name = command;
+    entry.raw_handler = std::move(handler);
+    add_command(std::move(entry));
+}
+
+void Server::add_async_handler(const std::string &command,
+                               AsyncHandler handler) {
+    Command entry;
+    entry.name = command;
+    entry.async_handler = std::move(handler);
+    add_command(std::move(entry));
+}
+
+void Server::add_async_handler(const std::string &command,
+                               CompiledSchema schema, AsyncHandler handler) {
+    Command entry;
+    entry.name = command;
+    entry.async_handler = std::move(handler);
+    entry.schema = std::make_shared<const CompiledSchema>(std::move(schema));
+    add_command(std::move(entry));
+}
+
+void Server::add_stream_handler(const std::string &command,
+                                StreamHandler handler) {
+    Command entry;
+    entry.name = command;
+    entry.stream_handler = std::move(handler);
+    add_command(std::move(entry));
+}
+
+void Server::add_stream_handler(const std::string &command,
+                                CompiledSchema schema, StreamHandler handler) {
+    Command entry;
+    entry.name = command;
+    entry.stream_handler = std::move(handler);
+    entry.schema = std::make_shared<const CompiledSchema>(std::move(schema));
+    add_command(std::move(entry));
+}
+
+void Server::add_command(Command command) {
+    command.id = CommandTable::id_of(command.name);
+    command.metrics = metrics_.command(command.name);
+    std::lock_guard<std::mutex> lock(registry_mutex_);
+    auto options = options_.find(command.name);
+    if (options != options_.end())
+        command.options = options->second;
+    // A new handler may answer differently, so it starts with a new cache.
+    command.cache = make_cache(command.options.cache);
+    auto same = std::find_if(
+        registry_.begin(), registry_.end(),
+        [&](const Command &c) { return c.name == command.name; });
+    if (same != registry_.end()) {
+        *same = std::move(command);
+    } else {
+        registry_.push_back(std::move(command));
+    }
+    publish();
+}
+
+void Server::set_options(const std::string &command,
+                         HandlerOptions options) {
+    std::lock_guard<std::mutex> lock(registry_mutex_);
+    options_[command] = options;
+    for (Command &registered : registry_) {
+        if (registered.name == command) {
+            const CacheOptions &cache = registered.options.cache;
+            if (cache.capacity != options.cache.capacity ||
+                cache.ttl != options.cache.ttl)
+                registered.cache = make_cache(options.cache);
+            registered.options = options;
+            publish();
+            break;
+        }
+    }
+}
+
+void Server::set_queue_limit(std::size_t capacity, Overflow overflow) {
+    queue_.configure(capacity, overflow);
+}
+
+void Server::publish() {
+    // The table it replaces goes once the last request routed with it is
+    // answered.
+    std::atomic_store_explicit(
+        &commands_, std::make_shared<const CommandTable>(registry_),
+        std::memory_order_release);
+}
+
+std::shared_ptr<const CommandTable> Server::commands() const {
+    return std::atomic_load_explicit(&commands_, std::memory_order_acquire);
 }
 
 void Server::start() {
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex_);
+        if (transports_.empty())
+            throw std::logic_error("Server has no transport");
+        started_ = true;
+    }
     running_ = true;
-    transport_->bind();
+    draining_ = false;
+    queue_.open(); // closed by an earlier stop()
+    {
+        std::lock_guard<std::mutex> lock(handoff_mutex_);
+        stopped_ = false;
+    }
+    for (size_t i = 0; i < transports_.size(); ++i) {
+        try {
+            transports_[i]->bind();
+        } catch (...) {
+            for (size_t bound = 0; bound < i; ++bound)
+                transports_[bound]->close();
+            throw;
+        }
+    }
+    if (takeover_channel_ != -1) {
+        // Serving on the adopted sockets: the old server can drain now.
+        char ready = kTakeoverReady;
+        (void)!::write(takeover_channel_, &ready, 1);
+        ::close(takeover_channel_);
+        takeover_channel_ = -1;
+    }
     log_info("[Socks] Server started. Waiting for connections...");
-    serve();
+
+    // Every transport but the last is served on a thread of its own; stop()
+    // closes them all, which ends every loop.
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i + 1 < transports_.size(); ++i) {
+        Transport &transport = *transports_[i];
+        threads.emplace_back([this, &transport] {
+            try {
+                serve(transport);
+            } catch (const std::exception &e) {
+                log_error("[Socks] Transport stopped: ", e.what());
+            }
+        });
+    }
+    try {
+        serve(*transports_.back());
+    } catch (...) {
+        stop();
+        for (auto &thread : threads)
+            thread.join();
+        throw;
+    }
+    for (auto &thread : threads)
+        thread.join();
 }
 
 void Server::stop() {
     running_ = false;
-    transport_->close();
+    {
+        std::lock_guard<std::mutex> lock(handoff_mutex_);
+        stopped_ = true;
+        for (int fd : {handoff_listener_, handoff_channel_}) {
+            if (fd != -1)
+                ::shutdown(fd, SHUT_RDWR);
+        }
+    }
+    queue_.close();
+    for (auto &transport : transports_)
+        transport->close();
     log_info("[Socks] Server stopped.");
 }
 
-void Server::serve() {
-    while (running_) {
+bool Server::drain(std::chrono::milliseconds timeout) {
+    log_info("[Socks] Draining...");
+    draining_ = true;
+    for (auto &transport : transports_)
+        transport->stop_listening();
+
+    // Subscribers are sent their final frame; they count as in flight
+    // until it has gone out.
+    end_streams();
+
+    bool finished;
+    {
+        std::unique_lock<std::mutex> lock(drain_mutex_);
+        finished = drained_.wait_for(lock, timeout,
+                                     [this] { return in_flight_ == 0; });
+    }
+    if (!finished)
+        log_warning("[Socks] Drain timed out with ", in_flight_.load(),
+                    " requests in flight.");
+    stop();
+    return finished;
+}
+
+bool Server::hand_off(const std::string &handoff_path,
+                      std::chrono::milliseconds timeout) {
+    std::uint64_t inode = 0;
+    int listener = listen_unix(handoff_path, SOCK_CLOEXEC, 1, inode);
+    bool stopped;
+    {
+        std::lock_guard<std::mutex> lock(handoff_mutex_);
+        stopped = stopped_;
+        if (!stopped)
+            handoff_listener_ = listener;
+    }
+
+    bool handed = false;
+    while (!stopped && !handed) {
+        int channel = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (channel == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break; // shut down by stop()
+        }
+        {
+            std::lock_guard<std::mutex> lock(handoff_mutex_);
+            handoff_channel_ = channel;
+            if (stopped_)
+                ::shutdown(channel, SHUT_RDWR);
+        }
+
+        // Both servers accept until the new one reports that it serves;
+        // if it goes away first, this one simply carries on. Each
+        // transport's sockets go in a message of their own, in order, and
+        // an empty message ends the list; on its own, it tells the new
+        // server there is nothing to take.
+        bool sent = false;
+        bool shareable = true;
+        std::vector<std::vector<int>> shared;
         try {
-            std::string client_id;
-            std::string data = transport_->receive(client_id);
-
-            auto task = [this, data, client_id]() {
-                json response;
-                std::string command = "<unknown>";
-
-                try {
-                    json request = json::parse(data);
-                    command = request.value("_cmd", "<no _cmd>");
-                    log_info("[Socks] Received request for command: " +
-                             command);
-
-                    if (auto it = handlers_.find(command);
-                        it != handlers_.end()) {
-                        response = it->second(request);
-                    } else {
-                        response = error({}, "Unknown command: " + command);
-                    }
+            for (auto &transport : transports_) {
+                shared.push_back(transport->share_listeners());
+                shareable = shareable && !shared.back().empty();
+            }
+            sent = true;
+            for (size_t i = 0; shareable && sent && i < shared.size(); ++i)
+                sent = send_sockets(channel, shared[i]);
+            sent = sent && send_sockets(channel, {});
+        } catch (const std::exception &e) {
+            log_error("[Socks] Handoff failed: ", e.what());
+            sent = false;
+        }
+        for (const auto &fds : shared) {
+            for (int fd : fds)
+                ::close(fd);
+        }
+        char ready = 0;
+        ssize_t n = 0;
+        if (sent && shareable) {
+            do {
+                n = ::read(channel, &ready, 1);
+            } while (n == -1 && errno == EINTR);
+        }
+        handed = n == 1 && ready == kTakeoverReady;
 
-                    if (response.value("_success", false)) {
-                        log_success("[Socks] Command '" + command +
-                                    "' handled successfully.");
-                    } else {
-                        log_error("[Socks] Command '" + command + "' failed: " +
-                                  response.value("_msg", "No error message"));
-                    }
+        {
+            std::lock_guard<std::mutex> lock(handoff_mutex_);
+            handoff_channel_ = -1;
+        }
+        ::close(channel);
+        if (sent && !shareable) {
+            log_error("[Socks] A transport cannot hand off its sockets.");
+            break;
+        }
+        if (!handed)
+            log_warning("[Socks] Replacement did not take over; serving on.");
+    }
 
-                } catch (const std::exception &e) {
-                    log_error("[Socks] JSON parse or internal error: " +
-                              std::string(e.what()));
-                    response = error({}, "Invalid JSON or internal error: " +
-                                             std::string(e.what()));
-                }
+    {
+        std::lock_guard<std::mutex> lock(handoff_mutex_);
+        handoff_listener_ = -1;
+    }
+    ::close(listener);
+    remove_unix_path(handoff_path, inode);
+    if (!handed)
+        return false;
+    log_info("[Socks] Listening sockets handed over.");
+    return drain(timeout);
+}
 
-                try {
-                    transport_->send(response.dump(), client_id);
-                } catch (const std::exception &e) {
-                    log_error("[Socks] Send error: " + std::string(e.what()));
-                }
-            };
+bool Server::take_over(const std::string &handoff_path) {
+    int channel = connect_unix(handoff_path);
+    if (channel == -1) {
+        if (errno == ENOENT || errno == ECONNREFUSED)
+            return false; // nobody to take over from
+        throw std::runtime_error("Failed to connect to " + handoff_path +
+                                 ": " + std::strerror(errno));
+    }
+
+    // One message per transport (see hand_off()), up to an empty one.
+    std::size_t count = 0;
+    std::vector<std::vector<int>> received;
+    try {
+        while (true) {
+            std::vector<int> fds = receive_sockets(channel);
+            if (fds.empty())
+                break;
+            count += fds.size();
+            received.push_back(std::move(fds));
+        }
+        if (!received.empty() && received.size() != transports_.size()) {
+            throw std::runtime_error(
+                "Handoff from a server with " +
+                std::to_string(received.size()) + " transports, not " +
+                std::to_string(transports_.size()));
+        }
+        for (size_t i = 0; i < received.size(); ++i)
+            transports_[i]->adopt_listeners(std::move(received[i]));
+    } catch (...) {
+        for (const auto &fds : received) { // those not adopted yet
+            for (int fd : fds)
+                ::close(fd);
+        }
+        ::close(channel);
+        throw;
+    }
+    if (count == 0) {
+        ::close(channel);
+        return false;
+    }
+
+    if (takeover_channel_ != -1)
+        ::close(takeover_channel_);
+    takeover_channel_ = channel;
+    log_info("[Socks] Took over ", count, " listening socket(s).");
+    return true;
+}
+
+void Server::finish_request() {
+    std::size_t count = in_flight_.load();
+    while (count > 1 && !in_flight_.compare_exchange_weak(count, count - 1)) {
+    }
+    if (count > 1)
+        return;
+    // Possibly the last: counted down under the lock, so that ~Server sees
+    // zero only once this thread is done with the server.
+    std::lock_guard<std::mutex> lock(drain_mutex_);
+    if (in_flight_.fetch_sub(1) == 1)
+        drained_.notify_all();
+}
+
+void Server::end_streams() {
+    std::vector<std::weak_ptr<Stream::State>> open;
+    {
+        std::lock_guard<std::mutex> lock(streams_mutex_);
+        for (const auto &[key, stream] : streams_)
+            open.push_back(stream);
+    }
+    for (const auto &stream : open)
+        Stream::end(stream);
+}
+
+json Server::stats() const {
+    json stats = metrics_.to_json(thread_pool_.get());
+    json &per_command = stats["commands"];
+    std::shared_ptr<const CommandTable> table = commands();
+    for (const Command &command : table->commands()) {
+        if (!command.cache)
+            continue;
+        ResponseCache::Stats cache = command.cache->stats();
+        per_command[command.name]["cache"] = {
+            {"hits", cache.hits},
+            {"misses", cache.misses},
+            {"evictions", cache.evictions},
+            {"entries", cache.entries},
+            {"capacity", command.cache->capacity()}};
+    }
+    if (thread_pool_) {
+        stats["queue"] = {{"queued", queue_.size()},
+                          {"capacity", queue_.capacity()}};
+    }
+    stats["streams"] = {{"open", open_streams_.load()}};
+    return stats;
+}
+
+std::string Server::metrics_text() const {
+    std::string text = metrics_.to_prometheus(thread_pool_.get());
+    if (thread_pool_) {
+        text += "# HELP socks_queued_requests Requests waiting for a "
+                "worker.\n"
+                "# TYPE socks_queued_requests gauge\n"
+                "socks_queued_requests " +
+                std::to_string(queue_.size()) + "\n";
+    }
+
+    std::string hits, misses;
+    std::shared_ptr<const CommandTable> table = commands();
+    for (const Command &command : table->commands()) {
+        if (!command.cache)
+            continue;
+        ResponseCache::Stats cache = command.cache->stats();
+        std::string labels =
+            "{command=\"" + prometheus_label(command.name) + "\"} ";
+        hits += "socks_cache_hits_total" + labels +
+                std::to_string(cache.hits) + "\n";
+        misses += "socks_cache_misses_total" + labels +
+                  std::to_string(cache.misses) + "\n";
+    }
+    if (!hits.empty()) {
+        text += "# HELP socks_cache_hits_total Requests answered from the "
+                "response cache, by command.\n"
+                "# TYPE socks_cache_hits_total counter\n" +
+                hits +
+                "# HELP socks_cache_misses_total Cache lookups that ran the "
+                "handler, by command.\n"
+                "# TYPE socks_cache_misses_total counter\n" +
+                misses;
+    }
+    return text;
+}
+
+void Server::dispatch(Transport &transport, Buffer data,
+                      std::string client_id) {
+    std::int64_t received = metrics_enabled_ ? now_ns() : -1;
+
+    // A subscriber cancels by sending anything on its subscription's tag.
+    if (open_streams_.load(std::memory_order_relaxed) > 0 &&
+        cancel_stream(transport, client_id))
+        return;
+    in_flight_.fetch_add(1);
+
+    // Route on the scanned _cmd before anything is parsed: unknown commands
+    // are turned away here, without parsing and without taking a worker.
+    // The table is loaded once, so the request sees a single registry even
+    // if handlers are added meanwhile.
+    std::shared_ptr<const CommandTable> table = commands();
+    const Command *command = nullptr;
+    if (auto scanned = scan_command(data.view())) {
+        if (scanned->kind == ScannedField::Kind::String) {
+            command = table->find(scanned->text);
+        } else {
+            command = table->find_id(scanned->number);
+        }
+        if (!command) {
+            std::string name =
+                scanned->kind == ScannedField::Kind::String
+                    ? std::string(scanned->text)
+                    : "#" + std::to_string(scanned->number);
+            log_debug("[Socks] Rejected unknown command: ", name);
+            metrics_.count_unknown();
+            reject(transport, data.view(), "Unknown command: " + name,
+                   client_id);
+            finish_request();
+            return;
+        }
+    }
+
+    std::int64_t deadline = request_deadline(data.view(), received);
+    if (!thread_pool_) {
+        if (!reject_expired(transport, data, client_id, deadline)) {
+            handle_request(transport, data, client_id, table, command,
+                           received, deadline);
+        }
+        return;
+    }
+
+    PendingRequest request{std::move(data), &transport, std::move(client_id),
+                           std::move(table), command, received};
+    request.deadline = deadline;
+
+    // Each pool job runs whichever request is most urgent when it starts,
+    // not necessarily this one.
+    std::optional<PendingRequest> evicted;
+    Priority priority = command ? command->options.priority : Priority::Normal;
+    auto admitted = queue_.push(request, priority, evicted);
+    if (evicted)
+        shed(*evicted);
+    if (admitted == AdmissionQueue::Admit::Rejected) {
+        shed(request);
+        return;
+    }
+    // The job counts as in flight itself: it may outlive the request it
+    // was queued for, which an earlier job can take.
+    in_flight_.fetch_add(1);
+    auto job = [this]() {
+        run_next();
+        finish_request();
+    };
+    try {
+        // Not enqueue_near(): the job runs whichever request is most urgent
+        // when it starts, so there is no locality to aim for.
+        thread_pool_->enqueue(job);
+    } catch (const std::exception &e) {
+        // Stopping pool: no job will take the request admitted above (or
+        // whichever took its place), so turn one away here.
+        log_debug("[Socks] Pool refused a job: ", e.what());
+        finish_request();
+        PendingRequest stranded;
+        if (queue_.pop(stranded))
+            shed(stranded);
+    }
+}
+
+void Server::run_next() {
+    PendingRequest request;
+    if (!queue_.pop(request))
+        return; // taken by an earlier job, or dropped
+    if (reject_expired(*request.transport, request.data, request.client_id,
+                       request.deadline))
+        return;
+    handle_request(*request.transport, request.data, request.client_id,
+                   request.table, request.command, request.received,
+                   request.deadline);
+}
 
-            if (thread_pool_) {
-                thread_pool_->enqueue(std::move(task));
+bool Server::reject_expired(Transport &transport, const Buffer &data,
+                            const std::string &client_id,
+                            std::int64_t deadline) {
+    if (deadline < 0 || now_ns() <= deadline)
+        return false;
+    // The client has given up; answer without running the handler.
+    log_debug("[Socks] Skipped request past its deadline.");
+    metrics_.count_expired();
+    reject(transport, data.view(), "Deadline exceeded", client_id);
+    finish_request();
+    return true;
+}
+
+void Server::shed(const PendingRequest &request) {
+    log_debug("[Socks] Shed request: queue full.");
+    metrics_.count_shed();
+    reject(*request.transport, request.data.view(), "Server overloaded",
+           request.client_id);
+    finish_request();
+}
+
+json Server::run_batch(const json &requests, const CommandTable &table,
+                       std::int64_t deadline) {
+    // The calling thread works through the entries and helpers on the pool
+    // claim entries alongside it. It never waits for a helper that has not
+    // started, so a batch cannot deadlock a busy (or one-thread) pool.
+    struct Batch {
+        std::atomic<std::size_t> next{0};
+        std::vector<json> responses;
+        std::mutex mutex;
+        std::condition_variable finished;
+        std::size_t done = 0;
+    };
+    auto batch = std::make_shared<Batch>();
+    std::size_t count = requests.size();
+    batch->responses.resize(count);
+    auto work = [this, batch, &requests, &table, count, deadline]() {
+        std::size_t i;
+        while ((i = batch->next.fetch_add(1)) < count) {
+            if (deadline >= 0 && now_ns() > deadline) {
+                // The client has given up on the whole batch.
+                metrics_.count_expired();
+                batch->responses[i] = error({}, "Deadline exceeded");
             } else {
-                task();
+                batch->responses[i] = run_one(requests[i], table);
             }
+            std::lock_guard<std::mutex> lock(batch->mutex);
+            if (++batch->done == count)
+                batch->finished.notify_all();
+        }
+    };
+
+    // Helpers only take workers that are idle while no admitted request
+    // waits: they are not counted by the queue's bound, and would otherwise
+    // run ahead of queued requests of any priority.
+    if (thread_pool_ && count > 1 && queue_.size() == 0) {
+        std::size_t busy = thread_pool_->active() + thread_pool_->queued();
+        std::size_t idle =
+            busy < thread_pool_->size() ? thread_pool_->size() - busy : 0;
+        std::size_t helpers = std::min(count - 1, idle);
+        try {
+            for (std::size_t n = 0; n < helpers; ++n)
+                thread_pool_->enqueue(work);
+        } catch (const std::exception &) {
+            // Stopping pool: whatever is left runs here.
+        }
+    }
+    work();
+
+    std::unique_lock<std::mutex> lock(batch->mutex);
+    batch->finished.wait(lock, [&] { return batch->done == count; });
+    return json(std::move(batch->responses));
+}
+
+json Server::run_one(const json &request, const CommandTable &table) {
+    auto cmd = request.is_object() ? request.find("_cmd") : request.end();
+    if (cmd == request.end())
+        return error({}, "Batch entry without _cmd");
+    const Command *entry = nullptr;
+    std::string name;
+    if (cmd->is_number_unsigned()) {
+        entry = table.find_id(cmd->get<std::uint64_t>());
+        name = "#" + std::to_string(cmd->get<std::uint64_t>());
+    } else if (cmd->is_string()) {
+        name = cmd->get<std::string>();
+        entry = table.find(name);
+    }
+    if (!entry) {
+        metrics_.count_unknown();
+        return error({}, "Unknown command: " + name);
+    }
+    if (entry->name == "_batch")
+        return error({}, "Nested _batch is not supported");
+    if (entry->stream_handler)
+        return error({}, "Stream commands cannot be batched");
+
+    std::int64_t started = metrics_enabled_ ? now_ns() : -1;
+    json response;
+    try {
+        std::string invalid;
+        if (entry->raw_handler) {
+            Buffer encoded;
+            encode(request, Codec::Json, encoded);
+            response = decode(entry->raw_handler(encoded.view(), Codec::Json)
+                                  .view());
+        } else if (entry->schema &&
+                   !entry->schema->validate(request, &invalid)) {
+            response = error({}, invalid);
+        } else if (entry->arena_handler) {
+            response = json(entry->arena_handler(ArenaJson(request)));
+        } else if (entry->async_handler) {
+            response = await_reply(*entry, request);
+        } else {
+            response = entry->handler(request);
+        }
+    } catch (const std::exception &e) {
+        response = error({}, "Internal error: " + std::string(e.what()));
+    }
+    log_outcome(entry->name, response);
 
+    if (started >= 0 && entry->metrics) {
+        RequestTiming timing;
+        timing[Stage::Handler] = timing[Stage::Total] = now_ns() - started;
+        timing.ok = succeeded(response);
+        entry->metrics->record(timing);
+    }
+    return response;
+}
+
+void Server::reject(Transport &transport, std::string_view data,
+                    const std::string &message, const std::string &client_id) {
+    try {
+        Buffer out;
+        encode(error({}, message), detect_codec(data), out);
+        transport.send_buffer(out, client_id);
+    } catch (const std::exception &e) {
+        log_error("[Socks] Send error: ", e.what());
+    }
+}
+
+void Server::handle_request(Transport &transport, const Buffer &data,
+                            const std::string &client_id,
+                            const std::shared_ptr<const CommandTable> &table,
+                            const Command *command, std::int64_t received,
+                            std::int64_t deadline) {
+    Codec codec = detect_codec(data.view()); // reply in the same encoding
+    RequestTiming timing;
+    RequestTiming *timed = received >= 0 ? &timing : nullptr;
+    if (timed)
+        timing[Stage::Queue] = now_ns() - received;
+    // These two finish the request themselves, once answered.
+    if (command && command->async_handler) {
+        start_async(transport, data, client_id, table, *command, codec,
+                    received, timing);
+        return;
+    }
+    if (command && command->stream_handler) {
+        open_stream(transport, data, client_id, *command, codec, received,
+                    timing);
+        return;
+    }
+    handled_deadline = deadline;
+    try {
+        Buffer out;
+        // Only arena handlers get their request parsed into the arena. One
+        // whose command the scanner could not find might be for any
+        // handler, so it goes there whenever an arena handler exists.
+        if (command ? static_cast<bool>(command->arena_handler)
+                    : table->uses_arena()) {
+            // Everything parsed or built while responding comes from this
+            // thread's arena and is released at once when the scope ends.
+            ArenaScope scope(thread_arena());
+            command = respond<ArenaJson>(data.view(), codec, *table, command,
+                                         out, timed);
+        } else {
+            command =
+                respond<json>(data.view(), codec, *table, command, out, timed);
+        }
+        std::int64_t sending = timed ? now_ns() : 0;
+        transport.send_buffer(out, client_id);
+        if (timed) {
+            std::int64_t sent = now_ns();
+            timing[Stage::Send] += sent - sending;
+            timing[Stage::Total] = sent - received;
+        }
+    } catch (const std::exception &e) {
+        log_error("[Socks] Send error: ", e.what());
+        timing.ok = false;
+    }
+    handled_deadline = -1;
+    if (timed && command && command->metrics)
+        command->metrics->record(timing);
+    finish_request();
+}
+
+void Server::start_async(Transport &transport, const Buffer &data,
+                         const std::string &client_id,
+                         std::shared_ptr<const CommandTable> table,
+                         const Command &command, Codec codec,
+                         std::int64_t received, RequestTiming timing) {
+    bool timed = received >= 0;
+    std::int64_t started = timed ? now_ns() : 0;
+    log_debug("[Socks] Received request for command: ", command.name);
+
+    json request;
+    std::string failure; // answered with this error instead of the handler
+    std::string cache_key;
+    try {
+        request = decode(data.view());
+        if (timed) {
+            std::int64_t parsed = now_ns();
+            timing[Stage::Parse] = parsed - started;
+            started = parsed;
+        }
+        if (command.cache && request.is_object()) {
+            cache_key = ResponseCache::key_of(request, codec);
+            Buffer out;
+            if (command.cache->find(cache_key, out)) {
+                log_debug("[Socks] Served '", command.name, "' from cache.");
+                timing.ok = true;
+                if (timed)
+                    timing[Stage::Handler] = now_ns() - started;
+                deliver(transport, out, client_id, command,
+                        timed ? &timing : nullptr, received);
+                finish_request();
+                return;
+            }
+        }
+    } catch (const std::exception &e) {
+        log_warning("[Socks] JSON parse or internal error: ", e.what());
+        failure = "Invalid JSON or internal error: " + std::string(e.what());
+    }
+
+    // The reply may come from any thread long after this returns, so it
+    // holds copies of everything it needs, and the table `command` is in.
+    Reply reply([this, &transport, table = std::move(table), &command,
+                 client_id, codec, received, timing, started,
+                 cache_key](json response) mutable {
+        bool timed = received >= 0;
+        if (timed)
+            timing[Stage::Handler] = now_ns() - started;
+        log_outcome(command.name, response);
+        try {
+            std::int64_t encoding = timed ? now_ns() : 0;
+            Buffer out;
+            encode(response, codec, out);
+            timing.ok = succeeded(response);
+            if (timing.ok && !cache_key.empty())
+                command.cache->insert(std::move(cache_key), out);
+            if (timed)
+                timing[Stage::Send] = now_ns() - encoding;
+            deliver(transport, out, client_id, command,
+                    timed ? &timing : nullptr, received);
+        } catch (const std::exception &e) {
+            log_error("[Socks] Send error: ", e.what());
+        }
+        finish_request();
+    });
+
+    std::string invalid;
+    if (!failure.empty()) {
+        reply(error({}, failure));
+    } else if (command.schema && !command.schema->validate(request, &invalid)) {
+        reply(error({}, invalid));
+    } else {
+        try {
+            command.async_handler(request, reply);
         } catch (const std::exception &e) {
-            log_error("[Socks] Receive error: " + std::string(e.what()));
+            reply(error({}, "Internal error: " + std::string(e.what())));
+        }
+    }
+}
+
+json Server::await_reply(const Command &command, const json &request) {
+    auto promise = std::make_shared<std::promise<json>>();
+    std::future<json> response = promise->get_future();
+    {
+        // Once the handler has dropped its copies too, an unanswered Reply
+        // answers with an error, so the wait below always ends.
+        Reply reply([promise](json result) {
+            promise->set_value(std::move(result));
+        });
+        try {
+            command.async_handler(request, reply);
+        } catch (const std::exception &e) {
+            reply(error({}, "Internal error: " + std::string(e.what())));
+        }
+    }
+    return response.get();
+}
+
+/**
+ * Sends a stream's frames to its subscriber, on the transport and in the
+ * codec of the request that opened it.
+ */
+class Server::StreamSink : public Stream::Sink {
+  public:
+    StreamSink(Server &server, Transport &transport, std::string client_id,
+               Codec codec, bool subscribed)
+        : server_(server), transport_(transport),
+          client_id_(std::move(client_id)), codec_(codec),
+          subscribed_(subscribed) {}
+
+    bool send(const json &frame) override {
+        try {
+            Buffer out;
+            encode(frame, codec_, out);
+            transport_.send_buffer(out, client_id_);
+            return true;
+        } catch (const std::exception &e) {
+            log_debug("[Socks] Stream to ", client_id_, " ended: ", e.what());
+            return false;
+        }
+    }
+
+    void post(std::function<void()> job) override {
+        if (server_.thread_pool_) {
+            try {
+                server_.thread_pool_->enqueue(job);
+                return;
+            } catch (const std::exception &) {
+                // Stopping pool: send from here.
+            }
         }
+        job();
     }
+
+    bool wait_drained(std::function<void()> ready) override {
+        return transport_.notify_drained(client_id_, std::move(ready));
+    }
+
+    bool once() const override { return !subscribed_; }
+
+    void ended() override {
+        if (subscribed_)
+            server_.end_stream(transport_, client_id_);
+        server_.finish_request();
+    }
+
+  private:
+    Server &server_;
+    Transport &transport_;
+    std::string client_id_;
+    Codec codec_;
+    bool subscribed_;
+};
+
+void Server::open_stream(Transport &transport, const Buffer &data,
+                         const std::string &client_id, const Command &command,
+                         Codec codec,
+                         std::int64_t received, RequestTiming timing) {
+    bool timed = received >= 0;
+    std::int64_t started = timed ? now_ns() : 0;
+    log_debug("[Socks] Received request for command: ", command.name);
+
+    json request;
+    std::string failure; // answered with this error instead of a stream
+    try {
+        request = decode(data.view());
+        if (timed) {
+            std::int64_t parsed = now_ns();
+            timing[Stage::Parse] = parsed - started;
+            started = parsed;
+        }
+    } catch (const std::exception &e) {
+        log_warning("[Socks] JSON parse or internal error: ", e.what());
+        failure = "Invalid JSON or internal error: " + std::string(e.what());
+    }
+
+    std::string invalid;
+    bool subscribed = false;
+    if (failure.empty()) {
+        auto flag = request.find("_subscribe");
+        subscribed = flag != request.end() && flag->is_boolean() &&
+                     flag->get<bool>();
+        if (command.schema && !command.schema->validate(request, &invalid))
+            failure = invalid;
+        else if (subscribed && !transport.supports_streams())
+            failure = "Subscriptions need an epoll transport "
+                      "(Framing::LengthPrefixed)";
+    }
+    if (!failure.empty()) {
+        Buffer out;
+        encode(error({}, failure), codec, out);
+        if (timed) {
+            timing[Stage::Handler] = now_ns() - started;
+            timing.ok = false;
+        }
+        deliver(transport, out, client_id, command, timed ? &timing : nullptr,
+                received);
+        finish_request();
+        return;
+    }
+
+    Stream stream(std::make_shared<StreamSink>(*this, transport, client_id,
+                                               codec, subscribed));
+    if (subscribed) {
+        // Registered before the handler runs, so that a cancel arriving
+        // right behind the request finds it.
+        std::lock_guard<std::mutex> lock(streams_mutex_);
+        streams_[{&transport, client_id}] = stream.state_;
+        open_streams_.store(streams_.size());
+    }
+    timing.ok = true;
+    try {
+        command.stream_handler(request, stream);
+    } catch (const std::exception &e) {
+        stream.push(error({}, "Internal error: " + std::string(e.what())));
+        stream.close();
+        timing.ok = false;
+    }
+    if (timed && command.metrics) {
+        std::int64_t now = now_ns();
+        timing[Stage::Handler] = now - started;
+        timing[Stage::Total] = now - received;
+        command.metrics->record(timing);
+    }
+}
+
+bool Server::cancel_stream(Transport &transport,
+                           const std::string &client_id) {
+    std::weak_ptr<Stream::State> stream;
+    {
+        std::lock_guard<std::mutex> lock(streams_mutex_);
+        auto found = streams_.find({&transport, client_id});
+        if (found == streams_.end())
+            return false;
+        stream = std::move(found->second);
+        streams_.erase(found);
+        open_streams_.store(streams_.size());
+    }
+    log_debug("[Socks] Subscription ", client_id, " cancelled.");
+    Stream::cancel(stream);
+    return true;
+}
+
+void Server::end_stream(Transport &transport, const std::string &client_id) {
+    std::lock_guard<std::mutex> lock(streams_mutex_);
+    streams_.erase({&transport, client_id});
+    open_streams_.store(streams_.size());
+}
+
+void Server::deliver(Transport &transport, const Buffer &out,
+                     const std::string &client_id, const Command &command,
+                     RequestTiming *timing, std::int64_t received) {
+    std::int64_t sending = timing ? now_ns() : 0;
+    try {
+        transport.send_buffer(out, client_id);
+    } catch (const std::exception &e) {
+        log_error("[Socks] Send error: ", e.what());
+        if (timing)
+            timing->ok = false;
+    }
+    if (timing) {
+        std::int64_t sent = now_ns();
+        (*timing)[Stage::Send] += sent - sending;
+        (*timing)[Stage::Total] = sent - received;
+        if (command.metrics)
+            command.metrics->record(*timing);
+    }
+}
+
+template <typename Request>
+const Command *Server::respond(std::string_view data, Codec codec,
+                               const CommandTable &table,
+                               const Command *entry, Buffer &out,
+                               RequestTiming *timing) {
+    json response;
+    ArenaJson arena_response; // used instead when an arena handler answers
+    bool from_arena = false;
+    std::string command = entry ? entry->name : "<unknown>";
+    std::string cache_key; // set when the response may be cached
+    std::int64_t started = timing ? now_ns() : 0;
+    auto lap = [&](Stage stage) {
+        if (!timing)
+            return;
+        std::int64_t now = now_ns();
+        (*timing)[stage] = now - started;
+        started = now;
+    };
+
+    try {
+        // Parse only when the scanner could not find _cmd, or when the
+        // handler wants a parsed request.
+        std::optional<Request> request;
+        if (!entry) {
+            request = parse_request<Request>(data);
+            lap(Stage::Parse);
+            if (request->is_array()) {
+                // A bare array of requests is a batch; so is its answer.
+                log_debug("[Socks] Received batch of ", request->size());
+                response =
+                    run_batch(as_json(*request), table, handled_deadline);
+                lap(Stage::Handler);
+                encode(response, codec, out);
+                if (timing)
+                    (*timing)[Stage::Send] = now_ns() - started;
+                return table.find("_batch");
+            }
+            auto id = request->find("_cmd");
+            if (id != request->end() && id->is_number_unsigned()) {
+                entry = table.find_id(id->template get<std::uint64_t>());
+                command = "#" + std::to_string(
+                                    id->template get<std::uint64_t>());
+            } else {
+                command = command_of(*request);
+                entry = table.find(command);
+            }
+            if (entry) {
+                command = entry->name;
+            } else {
+                metrics_.count_unknown();
+            }
+        }
+        log_debug("[Socks] Received request for command: ", command);
+
+        if (entry) {
+            std::string invalid;
+            if (entry->raw_handler) {
+                out = entry->raw_handler(data, codec);
+                lap(Stage::Handler);
+                if (timing)
+                    (*timing)[Stage::Send] = 0; // encoded by the handler
+                return entry;
+            }
+            if (!request) {
+                request = parse_request<Request>(data);
+                lap(Stage::Parse);
+            }
+            if (entry->cache && request->is_object()) {
+                cache_key = ResponseCache::key_of(*request, codec);
+                if (entry->cache->find(cache_key, out)) {
+                    // Only successful responses are cached.
+                    lap(Stage::Handler);
+                    if (timing) {
+                        timing->ok = true;
+                        (*timing)[Stage::Send] = 0; // encoded long ago
+                    }
+                    log_debug("[Socks] Served '", command, "' from cache.");
+                    return entry;
+                }
+            }
+            if (entry->schema &&
+                !entry->schema->validate(*request, &invalid)) {
+                response = error({}, invalid);
+            } else if (entry->arena_handler) {
+                arena_response = entry->arena_handler(*request);
+                from_arena = true;
+            } else if (entry->async_handler) {
+                response = await_reply(*entry, as_json(*request));
+            } else if (entry->stream_handler) {
+                response = error({}, "Stream requests need a plain `_cmd`");
+            } else {
+                response = entry->handler(as_json(*request));
+            }
+            lap(Stage::Handler);
+        } else {
+            response = error({}, "Unknown command: " + command);
+        }
+
+        if (from_arena) {
+            log_outcome(command, arena_response);
+        } else {
+            log_outcome(command, response);
+        }
+
+    } catch (const std::exception &e) {
+        log_warning("[Socks] JSON parse or internal error: ", e.what());
+        response = error({}, "Invalid JSON or internal error: " +
+                                 std::string(e.what()));
+        from_arena = false;
+        if (timing)
+            started = now_ns(); // the failed stage is not recorded
+    }
+
+    if (from_arena) {
+        encode(arena_response, codec, out);
+    } else {
+        encode(response, codec, out);
+    }
+    bool ok = from_arena ? succeeded(arena_response) : succeeded(response);
+    if (ok && !cache_key.empty())
+        entry->cache->insert(std::move(cache_key), out);
+    if (timing) {
+        timing->ok = ok;
+        (*timing)[Stage::Send] = now_ns() - started;
+    }
+    return entry;
+}
+
+void Server::serve(Transport &transport) {
+    if (auto *events = dynamic_cast<EventTransport *>(&transport)) {
+        serve_events(*events);
+        return;
+    }
+    while (running_) {
+        try {
+            std::string client_id;
+            Buffer data = transport.receive_buffer(client_id);
+            dispatch(transport, std::move(data), std::move(client_id));
+        } catch (const std::exception &e) {
+            if (running_) // otherwise stop() closed the transport under us
+                log_error("[Socks] Receive error: ", e.what());
+        }
+    }
+}
+
+void Server::serve_events(EventTransport &transport) {
+    // Reactor threads only see complete messages; everything else about a
+    // request is the same as in serve().
+    transport.run([this, &transport](Buffer data, std::string client_id) {
+        try {
+            dispatch(transport, std::move(data), std::move(client_id));
+        } catch (const std::exception &e) {
+            log_error("[Socks] Dispatch error: ", e.what());
+            throw;
+        }
+    });
 }
 
 } // namespace Socks
@@ -1,13 +1,32 @@
 #pragma once
 
+#include "admission.hpp"
+#include "codec.hpp"
+#include "commands.hpp"
+#include "eventloop.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "scan.hpp"
 #include "schema.hpp"
+#include "shm.hpp"
 #include "threadpool.hpp"
 #include "transport.hpp"
+#include "typed.hpp"
 
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 /**
  * @file socks.hpp
@@ -31,34 +50,72 @@
  *   "result": 123
  * }
  * @endcode
+ *
+ * Requests may also be MessagePack or CBOR (see codec.hpp); the server
+ * detects the encoding of each request and answers in the same one.
  */
 
 namespace Socks {
 
 using json = nlohmann::json;
 
-/**
- * @brief Type alias for a handler that receives and returns a JSON object.
- */
-using Handler = ::std::function<json(const json &)>;
-
 /**
  * @brief Wrap a successful JSON result.
+ *
+ * Takes the result by value, so a temporary (or std::move'd) result is
+ * moved into the response rather than copied.
+ *
  * @param result Payload to include.
  * @return JSON with `_success: true`.
  */
-json okay(const json &result);
+json okay(json result);
 
 /**
  * @brief Wrap a failed JSON result.
- * @param result Partial payload or context.
+ * @param result Partial payload or context (moved from, like okay()).
  * @param message Descriptive error message.
  * @return JSON with `_success: false` and `_msg`.
  */
-json error(const json &result, const std::string &message);
+json error(json result, const std::string &message);
+
+/**
+ * @brief okay() for arena handlers.
+ *
+ * A separate template so that `okay({...})` still builds a plain json.
+ */
+template <typename Json,
+          std::enable_if_t<std::is_same_v<Json, ArenaJson>, int> = 0>
+Json okay(Json result) {
+    result["_success"] = true;
+    return result;
+}
+
+/**
+ * @brief error() for arena handlers.
+ */
+template <typename Json,
+          std::enable_if_t<std::is_same_v<Json, ArenaJson>, int> = 0>
+Json error(Json result, const std::string &message) {
+    result["_success"] = false;
+    result["_msg"] = message;
+    return result;
+}
 
 /**
  * @brief Socks Server class that routes JSON requests over a transport.
+ *
+ * Besides the registered handlers, every server answers the reserved
+ * commands `_commands` (numeric command IDs), `_stats` (metrics) and
+ * `_batch`. A `_batch` request carries `"requests"`, an array of requests
+ * with their own `_cmd`; they run concurrently on the thread pool and the
+ * response holds their responses, in order, in `"responses"`. A message
+ * that is a bare array of requests is a batch as well, answered with a
+ * bare array.
+ *
+ * A server may listen on several transports at once, e.g. Unix for local
+ * clients and TCP for remote ones. They share the handlers, the thread
+ * pool, the request queue and the metrics; every request is answered on
+ * the transport it arrived on.
  */
 class Server {
   public:
@@ -72,36 +129,493 @@ class Server {
                     std::shared_ptr<ThreadPool> thread_pool = nullptr);
 
     /**
-     * @brief Destructor: shuts down the server.
+     * @brief Construct a Socks server listening on several transports.
+     * @code
+     * std::vector<std::unique_ptr<Transport>> transports;
+     * transports.push_back(std::make_unique<UnixSocketTransport>(path));
+     * transports.push_back(std::make_unique<EpollTcpTransport>(8080));
+     * Server server(std::move(transports), pool);
+     * @endcode
+     * @param transports Transport backends, at least one by start().
+     * @param thread_pool Optional shared pointer to a ThreadPool for concurrent
+     * request handling.
+     * @throws std::invalid_argument if a transport is null.
+     */
+    explicit Server(std::vector<std::unique_ptr<Transport>> transports,
+                    std::shared_ptr<ThreadPool> thread_pool = nullptr);
+
+    /**
+     * @brief Destructor: shuts down the server, ends open subscriptions
+     * and waits for the requests still running, whose pool jobs refer to
+     * it.
      */
     ~Server();
 
+    /**
+     * @brief Listen on another transport as well.
+     *
+     * Must be called before start().
+     *
+     * @throws std::invalid_argument if `transport` is null.
+     * @throws std::logic_error once the server has started.
+     */
+    void add_transport(std::unique_ptr<Transport> transport);
+
     /**
      * @brief Register a handler for a given `_cmd` name.
+     *
+     * Handlers may be registered, or replaced, at any time, including while
+     * the server is running: each registration publishes a new
+     * CommandTable, and requests already in flight finish with the table
+     * they started with. A command name that is registered again keeps
+     * its numeric ID.
+     *
      * @param command The `_cmd` string key.
      * @param handler A callback returning a JSON response.
      */
     void add_handler(const std::string &command, Handler handler);
 
     /**
-     * @brief Start the server. Will be blocking unless used with a threadpool.
+     * @brief Register a handler whose requests are validated first.
+     *
+     * The schema is compiled once here. Requests that do not match it are
+     * answered with an error response carrying the validation message, and
+     * the handler is not called.
+     *
+     * @param command The `_cmd` string key.
+     * @param schema Expected request structure.
+     * @param handler A callback returning a JSON response.
+     */
+    void add_handler(const std::string &command, CompiledSchema schema,
+                     Handler handler);
+
+    /**
+     * @brief Register a handler with options, e.g. a response cache:
+     * @code
+     * HandlerOptions options;
+     * options.cache = {10000, std::chrono::seconds(30)};
+     * server.add_handler("lookup", handler, options);
+     * @endcode
+     *
+     * The same as set_options() followed by add_handler(). Registering a
+     * command again, with or without options, empties its cache.
+     */
+    void add_handler(const std::string &command, Handler handler,
+                     HandlerOptions options);
+
+    /**
+     * @brief Register a validated handler with options.
+     */
+    void add_handler(const std::string &command, CompiledSchema schema,
+                     Handler handler, HandlerOptions options);
+
+    /**
+     * @brief Register a handler that works on arena-backed JSON.
+     *
+     * Requests for this command are parsed into the worker thread's arena.
+     * Other commands are unaffected, except requests whose `_cmd` cannot be
+     * found without parsing (batches, escaped keys): those are parsed into
+     * the arena too, and a plain handler then receives a copy as json.
+     *
+     * @param command The `_cmd` string key.
+     * @param handler A callback returning an ArenaJson response.
+     */
+    void add_arena_handler(const std::string &command, ArenaHandler handler);
+
+    /**
+     * @brief Register an arena handler whose requests are validated first.
+     * @param command The `_cmd` string key.
+     * @param schema Expected request structure.
+     * @param handler A callback returning an ArenaJson response.
+     */
+    void add_arena_handler(const std::string &command, CompiledSchema schema,
+                           ArenaHandler handler);
+
+    /**
+     * @brief Register a handler that receives the unparsed request.
+     *
+     * Requests whose `_cmd` the scanner can read are never parsed by the
+     * server. Otherwise (e.g. an escaped `_cmd`), the server parses the
+     * request to route it and then passes the original bytes on.
+     *
+     * @param command The `_cmd` string key.
+     * @param handler A callback returning the encoded response.
+     */
+    void add_raw_handler(const std::string &command, RawHandler handler);
+
+    /**
+     * @brief Register a handler that replies asynchronously.
+     *
+     * For handlers that wait on something else, e.g. another service
+     * through Client: the worker returns to the pool as soon as the handler
+     * returns, and the response is sent whenever `reply` is called. Such a
+     * request's Handler stage lasts until the reply. Inside a `_batch`, and
+     * for requests whose `_cmd` only the parser can read, the worker waits
+     * for the reply instead; a reply that needs a worker of the same pool
+     * then only comes if another one is free. The server must outlive every
+     * pending Reply.
+     *
+     * @param command The `_cmd` string key.
+     * @param handler A callback that arranges for `reply` to be called.
+     */
+    void add_async_handler(const std::string &command, AsyncHandler handler);
+
+    /**
+     * @brief Register an asynchronous handler whose requests are validated
+     * first.
+     * @param command The `_cmd` string key.
+     * @param schema Expected request structure.
+     * @param handler A callback that arranges for `reply` to be called.
+     */
+    void add_async_handler(const std::string &command, CompiledSchema schema,
+                           AsyncHandler handler);
+
+    /**
+     * @brief Register a handler that streams frames to subscribers (see
+     * stream.hpp and Client::subscribe()).
+     *
+     * A request that asks for a subscription (`"_subscribe": true`) gets
+     * every frame the handler pushes, coalesced to the newest when the
+     * subscriber falls behind, until the stream ends. Any other request
+     * gets the first frame only, as its response. Subscriptions need a
+     * transport that supports streams (Framing::LengthPrefixed); elsewhere
+     * the request is answered with an error. They cannot run inside a
+     * `_batch`. The server must outlive the streams it has handed out.
+     *
+     * @code
+     * server.add_stream_handler("pose", [&](const json &, Stream stream) {
+     *     std::lock_guard<std::mutex> lock(subscribers_mutex);
+     *     subscribers.push_back(std::move(stream)); // publisher pushes
+     * });
+     * @endcode
+     *
+     * @param command The `_cmd` string key.
+     * @param handler A callback that keeps the stream it is given.
+     */
+    void add_stream_handler(const std::string &command,
+                            StreamHandler handler);
+
+    /**
+     * @brief Register a stream handler whose requests are validated first.
+     * @param command The `_cmd` string key.
+     * @param schema Expected request structure.
+     * @param handler A callback that keeps the stream it is given.
+     */
+    void add_stream_handler(const std::string &command, CompiledSchema schema,
+                            StreamHandler handler);
+
+    /**
+     * @brief Register a handler that takes and returns described structs
+     * (see typed.hpp).
+     *
+     * The request is decoded straight into a `Request`, in whatever codec
+     * it arrived, without a json tree; one that does not match the struct
+     * is answered with an error and the handler is not called. The
+     * returned `Response`'s fields, plus `_success: true`, make up the
+     * response. To fail a request, throw: the client receives an error
+     * response with the exception's message.
+     *
+     * Typed handlers are raw handlers underneath, so the server never
+     * parses their requests either; response caching does not apply.
+     *
+     * @code
+     * server.add_handler<FiboRequest, FiboResponse>(
+     *     "fibo", [](const FiboRequest &req) { return FiboResponse{...}; });
+     * @endcode
+     */
+    template <typename Request, typename Response>
+    void add_handler(const std::string &command,
+                     std::function<Response(const Request &)> handler) {
+        add_raw_handler(command, [handler = std::move(handler)](
+                                     std::string_view data, Codec codec) {
+            Request request{};
+            std::string invalid;
+            Buffer out;
+            if (!decode_typed(data, request, invalid)) {
+                encode(error({}, invalid), codec, out);
+            } else {
+                encode_typed(handler(request), codec, out);
+            }
+            return out;
+        });
+    }
+
+    /**
+     * @brief Set a command's options, such as its Priority.
+     *
+     * May be called before or after the command is registered, and while
+     * the server runs; re-registering the command keeps them. `_commands`
+     * and `_stats` are Priority::High. Changing the CacheOptions of a
+     * command replaces its cache with an empty one.
+     */
+    void set_options(const std::string &command, HandlerOptions options);
+
+    /**
+     * @brief Bound the requests waiting for the thread pool.
+     *
+     * By default the queue is unbounded. With a bound, a request arriving
+     * while `capacity` requests wait is handled per `overflow`; a request
+     * turned away gets a "Server overloaded" error response. Without a
+     * thread pool requests are handled as they arrive and never queue.
+     *
+     * @param capacity Most requests waiting; 0 for unbounded.
+     * @param overflow Policy when full.
+     */
+    void set_queue_limit(std::size_t capacity,
+                         Overflow overflow = Overflow::Reject);
+
+    /**
+     * @brief The commands currently registered.
+     *
+     * A table never changes once published; a later registration publishes
+     * a new one. The table stays valid for as long as the returned pointer
+     * is held, and is freed once the last holder lets go.
+     */
+    std::shared_ptr<const CommandTable> commands() const;
+
+    /**
+     * @brief Request counts and latency summaries per command, plus thread
+     * pool gauges; what the reserved `_stats` command returns.
+     */
+    json stats() const;
+
+    /**
+     * @brief The same metrics in the Prometheus text exposition format;
+     * also returned by `_stats` when the request has
+     * `"format": "prometheus"`.
+     */
+    std::string metrics_text() const;
+
+    /**
+     * @brief Turn request timing on or off (on by default).
+     *
+     * Timing reads the clock a few times per request. With it off, requests
+     * are not counted either; unknown commands still are.
+     */
+    void set_metrics_enabled(bool enabled) { metrics_enabled_ = enabled; }
+
+    /**
+     * @brief Start the server. Blocks until stop() is called.
+     *
+     * With a blocking transport, one thread receives requests in turn; with an
+     * EventTransport (e.g. EpollTcpTransport), the transport's reactors accept
+     * and read connections and only complete requests are dispatched. With
+     * several transports, each gets such a thread (the last one the calling
+     * thread), and all of them dispatch to the same pool.
+     *
+     * @throws std::logic_error if the server has no transport.
      */
     void start();
 
     /**
      * @brief Stop the server and cleanup.
+     *
+     * Requests still running are not waited for, and their responses are
+     * lost; drain() lets them finish.
      */
     void stop();
 
+    /**
+     * @brief Shut down without dropping requests: stop taking new ones,
+     * let those already received finish, then stop().
+     *
+     * May be called from any thread while start() runs. The transport
+     * stops accepting and reading (see Transport::stop_listening()), open
+     * subscriptions end, and every request received so far, queued ones
+     * included, runs and is answered. Once they have, or once `timeout`
+     * has passed, the server stops and start() returns.
+     *
+     * @return Whether every request finished in time.
+     */
+    bool drain(std::chrono::milliseconds timeout);
+
+    /**
+     * @brief Hand the listening sockets to a replacement process, then
+     * drain (see handoff.hpp).
+     *
+     * Listens on the Unix socket `handoff_path` and blocks until a new
+     * process calls take_over() on the same path. That process receives
+     * duplicates of the sockets and reports back once its start() serves
+     * on them (both servers must list their transports in the same order);
+     * only then does this server drain within `timeout`. Until
+     * that moment both processes accept, so no connection attempt fails
+     * during a restart. If the new process goes away before it serves,
+     * this server carries on and waits for the next one.
+     *
+     * @code
+     * std::thread restart([&] { server.hand_off("/run/app.handoff", 5s); });
+     * server.start(); // returns once a replacement has taken over
+     * restart.join();
+     * @endcode
+     *
+     * @return Whether the sockets were handed off and every request
+     * finished in time; false without draining if stop() is called first
+     * or a transport cannot share its sockets.
+     * @throws std::runtime_error if `handoff_path` cannot be listened on.
+     */
+    bool hand_off(const std::string &handoff_path,
+                  std::chrono::milliseconds timeout);
+
+    /**
+     * @brief Serve on the sockets of the server listening on
+     * `handoff_path` (see hand_off()) instead of binding new ones.
+     *
+     * Call before start(), which tells the old server once it serves. With
+     * no server to take over from, start() binds as usual.
+     *
+     * @return Whether sockets were taken over.
+     * @throws std::runtime_error if the handoff fails halfway, or the old
+     * server has a different number of transports.
+     * @throws std::logic_error if the transport cannot adopt sockets.
+     */
+    bool take_over(const std::string &handoff_path);
+
   private:
-    void serve(); ///< Main loop for receiving requests
+    /// Receive from `transport` until stopped; for event transports, run
+    /// it. Runs on its own thread per transport.
+    void serve(Transport &transport);
+    void serve_events(EventTransport &transport); ///< Event-driven serving
+
+    /// Add or replace a command and publish the new table once serving.
+    void add_command(Command command);
+
+    /// Build a table from registry_ and make it current. Caller holds
+    /// registry_mutex_.
+    void publish();
+
+    /// Route a request by its scanned `_cmd`, rejecting unknown commands,
+    /// and run it on the pool (or inline without one).
+    void dispatch(Transport &transport, Buffer data, std::string client_id);
+
+    /// Pool job: run the most urgent queued request, unless its deadline
+    /// has passed.
+    void run_next();
+
+    /// Answer `Deadline exceeded`, without running the handler, if
+    /// `deadline` (now_ns() time; negative for none) has passed. True if
+    /// the request was turned away (and finished).
+    bool reject_expired(Transport &transport, const Buffer &data,
+                        const std::string &client_id, std::int64_t deadline);
+
+    /// Turn away a request the queue has no room for.
+    void shed(const PendingRequest &request);
+
+    /// Run a batch's entries, spread over idle pool workers, and return
+    /// their responses in order. Runs on the calling thread as well.
+    /// Entries not started by `deadline` (now_ns() time; negative for none)
+    /// are answered with an error instead.
+    json run_batch(const json &requests, const CommandTable &table,
+                   std::int64_t deadline);
+
+    /// Route and run one batch entry; errors become error responses.
+    json run_one(const json &request, const CommandTable &table);
+
+    /// Parse a request routed to an asynchronous handler and call it. The
+    /// Reply it gets encodes, sends and records the response, and holds
+    /// `table`, which `command` belongs to, until then.
+    void start_async(Transport &transport, const Buffer &data,
+                     const std::string &client_id,
+                     std::shared_ptr<const CommandTable> table,
+                     const Command &command, Codec codec,
+                     std::int64_t received, RequestTiming timing);
+
+    /// Call an asynchronous handler and wait for its reply.
+    json await_reply(const Command &command, const json &request);
+
+    /// Send an encoded response for `command` and record its timing, if
+    /// timed.
+    void deliver(Transport &transport, const Buffer &out,
+                 const std::string &client_id, const Command &command,
+                 RequestTiming *timing, std::int64_t received);
+
+    class StreamSink;
 
-    std::unique_ptr<Transport> transport_; ///< Communication backend
-    std::unordered_map<std::string, Handler>
-        handlers_; ///< Registered command handlers
+    /// Parse a request routed to a stream handler and hand it a Stream.
+    void open_stream(Transport &transport, const Buffer &data,
+                     const std::string &client_id, const Command &command,
+                     Codec codec, std::int64_t received,
+                     RequestTiming timing);
+
+    /// If `client_id` names an open subscription on `transport`, this
+    /// message cancels it; returns whether it did.
+    bool cancel_stream(Transport &transport, const std::string &client_id);
+
+    /// Forget a subscription that has ended.
+    void end_stream(Transport &transport, const std::string &client_id);
+
+    /// A request has been answered (a stream: has ended), or a pool job
+    /// has returned; wakes drain() and ~Server when it was the last.
+    void finish_request();
+
+    /// Send every open subscription its final frame.
+    void end_streams();
+
+    /// Answer a request with an error without parsing it.
+    void reject(Transport &transport, std::string_view data,
+                const std::string &message, const std::string &client_id);
+
+    /// Parse, route and answer a single request with `table`. `command` is
+    /// the command the scanner routed it to, or null if `_cmd` must be
+    /// parsed first. `received` is when it arrived (see now_ns() in
+    /// server.cpp), or negative if metrics are off; `deadline` is when the
+    /// client gives up, or negative.
+    void handle_request(Transport &transport, const Buffer &data,
+                        const std::string &client_id,
+                        const std::shared_ptr<const CommandTable> &table,
+                        const Command *command, std::int64_t received,
+                        std::int64_t deadline);
+
+    /// Parse a request as `Request` (json or ArenaJson), run its handler and
+    /// encode the response into `out`, filling `timing` if not null.
+    /// Returns the command that handled it, if any.
+    template <typename Request>
+    const Command *respond(std::string_view data, Codec codec,
+                           const CommandTable &table, const Command *routed,
+                           Buffer &out, RequestTiming *timing);
+
+    /// Communication backends; fixed once started.
+    std::vector<std::unique_ptr<Transport>> transports_;
     std::shared_ptr<ThreadPool>
         thread_pool_; ///< Optional thread pool for concurrent request handling
     std::atomic<bool> running_ = false; ///< Run state flag
+
+    std::mutex registry_mutex_;     ///< Serializes registrations
+    std::vector<Command> registry_; ///< Commands, in registration order
+    bool started_ = false;          ///< Transports are fixed from then on
+    /// Current table; read and replaced with std::atomic_load/store. Every
+    /// request holds the table it was routed with until it is answered.
+    std::shared_ptr<const CommandTable> commands_;
+
+    /// Options by command name, including commands not registered yet.
+    std::map<std::string, HandlerOptions> options_;
+
+    /// A subscription's transport and client_id; client IDs are only
+    /// unique per transport.
+    using StreamKey = std::pair<const Transport *, std::string>;
+
+    std::mutex streams_mutex_; ///< Protects streams_
+    /// Open subscriptions. Weak, so that a stream its handler has dropped
+    /// still ends.
+    std::map<StreamKey, std::weak_ptr<Stream::State>> streams_;
+    std::atomic<std::size_t> open_streams_{0}; ///< streams_.size()
+
+    /// Requests received and not yet answered, queued ones included, plus
+    /// pool jobs that have not returned.
+    std::atomic<std::size_t> in_flight_{0};
+    std::atomic<bool> draining_ = false;
+    std::mutex drain_mutex_;          ///< Pairs with drained_
+    std::condition_variable drained_; ///< in_flight_ may have reached 0
+
+    std::mutex handoff_mutex_; ///< Protects the three below
+    bool stopped_ = false;     ///< stop() has been called
+    /// Sockets hand_off() waits on; stop() shuts them down to wake it.
+    int handoff_listener_ = -1;
+    int handoff_channel_ = -1;
+    int takeover_channel_ = -1; ///< From take_over(): told once serving
+
+    AdmissionQueue queue_;                     ///< Waiting for the pool
+    Metrics metrics_;                          ///< Per-command statistics
+    std::atomic<bool> metrics_enabled_ = true; ///< Time requests
 };
 
 } // namespace Socks
@@ -0,0 +1,717 @@
+#include "shm.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <new>
+#include <signal.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace Socks {
+
+// ==========================
+// Segment layout
+// ==========================
+//
+// Every structure below is mapped straight onto the segment; offsets and
+// sizes are part of the wire format (docs/shared_memory.md) and must not
+// change without bumping kSegmentVersion.
+
+namespace {
+
+constexpr std::uint32_t kSegmentMagic = 0x31534B53; ///< "SKS1"
+constexpr std::uint32_t kSegmentVersion = 1;
+constexpr std::size_t kMaxSlots = 1024;
+constexpr std::size_t kMinRingBytes = 4096;
+constexpr std::size_t kMaxRingBytes = std::size_t(1) << 30;
+constexpr std::uint32_t kRecordHeaderSize = 8; ///< length, tag
+
+constexpr int kSpinIterations = 2000;       ///< Polls before sleeping
+constexpr long kWaitSliceNs = 100'000'000L; ///< Longest single futex sleep
+constexpr int kAttachAttempts = 100;        ///< 1 ms apart
+
+enum SlotState : std::uint32_t {
+    kSlotFree = 0,
+    kSlotInUse = 1,
+    kSlotClosing = 2, ///< Released by its client, not yet reclaimed
+};
+
+struct SegmentHeader {
+    std::atomic<std::uint32_t> magic; ///< Written last by bind()
+    std::uint32_t version;
+    std::uint32_t slot_count;
+    std::uint32_t ring_bytes;
+    std::uint32_t server_pid;
+    std::atomic<std::uint32_t> closed; ///< Set by the server's close()
+    alignas(64) std::atomic<std::uint32_t> doorbell; ///< Bumped per request
+    std::atomic<std::uint32_t> server_waiting; ///< Server sleeps on doorbell
+};
+
+struct RingControl {
+    alignas(64) std::atomic<std::uint32_t> head; ///< Consumer position
+    std::atomic<std::uint32_t> head_waiters;     ///< Producer sleeps on head
+    alignas(64) std::atomic<std::uint32_t> tail; ///< Producer position
+    std::atomic<std::uint32_t> tail_waiters;     ///< Consumer sleeps on tail
+};
+
+struct alignas(64) SlotHeader {
+    std::atomic<std::uint32_t> state;
+    std::atomic<std::uint32_t> generation; ///< Bumped on every reclaim
+    std::atomic<std::uint32_t> owner_pid;
+};
+
+static_assert(sizeof(SegmentHeader) == 128, "segment header layout");
+static_assert(sizeof(RingControl) == 128, "ring control layout");
+static_assert(sizeof(SlotHeader) == 64, "slot header layout");
+static_assert(std::atomic<std::uint32_t>::is_always_lock_free,
+              "shared-memory atomics must be lock-free");
+
+/**
+ * A process-local view of one ring. Positions are free-running 32-bit
+ * counters; the byte at position p lives at data[p & (size - 1)].
+ */
+struct Ring {
+    RingControl *control;
+    char *data;
+    std::uint32_t size;
+
+    std::uint32_t used(std::uint32_t head) const {
+        return control->tail.load() - head;
+    }
+
+    std::uint32_t room(std::uint32_t tail) const {
+        return size - (tail - control->head.load());
+    }
+
+    void copy_in(std::uint32_t pos, const char *src, std::uint32_t n) {
+        std::uint32_t offset = pos & (size - 1);
+        std::uint32_t first = std::min(n, size - offset);
+        std::memcpy(data + offset, src, first);
+        std::memcpy(data, src + first, n - first);
+    }
+
+    void copy_out(std::uint32_t pos, char *dst, std::uint32_t n) const {
+        std::uint32_t offset = pos & (size - 1);
+        std::uint32_t first = std::min(n, size - offset);
+        std::memcpy(dst, data + offset, first);
+        std::memcpy(dst + first, data, n - first);
+    }
+
+    void reset() {
+        control->head.store(0);
+        control->head_waiters.store(0);
+        control->tail.store(0);
+        control->tail_waiters.store(0);
+    }
+};
+
+} // namespace
+
+static std::size_t slot_stride(std::size_t ring_bytes) {
+    return sizeof(SlotHeader) + 2 * (sizeof(RingControl) + ring_bytes);
+}
+
+static std::size_t segment_size(std::size_t slots, std::size_t ring_bytes) {
+    return sizeof(SegmentHeader) + slots * slot_stride(ring_bytes);
+}
+
+static SegmentHeader &header_of(char *base) {
+    return *reinterpret_cast<SegmentHeader *>(base);
+}
+
+static char *slot_base(char *base, std::size_t ring_bytes, std::size_t i) {
+    return base + sizeof(SegmentHeader) + i * slot_stride(ring_bytes);
+}
+
+static SlotHeader &slot_of(char *base, std::size_t ring_bytes,
+                           std::size_t i) {
+    return *reinterpret_cast<SlotHeader *>(slot_base(base, ring_bytes, i));
+}
+
+/// Ring 0 carries requests, ring 1 responses.
+static Ring ring_of(char *base, std::size_t ring_bytes, std::size_t i,
+                    int which) {
+    char *at = slot_base(base, ring_bytes, i) + sizeof(SlotHeader) +
+               which * (sizeof(RingControl) + ring_bytes);
+    return Ring{reinterpret_cast<RingControl *>(at),
+                at + sizeof(RingControl),
+                static_cast<std::uint32_t>(ring_bytes)};
+}
+
+// ==========================
+// Waiting and waking
+// ==========================
+
+static void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+static void futex_wake(std::atomic<std::uint32_t> &word) {
+    syscall(SYS_futex, reinterpret_cast<std::uint32_t *>(&word), FUTEX_WAKE,
+            INT_MAX, nullptr, nullptr, 0);
+}
+
+/// Sleep while `word` holds `expected`. Returns false on timeout.
+static bool futex_wait(std::atomic<std::uint32_t> &word,
+                       std::uint32_t expected) {
+    timespec slice{0, kWaitSliceNs};
+    long rc = syscall(SYS_futex, reinterpret_cast<std::uint32_t *>(&word),
+                      FUTEX_WAIT, expected, &slice, nullptr, 0);
+    return !(rc == -1 && errno == ETIMEDOUT);
+}
+
+/**
+ * Wait until `ready()` holds. `word` is the futex word that changes when
+ * the other side makes progress, and `waiters` is the flag that tells the
+ * other side to wake it. Spins briefly before sleeping. Each time a sleep
+ * times out, `on_timeout()` runs and may throw to give up.
+ *
+ * The flag is raised before `word` is read again. publish() stores `word`
+ * before it reads the flag. With both sequentially consistent, either the
+ * sleeper sees the new value or the publisher sees the flag and wakes it.
+ */
+template <typename Ready, typename OnTimeout>
+static void await(std::atomic<std::uint32_t> &word,
+                  std::atomic<std::uint32_t> &waiters, Ready &&ready,
+                  OnTimeout &&on_timeout) {
+    for (int i = 0; i < kSpinIterations; ++i) {
+        if (ready())
+            return;
+        cpu_relax();
+    }
+    while (!ready()) {
+        waiters.store(1);
+        std::uint32_t seen = word.load();
+        bool woken = ready() || futex_wait(word, seen);
+        waiters.store(0);
+        if (!woken)
+            on_timeout();
+    }
+}
+
+static void publish(std::atomic<std::uint32_t> &word,
+                    std::atomic<std::uint32_t> &waiters,
+                    std::uint32_t value) {
+    word.store(value);
+    if (waiters.load())
+        futex_wake(word);
+}
+
+/// Tell the server a request (or a released slot) is waiting.
+static void ring_doorbell(SegmentHeader &header) {
+    header.doorbell.fetch_add(1);
+    if (header.server_waiting.load())
+        futex_wake(header.doorbell);
+}
+
+// ==========================
+// Records
+// ==========================
+
+static std::runtime_error oversized(std::size_t size, std::size_t limit) {
+    return std::runtime_error("Message of " + std::to_string(size) +
+                              " bytes exceeds max message size of " +
+                              std::to_string(limit) + " bytes");
+}
+
+/**
+ * Append one record (length, tag, payload) to a ring. The header is written
+ * whole; the payload streams through as the consumer frees space, so it may
+ * be larger than the ring. `on_progress()` runs each time more of the record
+ * becomes visible, starting with the header, so the consumer can be alerted
+ * before the producer has to wait.
+ */
+template <typename OnProgress, typename OnTimeout>
+static void write_record(Ring &ring, std::uint32_t tag, const char *data,
+                         std::size_t size, OnProgress &&on_progress,
+                         OnTimeout &&on_timeout) {
+    RingControl &c = *ring.control;
+    std::uint32_t tail = c.tail.load(std::memory_order_relaxed);
+    std::uint32_t header[2] = {static_cast<std::uint32_t>(size), tag};
+
+    await(c.head, c.head_waiters,
+          [&] { return ring.room(tail) >= kRecordHeaderSize; }, on_timeout);
+    ring.copy_in(tail, reinterpret_cast<const char *>(header),
+                 kRecordHeaderSize);
+    tail += kRecordHeaderSize;
+
+    const char *src = data;
+    std::size_t left = size;
+    while (true) {
+        std::uint32_t n = static_cast<std::uint32_t>(
+            std::min<std::size_t>(left, ring.room(tail)));
+        ring.copy_in(tail, src, n);
+        src += n;
+        left -= n;
+        tail += n;
+        publish(c.tail, c.tail_waiters, tail);
+        on_progress();
+        if (left == 0)
+            return;
+        await(c.head, c.head_waiters, [&] { return ring.room(tail) > 0; },
+              on_timeout);
+    }
+}
+
+/**
+ * Take the next record off a ring into a std::string or Buffer, waiting for
+ * it to arrive. A record above `limit` is consumed and discarded, then
+ * reported by throwing.
+ */
+template <typename Bytes, typename OnTimeout>
+static void read_record(Ring &ring, std::uint32_t &tag, Bytes &payload,
+                        std::size_t limit, OnTimeout &&on_timeout) {
+    RingControl &c = *ring.control;
+    std::uint32_t head = c.head.load(std::memory_order_relaxed);
+
+    await(c.tail, c.tail_waiters,
+          [&] { return ring.used(head) >= kRecordHeaderSize; }, on_timeout);
+    std::uint32_t header[2];
+    ring.copy_out(head, reinterpret_cast<char *>(header), kRecordHeaderSize);
+    head += kRecordHeaderSize;
+    std::uint32_t length = header[0];
+    tag = header[1];
+
+    bool keep = length <= limit;
+    payload.resize(keep ? length : 0);
+    std::uint32_t done = 0;
+    while (true) {
+        std::uint32_t n = std::min(length - done, ring.used(head));
+        if (keep)
+            ring.copy_out(head, payload.data() + done, n);
+        done += n;
+        head += n;
+        publish(c.head, c.head_waiters, head);
+        if (done == length)
+            break;
+        await(c.tail, c.tail_waiters, [&] { return ring.used(head) > 0; },
+              on_timeout);
+    }
+    if (!keep)
+        throw oversized(length, limit);
+}
+
+// ==========================
+// Slot ownership
+// ==========================
+
+/// Take (F_WRLCK) or drop (F_UNLCK) the lock on a slot's byte.
+static bool lock_slot(int fd, std::size_t slot, short type) {
+    struct flock lock{};
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = static_cast<off_t>(slot);
+    lock.l_len = 1;
+    return fcntl(fd, F_OFD_SETLK, &lock) == 0;
+}
+
+static char *map_segment(int fd, std::size_t size) {
+    void *base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    return base == MAP_FAILED ? nullptr : static_cast<char *>(base);
+}
+
+// ==========================
+// SharedMemoryTransport
+// ==========================
+
+SharedMemoryTransport::SharedMemoryTransport(const std::string &name,
+                                             std::size_t slots,
+                                             std::size_t ring_bytes)
+    : name_(!name.empty() && name[0] == '/' ? name : "/" + name),
+      slot_count_(slots), ring_bytes_(ring_bytes) {
+    if (slots == 0 || slots > kMaxSlots)
+        throw std::invalid_argument("Shared memory slot count must be "
+                                    "between 1 and " +
+                                    std::to_string(kMaxSlots));
+    if (ring_bytes < kMinRingBytes || ring_bytes > kMaxRingBytes ||
+        (ring_bytes & (ring_bytes - 1)) != 0)
+        throw std::invalid_argument("Shared memory ring size must be a "
+                                    "power of two between 4 KiB and 1 GiB");
+}
+
+SharedMemoryTransport::~SharedMemoryTransport() {
+    close();
+    if (base_)
+        munmap(base_, mapped_size_);
+    if (fd_ != -1)
+        ::close(fd_);
+}
+
+void SharedMemoryTransport::bind() {
+    shm_unlink(name_.c_str()); // left behind by a server that crashed
+    int fd = shm_open(name_.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+                      0600);
+    if (fd == -1)
+        throw std::runtime_error("Failed to create shared memory segment " +
+                                 name_);
+
+    std::size_t size = segment_size(slot_count_, ring_bytes_);
+    char *base = nullptr;
+    if (ftruncate(fd, static_cast<off_t>(size)) == 0)
+        base = map_segment(fd, size);
+    if (!base) {
+        ::close(fd);
+        shm_unlink(name_.c_str());
+        throw std::runtime_error("Failed to map shared memory segment " +
+                                 name_);
+    }
+
+    SegmentHeader &header = *new (base) SegmentHeader();
+    header.version = kSegmentVersion;
+    header.slot_count = static_cast<std::uint32_t>(slot_count_);
+    header.ring_bytes = static_cast<std::uint32_t>(ring_bytes_);
+    header.server_pid = static_cast<std::uint32_t>(getpid());
+    for (std::size_t i = 0; i < slot_count_; ++i) {
+        new (slot_base(base, ring_bytes_, i)) SlotHeader();
+        for (int which = 0; which < 2; ++which)
+            new (ring_of(base, ring_bytes_, i, which).control) RingControl();
+    }
+
+    // A server started again gets a fresh segment; the previous one, kept
+    // by close() for the responses then in flight, goes now.
+    if (base_)
+        munmap(base_, mapped_size_);
+    if (fd_ != -1)
+        ::close(fd_);
+    fd_ = fd;
+    base_ = base;
+    mapped_size_ = size;
+    server_ = true;
+    closed_ = false;
+    slot_mutexes_ = std::make_unique<std::mutex[]>(slot_count_);
+    partials_ = std::make_unique<Partial[]>(slot_count_);
+    header.magic.store(kSegmentMagic, std::memory_order_release);
+}
+
+std::string SharedMemoryTransport::receive(std::string &client_id) {
+    Buffer message = receive_buffer(client_id);
+    return std::string(message.view());
+}
+
+Buffer SharedMemoryTransport::receive_buffer(std::string &client_id) {
+    if (!server_)
+        throw std::runtime_error("Shared memory transport is not bound");
+    SegmentHeader &header = header_of(base_);
+
+    while (true) {
+        if (closed_)
+            throw std::runtime_error("Transport closed");
+
+        // Read the doorbell before scanning so a request that lands during
+        // the scan still ends the wait below.
+        std::uint32_t seen = header.doorbell.load();
+        for (std::size_t n = 0; n < slot_count_; ++n) {
+            std::size_t i = (poll_cursor_ + n) % slot_count_;
+            std::uint32_t state = slot_of(base_, ring_bytes_, i).state.load();
+            if (state == kSlotClosing) {
+                reclaim(i);
+                continue;
+            }
+            if (state != kSlotInUse)
+                continue;
+
+            Partial complete;
+            if (!read_available(i, complete))
+                continue;
+            poll_cursor_ = i + 1;
+            if (complete.payload.size() != complete.length)
+                throw oversized(complete.length, max_message_size_);
+            client_id = std::to_string(i) + ":" +
+                        std::to_string(complete.generation) + ":" +
+                        std::to_string(complete.tag);
+            return std::move(complete.payload);
+        }
+
+        await(header.doorbell, header.server_waiting,
+              [&] { return header.doorbell.load() != seen || closed_; },
+              [&] { sweep(); });
+    }
+}
+
+/**
+ * Take whatever has arrived of the request on `slot` without waiting. Once
+ * the whole record is in, it is moved to `complete` and true is returned.
+ * A record over max_message_size_ is consumed and discarded, and comes back
+ * with an empty payload.
+ */
+bool SharedMemoryTransport::read_available(std::size_t slot,
+                                           Partial &complete) {
+    Partial &partial = partials_[slot];
+    Ring ring = ring_of(base_, ring_bytes_, slot, 0);
+    RingControl &c = *ring.control;
+    std::uint32_t head = c.head.load(std::memory_order_relaxed);
+
+    if (!partial.started) {
+        if (ring.used(head) < kRecordHeaderSize)
+            return false;
+        std::uint32_t header[2];
+        ring.copy_out(head, reinterpret_cast<char *>(header),
+                      kRecordHeaderSize);
+        head += kRecordHeaderSize;
+        partial.started = true;
+        partial.generation = slot_of(base_, ring_bytes_, slot).generation;
+        partial.length = header[0];
+        partial.tag = header[1];
+        partial.done = 0;
+        partial.payload.resize(
+            partial.length <= max_message_size_ ? partial.length : 0);
+    }
+
+    std::uint32_t n = std::min(partial.length - partial.done, ring.used(head));
+    if (partial.payload.size() == partial.length)
+        ring.copy_out(head, partial.payload.data() + partial.done, n);
+    partial.done += n;
+    head += n;
+    publish(c.head, c.head_waiters, head);
+    if (partial.done != partial.length)
+        return false;
+
+    complete = std::move(partial);
+    partial = Partial();
+    return true;
+}
+
+void SharedMemoryTransport::send(const std::string &data,
+                                 const std::string &client_id) {
+    send_bytes(data.data(), data.size(), client_id);
+}
+
+void SharedMemoryTransport::send_buffer(const Buffer &data,
+                                        const std::string &client_id) {
+    send_bytes(data.data(), data.size(), client_id);
+}
+
+void SharedMemoryTransport::send_bytes(const char *data, std::size_t size,
+                                       const std::string &client_id) {
+    if (size > max_message_size_ || size > UINT32_MAX)
+        throw oversized(size, max_message_size_);
+
+    char *end = nullptr;
+    std::size_t i = std::strtoull(client_id.c_str(), &end, 10);
+    auto generation =
+        static_cast<std::uint32_t>(std::strtoul(end + 1, &end, 10));
+    auto tag = static_cast<std::uint32_t>(std::strtoul(end + 1, nullptr, 10));
+    if (!server_ || i >= slot_count_)
+        throw std::runtime_error("Invalid client id: " + client_id);
+
+    std::lock_guard<std::mutex> lock(slot_mutexes_[i]);
+    if (closed_)
+        throw std::runtime_error("Transport closed");
+    SlotHeader &slot = slot_of(base_, ring_bytes_, i);
+    if (slot.state.load() != kSlotInUse ||
+        slot.generation.load() != generation)
+        throw std::runtime_error("Connection " + client_id +
+                                 " is no longer open");
+
+    Ring ring = ring_of(base_, ring_bytes_, i, 1);
+    write_record(ring, tag, data, size, [] {}, [&] {
+        if (closed_)
+            throw std::runtime_error("Transport closed");
+        if (abandoned(i))
+            throw std::runtime_error("Connection " + client_id +
+                                     " is no longer open");
+    });
+}
+
+std::string SharedMemoryTransport::send(const std::string &data) {
+    return send_until(data, kNoDeadline);
+}
+
+std::string SharedMemoryTransport::send_until(const std::string &data,
+                                              Deadline deadline) {
+    if (data.size() > max_message_size_ || data.size() > UINT32_MAX)
+        throw oversized(data.size(), max_message_size_);
+
+    // A server that shut down cleanly is replaced on the next attach.
+    if (attached_ && header_of(base_).closed.load())
+        detach();
+    if (!attached_)
+        attach();
+
+    // The deadline is checked whenever a wait slice ends, so it may be
+    // overrun by up to kWaitSliceNs. A record cut short leaves the rings
+    // out of step, so the slot is given up, as when the server is gone,
+    // and the next send() claims a fresh one.
+    auto on_timeout = [this, deadline] {
+        if (server_gone()) {
+            detach();
+            throw std::runtime_error("Connection closed by server");
+        }
+        if (std::chrono::steady_clock::now() >= deadline) {
+            detach();
+            throw RequestTimeout();
+        }
+    };
+
+    std::uint32_t tag = ++next_tag_;
+    Ring requests = ring_of(base_, ring_bytes_, slot_, 0);
+    write_record(
+        requests, tag, data.data(), data.size(),
+        [this] { ring_doorbell(header_of(base_)); }, on_timeout);
+
+    Ring responses = ring_of(base_, ring_bytes_, slot_, 1);
+    std::uint32_t response_tag = 0;
+    std::string response;
+    do {
+        read_record(responses, response_tag, response, max_message_size_,
+                    on_timeout);
+    } while (response_tag != tag);
+    return response;
+}
+
+void SharedMemoryTransport::close() {
+    if (!server_) {
+        detach();
+        return;
+    }
+    if (closed_.exchange(true))
+        return;
+
+    SegmentHeader &header = header_of(base_);
+    header.closed.store(1);
+    futex_wake(header.doorbell);
+    for (std::size_t i = 0; i < slot_count_; ++i)
+        futex_wake(ring_of(base_, ring_bytes_, i, 1).control->tail);
+
+    // Only unlink the name if it still refers to this segment; a newer
+    // server may already have replaced it.
+    int current = shm_open(name_.c_str(), O_RDONLY | O_CLOEXEC, 0);
+    if (current != -1) {
+        struct stat ours{}, named{};
+        if (fstat(fd_, &ours) == 0 && fstat(current, &named) == 0 &&
+            ours.st_ino == named.st_ino)
+            shm_unlink(name_.c_str());
+        ::close(current);
+    }
+    // The mapping stays until destruction: receive() and in-flight
+    // responses may still be touching it.
+}
+
+void SharedMemoryTransport::attach() {
+    int fd = shm_open(name_.c_str(), O_RDWR | O_CLOEXEC, 0);
+    if (fd == -1)
+        throw std::runtime_error("Failed to open shared memory segment " +
+                                 name_);
+
+    struct stat info{};
+    char *base = nullptr;
+    std::size_t size = 0;
+    if (fstat(fd, &info) == 0 &&
+        static_cast<std::size_t>(info.st_size) >= sizeof(SegmentHeader)) {
+        size = static_cast<std::size_t>(info.st_size);
+        base = map_segment(fd, size);
+    }
+
+    SegmentHeader *header = base ? &header_of(base) : nullptr;
+    if (!header ||
+        header->magic.load(std::memory_order_acquire) != kSegmentMagic ||
+        header->version != kSegmentVersion || header->closed.load() ||
+        size != segment_size(header->slot_count, header->ring_bytes)) {
+        if (base)
+            munmap(base, size);
+        ::close(fd);
+        throw std::runtime_error("Shared memory segment " + name_ +
+                                 " is not served");
+    }
+
+    // Slots released or abandoned by earlier clients become free once the
+    // server reclaims them; ask it to and retry for a short while.
+    for (int attempt = 0; attempt < kAttachAttempts; ++attempt) {
+        bool reclaimable = false;
+        for (std::size_t i = 0; i < header->slot_count; ++i) {
+            if (!lock_slot(fd, i, F_WRLCK))
+                continue;
+            SlotHeader &slot = slot_of(base, header->ring_bytes, i);
+            if (slot.state.load() == kSlotFree) {
+                slot.owner_pid.store(static_cast<std::uint32_t>(getpid()));
+                slot.state.store(kSlotInUse);
+
+                fd_ = fd;
+                base_ = base;
+                mapped_size_ = size;
+                slot_count_ = header->slot_count;
+                ring_bytes_ = header->ring_bytes;
+                slot_ = i;
+                attached_ = true;
+                return;
+            }
+            // Lockable but not free: its owner is gone.
+            slot.state.store(kSlotClosing);
+            lock_slot(fd, i, F_UNLCK);
+            reclaimable = true;
+        }
+        if (!reclaimable)
+            break;
+        ring_doorbell(*header);
+        usleep(1000);
+    }
+
+    munmap(base, size);
+    ::close(fd);
+    throw std::runtime_error("No free client slot in shared memory segment " +
+                             name_);
+}
+
+void SharedMemoryTransport::detach() {
+    if (!attached_)
+        return;
+    attached_ = false;
+
+    slot_of(base_, ring_bytes_, slot_).state.store(kSlotClosing);
+    ::close(fd_); // drops the slot lock
+    fd_ = -1;
+    ring_doorbell(header_of(base_));
+    munmap(base_, mapped_size_);
+    base_ = nullptr;
+}
+
+bool SharedMemoryTransport::abandoned(std::size_t slot) const {
+    if (!lock_slot(fd_, slot, F_WRLCK))
+        return false;
+    lock_slot(fd_, slot, F_UNLCK);
+    return true;
+}
+
+bool SharedMemoryTransport::reclaim(std::size_t i) {
+    std::lock_guard<std::mutex> lock(slot_mutexes_[i]);
+    SlotHeader &slot = slot_of(base_, ring_bytes_, i);
+    if (slot.state.load() == kSlotFree || !lock_slot(fd_, i, F_WRLCK))
+        return false;
+
+    ring_of(base_, ring_bytes_, i, 0).reset();
+    ring_of(base_, ring_bytes_, i, 1).reset();
+    partials_[i] = Partial(); // whatever the client left unfinished
+    slot.owner_pid.store(0);
+    slot.generation.fetch_add(1);
+    slot.state.store(kSlotFree);
+    lock_slot(fd_, i, F_UNLCK);
+    return true;
+}
+
+void SharedMemoryTransport::sweep() {
+    for (std::size_t i = 0; i < slot_count_; ++i)
+        if (slot_of(base_, ring_bytes_, i).state.load() != kSlotFree)
+            reclaim(i);
+}
+
+bool SharedMemoryTransport::server_gone() const {
+    const SegmentHeader &header = header_of(base_);
+    if (header.closed.load())
+        return true;
+    return kill(static_cast<pid_t>(header.server_pid), 0) == -1 &&
+           errno == ESRCH;
+}
+
+} // namespace Socks
@@ -0,0 +1,128 @@
+#pragma once
+
+#include "transport.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+/**
+ * @file shm.hpp
+ * @brief Shared-memory transport for clients and servers on the same host.
+ *
+ * The server creates a POSIX shared-memory segment holding a fixed number
+ * of client slots. Each slot carries two single-producer/single-consumer
+ * byte rings, one for requests and one for responses. Messages are copied
+ * straight into the peer's ring and out of it again. Nothing passes through
+ * the kernel, and futexes put a side to sleep only when it has nothing to
+ * do. The layout is documented in docs/shared_memory.md so that other
+ * languages can attach to the same segment.
+ */
+
+namespace Socks {
+
+/**
+ * @class SharedMemoryTransport
+ * @brief Same-host transport over shared-memory rings with futex wakeups.
+ *
+ * The same constructor is used on both sides, as with UnixSocketTransport.
+ * bind() makes this object the server and creates the segment. On the
+ * client, the first send() attaches to the segment and claims a free slot,
+ * and close() releases it.
+ *
+ * A client owns its slot through an open-file-description lock on one byte
+ * of the segment. The kernel drops that lock when the client process exits,
+ * so the server reclaims slots from crashed clients. It checks for this
+ * whenever it has been idle for a while.
+ *
+ * Messages larger than a ring are streamed through it in pieces. The server
+ * takes whatever part of a request has arrived and moves on to the next
+ * slot, so a client that stalls halfway through a large request holds up
+ * only itself. The client side performs one round trip at a time:
+ * send(data) is not thread-safe, and Client serializes calls itself.
+ */
+class SharedMemoryTransport : public Transport {
+  public:
+    /**
+     * @brief Construct a shared-memory transport.
+     * @param name Segment name, with or without the leading '/' (the
+     * segment appears as /dev/shm/<name>).
+     * @param slots Number of clients that can be attached at once (server
+     * only; clients use the server's geometry).
+     * @param ring_bytes Size of each ring, a power of two (server only).
+     * @throws std::invalid_argument if slots or ring_bytes is out of range.
+     */
+    explicit SharedMemoryTransport(const std::string &name,
+                                   std::size_t slots = 16,
+                                   std::size_t ring_bytes = 1 << 20);
+
+    /**
+     * @brief Release the slot or segment and unmap it.
+     */
+    ~SharedMemoryTransport() override;
+
+    SharedMemoryTransport(const SharedMemoryTransport &) = delete;
+    SharedMemoryTransport &operator=(const SharedMemoryTransport &) = delete;
+
+    void bind() override;
+    std::string receive(std::string &client_id) override;
+    Buffer receive_buffer(std::string &client_id) override;
+    void send(const std::string &data, const std::string &client_id) override;
+    void send_buffer(const Buffer &data,
+                     const std::string &client_id) override;
+    std::string send(const std::string &data) override;
+    std::string send_until(const std::string &data,
+                           Deadline deadline) override;
+    void close() override;
+
+    /**
+     * @brief The segment name, including the leading '/'.
+     */
+    const std::string &name() const { return name_; }
+
+  private:
+    /// A request being taken off a slot's ring, as much as has arrived.
+    struct Partial {
+        bool started = false; ///< The record header has been read
+        std::uint32_t generation = 0;
+        std::uint32_t tag = 0;
+        std::uint32_t length = 0;
+        std::uint32_t done = 0; ///< Payload bytes consumed so far
+        Buffer payload;         ///< Left empty if length is over the limit
+    };
+
+    bool read_available(std::size_t slot, Partial &complete);
+    void send_bytes(const char *data, std::size_t size,
+                    const std::string &client_id);
+    void attach();
+    void detach();
+    bool reclaim(std::size_t slot);
+    bool abandoned(std::size_t slot) const;
+    void sweep();
+    bool server_gone() const;
+
+    std::string name_;
+    std::size_t slot_count_;
+    std::size_t ring_bytes_;
+
+    int fd_ = -1;
+    char *base_ = nullptr;
+    std::size_t mapped_size_ = 0;
+
+    // Server side
+    bool server_ = false;
+    std::atomic<bool> closed_ = false;
+    std::unique_ptr<std::mutex[]>
+        slot_mutexes_; ///< Serialize responses and reclaiming, per slot
+    std::size_t poll_cursor_ = 0; ///< Rotates which slot is read first
+    std::unique_ptr<Partial[]> partials_; ///< By slot; receive thread only
+
+    // Client side
+    std::size_t slot_ = 0;
+    bool attached_ = false;
+    std::uint32_t next_tag_ = 0;
+};
+
+} // namespace Socks
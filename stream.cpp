@@ -0,0 +1,148 @@
+#include "stream.hpp"
+
+#include <mutex>
+#include <optional>
+
+namespace Socks {
+
+namespace {
+
+json end_frame() { return json{{"_success", true}, {"_end", true}}; }
+
+} // namespace
+
+struct Stream::State {
+    explicit State(std::shared_ptr<Sink> sink) : sink(std::move(sink)) {}
+
+    ~State() {
+        // The last handle is gone and no send is under way, since a send
+        // holds the state too.
+        if (!ended) {
+            sink->send(end_frame());
+            sink->ended();
+        }
+    }
+
+    std::shared_ptr<Sink> sink;
+
+    std::mutex mutex;           ///< Protects everything below
+    std::optional<json> latest; ///< Newest frame not sent yet
+    bool sending = false;       ///< A drain() is scheduled or running
+    bool closing = false;       ///< Final frame follows what is waiting
+    bool ended = false;
+    std::uint64_t coalesced = 0;
+};
+
+Stream::Stream(std::shared_ptr<Sink> sink)
+    : state_(std::make_shared<State>(std::move(sink))) {}
+
+bool Stream::push(json frame) const {
+    {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        if (state_->ended || state_->closing)
+            return false;
+        if (state_->latest)
+            ++state_->coalesced;
+        state_->latest = std::move(frame);
+        if (state_->sending)
+            return true; // picked up by the drain() under way
+        state_->sending = true;
+    }
+    auto state = state_;
+    state_->sink->post([state]() { drain(state); });
+    return true;
+}
+
+void Stream::close() const { end(state_); }
+
+bool Stream::is_open() const {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    return !state_->ended && !state_->closing;
+}
+
+std::uint64_t Stream::coalesced() const {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    return state_->coalesced;
+}
+
+void Stream::cancel(const std::weak_ptr<State> &weak) {
+    std::shared_ptr<State> state = weak.lock();
+    if (!state)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        if (state->ended || state->closing)
+            return;
+        state->closing = true;
+        state->latest.reset();
+        if (state->sending)
+            return;
+        state->sending = true;
+    }
+    state->sink->post([state]() { drain(state); });
+}
+
+void Stream::end(const std::weak_ptr<State> &weak) {
+    std::shared_ptr<State> state = weak.lock();
+    if (!state)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        if (state->ended || state->closing)
+            return;
+        state->closing = true;
+        if (state->sending)
+            return;
+        state->sending = true;
+    }
+    state->sink->post([state]() { drain(state); });
+}
+
+void Stream::drain(const std::shared_ptr<State> &state) {
+    while (true) {
+        json frame;
+        bool last = false;
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            if (state->ended || (!state->latest && !state->closing)) {
+                state->sending = false;
+                return;
+            }
+            // One frame in the transport at a time: until it has been
+            // written, newer frames keep replacing `latest`. The transport
+            // holds only a weak reference, so a dropped stream still ends.
+            std::weak_ptr<State> weak = state;
+            if (state->sink->wait_drained([weak]() {
+                    if (auto resumed = weak.lock())
+                        resumed->sink->post([resumed]() { drain(resumed); });
+                }))
+                return;
+            if (state->latest) {
+                frame = std::move(*state->latest);
+                state->latest.reset();
+                last = state->sink->once();
+            } else {
+                frame = end_frame();
+                last = true;
+            }
+        }
+        if (!state->sink->send(frame) || last) {
+            finish(state);
+            return;
+        }
+    }
+}
+
+void Stream::finish(const std::shared_ptr<State> &state) {
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        if (state->ended)
+            return;
+        state->ended = true;
+        state->latest.reset();
+        state->sending = false;
+    }
+    state->sink->ended();
+}
+
+} // namespace Socks
@@ -0,0 +1,120 @@
+#pragma once
+
+#include "nlohmann/json.hpp"
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+/**
+ * @file stream.hpp
+ * @brief Server push: frames sent to a subscriber until either side stops.
+ *
+ * A client subscribes by sending a request to a command registered with
+ * Server::add_stream_handler() (see Client::subscribe()). The handler
+ * keeps the Stream it is given and pushes frames into it from any thread.
+ * Each frame reaches the subscriber as one more response to its request,
+ * on the same persistent connection.
+ *
+ * Frames coalesce, latest value wins: a stream holds at most one frame
+ * that has not been sent, and a newer push replaces it. Where the
+ * transport queues what the socket cannot take (the epoll transports), the
+ * next frame is not sent until the previous one has been written. A slow
+ * subscriber therefore receives fewer frames, always the newest, and
+ * nothing piles up for it on the server.
+ */
+
+namespace Socks {
+
+using json = nlohmann::json;
+
+/**
+ * @class Stream
+ * @brief The sending end of one subscription.
+ *
+ * Copies refer to the same subscription, and every member may be called
+ * from any thread. The stream ends when close() is called, when the
+ * subscriber cancels, when its connection goes away, or when the last copy
+ * is destroyed. The subscriber is sent a final `{"_success": true, "_end":
+ * true}` frame unless its connection is gone. After that push() returns
+ * false, so publishers can forget the stream.
+ *
+ * Streams are created by the server, which must outlive them.
+ */
+class Stream {
+  public:
+    /**
+     * @brief Send `frame` (e.g. built with okay()) to the subscriber,
+     * replacing a frame pushed earlier that has not been sent yet.
+     *
+     * Returns at once. The frame is sent from the server's thread pool
+     * (or right here, without one).
+     *
+     * @return false once the stream has ended.
+     */
+    bool push(json frame) const;
+
+    /**
+     * @brief End the stream after any frame still waiting to be sent.
+     */
+    void close() const;
+
+    /**
+     * @brief Whether the stream still accepts frames.
+     */
+    bool is_open() const;
+
+    /**
+     * @brief Frames replaced by a newer one before they could be sent.
+     */
+    std::uint64_t coalesced() const;
+
+  private:
+    friend class Server;
+
+    /// What a stream needs from the server that opened it.
+    class Sink {
+      public:
+        virtual ~Sink() = default;
+
+        /// Encode and send one frame; false once the subscriber is gone.
+        virtual bool send(const json &frame) = 0;
+
+        /// Run `job` soon, off the publisher's thread if possible.
+        virtual void post(std::function<void()> job) = 0;
+
+        /// Arrange for `ready` to run once earlier frames have left (see
+        /// Transport::notify_drained()); false if they already have.
+        virtual bool wait_drained(std::function<void()> ready) = 0;
+
+        /// Whether the stream ends after its first frame: the request
+        /// did not ask for a subscription.
+        virtual bool once() const = 0;
+
+        /// The stream has ended; called once.
+        virtual void ended() = 0;
+    };
+
+    struct State;
+
+    explicit Stream(std::shared_ptr<Sink> sink);
+
+    /// End the stream on the subscriber's request: frames still waiting
+    /// are dropped before the final frame.
+    static void cancel(const std::weak_ptr<State> &state);
+
+    /// End the stream for the server (see Server::drain()): like close(),
+    /// if it has not ended already.
+    static void end(const std::weak_ptr<State> &state);
+
+    /// Send frames until none is waiting, the transport is backed up, or
+    /// the stream ends.
+    static void drain(const std::shared_ptr<State> &state);
+
+    /// Mark the stream ended and tell the sink.
+    static void finish(const std::shared_ptr<State> &state);
+
+    std::shared_ptr<State> state_;
+};
+
+} // namespace Socks
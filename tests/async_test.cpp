@@ -0,0 +1,118 @@
+#include "../client.hpp"
+#include "../coro.hpp"
+#include "harness.hpp"
+
+#include <condition_variable>
+#include <future>
+#include <mutex>
+
+using namespace Socks;
+using namespace SocksTest;
+
+static std::unique_ptr<Transport> listen_at(const std::string &path) {
+    return std::make_unique<EpollUnixTransport>(path);
+}
+
+static std::unique_ptr<Transport> connect_at(const std::string &path) {
+    return std::make_unique<UnixSocketTransport>(path,
+                                                 Framing::LengthPrefixed);
+}
+
+/// An async handler returns its worker at once; the reply goes out when it
+/// is called, from another request's handler here, and a reply dropped
+/// without a call still answers with an error.
+static void replies_outlive_the_handler() {
+    std::string path = socket_path("async");
+    Server server(listen_at(path), std::make_shared<ThreadPool>(1));
+    std::mutex mutex;
+    std::condition_variable arrived;
+    std::vector<Reply> held;
+    server.add_async_handler("hold", [&](const json &request, Reply reply) {
+        std::lock_guard<std::mutex> lock(mutex);
+        held.push_back(reply);
+        arrived.notify_one();
+        if (request.value("twice", false))
+            reply(okay({{"early", true}}));
+    });
+    server.add_handler("release", [&](const json &) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const Reply &reply : held)
+            reply(okay({{"released", held.size()}}));
+        held.clear();
+        return okay({});
+    });
+    server.add_async_handler("drop", [](const json &, Reply) {});
+    ServerThread running(server, path);
+
+    Client client(connect_at(path), Codec::Json, 4);
+    std::future<json> first = client.send_request_async("hold", {});
+    std::future<json> second = client.send_request_async("hold", {});
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        arrived.wait(lock, [&] { return held.size() == 2; });
+    }
+    client.send_request("release", {}); // needs the pool's only worker
+    CHECK(first.get()["released"] == 2);
+    CHECK(second.get()["released"] == 2);
+
+    CHECK(client.send_request("hold", {{"twice", true}})["early"] == true);
+    client.send_request("release", {}); // a second call is ignored
+    CHECK_THROWS(client.send_request("drop", {}));
+}
+
+#ifdef SOCKS_HAVE_COROUTINES
+/// A coroutine handler awaits another server's responses and co_returns
+/// its own; an error it awaits becomes its error response.
+static void coroutines_await_requests() {
+    std::string prices_path = socket_path("prices");
+    Server prices(listen_at(prices_path));
+    prices.add_handler("price", [](const json &request) {
+        return okay({{"value", request.at("item").get<int>() * 10}});
+    });
+    prices.add_handler("missing", [](const json &) {
+        return error({}, "No such item");
+    });
+    ServerThread prices_running(prices, prices_path);
+
+    Client to_prices(connect_at(prices_path), Codec::Json, 4);
+    std::string path = socket_path("coro");
+    Server server(listen_at(path), std::make_shared<ThreadPool>(1));
+    add_coroutine_handler(server, "total", [&](json request) -> Task<json> {
+        int total = 0;
+        for (const json &item : request.at("items")) {
+            json body = {{"item", item}};
+            json price = co_await Socks::request(to_prices, "price", body);
+            total += price["value"].get<int>();
+        }
+        co_return okay({{"total", total}});
+    });
+    add_coroutine_handler(server, "broken", [&](json request) -> Task<json> {
+        co_await Socks::request(to_prices, "missing", request);
+        co_return okay({});
+    });
+    ServerThread running(server, path);
+
+    Client client(connect_at(path), Codec::Json, 4);
+    std::vector<std::future<json>> totals;
+    for (int i = 1; i <= 4; ++i)
+        totals.push_back(
+            client.send_request_async("total", {{"items", {i, i + 1}}}));
+    for (int i = 1; i <= 4; ++i)
+        CHECK(totals[i - 1].get()["total"] == (2 * i + 1) * 10);
+
+    try {
+        client.send_request("broken", {});
+        CHECK(false);
+    } catch (const std::exception &e) {
+        CHECK(std::string(e.what()).find("No such item") != std::string::npos);
+    }
+}
+#endif
+
+int main() {
+    replies_outlive_the_handler();
+#ifdef SOCKS_HAVE_COROUTINES
+    coroutines_await_requests();
+#endif
+    return 0;
+}
@@ -0,0 +1,134 @@
+#include "../client.hpp"
+#include "../framing.hpp"
+#include "harness.hpp"
+
+#include <atomic>
+#include <poll.h>
+
+using namespace Socks;
+using namespace SocksTest;
+
+static void read_bytes(int fd, char *data, size_t size) {
+    while (size > 0) {
+        pollfd pfd{fd, POLLIN, 0};
+        CHECK(::poll(&pfd, 1, 5000) == 1);
+        ssize_t n = ::recv(fd, data, size, 0);
+        CHECK(n > 0);
+        data += n;
+        size -= static_cast<size_t>(n);
+    }
+}
+
+/// Send `text` as one framed request, byte for byte, and decode the answer.
+static json request_text(const std::string &path, const std::string &text) {
+    int fd = connect_to(path);
+    CHECK(fd != -1);
+    unsigned char header[kFrameHeaderSize];
+    encode_frame_header({static_cast<std::uint32_t>(text.size()), 1}, header);
+    std::string frame(reinterpret_cast<char *>(header), sizeof(header));
+    frame += text;
+    CHECK(::send(fd, frame.data(), frame.size(), MSG_NOSIGNAL) ==
+          static_cast<ssize_t>(frame.size()));
+    read_bytes(fd, reinterpret_cast<char *>(header), sizeof(header));
+    std::string reply(decode_frame_header(header).length, '\0');
+    read_bytes(fd, reply.data(), reply.size());
+    ::close(fd);
+    return decode(reply);
+}
+
+/// A server whose "lookup" command counts its calls and caches its
+/// responses per `cache`.
+struct CachedServer {
+    explicit CachedServer(const std::string &name, CacheOptions cache)
+        : path(socket_path(name)),
+          server(std::make_unique<UnixSocketTransport>(
+              path, Framing::LengthPrefixed)) {
+        HandlerOptions options;
+        options.cache = cache;
+        server.add_handler(
+            "lookup",
+            [this](const json &request) {
+                ++calls;
+                return okay({{"key", request.at("key")}});
+            },
+            options);
+    }
+
+    json cache_stats() const {
+        return server.stats()["commands"]["lookup"]["cache"];
+    }
+
+    std::string path;
+    Server server;
+    std::atomic<int> calls = 0;
+};
+
+/// Requests that differ only in member order or reserved fields share an
+/// entry; a hit is answered without running the handler.
+static void hits_skip_the_handler() {
+    CachedServer cached("hits", {16, std::chrono::milliseconds(0)});
+    ServerThread running(cached.server, cached.path);
+
+    json first = request_text(cached.path,
+                              R"({"_cmd":"lookup","key":"a","page":1})");
+    json reordered = request_text(
+        cached.path,
+        R"({"page":1,"_deadline_ms":5000,"key":"a","_cmd":"lookup"})");
+    CHECK(first == reordered);
+    CHECK(first["key"] == "a");
+    CHECK(cached.calls == 1);
+
+    request_text(cached.path, R"({"_cmd":"lookup","key":"a","page":2})");
+    CHECK(cached.calls == 2);
+
+    json stats = cached.cache_stats();
+    CHECK(stats["hits"] == 1);
+    CHECK(stats["misses"] == 2);
+    CHECK(stats["entries"] == 2);
+
+    json request = {{"_cmd", "lookup"}, {"key", "a"}};
+    CHECK(ResponseCache::key_of(request, Codec::Json) !=
+          ResponseCache::key_of(request, Codec::Cbor));
+}
+
+/// A full cache drops its least recently used entry.
+static void least_recently_used_is_evicted() {
+    CachedServer cached("lru", {2, std::chrono::milliseconds(0)});
+    ServerThread running(cached.server, cached.path);
+    Client client(std::make_unique<UnixSocketTransport>(
+        cached.path, Framing::LengthPrefixed));
+
+    // "a" is used again after "b", so "c" evicts "b".
+    for (const char *key : {"a", "b", "a", "c"})
+        client.send_request("lookup", {{"key", key}});
+    CHECK(cached.calls == 3);
+    client.send_request("lookup", {{"key", "a"}});
+    CHECK(cached.calls == 3);
+    client.send_request("lookup", {{"key", "b"}});
+    CHECK(cached.calls == 4);
+    CHECK(cached.cache_stats()["evictions"] == 2);
+    CHECK(cached.cache_stats()["entries"] == 2);
+}
+
+/// An entry older than the TTL is not served.
+static void expired_entries_miss() {
+    CachedServer cached("ttl", {16, std::chrono::milliseconds(50)});
+    ServerThread running(cached.server, cached.path);
+    Client client(std::make_unique<UnixSocketTransport>(
+        cached.path, Framing::LengthPrefixed));
+
+    client.send_request("lookup", {{"key", "a"}});
+    client.send_request("lookup", {{"key", "a"}});
+    CHECK(cached.calls == 1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    json answer = client.send_request("lookup", {{"key", "a"}});
+    CHECK(answer["key"] == "a");
+    CHECK(cached.calls == 2);
+}
+
+int main() {
+    hits_skip_the_handler();
+    least_recently_used_is_evicted();
+    expired_entries_miss();
+    return 0;
+}
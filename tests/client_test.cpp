@@ -0,0 +1,165 @@
+#include "../client.hpp"
+#include "../framing.hpp"
+#include "harness.hpp"
+
+#include <atomic>
+#include <poll.h>
+
+using namespace Socks;
+using namespace SocksTest;
+using Clock = std::chrono::steady_clock;
+
+/// Connects slowly from its second connection on.
+class SlowConnects : public UnixSocketTransport {
+  public:
+    explicit SlowConnects(const std::string &path)
+        : UnixSocketTransport(path, Framing::LengthPrefixed) {}
+
+  protected:
+    int open_connection(Deadline deadline) override {
+        if (++connects_ > 1)
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+        return UnixSocketTransport::open_connection(deadline);
+    }
+
+  private:
+    std::atomic<int> connects_ = 0;
+};
+
+/// A connection being opened does not hold up requests on the others.
+static void connect_outside_the_pool_lock() {
+    std::string path = socket_path("slow_connect");
+    auto pool = std::make_shared<ThreadPool>(3);
+    Server server(
+        std::make_unique<UnixSocketTransport>(path, Framing::LengthPrefixed),
+        pool);
+    std::atomic<bool> released = false;
+    server.add_handler("hold", [&](const json &) {
+        auto until = Clock::now() + std::chrono::seconds(5);
+        while (!released && Clock::now() < until)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        return okay({});
+    });
+    server.add_handler("echo", [](const json &request) {
+        return okay({{"value", request.at("value")}});
+    });
+    ServerThread running(server, path);
+
+    Client client(std::make_unique<SlowConnects>(path), Codec::Json, 2);
+    std::future<json> held = client.send_request_async("hold", {});
+
+    // The first connection is busy, so this opens the second, slowly.
+    std::thread opener([&] { client.send_request("echo", {{"value", 1}}); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    auto started = Clock::now();
+    CHECK(client.send_request("echo", {{"value", 2}})["value"] == 2);
+    CHECK(Clock::now() - started < std::chrono::milliseconds(500));
+
+    released = true;
+    held.get();
+    opener.join();
+}
+
+/// Background callbacks still pending when the client goes all run, with
+/// an error, before the destructor returns.
+static void destroyed_with_callbacks_pending() {
+    std::string path = socket_path("bg_pending");
+    auto pool = std::make_shared<ThreadPool>(1);
+    Server server(
+        std::make_unique<UnixSocketTransport>(path, Framing::LengthPrefixed),
+        pool);
+    server.add_handler("slow", [](const json &) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        return okay({});
+    });
+    ServerThread running(server, path);
+
+    std::atomic<int> answered = 0, failed = 0;
+    {
+        Client client(std::make_unique<UnixSocketTransport>(
+            path, Framing::LengthPrefixed));
+        for (int i = 0; i < 20; ++i) {
+            client.send_request_bg(
+                "slow", {},
+                [&](json response) {
+                    ++(response.value("_success", false) ? answered : failed);
+                },
+                std::chrono::milliseconds(i % 2 ? 30 : 0));
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    CHECK(answered + failed == 20);
+    CHECK(failed > 0);
+}
+
+/// Read one frame from `fd`; false if the peer closed first.
+static bool read_frame_from(int fd, FrameHeader &header, std::string &body) {
+    unsigned char bytes[kFrameHeaderSize];
+    for (size_t got = 0; got < sizeof(bytes);) {
+        pollfd pfd{fd, POLLIN, 0};
+        CHECK(::poll(&pfd, 1, 5000) == 1);
+        ssize_t n = ::recv(fd, bytes + got, sizeof(bytes) - got, 0);
+        if (n <= 0)
+            return false;
+        got += static_cast<size_t>(n);
+    }
+    header = decode_frame_header(bytes);
+    body.assign(header.length, '\0');
+    for (size_t got = 0; got < body.size();) {
+        ssize_t n = ::recv(fd, body.data() + got, body.size() - got, 0);
+        if (n <= 0)
+            return false;
+        got += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+/// A request retried after its reused connection dropped fails cleanly
+/// when the server is gone by then.
+static void reused_connection_dropped_server_gone() {
+    std::string path = socket_path("gone");
+    ::unlink(path.c_str());
+    int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    path.copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+    CHECK(::bind(listener, reinterpret_cast<sockaddr *>(&addr),
+                 sizeof(addr)) == 0);
+    CHECK(::listen(listener, 4) == 0);
+
+    // Answers the first request, reads the second, then closes the
+    // connection and stops listening.
+    std::thread server([&] {
+        int conn = ::accept(listener, nullptr, nullptr);
+        CHECK(conn != -1);
+        FrameHeader header;
+        std::string body;
+        CHECK(read_frame_from(conn, header, body));
+        std::string reply = json{{"_success", true}}.dump();
+        unsigned char bytes[kFrameHeaderSize];
+        encode_frame_header(
+            {static_cast<std::uint32_t>(reply.size()), header.tag}, bytes);
+        std::string frame(reinterpret_cast<char *>(bytes), sizeof(bytes));
+        frame += reply;
+        CHECK(::send(conn, frame.data(), frame.size(), MSG_NOSIGNAL) ==
+              static_cast<ssize_t>(frame.size()));
+        CHECK(read_frame_from(conn, header, body));
+        ::close(listener);
+        ::unlink(path.c_str());
+        ::close(conn);
+    });
+
+    Client client(
+        std::make_unique<UnixSocketTransport>(path, Framing::LengthPrefixed));
+    CHECK(client.send_request("ping", {})["_success"] == true);
+    CHECK_THROWS(client.send_request("ping", {}));
+    server.join();
+}
+
+int main() {
+    connect_outside_the_pool_lock();
+    destroyed_with_callbacks_pending();
+    reused_connection_dropped_server_gone();
+    return 0;
+}
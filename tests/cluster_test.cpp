@@ -0,0 +1,107 @@
+#include "../cluster.hpp"
+#include "harness.hpp"
+
+#include <atomic>
+#include <poll.h>
+
+using namespace Socks;
+using namespace SocksTest;
+
+static std::unique_ptr<Transport> node(const std::string &path) {
+    return std::make_unique<UnixSocketTransport>(path,
+                                                 Framing::LengthPrefixed);
+}
+
+/**
+ * Listens at a path, reads the first bytes of one connection and closes
+ * it without an answer: a server that dies after the request was written.
+ */
+class DroppingListener {
+  public:
+    explicit DroppingListener(const std::string &path) {
+        ::unlink(path.c_str());
+        fd_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        path.copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+        CHECK(::bind(fd_, reinterpret_cast<sockaddr *>(&addr),
+                     sizeof(addr)) == 0);
+        CHECK(::listen(fd_, 4) == 0);
+        thread_ = std::thread([this] {
+            int conn = ::accept(fd_, nullptr, nullptr);
+            CHECK(conn != -1);
+            pollfd pfd{conn, POLLIN, 0};
+            CHECK(::poll(&pfd, 1, 5000) == 1);
+            char buffer[64];
+            CHECK(::recv(conn, buffer, sizeof(buffer), 0) > 0);
+            ::close(conn);
+        });
+    }
+
+    ~DroppingListener() {
+        thread_.join();
+        ::close(fd_);
+    }
+
+  private:
+    int fd_ = -1;
+    std::thread thread_;
+};
+
+/// A request to a server that is not listening goes to another one.
+static void unreachable_server_fails_over() {
+    std::string down = socket_path("down");
+    std::string up = socket_path("up");
+    Server server(node(up));
+    server.add_handler("ping", [](const json &) { return okay({}); });
+    ServerThread running(server, up);
+
+    std::vector<std::unique_ptr<Transport>> nodes;
+    nodes.push_back(node(down));
+    nodes.push_back(node(up));
+    ClusterClient cluster(std::move(nodes));
+    for (int i = 0; i < 4; ++i)
+        cluster.send_request("ping", json::object());
+
+    json stats = cluster.stats();
+    CHECK(stats[0]["failures"] > 0);
+    CHECK(stats[1]["requests"] == 4);
+}
+
+/// A request whose connection drops after it was written is not sent
+/// again, unless the requests are idempotent.
+static void dropped_request_fails_over_if_idempotent() {
+    for (bool idempotent : {false, true}) {
+        std::string dropping = socket_path("dropping");
+        std::string up = socket_path("up");
+        std::atomic<int> calls = 0;
+        Server server(node(up));
+        server.add_handler("ping", [&calls](const json &) {
+            ++calls;
+            return okay({});
+        });
+        ServerThread running(server, up);
+        DroppingListener listener(dropping);
+
+        std::vector<std::unique_ptr<Transport>> nodes;
+        nodes.push_back(node(dropping)); // picked first: nothing outstanding
+        nodes.push_back(node(up));
+        ClusterOptions options;
+        options.idempotent = idempotent;
+        ClusterClient cluster(std::move(nodes), options);
+        if (idempotent) {
+            cluster.send_request("ping", json::object());
+            CHECK(calls == 1);
+        } else {
+            CHECK_THROWS(cluster.send_request("ping", json::object()));
+            CHECK(calls == 0);
+        }
+        CHECK(cluster.stats()[0]["failures"] == 1);
+    }
+}
+
+int main() {
+    unreachable_server_fails_over();
+    dropped_request_fails_over_if_idempotent();
+    return 0;
+}
@@ -0,0 +1,92 @@
+#include "../client.hpp"
+#include "../framing.hpp"
+#include "harness.hpp"
+
+#include <poll.h>
+
+using namespace Socks;
+using namespace SocksTest;
+
+static void read_bytes(int fd, char *data, size_t size) {
+    while (size > 0) {
+        pollfd pfd{fd, POLLIN, 0};
+        CHECK(::poll(&pfd, 1, 5000) == 1);
+        ssize_t n = ::recv(fd, data, size, 0);
+        CHECK(n > 0);
+        data += n;
+        size -= static_cast<size_t>(n);
+    }
+}
+
+/// Every codec gives back what it was given, and is told from its first
+/// byte.
+static void round_trip() {
+    json value = {{"_cmd", "pose"},
+                  {"x", 1.5},
+                  {"ids", {1, 2, 3}},
+                  {"name", "arm"},
+                  {"nested", {{"ok", true}, {"none", nullptr}}}};
+    for (Codec codec : {Codec::Json, Codec::MessagePack, Codec::Cbor}) {
+        std::string bytes = encode(value, codec);
+        CHECK(detect_codec(bytes) == codec);
+        Codec found;
+        CHECK(decode(bytes, &found) == value);
+        CHECK(found == codec);
+
+        Buffer out;
+        encode(value, codec, out);
+        CHECK(out.view() == bytes);
+    }
+    CHECK_THROWS(decode(std::string("\x01\xc1", 2)));
+}
+
+/// One endpoint serves clients of every codec, and answers each request
+/// in the encoding it came in.
+static void one_endpoint_every_codec() {
+    std::string path = socket_path("codecs");
+    Server server(
+        std::make_unique<UnixSocketTransport>(path, Framing::LengthPrefixed));
+    server.add_handler("echo", [](const json &request) {
+        return okay({{"value", request.at("value")}});
+    });
+    ServerThread running(server, path);
+
+    for (Codec codec : {Codec::Json, Codec::MessagePack, Codec::Cbor}) {
+        Client client(std::make_unique<UnixSocketTransport>(
+                          path, Framing::LengthPrefixed),
+                      codec);
+        json answer = client.send_request("echo", {{"value", "bytes\x01"}});
+        CHECK(answer["value"] == "bytes\x01");
+    }
+
+    int fd = connect_to(path);
+    CHECK(fd != -1);
+    std::string body =
+        encode(json{{"_cmd", "echo"}, {"value", 7}}, Codec::Cbor);
+    unsigned char header[kFrameHeaderSize];
+    encode_frame_header({static_cast<std::uint32_t>(body.size()), 1}, header);
+    std::string frame(reinterpret_cast<char *>(header), sizeof(header));
+    frame += body;
+    CHECK(::send(fd, frame.data(), frame.size(), MSG_NOSIGNAL) ==
+          static_cast<ssize_t>(frame.size()));
+    read_bytes(fd, reinterpret_cast<char *>(header), sizeof(header));
+    std::string reply(decode_frame_header(header).length, '\0');
+    read_bytes(fd, reply.data(), reply.size());
+    ::close(fd);
+    CHECK(detect_codec(reply) == Codec::Cbor);
+    CHECK(decode(reply)["value"] == 7);
+}
+
+/// Binary codecs need a transport that delimits messages itself.
+static void binary_needs_framing() {
+    CHECK_THROWS(Client(std::make_unique<UnixSocketTransport>(
+                            socket_path("raw"), Framing::Raw),
+                        Codec::MessagePack));
+}
+
+int main() {
+    round_trip();
+    one_endpoint_every_codec();
+    binary_needs_framing();
+    return 0;
+}
@@ -0,0 +1,69 @@
+#include "../client.hpp"
+#include "../eventloop.hpp"
+#include "harness.hpp"
+
+#include <poll.h>
+
+using namespace Socks;
+using namespace SocksTest;
+
+/// Requests from several clients are answered by the reactors.
+static void serves_requests() {
+    std::string path = socket_path("epoll");
+    auto pool = std::make_shared<ThreadPool>(2);
+    Server server(std::make_unique<EpollUnixTransport>(
+                      path, Framing::LengthPrefixed, 2),
+                  pool);
+    server.add_handler("echo", [](const json &request) {
+        return okay({{"value", request.at("value")}});
+    });
+    ServerThread running(server, path);
+
+    std::vector<std::unique_ptr<Client>> clients;
+    std::vector<std::future<json>> answers;
+    for (int c = 0; c < 4; ++c) {
+        clients.push_back(std::make_unique<Client>(
+            std::make_unique<UnixSocketTransport>(path,
+                                                  Framing::LengthPrefixed)));
+        for (int i = 0; i < 20; ++i) {
+            answers.push_back(clients.back()->send_request_async(
+                "echo", {{"value", c * 100 + i}}));
+        }
+    }
+    for (size_t n = 0; n < answers.size(); ++n) {
+        int c = static_cast<int>(n / 20), i = static_cast<int>(n % 20);
+        CHECK(answers[n].get()["value"] == c * 100 + i);
+    }
+}
+
+/// Once the server stops, open connections are closed, not left dangling.
+static void stop_closes_connections() {
+    std::string path = socket_path("epoll_stop");
+    Server server(
+        std::make_unique<EpollUnixTransport>(path, Framing::LengthPrefixed));
+    server.add_handler("echo", [](const json &request) {
+        return okay({{"value", request.at("value")}});
+    });
+    ServerThread running(server, path);
+
+    Client client(
+        std::make_unique<UnixSocketTransport>(path, Framing::LengthPrefixed));
+    CHECK(client.send_request("echo", {{"value", 1}})["value"] == 1);
+
+    int idle = connect_to(path);
+    CHECK(idle != -1);
+    running.stop();
+
+    pollfd pfd{idle, POLLIN, 0};
+    CHECK(::poll(&pfd, 1, 5000) == 1);
+    char byte;
+    // EOF, or a reset if the connection was never accepted.
+    CHECK(::recv(idle, &byte, 1, 0) <= 0);
+    ::close(idle);
+}
+
+int main() {
+    serves_requests();
+    stop_closes_connections();
+    return 0;
+}
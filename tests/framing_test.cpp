@@ -0,0 +1,101 @@
+#include "../client.hpp"
+#include "../framing.hpp"
+#include "harness.hpp"
+
+#include <poll.h>
+
+using namespace Socks;
+using namespace SocksTest;
+
+static void write_bytes(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = ::send(fd, data, size, MSG_NOSIGNAL);
+        CHECK(n > 0);
+        data += n;
+        size -= static_cast<size_t>(n);
+    }
+}
+
+static void read_bytes(int fd, char *data, size_t size) {
+    while (size > 0) {
+        pollfd pfd{fd, POLLIN, 0};
+        CHECK(::poll(&pfd, 1, 5000) == 1);
+        ssize_t n = ::recv(fd, data, size, 0);
+        CHECK(n > 0);
+        data += n;
+        size -= static_cast<size_t>(n);
+    }
+}
+
+/// A client that stops halfway through a frame does not hold up the others.
+static void partial_frame_does_not_stall() {
+    std::string path = socket_path("partial");
+    Server server(
+        std::make_unique<UnixSocketTransport>(path, Framing::LengthPrefixed));
+    server.add_handler("echo", [](const json &request) {
+        return okay({{"value", request.at("value")}});
+    });
+    ServerThread running(server, path);
+
+    std::string body = json{{"_cmd", "echo"}, {"value", 7}}.dump();
+    unsigned char header[kFrameHeaderSize];
+    encode_frame_header({static_cast<std::uint32_t>(body.size()), 42}, header);
+
+    // Half a header, then nothing for now.
+    int slow = connect_to(path);
+    CHECK(slow != -1);
+    write_bytes(slow, reinterpret_cast<char *>(header), 4);
+
+    Client client(
+        std::make_unique<UnixSocketTransport>(path, Framing::LengthPrefixed));
+    json answer =
+        client.send_request("echo", {{"value", 1}}, std::chrono::seconds(2));
+    CHECK(answer["value"] == 1);
+
+    // The rest of the frame, a byte at a time, is still put together.
+    write_bytes(slow, reinterpret_cast<char *>(header) + 4, 4);
+    for (char c : body) {
+        write_bytes(slow, &c, 1);
+        answer = client.send_request("echo", {{"value", 2}},
+                                     std::chrono::seconds(2));
+        CHECK(answer["value"] == 2);
+    }
+
+    unsigned char reply_header[kFrameHeaderSize];
+    read_bytes(slow, reinterpret_cast<char *>(reply_header),
+               sizeof(reply_header));
+    FrameHeader reply = decode_frame_header(reply_header);
+    CHECK(reply.tag == 42);
+    std::string payload(reply.length, '\0');
+    read_bytes(slow, payload.data(), payload.size());
+    CHECK(json::parse(payload)["value"] == 7);
+    ::close(slow);
+}
+
+/// Several requests in flight on one connection are matched by tag.
+static void pipelined_requests() {
+    std::string path = socket_path("pipelined");
+    auto pool = std::make_shared<ThreadPool>(2);
+    Server server(
+        std::make_unique<UnixSocketTransport>(path, Framing::LengthPrefixed),
+        pool);
+    server.add_handler("echo", [](const json &request) {
+        return okay({{"value", request.at("value")}});
+    });
+    ServerThread running(server, path);
+
+    Client client(
+        std::make_unique<UnixSocketTransport>(path, Framing::LengthPrefixed),
+        Codec::Json, 1);
+    std::vector<std::future<json>> answers;
+    for (int i = 0; i < 50; ++i)
+        answers.push_back(client.send_request_async("echo", {{"value", i}}));
+    for (int i = 0; i < 50; ++i)
+        CHECK(answers[i].get()["value"] == i);
+}
+
+int main() {
+    partial_frame_does_not_stall();
+    pipelined_requests();
+    return 0;
+}
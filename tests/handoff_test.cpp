@@ -0,0 +1,104 @@
+#include "../client.hpp"
+#include "harness.hpp"
+
+#include <atomic>
+#include <future>
+
+using namespace Socks;
+using namespace SocksTest;
+
+static std::unique_ptr<Transport> connect_at(const std::string &path) {
+    return std::make_unique<UnixSocketTransport>(path,
+                                                 Framing::LengthPrefixed);
+}
+
+/// A server whose "slow" command answers with its generation after
+/// `delay`, counting the calls that have started.
+struct Generation {
+    Generation(const std::string &path, int generation,
+               std::chrono::milliseconds delay)
+        : server(std::make_unique<EpollUnixTransport>(path),
+                 std::make_shared<ThreadPool>(2)) {
+        server.add_handler("slow", [this, generation, delay](const json &) {
+            ++started;
+            std::this_thread::sleep_for(delay);
+            return okay({{"generation", generation}});
+        });
+    }
+
+    void wait_until_started(int calls) const {
+        for (int i = 0; i < 500 && started < calls; ++i)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        CHECK(started == calls);
+    }
+
+    Server server;
+    std::atomic<int> started = 0;
+};
+
+/// drain() answers every request already received, then stops the server
+/// and stops accepting.
+static void drain_answers_running_requests() {
+    std::string path = socket_path("drain");
+    Generation old(path, 1, std::chrono::milliseconds(200));
+    ServerThread running(old.server, path);
+
+    Client client(connect_at(path), Codec::Json, 2);
+    std::future<json> first = client.send_request_async("slow", {});
+    std::future<json> second = client.send_request_async("slow", {});
+    old.wait_until_started(2);
+
+    CHECK(old.server.drain(std::chrono::seconds(5)));
+    CHECK(first.get()["generation"] == 1);
+    CHECK(second.get()["generation"] == 1);
+    running.stop();
+    CHECK(connect_to(path) == -1);
+}
+
+/// After a handoff the new server answers new connections on the same
+/// path, while a request the old one was running still gets its answer.
+static void hand_off_keeps_the_socket() {
+    std::string path = socket_path("served");
+    std::string handoff_path = socket_path("handoff");
+    Generation old(path, 1, std::chrono::milliseconds(200));
+    ServerThread old_running(old.server, path);
+
+    Client old_client(connect_at(path));
+    std::future<json> running = old_client.send_request_async("slow", {});
+    old.wait_until_started(1);
+
+    std::future<bool> handed_off = std::async(std::launch::async, [&] {
+        return old.server.hand_off(handoff_path, std::chrono::seconds(5));
+    });
+    for (int i = 0; i < 500 && ::access(handoff_path.c_str(), F_OK) != 0; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    Generation next(path, 2, std::chrono::milliseconds(0));
+    CHECK(next.server.take_over(handoff_path));
+    ServerThread next_running(next.server, path);
+    CHECK(handed_off.get());
+    CHECK(running.get()["generation"] == 1);
+    old_running.stop();
+
+    Client new_client(connect_at(path));
+    CHECK(new_client.send_request("slow", {})["generation"] == 2);
+    CHECK(next.started == 1);
+}
+
+/// With nobody listening on the handoff path, take_over() leaves the
+/// server to bind as usual.
+static void take_over_without_a_peer() {
+    std::string path = socket_path("alone");
+    Generation first(path, 1, std::chrono::milliseconds(0));
+    CHECK(!first.server.take_over(socket_path("nobody")));
+    ServerThread running(first.server, path);
+    Client client(connect_at(path));
+    CHECK(client.send_request("slow", {})["generation"] == 1);
+}
+
+int main() {
+    drain_answers_running_requests();
+    hand_off_keeps_the_socket();
+    take_over_without_a_peer();
+    return 0;
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include "../server.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+/**
+ * @file harness.hpp
+ * @brief What the tests share: a failing check and a server on a thread.
+ *
+ * Each test is a plain executable that CTest runs; CHECK ends it with a
+ * non-zero status at the first failure.
+ */
+
+#define CHECK(condition)                                                       \
+    do {                                                                       \
+        if (!(condition)) {                                                    \
+            std::cerr << __FILE__ << ":" << __LINE__                           \
+                      << ": CHECK(" #condition ") failed" << std::endl;        \
+            std::exit(1);                                                      \
+        }                                                                      \
+    } while (0)
+
+#define CHECK_THROWS(expression)                                               \
+    do {                                                                       \
+        bool thrown = false;                                                   \
+        try {                                                                  \
+            (void)(expression);                                                \
+        } catch (const std::exception &) {                                     \
+            thrown = true;                                                     \
+        }                                                                      \
+        if (!thrown) {                                                         \
+            std::cerr << __FILE__ << ":" << __LINE__                           \
+                      << ": " #expression " did not throw" << std::endl;       \
+            std::exit(1);                                                      \
+        }                                                                      \
+    } while (0)
+
+namespace SocksTest {
+
+/// A UNIX socket path of this process's own, so tests can run in parallel.
+inline std::string socket_path(const std::string &name) {
+    return "/tmp/socks_test_" + std::to_string(::getpid()) + "_" + name +
+           ".sock";
+}
+
+/// Connect to the UNIX socket at `path`; -1 if nothing listens there.
+inline int connect_to(const std::string &path) {
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    path.copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+    if (::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) ==
+        0)
+        return fd;
+    ::close(fd);
+    return -1;
+}
+
+/// Wait, up to a few seconds, until a server listens at `path`.
+inline void wait_for_socket(const std::string &path) {
+    for (int attempt = 0; attempt < 500; ++attempt) {
+        int fd = connect_to(path);
+        if (fd != -1) {
+            ::close(fd);
+            return;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    std::cerr << "Nothing listens at " << path << std::endl;
+    std::exit(1);
+}
+
+/**
+ * Runs Server::start() on a thread of its own, and stops the server when
+ * destroyed. `path`, if given, is waited for before the constructor
+ * returns.
+ */
+class ServerThread {
+  public:
+    explicit ServerThread(Socks::Server &server, const std::string &path = "")
+        : server_(server), thread_([this] { run(); }) {
+        if (!path.empty())
+            wait_for_socket(path);
+    }
+
+    ~ServerThread() { stop(); }
+
+    void stop() {
+        if (!thread_.joinable())
+            return;
+        server_.stop();
+        thread_.join();
+    }
+
+  private:
+    void run() {
+        try {
+            server_.start();
+        } catch (const std::exception &e) {
+            std::cerr << "Server failed: " << e.what() << std::endl;
+            std::exit(1);
+        }
+    }
+
+    Socks::Server &server_;
+    std::thread thread_;
+};
+
+} // namespace SocksTest
@@ -0,0 +1,65 @@
+#include "../client.hpp"
+#include "harness.hpp"
+
+#include <future>
+
+using namespace Socks;
+using namespace SocksTest;
+
+static int test_port() { return 20000 + (::getpid() + 7) % 20000; }
+
+/// One server answers the same command over a blocking UNIX socket, an
+/// epoll UNIX socket and UDP, counts all of it in one set of stats, and
+/// stops listening on every transport when stopped.
+static void one_server_many_transports() {
+    std::string blocking_path = socket_path("blocking");
+    std::string epoll_path = socket_path("epoll");
+    int port = test_port();
+
+    std::vector<std::unique_ptr<Transport>> transports;
+    transports.push_back(std::make_unique<UnixSocketTransport>(
+        blocking_path, Framing::LengthPrefixed));
+    transports.push_back(std::make_unique<EpollUnixTransport>(epoll_path));
+    Server server(std::move(transports), std::make_shared<ThreadPool>(2));
+    server.add_transport(std::make_unique<UdpTransport>(port));
+    server.add_handler("echo", [](const json &request) {
+        return okay({{"value", request.at("value")}});
+    });
+    ServerThread running(server, blocking_path);
+    wait_for_socket(epoll_path);
+    CHECK_THROWS(server.add_transport(
+        std::make_unique<UnixSocketTransport>(socket_path("late"))));
+
+    std::vector<std::unique_ptr<Client>> clients;
+    for (const std::string &path : {blocking_path, epoll_path}) {
+        clients.push_back(std::make_unique<Client>(
+            std::make_unique<UnixSocketTransport>(path,
+                                                  Framing::LengthPrefixed)));
+    }
+    clients.push_back(std::make_unique<Client>(
+        std::make_unique<UdpTransport>("127.0.0.1", port)));
+
+    std::vector<std::future<json>> answers;
+    for (int round = 0; round < 3; ++round) {
+        for (size_t i = 0; i < clients.size(); ++i) {
+            int value = round * 10 + static_cast<int>(i);
+            answers.push_back(
+                clients[i]->send_request_async("echo", {{"value", value}}));
+        }
+    }
+    for (size_t n = 0; n < answers.size(); ++n) {
+        int value = static_cast<int>(n / clients.size()) * 10 +
+                    static_cast<int>(n % clients.size());
+        CHECK(answers[n].get()["value"] == value);
+    }
+    CHECK(server.stats()["commands"]["echo"]["requests"] == 9);
+
+    running.stop();
+    CHECK(connect_to(blocking_path) == -1);
+    CHECK(connect_to(epoll_path) == -1);
+}
+
+int main() {
+    one_server_many_transports();
+    return 0;
+}
@@ -0,0 +1,94 @@
+#include "../framing.hpp"
+#include "../scan.hpp"
+#include "harness.hpp"
+
+#include <poll.h>
+
+using namespace Socks;
+using namespace SocksTest;
+
+static std::string bytes(std::initializer_list<int> values) {
+    std::string out;
+    for (int value : values)
+        out += static_cast<char>(value);
+    return out;
+}
+
+static void read_bytes(int fd, char *data, size_t size) {
+    while (size > 0) {
+        pollfd pfd{fd, POLLIN, 0};
+        CHECK(::poll(&pfd, 1, 5000) == 1);
+        ssize_t n = ::recv(fd, data, size, 0);
+        CHECK(n > 0);
+        data += n;
+        size -= static_cast<size_t>(n);
+    }
+}
+
+static bool scans_to(std::string_view message, std::string_view command) {
+    auto field = scan_command(message);
+    return field && field->kind == ScannedField::Kind::String &&
+           field->text == command;
+}
+
+/// A key given once is found wherever it stands in the object.
+static void single_key() {
+    CHECK(scans_to(R"({"_cmd":"a"})", "a"));
+    CHECK(scans_to(R"({"x":[1,{"_cmd":"no"}],"_cmd":"a","y":2})", "a"));
+    CHECK(!scan_command(R"({"x":1})"));
+    CHECK(scans_to(bytes({0x01, 0x81, 0xa4, '_', 'c', 'm', 'd', 0xa1, 'a'}),
+                   "a"));
+    CHECK(scans_to(bytes({0x02, 0xa1, 0x64, '_', 'c', 'm', 'd', 0x61, 'a'}),
+                   "a"));
+}
+
+/// A repeated key, or one that might be, is left to the parser, which
+/// keeps the last value.
+static void repeated_key() {
+    CHECK(!scan_command(R"({"_cmd":"a","_cmd":"b"})"));
+    CHECK(!scan_command(R"({"_cmd":"a","x":{"_cmd":"c"},"_cmd":"b"})"));
+    CHECK(!scan_command(bytes({0x01, 0x82, 0xa4, '_', 'c', 'm', 'd', 0xa1,
+                               'a', 0xa4, '_', 'c', 'm', 'd', 0xa1, 'b'})));
+    CHECK(!scan_command(bytes({0x02, 0xa2, 0x64, '_', 'c', 'm', 'd', 0x61,
+                               'a', 0x64, '_', 'c', 'm', 'd', 0x61, 'b'})));
+    // An indefinite-length text key.
+    CHECK(!scan_command(bytes({0x02, 0xa2, 0x64, '_', 'c', 'm', 'd', 0x61,
+                               'a', 0x7f, 0x64, '_', 'c', 'm', 'd', 0xff,
+                               0x61, 'b'})));
+}
+
+/// The server routes a request with a repeated `_cmd` as the parser reads
+/// it.
+static void routed_to_last() {
+    std::string path = socket_path("scan");
+    Server server(
+        std::make_unique<UnixSocketTransport>(path, Framing::LengthPrefixed));
+    server.add_handler("a", [](const json &) { return okay({{"by", "a"}}); });
+    server.add_handler("b", [](const json &) { return okay({{"by", "b"}}); });
+    ServerThread running(server, path);
+
+    int fd = connect_to(path);
+    CHECK(fd != -1);
+    std::string body = R"({"_cmd":"a","_cmd":"b"})";
+    unsigned char header[kFrameHeaderSize];
+    encode_frame_header({static_cast<std::uint32_t>(body.size()), 1}, header);
+    std::string frame(reinterpret_cast<char *>(header), sizeof(header));
+    frame += body;
+    CHECK(::send(fd, frame.data(), frame.size(), MSG_NOSIGNAL) ==
+          static_cast<ssize_t>(frame.size()));
+
+    unsigned char reply_header[kFrameHeaderSize];
+    read_bytes(fd, reinterpret_cast<char *>(reply_header),
+               sizeof(reply_header));
+    std::string reply(decode_frame_header(reply_header).length, '\0');
+    read_bytes(fd, reply.data(), reply.size());
+    ::close(fd);
+    CHECK(json::parse(reply)["by"] == "b");
+}
+
+int main() {
+    single_key();
+    repeated_key();
+    routed_to_last();
+    return 0;
+}
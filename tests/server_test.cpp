@@ -0,0 +1,240 @@
+#include "../client.hpp"
+#include "harness.hpp"
+
+using namespace Socks;
+using namespace SocksTest;
+
+static void add_echo(Server &server) {
+    server.add_handler("echo", [](const json &request) {
+        return okay({{"value", request.at("value")}});
+    });
+}
+
+static std::unique_ptr<Client> connect_client(const std::string &path) {
+    return std::make_unique<Client>(
+        std::make_unique<UnixSocketTransport>(path, Framing::LengthPrefixed));
+}
+
+/// A server stopped and started again serves as before.
+static void restart() {
+    std::string path = socket_path("restart");
+    auto pool = std::make_shared<ThreadPool>(2);
+    Server server(
+        std::make_unique<UnixSocketTransport>(path, Framing::LengthPrefixed),
+        pool);
+    add_echo(server);
+
+    for (int run = 0; run < 3; ++run) {
+        ServerThread running(server, path);
+        auto client = connect_client(path);
+        CHECK(client->send_request("echo", {{"value", run}})["value"] == run);
+    }
+}
+
+/// A request the pool will not take is turned away, and does not keep
+/// drain() waiting.
+static void refused_by_the_pool() {
+    std::string path = socket_path("refused");
+    auto pool = std::make_shared<ThreadPool>(1);
+    Server server(
+        std::make_unique<UnixSocketTransport>(path, Framing::LengthPrefixed),
+        pool);
+    add_echo(server);
+    ServerThread running(server, path);
+    pool->wait(); // takes no more jobs
+
+    auto client = connect_client(path);
+    CHECK_THROWS(client->send_request("echo", {{"value", 1}}));
+    CHECK(server.drain(std::chrono::seconds(5)));
+}
+
+/// A server can go while a pool it shares still holds jobs for it.
+static void destroyed_with_queued_jobs() {
+    std::string path = socket_path("queued");
+    auto pool = std::make_shared<ThreadPool>(1);
+    auto client_done = std::make_shared<std::atomic<int>>(0);
+    {
+        Server server(std::make_unique<UnixSocketTransport>(
+                          path, Framing::LengthPrefixed),
+                      pool);
+        server.add_handler("slow", [](const json &) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            return okay({});
+        });
+        ServerThread running(server, path);
+
+        auto client = connect_client(path);
+        for (int i = 0; i < 10; ++i) {
+            client->send_request_bg("slow", {},
+                                    [client_done](json) { ++*client_done; });
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(30));
+        running.stop();
+    }
+    // The pool carries on with other work.
+    std::promise<void> ran;
+    pool->enqueue([&] { ran.set_value(); });
+    ran.get_future().get();
+}
+
+/// Registering an arena handler leaves the other commands' parsing alone.
+static void arena_only_for_arena_handlers() {
+    std::string path = socket_path("arena");
+    Server server(
+        std::make_unique<UnixSocketTransport>(path, Framing::LengthPrefixed));
+    server.add_arena_handler("sum", [](const ArenaJson &request) {
+        return okay<ArenaJson>(
+            {{"sum", request.at("a").get<int>() + request.at("b").get<int>()},
+             {"arena", Arena::current() != nullptr}});
+    });
+    server.add_handler("plain", [](const json &) {
+        return okay({{"arena", Arena::current() != nullptr}});
+    });
+    ServerThread running(server, path);
+
+    auto client = connect_client(path);
+    json sum = client->send_request("sum", {{"a", 2}, {"b", 3}});
+    CHECK(sum["sum"] == 5);
+    CHECK(sum["arena"] == true);
+    CHECK(client->send_request("plain", {})["arena"] == false);
+}
+
+/// A replaced command table is freed once nothing holds it; an async
+/// request still being answered holds the one it was routed with.
+static void replaced_tables_are_freed() {
+    std::string path = socket_path("tables");
+    Server server(
+        std::make_unique<UnixSocketTransport>(path, Framing::LengthPrefixed));
+    std::mutex mutex;
+    std::condition_variable arrived;
+    std::optional<Reply> parked;
+    server.add_async_handler("later", [&](const json &, Reply reply) {
+        std::lock_guard<std::mutex> lock(mutex);
+        parked = reply;
+        arrived.notify_one();
+    });
+    ServerThread running(server, path);
+
+    auto client = connect_client(path);
+    std::future<json> answer = client->send_request_async("later", {});
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        arrived.wait(lock, [&] { return parked.has_value(); });
+    }
+    std::weak_ptr<const CommandTable> routed = server.commands();
+    for (int i = 0; i < 100; ++i)
+        add_echo(server);
+    CHECK(!routed.expired());
+
+    (*parked)(okay({{"value", 1}}));
+    CHECK(answer.get()["value"] == 1);
+    parked.reset();
+    CHECK(routed.expired());
+    CHECK(client->send_request("echo", {{"value", 2}})["value"] == 2);
+}
+
+/// Batch entries not started by the batch's deadline are answered with an
+/// error instead of being run.
+static void batch_entries_past_deadline() {
+    for (bool pooled : {true, false}) {
+        std::string path = socket_path(pooled ? "batch_pool" : "batch");
+        Server server(std::make_unique<UnixSocketTransport>(
+                          path, Framing::LengthPrefixed),
+                      pooled ? std::make_shared<ThreadPool>(1) : nullptr);
+        std::atomic<int> ran{0};
+        server.add_handler("slow", [&](const json &) {
+            ++ran;
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            return okay({});
+        });
+        ServerThread running(server, path);
+
+        json requests = json::array();
+        for (int i = 0; i < 10; ++i)
+            requests.push_back({{"_cmd", "slow"}});
+        auto client = connect_client(path);
+        json answer = client->send_request(
+            "_batch", {{"requests", requests}, {"_deadline_ms", 120}});
+        const json &responses = answer["responses"];
+        CHECK(responses.size() == 10);
+        CHECK(responses[0]["_success"] == true);
+        CHECK(responses[9]["_success"] == false);
+        CHECK(responses[9]["_msg"] == "Deadline exceeded");
+        CHECK(ran < 10);
+    }
+}
+
+/// A request whose deadline has passed before its handler starts is
+/// answered without running it, with a pool or without.
+static void requests_past_deadline() {
+    for (bool pooled : {true, false}) {
+        std::string path = socket_path(pooled ? "expired_pool" : "expired");
+        Server server(std::make_unique<UnixSocketTransport>(
+                          path, Framing::LengthPrefixed),
+                      pooled ? std::make_shared<ThreadPool>(1) : nullptr);
+        std::atomic<int> ran{0};
+        server.add_handler("count", [&](const json &) {
+            ++ran;
+            return okay({});
+        });
+        ServerThread running(server, path);
+
+        auto client = connect_client(path);
+        try {
+            client->send_request("count", {{"_deadline_ms", 0}});
+            CHECK(!"answered past its deadline");
+        } catch (const std::runtime_error &e) {
+            CHECK(std::string(e.what()).find("Deadline exceeded") !=
+                  std::string::npos);
+        }
+        CHECK(client->send_request("count", {{"_deadline_ms", 5000}})
+                  ["_success"] == true);
+        CHECK(ran == 1);
+        CHECK(server.stats()["expired_requests"] == 1);
+    }
+}
+
+/// A subscription over a stream transport is either served by the epoll
+/// transport or turned away, never left to block the sending thread.
+static void subscriptions_need_event_transports() {
+    for (bool epoll : {true, false}) {
+        std::string path = socket_path(epoll ? "sub_epoll" : "sub_plain");
+        std::unique_ptr<Transport> transport;
+        if (epoll) {
+            transport = std::make_unique<EpollUnixTransport>(
+                path, Framing::LengthPrefixed, 1);
+        } else {
+            transport = std::make_unique<UnixSocketTransport>(
+                path, Framing::LengthPrefixed);
+        }
+        Server server(std::move(transport));
+        server.add_stream_handler("ticks", [](const json &, Stream stream) {
+            stream.push(okay({{"tick", 1}}));
+            stream.close();
+        });
+        ServerThread running(server, path);
+
+        auto client = connect_client(path);
+        std::promise<json> first;
+        auto subscription = client->subscribe(
+            "ticks", {}, [&first, done = false](json frame) mutable {
+                if (!done)
+                    first.set_value(std::move(frame));
+                done = true;
+            });
+        json frame = first.get_future().get();
+        CHECK(frame["_success"] == epoll);
+    }
+}
+
+int main() {
+    restart();
+    refused_by_the_pool();
+    destroyed_with_queued_jobs();
+    arena_only_for_arena_handlers();
+    replaced_tables_are_freed();
+    batch_entries_past_deadline();
+    requests_past_deadline();
+    subscriptions_need_event_transports();
+    return 0;
+}
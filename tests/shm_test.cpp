@@ -0,0 +1,183 @@
+#include "../client.hpp"
+#include "../shm.hpp"
+#include "harness.hpp"
+
+#include <atomic>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+using namespace Socks;
+using namespace SocksTest;
+
+constexpr std::size_t kRing = 4096;
+
+/**
+ * A client written against docs/shared_memory.md rather than through
+ * SharedMemoryTransport, so that it can stop halfway through a record.
+ */
+class RawClient {
+  public:
+    explicit RawClient(const std::string &name) {
+        fd_ = shm_open(name.c_str(), O_RDWR, 0);
+        CHECK(fd_ != -1);
+        size_ = 128 + 2 * kStride;
+        base_ = static_cast<char *>(
+            mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0));
+        CHECK(base_ != MAP_FAILED);
+
+        for (std::size_t i = 0; i < 2; ++i) {
+            struct flock lock{};
+            lock.l_type = F_WRLCK;
+            lock.l_whence = SEEK_SET;
+            lock.l_start = static_cast<off_t>(i);
+            lock.l_len = 1;
+            if (fcntl(fd_, F_OFD_SETLK, &lock) != 0)
+                continue;
+            slot_ = 128 + i * kStride;
+            CHECK(word(slot_)->load() == 0);
+            word(slot_ + 8)->store(static_cast<std::uint32_t>(getpid()));
+            word(slot_)->store(1);
+            return;
+        }
+        CHECK(!"no free slot");
+    }
+
+    ~RawClient() {
+        munmap(base_, size_);
+        ::close(fd_);
+    }
+
+    /// Write `bytes` into the request ring, waiting for room as needed.
+    void write(const std::string &bytes) {
+        std::size_t requests = slot_ + 64;
+        std::uint32_t tail = word(requests + 64)->load();
+        for (std::size_t done = 0; done < bytes.size();) {
+            std::uint32_t room = kRing - (tail - word(requests)->load());
+            if (room == 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                continue;
+            }
+            std::uint32_t n = static_cast<std::uint32_t>(
+                std::min<std::size_t>(room, bytes.size() - done));
+            for (std::uint32_t k = 0; k < n; ++k)
+                base_[requests + 128 + (tail + k) % kRing] = bytes[done + k];
+            tail += n;
+            done += n;
+            word(requests + 64)->store(tail);
+            word(64)->fetch_add(1); // the doorbell
+            syscall(SYS_futex, word(64), FUTEX_WAKE, INT_MAX, nullptr,
+                    nullptr, 0);
+        }
+    }
+
+    /// Read `n` bytes from the response ring, waiting for them.
+    std::string read(std::size_t n) {
+        std::size_t responses = slot_ + 64 + 128 + kRing;
+        std::uint32_t head = word(responses)->load();
+        std::string out;
+        auto give_up = std::chrono::steady_clock::now() +
+                       std::chrono::seconds(5);
+        while (out.size() < n) {
+            CHECK(std::chrono::steady_clock::now() < give_up);
+            if (word(responses + 64)->load() == head) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                continue;
+            }
+            out += base_[responses + 128 + head % kRing];
+            word(responses)->store(++head);
+        }
+        return out;
+    }
+
+  private:
+    static constexpr std::size_t kStride = 64 + 2 * (128 + kRing);
+
+    std::atomic<std::uint32_t> *word(std::size_t offset) {
+        return reinterpret_cast<std::atomic<std::uint32_t> *>(base_ + offset);
+    }
+
+    int fd_ = -1;
+    char *base_ = nullptr;
+    std::size_t size_ = 0;
+    std::size_t slot_ = 0; ///< Offset of the slot claimed
+};
+
+static std::string record(const std::string &body, std::uint32_t tag) {
+    std::uint32_t header[2] = {static_cast<std::uint32_t>(body.size()), tag};
+    return std::string(reinterpret_cast<char *>(header), sizeof(header)) +
+           body;
+}
+
+/// A client that stops halfway through a large request does not hold up
+/// the others, and its request still goes through once the rest arrives.
+static void stalled_record_does_not_block() {
+    std::string name = "/socks_test_" + std::to_string(getpid()) + "_shm";
+    Server server(std::make_unique<SharedMemoryTransport>(name, 2, kRing));
+    server.add_handler("size", [](const json &request) {
+        return okay({{"size", request.at("value").get<std::string>().size()}});
+    });
+    ServerThread running(server);
+
+    // The client's first request attaches once the server is up.
+    Client client(std::make_unique<SharedMemoryTransport>(name));
+    json answer;
+    for (int attempt = 0; attempt < 500 && answer.is_null(); ++attempt) {
+        try {
+            answer = client.send_request("size", {{"value", ""}});
+        } catch (const std::exception &) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+    CHECK(answer["size"] == 0);
+    RawClient raw(name);
+
+    std::string value(3 * kRing, 'x');
+    std::string large =
+        record(json{{"_cmd", "size"}, {"value", value}}.dump(), 9);
+    raw.write(large.substr(0, kRing / 2));
+
+    answer = client.send_request("size", {{"value", "abc"}},
+                                 std::chrono::seconds(2));
+    CHECK(answer["size"] == 3);
+
+    raw.write(large.substr(kRing / 2));
+    std::string header = raw.read(8);
+    std::uint32_t reply[2];
+    std::memcpy(reply, header.data(), sizeof(reply));
+    CHECK(reply[1] == 9);
+    CHECK(json::parse(raw.read(reply[0]))["size"] == value.size());
+}
+
+/// A server stopped and started again serves as before.
+static void restart() {
+    std::string name = "/socks_test_" + std::to_string(getpid()) + "_restart";
+    Server server(std::make_unique<SharedMemoryTransport>(name, 2, kRing));
+    server.add_handler("echo", [](const json &request) {
+        return okay({{"value", request.at("value")}});
+    });
+
+    for (int run = 0; run < 3; ++run) {
+        ServerThread running(server);
+        Client client(std::make_unique<SharedMemoryTransport>(name));
+        json answer;
+        for (int attempt = 0; attempt < 500 && answer.is_null(); ++attempt) {
+            try {
+                answer = client.send_request("echo", {{"value", run}},
+                                             std::chrono::seconds(2));
+            } catch (const std::exception &) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+        }
+        CHECK(answer["value"] == run);
+    }
+}
+
+int main() {
+    stalled_record_does_not_block();
+    restart();
+    return 0;
+}
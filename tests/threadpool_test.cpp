@@ -0,0 +1,84 @@
+#include "../logger.hpp"
+#include "../threadpool.hpp"
+#include "harness.hpp"
+
+#include <atomic>
+
+using namespace Socks;
+
+/// Every task enqueue() accepts runs, even when wait() comes in between.
+static void accepted_tasks_run(Scheduler scheduler) {
+    for (int round = 0; round < 200; ++round) {
+        std::atomic<int> accepted = 0, ran = 0;
+        {
+            ThreadPool pool(2, scheduler);
+            std::thread producer([&] {
+                for (int i = 0; i < 1000; ++i) {
+                    try {
+                        pool.enqueue([&] { ++ran; });
+                        ++accepted;
+                    } catch (const std::exception &) {
+                        return; // stopped
+                    }
+                }
+            });
+            std::this_thread::yield();
+            pool.wait();
+            producer.join();
+        }
+        CHECK(ran == accepted);
+    }
+}
+
+/// Tasks spawned by tasks run too.
+static void nested_tasks_run(Scheduler scheduler) {
+    std::atomic<int> ran = 0;
+    {
+        ThreadPool pool(3, scheduler);
+        for (int i = 0; i < 100; ++i) {
+            pool.enqueue([&] {
+                pool.enqueue([&] { ++ran; });
+                ++ran;
+            });
+        }
+        while (ran < 200)
+            std::this_thread::yield();
+    }
+    CHECK(ran == 200);
+}
+
+/// A task that throws is logged, and the worker goes on to the next.
+static void throwing_task_is_logged() {
+    struct Capture : LogSink {
+        void write(LogLevel level, const std::string &line) override {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (level == LogLevel::Error &&
+                line.find("boom") != std::string::npos)
+                ++errors;
+        }
+        std::mutex mutex;
+        int errors = 0;
+    };
+    auto capture = std::make_shared<Capture>();
+    set_log_sink(capture);
+
+    std::atomic<int> ran = 0;
+    {
+        ThreadPool pool(1);
+        pool.enqueue([] { throw std::runtime_error("boom"); });
+        pool.enqueue([&] { ++ran; });
+    }
+    set_log_sink(nullptr);
+    CHECK(ran == 1);
+    CHECK(capture->errors == 1);
+}
+
+int main() {
+    for (Scheduler scheduler :
+         {Scheduler::SharedQueue, Scheduler::WorkStealing}) {
+        accepted_tasks_run(scheduler);
+        nested_tasks_run(scheduler);
+    }
+    throwing_task_is_logged();
+    return 0;
+}
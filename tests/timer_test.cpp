@@ -0,0 +1,46 @@
+#include "../timer.hpp"
+#include "harness.hpp"
+
+#include <atomic>
+
+using namespace Socks;
+
+/// A cancelled job never runs; one that ran can no longer be cancelled.
+static void cancelled_jobs_do_not_run() {
+    std::atomic<int> ran = 0;
+    Timer timer;
+    auto now = Timer::Clock::now();
+    Timer::Handle dropped = timer.schedule(
+        now + std::chrono::milliseconds(20), [&] { ran += 100; });
+    Timer::Handle kept =
+        timer.schedule(now + std::chrono::milliseconds(40), [&] { ++ran; });
+    CHECK(timer.cancel(dropped));
+    CHECK(!timer.cancel(dropped));
+
+    for (int i = 0; i < 500 && ran == 0; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    CHECK(ran == 1);
+    CHECK(!timer.cancel(kept));
+}
+
+/// Cancelling the job the thread sleeps until leaves the others on time.
+static void cancel_while_waiting() {
+    std::atomic<int> ran = 0;
+    Timer timer;
+    auto now = Timer::Clock::now();
+    Timer::Handle first = timer.schedule(
+        now + std::chrono::milliseconds(30), [&] { ran += 100; });
+    timer.schedule(now + std::chrono::milliseconds(60), [&] { ++ran; });
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    CHECK(timer.cancel(first));
+
+    for (int i = 0; i < 500 && ran == 0; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    CHECK(ran == 1);
+}
+
+int main() {
+    cancelled_jobs_do_not_run();
+    cancel_while_waiting();
+    return 0;
+}
@@ -0,0 +1,103 @@
+#include "../client.hpp"
+#include "harness.hpp"
+
+#include <atomic>
+
+using namespace Socks;
+using namespace SocksTest;
+
+struct Pose {
+    double x;
+    double y;
+};
+SOCKS_FIELDS(Pose, x, y)
+
+struct MoveRequest {
+    std::string robot;
+    Pose target;
+    std::vector<Pose> via;
+    std::optional<std::uint8_t> speed;
+    json tags;
+};
+SOCKS_FIELDS(MoveRequest, robot, target, via, speed, tags)
+
+struct MoveResponse {
+    std::string robot;
+    double distance;
+    std::optional<int> speed;
+    json tags;
+};
+SOCKS_FIELDS(MoveResponse, robot, distance, speed, tags)
+
+/// The message of the error a request fails with.
+static std::string failure(Client &client, const json &request) {
+    try {
+        client.send_request("move", request);
+    } catch (const std::exception &e) {
+        return e.what();
+    }
+    return "";
+}
+
+/// A typed handler gets the request as a struct and answers with one, in
+/// every codec; a request that does not match never reaches it.
+static void structs_round_trip() {
+    std::string path = socket_path("typed");
+    std::atomic<int> calls = 0;
+    Server server(
+        std::make_unique<UnixSocketTransport>(path, Framing::LengthPrefixed));
+    server.add_handler<MoveRequest, MoveResponse>(
+        "move", [&calls](const MoveRequest &request) {
+            ++calls;
+            double distance = 0;
+            Pose from{0, 0};
+            for (const Pose &to : request.via) {
+                distance += std::abs(to.x - from.x) + std::abs(to.y - from.y);
+                from = to;
+            }
+            distance += std::abs(request.target.x - from.x) +
+                        std::abs(request.target.y - from.y);
+            std::optional<int> speed;
+            if (request.speed)
+                speed = *request.speed;
+            return MoveResponse{request.robot, distance, speed, request.tags};
+        });
+    ServerThread running(server, path);
+
+    MoveRequest request{"arm", {3, 4}, {{1, 0}}, std::nullopt,
+                        json{{"shift", "night"}}};
+    for (Codec codec : {Codec::Json, Codec::MessagePack, Codec::Cbor}) {
+        Client client(std::make_unique<UnixSocketTransport>(
+                          path, Framing::LengthPrefixed),
+                      codec);
+        auto response =
+            client.send_request("move", json(request)).get<MoveResponse>();
+        CHECK(response.robot == "arm");
+        CHECK(response.distance == 7);
+        CHECK(!response.speed);
+        CHECK(response.tags["shift"] == "night");
+
+        json fast = request;
+        fast["speed"] = 200;
+        CHECK(client.send_request("move", fast)["speed"] == 200);
+    }
+    CHECK(calls == 6);
+
+    Client client(
+        std::make_unique<UnixSocketTransport>(path, Framing::LengthPrefixed));
+    json missing = request;
+    missing.erase("target");
+    CHECK(failure(client, missing).find("target") != std::string::npos);
+    json wrong = request;
+    wrong["target"]["x"] = "three";
+    CHECK(failure(client, wrong).find("target.x") != std::string::npos);
+    json too_fast = request;
+    too_fast["speed"] = 300;
+    CHECK(failure(client, too_fast).find("speed") != std::string::npos);
+    CHECK(calls == 6);
+}
+
+int main() {
+    structs_round_trip();
+    return 0;
+}
@@ -0,0 +1,105 @@
+#include "../eventloop.hpp"
+#include "../transport.hpp"
+#include "harness.hpp"
+
+#include <atomic>
+#include <filesystem>
+
+using namespace Socks;
+using namespace SocksTest;
+
+/// A port of this process's own, so tests can run in parallel.
+static int test_port() { return 20000 + ::getpid() % 20000; }
+
+/// Concurrent send() calls on one client transport each get their own
+/// response.
+static void concurrent_client_sends() {
+    int port = test_port();
+    auto pool = std::make_shared<ThreadPool>(2);
+    Server server(std::make_unique<UdpTransport>(port), pool);
+    server.add_handler("echo", [](const json &request) {
+        return okay({{"value", request.at("value")}});
+    });
+    ServerThread running(server);
+
+    UdpTransport client("127.0.0.1", port);
+    // Datagrams sent before the server binds are lost; resend those.
+    client.set_retries(8, std::chrono::milliseconds(20));
+
+    std::atomic<bool> failed = false;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&, t] {
+            for (int i = 0; i < 100; ++i) {
+                int value = t * 1000 + i;
+                json answer = json::parse(client.send(
+                    json{{"_cmd", "echo"}, {"value", value}}.dump()));
+                if (answer["value"] != value)
+                    failed = true;
+            }
+        });
+    }
+    for (auto &thread : threads)
+        thread.join();
+    CHECK(!failed);
+}
+
+/// Responses above the limit are refused, not truncated.
+static void oversized_response() {
+    int port = test_port() + 1;
+    Server server(std::make_unique<UdpTransport>(port));
+    server.add_handler("big", [](const json &) {
+        return okay({{"text", std::string(4000, 'x')}});
+    });
+    ServerThread running(server);
+
+    UdpTransport client("127.0.0.1", port);
+    client.set_retries(8, std::chrono::milliseconds(20));
+    json answer = json::parse(client.send(json{{"_cmd", "big"}}.dump()));
+    CHECK(answer["text"].get<std::string>().size() == 4000);
+
+    client.set_max_message_size(1000);
+    CHECK_THROWS(client.send(json{{"_cmd", "big"}}.dump()));
+}
+
+/// Descriptors this process has open.
+static size_t open_fds() {
+    size_t count = 0;
+    for (auto &entry : std::filesystem::directory_iterator("/proc/self/fd")) {
+        (void)entry;
+        ++count;
+    }
+    return count;
+}
+
+/// A batched server stopped and started again serves as before, on
+/// fresh sockets only.
+static void batched_restart() {
+    int port = test_port() + 2;
+    Server server(std::make_unique<BatchedUdpTransport>(port, 2));
+    server.add_handler("echo", [](const json &request) {
+        return okay({{"value", request.at("value")}});
+    });
+
+    size_t fds = 0;
+    for (int run = 0; run < 3; ++run) {
+        {
+            ServerThread running(server);
+            UdpTransport client("127.0.0.1", port);
+            client.set_retries(8, std::chrono::milliseconds(20));
+            json answer = json::parse(
+                client.send(json{{"_cmd", "echo"}, {"value", run}}.dump()));
+            CHECK(answer["value"] == run);
+        }
+        if (run == 0)
+            fds = open_fds();
+        CHECK(open_fds() == fds);
+    }
+}
+
+int main() {
+    concurrent_client_sends();
+    oversized_response();
+    batched_restart();
+    return 0;
+}
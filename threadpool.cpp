@@ -1,64 +1,324 @@
 #include "threadpool.hpp"
 
-#include <iostream>
+#include "logger.hpp"
+
+#include <algorithm>
 
 namespace Socks {
 
-ThreadPool::ThreadPool(size_t thread_count)
-    : stop_(false), terminate_now_(false) {
-    std::cout << "\033[1;32m[ThreadPool] INFO: Starting thread pool with "
-              << thread_count << " threads.\033[0m" << std::endl;
-    for (size_t i = 0; i < thread_count; ++i) {
-        workers_.emplace_back(&ThreadPool::worker, this);
+/// Jobs a pinned worker's deque has room for from the start.
+static constexpr size_t kLocalSlots = 256;
+
+/// Pool and worker index of the calling thread, if it is a pool worker.
+static thread_local const ThreadPool *current_pool = nullptr;
+static thread_local size_t current_index = 0;
+
+// ==========================
+// JobQueue
+// ==========================
+
+void ThreadPool::JobQueue::grow() {
+    std::vector<Job> slots(slots_.empty() ? 16 : slots_.size() * 2);
+    for (size_t i = 0; i < size_; ++i) {
+        slots[i] = std::move(slots_[(head_ + i) & (slots_.size() - 1)]);
     }
+    slots_.swap(slots);
+    head_ = 0;
 }
 
-ThreadPool::~ThreadPool() { wait(); }
+void ThreadPool::JobQueue::reserve(size_t count) {
+    while (slots_.size() < count) {
+        grow();
+    }
+}
 
-void ThreadPool::worker() {
-    while (true) {
-        std::function<void()> task;
+void ThreadPool::JobQueue::push_back(Job job) {
+    if (size_ == slots_.size()) {
+        grow();
+    }
+    slots_[(head_ + size_) & (slots_.size() - 1)] = std::move(job);
+    ++size_;
+}
 
-        {
-            std::unique_lock<std::mutex> lock(queue_mutex_);
-            condition_.wait(lock, [this] {
-                return terminate_now_ || (!tasks_.empty() && !stop_);
-            });
-
-            if (terminate_now_) {
-                std::cout
-                    << "\033[1;31m[ThreadPool] INFO: Worker thread exiting "
-                       "immediately due to termination request.\033[0m"
-                    << std::endl;
-                return;
-            }
+ThreadPool::Job ThreadPool::JobQueue::pop_front() {
+    Job job = std::move(slots_[head_]);
+    head_ = (head_ + 1) & (slots_.size() - 1);
+    --size_;
+    return job;
+}
+
+ThreadPool::Job ThreadPool::JobQueue::pop_back() {
+    --size_;
+    return std::move(slots_[(head_ + size_) & (slots_.size() - 1)]);
+}
+
+// ==========================
+// ThreadPool
+// ==========================
+
+ThreadPool::ThreadPool(size_t thread_count, Scheduler scheduler,
+                       CpuAffinity affinity)
+    : scheduler_(scheduler), affinity_(std::move(affinity)), stop_(false),
+      terminate_now_(false) {
+    log_info("[ThreadPool] Starting thread pool with ", thread_count,
+             pinned() ? " pinned threads." : " threads.");
+    if (scheduler_ == Scheduler::WorkStealing) {
+        // Pinned workers allocate their own deques (see settle()).
+        for (size_t i = 0; i < thread_count; ++i) {
+            queues_.push_back(pinned() ? nullptr
+                                       : std::make_unique<WorkerQueue>());
+        }
+        if (pinned()) {
+            map_cpus();
+        }
+    }
+    for (size_t i = 0; i < thread_count; ++i) {
+        workers_.emplace_back(&ThreadPool::worker, this, i);
+    }
+    if (pinned()) {
+        std::unique_lock<std::mutex> lock(queue_mutex_);
+        condition_.wait(lock, [&] { return settled_ == thread_count; });
+    }
+}
 
-            if (stop_ && tasks_.empty()) {
-                return;
+void ThreadPool::map_cpus() {
+    // CPUs a worker is pinned to go to that worker (spread over the
+    // workers sharing them); other CPUs to a worker on the same node.
+    int highest = 0;
+    for (const auto &set : affinity_.sets) {
+        for (int cpu : set) {
+            highest = std::max(highest, cpu);
+        }
+    }
+    std::vector<int> cpus = allowed_cpus();
+    for (int cpu : cpus) {
+        highest = std::max(highest, cpu);
+    }
+
+    std::vector<std::vector<size_t>> pinned_to(highest + 1);
+    std::vector<std::vector<size_t>> on_node;
+    for (size_t i = 0; i < queues_.size(); ++i) {
+        const std::vector<int> &set = affinity_.cpus_of(i);
+        if (set.empty()) {
+            continue;
+        }
+        for (int cpu : set) {
+            if (cpu >= 0) {
+                pinned_to[cpu].push_back(i);
             }
+        }
+        size_t node = static_cast<size_t>(numa_node_of_cpu(set.front()));
+        if (on_node.size() <= node) {
+            on_node.resize(node + 1);
+        }
+        on_node[node].push_back(i);
+    }
 
-            if (!tasks_.empty()) {
-                task = std::move(tasks_.front());
-                tasks_.pop();
-            } else {
+    near_worker_.assign(highest + 1, kAnyWorker);
+    for (int cpu = 0; cpu <= highest; ++cpu) {
+        const std::vector<size_t> *workers = &pinned_to[cpu];
+        if (workers->empty()) {
+            size_t node = static_cast<size_t>(numa_node_of_cpu(cpu));
+            if (node >= on_node.size() || on_node[node].empty()) {
                 continue;
             }
+            workers = &on_node[node];
         }
+        near_worker_[cpu] = (*workers)[cpu % workers->size()];
+    }
+}
 
-        task(); // already wrapped with auto-abort safety
+size_t ThreadPool::worker_near(int cpu) const {
+    if (cpu < 0 || static_cast<size_t>(cpu) >= near_worker_.size()) {
+        return kAnyWorker;
     }
+    return near_worker_[cpu];
 }
 
-void ThreadPool::enqueue(std::function<void()> task) {
-    {
+void ThreadPool::settle(size_t index) {
+    if (!pin_current_thread(affinity_.cpus_of(index))) {
+        log_warning("[ThreadPool] Could not pin worker ", index,
+                    "; it runs unpinned.");
+    }
+
+    // Allocated here rather than by the constructor, so that first touch
+    // places the deque on this worker's node.
+    std::unique_ptr<WorkerQueue> queue;
+    if (scheduler_ == Scheduler::WorkStealing) {
+        queue = std::make_unique<WorkerQueue>();
+        queue->tasks.reserve(kLocalSlots);
+    }
+
+    std::unique_lock<std::mutex> lock(queue_mutex_);
+    if (queue) {
+        queues_[index] = std::move(queue);
+    }
+    ++settled_;
+    condition_.notify_all();
+    if (scheduler_ == Scheduler::WorkStealing) {
+        // Workers steal from one another, so none starts before all
+        // deques exist.
+        condition_.wait(lock, [this] { return settled_ == queues_.size(); });
+    }
+}
+
+ThreadPool::~ThreadPool() { wait(); }
+
+void ThreadPool::worker(size_t index) {
+    current_pool = this;
+    current_index = index;
+    if (pinned()) {
+        settle(index);
+    }
+
+    Job task;
+    while (next_task(index, task)) {
+        if (!should_terminate()) {
+            active_.fetch_add(1, std::memory_order_relaxed);
+            try {
+                task();
+            } catch (const std::exception &e) {
+                log_error("[ThreadPool] Task threw an exception: ", e.what());
+            } catch (...) {
+                log_error("[ThreadPool] Task threw an unknown exception.");
+            }
+            active_.fetch_sub(1, std::memory_order_relaxed);
+        }
+        task = nullptr;
+    }
+}
+
+bool ThreadPool::next_task(size_t index, Job &task) {
+    if (scheduler_ == Scheduler::SharedQueue) {
         std::unique_lock<std::mutex> lock(queue_mutex_);
-        if (stop_ || terminate_now_) {
+        condition_.wait(lock, [this] {
+            return terminate_now_ || stop_ || !tasks_.empty();
+        });
+
+        if (terminate_now_) {
+            log_debug("[ThreadPool] Worker thread exiting immediately due "
+                      "to termination request.");
+            return false;
+        }
+
+        if (tasks_.empty()) {
+            return false; // stopping and drained
+        }
+
+        task = tasks_.pop_front();
+        pending_.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    while (true) {
+        if (terminate_now_) {
+            log_debug("[ThreadPool] Worker thread exiting immediately due "
+                      "to termination request.");
+            return false;
+        }
+
+        if (take_task(index, task)) {
+            pending_.fetch_sub(1);
+            return true;
+        }
+
+        // Nothing to run or steal: sleep until a producer signals. sleepers_
+        // is raised before pending_ is re-checked, and producers bump
+        // pending_ before reading sleepers_, so a wakeup cannot be missed.
+        std::unique_lock<std::mutex> lock(queue_mutex_);
+        sleepers_.fetch_add(1);
+        condition_.wait(lock, [this] {
+            return terminate_now_ || stop_ || pending_.load() > 0;
+        });
+        sleepers_.fetch_sub(1);
+
+        if (stop_ && !terminate_now_ && pending_.load() == 0) {
+            return false; // stopping and drained
+        }
+    }
+}
+
+bool ThreadPool::take_task(size_t index, Job &task) {
+    // Own deque first, oldest task first so requests are served in order.
+    {
+        WorkerQueue &own = *queues_[index];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = own.tasks.pop_front();
+            return true;
+        }
+    }
+
+    // Steal from the back of the others, away from their owners' end.
+    size_t count = queues_.size();
+    for (size_t n = 1; n < count; ++n) {
+        WorkerQueue &victim = *queues_[(index + n) % count];
+        std::unique_lock<std::mutex> lock(victim.mutex, std::try_to_lock);
+        if (lock.owns_lock() && !victim.tasks.empty()) {
+            task = victim.tasks.pop_back();
+            return true;
+        }
+    }
+
+    // Contended deques were skipped above; take a blocking pass before
+    // concluding there is nothing to do.
+    for (size_t n = 1; n < count; ++n) {
+        WorkerQueue &victim = *queues_[(index + n) % count];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = victim.tasks.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::push(Job task, size_t target) {
+    if (scheduler_ == Scheduler::SharedQueue) {
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex_);
+            if (stop_ || terminate_now_) {
+                throw std::runtime_error("[ThreadPool] Cannot enqueue on "
+                                         "stopped or terminated pool.");
+            }
+            tasks_.push_back(std::move(task));
+            pending_.fetch_add(1, std::memory_order_relaxed);
+        }
+        condition_.notify_one();
+        return;
+    }
+
+    {
+        // Admitted under the lock wait() raises stop_ with, and counted
+        // before it is queued: a worker that still sees it pending does not
+        // exit, so a task admitted here always runs.
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        if (stop_ || terminate_now_ || queues_.empty()) {
             throw std::runtime_error(
                 "[ThreadPool] Cannot enqueue on stopped or terminated pool.");
         }
-        tasks_.emplace(wrap_task(std::move(task)));
+        pending_.fetch_add(1);
+    }
+
+    // Tasks go where they are sent; otherwise, tasks spawned by a worker
+    // stay local and others are spread round-robin.
+    size_t index = target;
+    if (index == kAnyWorker) {
+        index = current_pool == this
+                    ? current_index
+                    : next_queue_.fetch_add(1, std::memory_order_relaxed) %
+                          queues_.size();
+    }
+    {
+        WorkerQueue &queue = *queues_[index];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(std::move(task));
+    }
+
+    if (sleepers_.load() > 0) {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        condition_.notify_one();
     }
-    condition_.notify_one();
 }
 
 void ThreadPool::wait() {
@@ -72,11 +332,11 @@ void ThreadPool::wait() {
             worker.join();
         }
     }
-    std::cout << "\033[1;32m[ThreadPool] INFO: All worker threads joined "
-                 "successfully.\033[0m"
-              << std::endl;
+    log_info("[ThreadPool] All worker threads joined successfully.");
 }
 
+bool ThreadPool::on_worker_thread() const { return current_pool == this; }
+
 void ThreadPool::terminate() {
     {
         std::unique_lock<std::mutex> lock(queue_mutex_);
@@ -88,9 +348,8 @@ void ThreadPool::terminate() {
             worker.join();
         }
     }
-    std::cout << "\033[1;31m[ThreadPool] WARNING: Thread pool terminated "
-                 "immediately. Pending tasks may have been abandoned.\033[0m"
-              << std::endl;
+    log_warning("[ThreadPool] Thread pool terminated immediately. Pending "
+                "tasks may have been abandoned.");
 }
 
 } // namespace Socks
@@ -1,12 +1,16 @@
 #pragma once
 
+#include "affinity.hpp"
+#include "function.hpp"
+
 #include <atomic>
 #include <condition_variable>
-#include <functional>
+#include <cstddef>
 #include <future>
+#include <memory>
 #include <mutex>
-#include <queue>
 #include <thread>
+#include <tuple>
 #include <vector>
 
 /**
@@ -21,6 +25,19 @@
 
 namespace Socks {
 
+/**
+ * @brief Task scheduling strategy used by a ThreadPool.
+ */
+enum class Scheduler {
+    /// One queue shared by every worker, protected by a single mutex.
+    SharedQueue,
+    /// One deque per worker. Tasks submitted from a worker stay on its own
+    /// deque, external submissions are spread round-robin, and idle workers
+    /// steal from the others. The pool-wide mutex is only taken to sleep and
+    /// to wake sleeping workers.
+    WorkStealing,
+};
+
 /**
  * @class ThreadPool
  * @brief A thread pool that manages a fixed number of worker threads to execute
@@ -30,15 +47,42 @@ namespace Socks {
  * - Safe task submission with automatic termination checking.
  * - Graceful and immediate shutdown.
  * - Asynchronous task submission returning std::future.
+ * - Shared-queue or work-stealing scheduling (see Scheduler).
+ * - Optional pinning of workers to cores or NUMA nodes (see CpuAffinity),
+ *   with tasks routed to the worker on a given core.
+ * - No heap allocation per task for callables that fit in a Job's inline
+ *   buffer; submit_async() only allocates the future's shared state.
  */
 class ThreadPool {
   public:
+    /**
+     * @brief Queued task type: move-only, with room for a lambda capturing a
+     * few pointers, two std::strings or a std::promise without allocating.
+     */
+    using Job = UniqueFunction<void(), 120>;
+
     /**
      * @brief Constructs a ThreadPool with the specified number of worker
      * threads.
+     *
+     * Pinned workers pin themselves before anything else, and with
+     * Scheduler::WorkStealing allocate their own deques afterwards, so
+     * that these sit in memory local to the worker's node. The constructor
+     * returns once they have.
+     *
+     * @code
+     * // A worker per core, each with its own deque
+     * ThreadPool pool(16, Scheduler::WorkStealing, CpuAffinity::all_cores());
+     * @endcode
+     *
      * @param thread_count Number of worker threads to create.
+     * @param scheduler Task scheduling strategy.
+     * @param affinity Where workers run; empty leaves them unpinned. A
+     * worker whose CPUs cannot be used runs unpinned, with a warning.
      */
-    explicit ThreadPool(size_t thread_count);
+    explicit ThreadPool(size_t thread_count,
+                        Scheduler scheduler = Scheduler::SharedQueue,
+                        CpuAffinity affinity = {});
 
     /**
      * @brief Destroys the ThreadPool, waiting for tasks to complete (graceful
@@ -63,11 +107,31 @@ class ThreadPool {
 
     /**
      * @brief Enqueues a fire-and-forget task to the pool.
-     * @param task Callable task without return value.
+     * @param task Callable task without return value. Move-only callables
+     * are accepted.
+     *
+     * @throws std::runtime_error if the pool is stopping or terminating.
+     */
+    template <typename F> void enqueue(F &&task) {
+        push(Job(std::forward<F>(task)), kAnyWorker);
+    }
+
+    /**
+     * @brief Enqueues a task for the worker pinned to `cpu`, so that it
+     * runs where its data was just touched (e.g. where a request was
+     * received).
+     *
+     * Without such a worker, a worker on the same NUMA node is chosen. The
+     * task is only placed: idle workers may still steal it. With an
+     * unpinned pool or Scheduler::SharedQueue this is enqueue().
      *
+     * @param cpu A CPU number, as returned by current_cpu().
+     * @param task Callable task without return value.
      * @throws std::runtime_error if the pool is stopping or terminating.
      */
-    void enqueue(std::function<void()> task);
+    template <typename F> void enqueue_near(int cpu, F &&task) {
+        push(Job(std::forward<F>(task)), worker_near(cpu));
+    }
 
     /**
      * @brief Waits for all currently enqueued tasks to complete and joins all
@@ -94,31 +158,140 @@ class ThreadPool {
      */
     bool should_terminate() const { return terminate_now_; }
 
+    /**
+     * @brief The scheduling strategy this pool was constructed with.
+     */
+    Scheduler scheduler() const { return scheduler_; }
+
+    /**
+     * @brief Where the workers run; empty if unpinned.
+     */
+    const CpuAffinity &affinity() const { return affinity_; }
+
+    /**
+     * @brief Whether the workers are pinned.
+     */
+    bool pinned() const { return !affinity_.empty(); }
+
+    /**
+     * @brief Whether the calling thread is one of this pool's workers.
+     */
+    bool on_worker_thread() const;
+
+    /**
+     * @brief Number of worker threads.
+     */
+    size_t size() const { return workers_.size(); }
+
+    /**
+     * @brief Tasks queued and not yet picked up by a worker.
+     */
+    size_t queued() const { return pending_.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Workers currently running a task.
+     */
+    size_t active() const { return active_.load(std::memory_order_relaxed); }
+
   private:
+    /**
+     * @brief Growable ring buffer of jobs.
+     *
+     * Unlike std::deque it never frees or allocates once it has grown to the
+     * working-set size, so steady-state queueing is allocation-free.
+     */
+    class JobQueue {
+      public:
+        bool empty() const { return size_ == 0; }
+        void reserve(size_t count); ///< Allocate room for `count` jobs
+        void push_back(Job job);
+        Job pop_front();
+        Job pop_back();
+
+      private:
+        void grow();
+
+        std::vector<Job> slots_; ///< Capacity is always a power of two
+        size_t head_ = 0;
+        size_t size_ = 0;
+    };
+
+    /**
+     * @brief Per-worker task deque used by Scheduler::WorkStealing.
+     */
+    struct alignas(64) WorkerQueue {
+        std::mutex mutex;
+        JobQueue tasks;
+    };
+
+    /// push() target meaning "as the scheduler sees fit".
+    static constexpr size_t kAnyWorker = static_cast<size_t>(-1);
+
+    /**
+     * @brief Queue a job according to the scheduler.
+     * @param target Worker whose deque takes the job (work stealing), or
+     * kAnyWorker.
+     * @throws std::runtime_error if the pool is stopping or terminating.
+     */
+    void push(Job job, size_t target);
+
+    /**
+     * @brief The worker enqueue_near() places tasks for `cpu` with, or
+     * kAnyWorker.
+     */
+    size_t worker_near(int cpu) const;
+
+    /**
+     * @brief Map every CPU to the worker pinned nearest to it (see
+     * near_worker_).
+     */
+    void map_cpus();
+
+    /**
+     * @brief Pin the calling worker and, when work stealing, allocate its
+     * deque; returns once every worker has.
+     */
+    void settle(size_t index);
+
     /**
      * @brief Main loop executed by each worker thread.
      *
      * Fetches tasks from the queue and executes them, checking for termination
      * requests.
+     *
+     * @param index Index of the worker (its own deque when work stealing).
      */
-    void worker();
+    void worker(size_t index);
 
     /**
-     * @brief Internal helper to wrap tasks and automatically check for
-     * termination.
-     *
-     * If termination is requested, the task will not run.
-     *
-     * @tparam Func Task function type.
-     * @param f The task to wrap.
-     * @return A wrapped version of the task.
+     * @brief Block until a task is available for the given worker.
+     * @return false if the worker should exit.
      */
-    template <typename Func> std::function<void()> wrap_task(Func &&f);
+    bool next_task(size_t index, Job &task);
 
+    /**
+     * @brief Pop from the worker's own deque, or steal from another one.
+     */
+    bool take_task(size_t index, Job &task);
+
+    Scheduler scheduler_;                     ///< Scheduling strategy
+    CpuAffinity affinity_;                    ///< Where workers run
+    /// Worker for each CPU number, or kAnyWorker; only filled for a
+    /// pinned, work-stealing pool.
+    std::vector<size_t> near_worker_;
+    size_t settled_ = 0; ///< Workers done with settle(); queue_mutex_
     std::vector<std::thread> workers_;        ///< Vector of worker threads
-    std::queue<std::function<void()>> tasks_; ///< Queue of pending tasks
+    JobQueue tasks_;                          ///< Queue of pending tasks
+
+    std::vector<std::unique_ptr<WorkerQueue>>
+        queues_; ///< Per-worker deques (work stealing)
+    std::atomic<size_t> pending_{0};  ///< Queued tasks
+    std::atomic<size_t> active_{0};   ///< Workers running a task
+    std::atomic<size_t> sleepers_{0}; ///< Workers waiting on condition_
+    std::atomic<size_t> next_queue_{0}; ///< Round-robin target for enqueue
 
-    std::mutex queue_mutex_; ///< Protects access to the task queue
+    std::mutex queue_mutex_; ///< Protects the shared queue; sleep lock for
+                             ///< work stealing
     std::condition_variable
         condition_;          ///< Signals when new tasks are available
     std::atomic<bool> stop_; ///< Indicates graceful stop requested
@@ -128,28 +301,28 @@ class ThreadPool {
 
 // ------------ Template Implementations -------------
 
-template <typename Func> std::function<void()> ThreadPool::wrap_task(Func &&f) {
-    return [this, func = std::forward<Func>(f)]() {
-        if (should_terminate())
-            return;
-        try {
-            func();
-        } catch (...) {
-            // Optional: handle/log exception internally
-        }
-    };
-}
-
 template <typename F, typename... Args>
 auto ThreadPool::submit_async(F &&f, Args &&...args)
     -> std::future<decltype(f(args...))> {
     using ReturnType = decltype(f(args...));
 
-    auto task = std::make_shared<std::packaged_task<ReturnType()>>(
-        std::bind(std::forward<F>(f), std::forward<Args>(args)...));
-
-    std::future<ReturnType> res = task->get_future();
-    enqueue(wrap_task([task]() { (*task)(); }));
+    // The promise and the callable travel inside the job itself; only the
+    // future's shared state is allocated.
+    std::promise<ReturnType> promise;
+    std::future<ReturnType> res = promise.get_future();
+    push(Job([promise = std::move(promise), func = std::forward<F>(f),
+              bound = std::make_tuple(std::forward<Args>(args)...)]() mutable {
+        try {
+            if constexpr (std::is_void_v<ReturnType>) {
+                std::apply(func, bound);
+                promise.set_value();
+            } else {
+                promise.set_value(std::apply(func, bound));
+            }
+        } catch (...) {
+            promise.set_exception(std::current_exception());
+        }
+    }), kAnyWorker);
     return res;
 }
 
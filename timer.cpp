@@ -0,0 +1,70 @@
+#include "timer.hpp"
+
+namespace Socks {
+
+Timer::Timer() : thread_([this] { run(); }) {}
+
+Timer::~Timer() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_one();
+    thread_.join();
+}
+
+Timer::Handle Timer::schedule(Clock::time_point when,
+                              std::function<void()> job) {
+    Handle handle{when, 0};
+    bool earliest;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        handle.id = ++next_id_;
+        auto added = jobs_.emplace(std::make_pair(when, handle.id),
+                                   std::move(job));
+        earliest = added.first == jobs_.begin();
+    }
+    // Only a new first job changes how long the thread should sleep.
+    if (earliest)
+        wake_.notify_one();
+    return handle;
+}
+
+bool Timer::cancel(const Handle &handle) {
+    // The job is destroyed outside the lock: it may hold the last
+    // reference to something whose destructor takes a while.
+    std::function<void()> job;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto found = jobs_.find({handle.when, handle.id});
+        if (found == jobs_.end())
+            return false;
+        job = std::move(found->second);
+        jobs_.erase(found);
+    }
+    return true;
+}
+
+void Timer::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_) {
+        if (jobs_.empty()) {
+            wake_.wait(lock);
+            continue;
+        }
+        auto first = jobs_.begin();
+        // A copy: cancel() may erase the job while the thread sleeps.
+        Clock::time_point due = first->first.first;
+        if (due > Clock::now()) {
+            wake_.wait_until(lock, due);
+            continue;
+        }
+        std::function<void()> job = std::move(first->second);
+        jobs_.erase(first);
+        lock.unlock();
+        job();
+        lock.lock();
+    }
+}
+
+} // namespace Socks
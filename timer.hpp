@@ -0,0 +1,77 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+
+/**
+ * @file timer.hpp
+ * @brief A thread running jobs at given times.
+ *
+ * Client uses one to fail pipelined requests at their deadline, and
+ * ClusterClient for its timeouts and hedges.
+ */
+
+namespace Socks {
+
+/**
+ * @class Timer
+ * @brief Runs each scheduled job on its own thread once its time comes.
+ *
+ * Jobs run one at a time, in time order, and should be short: a job that
+ * blocks delays the ones after it. Jobs must not throw. Jobs still waiting
+ * when the timer is destroyed never run. A job no longer needed can be
+ * cancelled, so that what it holds is released at once.
+ */
+class Timer {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    /// Identifies a scheduled job (see cancel()).
+    struct Handle {
+        Clock::time_point when;
+        std::uint64_t id = 0; ///< Zero for none
+    };
+
+    Timer();
+
+    /**
+     * @brief Stop the thread, dropping the jobs that have not run.
+     */
+    ~Timer();
+
+    Timer(const Timer &) = delete;
+    Timer &operator=(const Timer &) = delete;
+
+    /**
+     * @brief Run `job` at `when`, or as soon as possible if that has
+     * passed.
+     * @return A handle for cancel().
+     */
+    Handle schedule(Clock::time_point when, std::function<void()> job);
+
+    /**
+     * @brief Drop a job that has not started yet.
+     * @return false if it has run, is running or was cancelled already.
+     */
+    bool cancel(const Handle &handle);
+
+  private:
+    void run();
+
+    std::mutex mutex_; ///< Protects jobs_, next_id_ and stopping_
+    std::condition_variable wake_;
+    /// By time, then by id so that jobs due at once run in schedule order.
+    std::map<std::pair<Clock::time_point, std::uint64_t>,
+             std::function<void()>>
+        jobs_;
+    std::uint64_t next_id_ = 0;
+    bool stopping_ = false;
+    std::thread thread_; ///< Last, so that it starts after the rest
+};
+
+} // namespace Socks
@@ -1,65 +1,711 @@
-
 #include "transport.hpp"
+#include "handoff.hpp"
 
+#include <algorithm>
 #include <arpa/inet.h>
+#include <cerrno>
+#include <charconv>
+#include <climits>
+#include <cstdint>
 #include <cstring>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <stdexcept>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <unistd.h>
+#include <utility>
+#include <vector>
 
 namespace Socks {
 
 // ==========================
-// UnixSocketTransport
+// Socket I/O helpers
 // ==========================
+//
+// Without a deadline the helpers block in the system call. With one, every
+// call is made with MSG_DONTWAIT and the waiting happens in poll(), which
+// gives up at the deadline.
 
-UnixSocketTransport::UnixSocketTransport(const std::string &socket_path)
-    : socket_path_(socket_path) {}
+/// Milliseconds left until `deadline`, rounded up, as a poll() timeout.
+static int poll_timeout(Deadline deadline) {
+    if (deadline == kNoDeadline)
+        return -1;
+    auto left = std::chrono::ceil<std::chrono::milliseconds>(
+        deadline - std::chrono::steady_clock::now());
+    return static_cast<int>(std::clamp<std::int64_t>(left.count(), 0, INT_MAX));
+}
 
-void UnixSocketTransport::bind() {
-    server_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (server_fd_ == -1)
-        throw std::runtime_error("Failed to create UNIX socket");
+/// Wait until `fd` is ready for `events`; false if `until` passes first.
+static bool wait_ready(int fd, short events, Deadline until) {
+    pollfd pfd{fd, events, 0};
+    while (true) {
+        int ready = poll(&pfd, 1, poll_timeout(until));
+        if (ready > 0)
+            return true; // or failed, which the next call reports
+        if (ready == 0)
+            return false;
+        if (errno != EINTR)
+            throw std::runtime_error("Failed to poll socket");
+    }
+}
 
-    sockaddr_un addr{};
-    addr.sun_family = AF_UNIX;
-    std::strncpy(addr.sun_path, socket_path_.c_str(),
-                 sizeof(addr.sun_path) - 1);
-    unlink(socket_path_.c_str());
+static int io_flags(Deadline deadline) {
+    return deadline == kNoDeadline ? 0 : MSG_DONTWAIT;
+}
 
-    if (::bind(server_fd_, (sockaddr *)&addr, sizeof(addr)) == -1)
-        throw std::runtime_error("Failed to bind UNIX socket");
+/// Whether a socket call that returned `n` should be made again, after
+/// waiting for `events` if it would have blocked.
+static bool retry_io(ssize_t n, int fd, short events, Deadline deadline) {
+    if (n >= 0)
+        return false;
+    if (errno == EINTR)
+        return true;
+    if (deadline == kNoDeadline || (errno != EAGAIN && errno != EWOULDBLOCK))
+        return false;
+    if (!wait_ready(fd, events, deadline))
+        throw RequestTimeout();
+    return true;
+}
 
-    if (listen(server_fd_, 5) == -1)
-        throw std::runtime_error("Failed to listen on UNIX socket");
+static bool write_all(int fd, const char *data, size_t len,
+                      Deadline deadline = kNoDeadline) {
+    while (len > 0) {
+        ssize_t n = ::send(fd, data, len, MSG_NOSIGNAL | io_flags(deadline));
+        if (retry_io(n, fd, POLLOUT, deadline))
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= static_cast<size_t>(n);
+    }
+    return true;
 }
 
-std::string UnixSocketTransport::receive(std::string &client_id) {
-    int client_fd = accept(server_fd_, nullptr, nullptr);
-    if (client_fd == -1)
+static bool read_exact(int fd, char *data, size_t len,
+                       Deadline deadline = kNoDeadline) {
+    while (len > 0) {
+        ssize_t n = ::recv(fd, data, len, io_flags(deadline));
+        if (retry_io(n, fd, POLLIN, deadline))
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+/// connect() that gives up at `deadline`; false if the connection fails.
+static bool connect_until(int fd, const sockaddr *addr, socklen_t len,
+                          Deadline deadline) {
+    if (deadline == kNoDeadline)
+        return connect(fd, addr, len) == 0;
+
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    bool ok = connect(fd, addr, len) == 0;
+    if (!ok && errno == EINPROGRESS) {
+        if (!wait_ready(fd, POLLOUT, deadline))
+            throw RequestTimeout();
+        int error = 0;
+        socklen_t size = sizeof(error);
+        ok = getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &size) == 0 &&
+             error == 0;
+    }
+    fcntl(fd, F_SETFL, flags);
+    return ok;
+}
+
+static bool write_frame(int fd, std::uint32_t tag, const char *data,
+                        size_t size, Deadline deadline = kNoDeadline) {
+    unsigned char header[kFrameHeaderSize];
+    encode_frame_header({static_cast<std::uint32_t>(size), tag}, header);
+
+    iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = const_cast<char *>(data);
+    iov[1].iov_len = size;
+
+    msghdr msg{};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    // Loop over partial writes, advancing through the iovec array.
+    while (msg.msg_iovlen > 0) {
+        ssize_t n = ::sendmsg(fd, &msg, MSG_NOSIGNAL | io_flags(deadline));
+        if (retry_io(n, fd, POLLOUT, deadline))
+            continue;
+        if (n <= 0)
+            return false;
+        size_t sent = static_cast<size_t>(n);
+        while (msg.msg_iovlen > 0 && sent >= msg.msg_iov->iov_len) {
+            sent -= msg.msg_iov->iov_len;
+            ++msg.msg_iov;
+            --msg.msg_iovlen;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base =
+                static_cast<char *>(msg.msg_iov->iov_base) + sent;
+            msg.msg_iov->iov_len -= sent;
+        }
+    }
+    return true;
+}
+
+static std::runtime_error oversized(size_t size, size_t limit) {
+    return std::runtime_error("Message of " + std::to_string(size) +
+                              " bytes exceeds max message size of " +
+                              std::to_string(limit) + " bytes");
+}
+
+static void check_outgoing(size_t size, size_t limit) {
+    if (size > limit || size > UINT32_MAX)
+        throw oversized(size, limit);
+}
+
+/**
+ * Read one length-prefixed frame into a std::string or Buffer. Returns false
+ * on EOF or a short read; throws if the header announces a payload above
+ * `limit`, before reading any of it.
+ */
+template <typename Bytes>
+static bool read_frame(int fd, FrameHeader &header, Bytes &payload,
+                       size_t limit, Deadline deadline = kNoDeadline) {
+    unsigned char raw[kFrameHeaderSize];
+    if (!read_exact(fd, reinterpret_cast<char *>(raw), sizeof(raw),
+                    deadline))
+        return false;
+    header = decode_frame_header(raw);
+    if (header.length > limit)
+        throw oversized(header.length, limit);
+    payload.resize(header.length);
+    return read_exact(fd, payload.data(), payload.size(), deadline);
+}
+
+/**
+ * Read an unframed message, growing `out` as needed. Stops at EOF or, when a
+ * scanner is given, as soon as the JSON document it tracks is complete.
+ * Returns false if nothing could be read.
+ */
+template <typename Bytes>
+static bool read_raw_message(int fd, Bytes &out, size_t limit,
+                             RawMessageScanner *scanner,
+                             Deadline deadline = kNoDeadline) {
+    constexpr size_t chunk = 4096;
+    out.clear();
+    while (true) {
+        size_t used = out.size();
+        out.resize(used + chunk);
+        ssize_t n = ::recv(fd, out.data() + used, chunk, io_flags(deadline));
+        if (n < 0) {
+            out.resize(used);
+            if (retry_io(n, fd, POLLIN, deadline))
+                continue;
+            return false;
+        }
+        out.resize(used + static_cast<size_t>(n));
+        if (n == 0)
+            return !out.empty();
+        if (out.size() > limit)
+            throw oversized(out.size(), limit);
+        if (scanner && scanner->feed(out.data() + used, n))
+            return true;
+    }
+}
+
+// ==========================
+// Transport
+// ==========================
+
+Buffer Transport::receive_buffer(std::string &client_id) {
+    std::string data = receive(client_id);
+    return Buffer(data.data(), data.size());
+}
+
+void Transport::send_buffer(const Buffer &data, const std::string &client_id) {
+    send(std::string(data.view()), client_id);
+}
+
+void Transport::adopt_listeners(std::vector<int> fds) {
+    for (int fd : fds)
+        ::close(fd);
+    throw std::logic_error("This transport cannot adopt listening sockets");
+}
+
+
+// ==========================
+// FramedChannel
+// ==========================
+
+FramedChannel::FramedChannel(int fd, std::size_t max_message_size)
+    : fd_(fd), max_message_size_(max_message_size) {}
+
+FramedChannel::~FramedChannel() { ::close(fd_); }
+
+bool FramedChannel::write(std::uint32_t tag, const std::string &payload) {
+    check_outgoing(payload.size(), max_message_size_);
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    return write_frame(fd_, tag, payload.data(), payload.size());
+}
+
+bool FramedChannel::read(std::uint32_t &tag, std::string &payload) {
+    FrameHeader header;
+    if (!read_frame(fd_, header, payload, max_message_size_))
+        return false;
+    tag = header.tag;
+    return true;
+}
+
+void FramedChannel::shutdown() { ::shutdown(fd_, SHUT_RDWR); }
+
+// ==========================
+// StreamTransport
+// ==========================
+
+struct StreamTransport::Connection {
+    explicit Connection(int fd) : fd(fd) {}
+    ~Connection() { ::close(fd); }
+
+    enum class Progress { Partial, Complete, Closed };
+
+    /**
+     * Read what has arrived of the current frame without blocking, so that
+     * a peer sending slowly holds up only itself. Throws if the header
+     * announces a payload above `limit`.
+     */
+    Progress read_available(size_t limit) {
+        while (true) {
+            char *dst;
+            size_t want;
+            if (header_read < kFrameHeaderSize) {
+                dst = reinterpret_cast<char *>(header) + header_read;
+                want = kFrameHeaderSize - header_read;
+            } else {
+                dst = payload.data() + payload_read;
+                want = payload.size() - payload_read;
+                if (want == 0)
+                    return Progress::Complete;
+            }
+
+            ssize_t n = ::recv(fd, dst, want, MSG_DONTWAIT);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                return errno == EAGAIN || errno == EWOULDBLOCK
+                           ? Progress::Partial
+                           : Progress::Closed;
+            }
+            if (n == 0)
+                return Progress::Closed;
+
+            if (header_read < kFrameHeaderSize) {
+                header_read += static_cast<size_t>(n);
+                if (header_read == kFrameHeaderSize) {
+                    FrameHeader decoded = decode_frame_header(header);
+                    if (decoded.length > limit)
+                        throw oversized(decoded.length, limit);
+                    payload.resize(decoded.length);
+                }
+            } else {
+                payload_read += static_cast<size_t>(n);
+            }
+        }
+    }
+
+    /// Hand out the frame read_available() completed and start the next.
+    Buffer take_frame(std::uint32_t &tag) {
+        tag = decode_frame_header(header).tag;
+        header_read = 0;
+        payload_read = 0;
+        return std::move(payload);
+    }
+
+    int fd;
+    std::mutex write_mutex; ///< Serializes responses from pool workers
+
+    // The frame being assembled; only the polling thread touches these.
+    unsigned char header[kFrameHeaderSize];
+    size_t header_read = 0;
+    Buffer payload;
+    size_t payload_read = 0;
+};
+
+StreamTransport::StreamTransport(Framing framing) : framing_(framing) {}
+
+StreamTransport::~StreamTransport() {
+    close_client();
+    close_listeners();
+    for (int fd : adopted_)
+        ::close(fd);
+    if (wake_fd_ != -1)
+        ::close(wake_fd_);
+}
+
+void StreamTransport::bind() {
+    if (wake_fd_ == -1) {
+        wake_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (wake_fd_ == -1)
+            throw std::runtime_error("Failed to create wake eventfd");
+    }
+    std::uint64_t pending;
+    (void)!::read(wake_fd_, &pending, sizeof(pending)); // reset after close()
+    close_listeners();
+    closed_ = false;
+    accepting_ = true;
+    shared_ = false;
+
+    std::vector<int> listeners;
+    listeners.swap(adopted_);
+    if (listeners.empty())
+        listeners.push_back(open_listener());
+    // Non-blocking, so that a connection another process sharing the
+    // socket accepted first does not leave accept() waiting for the next.
+    for (int fd : listeners)
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    std::lock_guard<std::mutex> lock(connections_mutex_);
+    listeners_ = std::move(listeners);
+}
+
+std::vector<int> StreamTransport::share_listeners() {
+    std::lock_guard<std::mutex> lock(connections_mutex_);
+    std::vector<int> fds = duplicate_sockets(listeners_);
+    shared_ = true;
+    return fds;
+}
+
+void StreamTransport::adopt_listeners(std::vector<int> fds) {
+    for (int fd : adopted_)
+        ::close(fd);
+    adopted_ = std::move(fds);
+}
+
+void StreamTransport::stop_listening() {
+    accepting_ = false;
+    close_listeners();
+    if (wake_fd_ != -1) {
+        std::uint64_t one = 1;
+        (void)!::write(wake_fd_, &one, sizeof(one));
+    }
+}
+
+void StreamTransport::close_listeners() {
+    std::lock_guard<std::mutex> lock(connections_mutex_);
+    for (int fd : listeners_)
+        ::close(fd);
+    listeners_.clear();
+}
+
+std::shared_ptr<StreamTransport::Connection>
+StreamTransport::accept_connection(int listener) {
+    int client_fd = accept(listener, nullptr, nullptr);
+    if (client_fd == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ||
+            errno == ECONNABORTED)
+            return nullptr; // taken by another process, or gone already
         throw std::runtime_error("Failed to accept connection");
+    }
+    configure_socket(client_fd);
+    return std::make_shared<Connection>(client_fd);
+}
+
+std::shared_ptr<StreamTransport::Connection>
+StreamTransport::find_connection(std::uint64_t id) {
+    std::lock_guard<std::mutex> lock(connections_mutex_);
+    auto it = connections_.find(id);
+    return it == connections_.end() ? nullptr : it->second;
+}
+
+void StreamTransport::drop_connection(std::uint64_t id) {
+    std::lock_guard<std::mutex> lock(connections_mutex_);
+    connections_.erase(id);
+}
+
+std::string StreamTransport::receive(std::string &client_id) {
+    Buffer message = receive_buffer(client_id);
+    return std::string(message.view());
+}
+
+Buffer StreamTransport::receive_buffer(std::string &client_id) {
+    std::vector<pollfd> fds;
+    std::vector<std::uint64_t> ids;
+
+    while (true) {
+        if (closed_)
+            throw std::runtime_error("Transport closed");
+
+        // After stop_listening() only close() is waited for: connections
+        // are no longer read.
+        fds.clear();
+        ids.clear();
+        fds.push_back({wake_fd_, POLLIN, 0});
+        if (accepting_) {
+            std::lock_guard<std::mutex> lock(connections_mutex_);
+            for (int fd : listeners_)
+                fds.push_back({fd, POLLIN, 0});
+            if (framing_ == Framing::LengthPrefixed) {
+                for (const auto &[id, conn] : connections_) {
+                    fds.push_back({conn->fd, POLLIN, 0});
+                    ids.push_back(id);
+                }
+            }
+        }
+        size_t first = fds.size() - ids.size(); // first connection's entry
+
+        if (poll(fds.data(), fds.size(), -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error("Failed to poll stream sockets");
+        }
+
+        if (closed_)
+            throw std::runtime_error("Transport closed");
+        if (fds[0].revents != 0) {
+            std::uint64_t pending; // woken by stop_listening()
+            (void)!::read(wake_fd_, &pending, sizeof(pending));
+            continue;
+        }
+        if (!accepting_)
+            continue; // the descriptors polled may be closed already
+
+        for (size_t l = 1; l < first; ++l) {
+            if (!(fds[l].revents & POLLIN))
+                continue;
+            auto conn = accept_connection(fds[l].fd);
+            if (!conn)
+                continue;
+
+            if (framing_ == Framing::Raw) {
+                Buffer message;
+                RawMessageScanner scanner;
+                if (!read_raw_message(conn->fd, message, max_message_size_,
+                                      &scanner))
+                    throw std::runtime_error("Failed to read request");
+
+                std::lock_guard<std::mutex> lock(connections_mutex_);
+                std::uint64_t id = next_connection_id_++;
+                connections_.emplace(id, std::move(conn));
+                client_id = std::to_string(id);
+                return message;
+            }
+
+            std::lock_guard<std::mutex> lock(connections_mutex_);
+            connections_.emplace(next_connection_id_++, std::move(conn));
+        }
+
+        // Serve one ready connection per call, rotating the starting point so
+        // a busy client cannot starve the others.
+        size_t count = ids.size();
+        for (size_t n = 0; n < count; ++n) {
+            size_t i = (poll_cursor_ + n) % count;
+            if (fds[first + i].revents == 0)
+                continue;
+
+            std::uint64_t id = ids[i];
+            auto conn = find_connection(id);
+            if (!conn)
+                continue;
+
+            Connection::Progress progress;
+            try {
+                progress = conn->read_available(max_message_size_);
+            } catch (const std::exception &) {
+                // The stream cannot be resynchronised past an oversized
+                // frame, so the connection goes with it.
+                drop_connection(id);
+                throw;
+            }
+            if (progress == Connection::Progress::Closed) {
+                drop_connection(id); // peer closed, possibly mid-frame
+                continue;
+            }
+            if (progress == Connection::Progress::Partial)
+                continue; // the rest comes with a later POLLIN
+
+            std::uint32_t tag;
+            Buffer payload = conn->take_frame(tag);
+            poll_cursor_ = i + 1;
+            client_id = std::to_string(id) + ":" + std::to_string(tag);
+            return payload;
+        }
+    }
+}
+
+void StreamTransport::send(const std::string &data,
+                           const std::string &client_id) {
+    send_bytes(data.data(), data.size(), client_id);
+}
+
+void StreamTransport::send_buffer(const Buffer &data,
+                                  const std::string &client_id) {
+    send_bytes(data.data(), data.size(), client_id);
+}
+
+void StreamTransport::send_bytes(const char *data, size_t size,
+                                 const std::string &client_id) {
+    size_t delim = client_id.find(':');
+    std::uint64_t id = std::stoull(client_id.substr(0, delim));
+
+    auto conn = find_connection(id);
+    if (!conn)
+        throw std::runtime_error("Connection " + client_id +
+                                 " is no longer open");
+
+    try {
+        check_outgoing(size, max_message_size_);
+    } catch (const std::exception &) {
+        drop_connection(id);
+        throw;
+    }
 
-    char buffer[2048] = {};
-    ssize_t len = read(client_fd, buffer, sizeof(buffer) - 1);
-    if (len <= 0) {
+    if (framing_ == Framing::Raw) {
+        // One response per connection, so it is dropped either way.
+        bool ok = write_all(conn->fd, data, size);
+        drop_connection(id);
+        if (!ok)
+            throw std::runtime_error("Failed to write response");
+        return;
+    }
+
+    std::uint32_t tag =
+        static_cast<std::uint32_t>(std::stoul(client_id.substr(delim + 1)));
+    bool ok;
+    {
+        std::lock_guard<std::mutex> lock(conn->write_mutex);
+        ok = write_frame(conn->fd, tag, data, size);
+    }
+    if (!ok) {
+        drop_connection(id);
+        throw std::runtime_error("Failed to write response frame");
+    }
+}
+
+std::unique_ptr<FramedChannel>
+StreamTransport::open_channel(Deadline deadline) {
+    if (framing_ != Framing::LengthPrefixed)
+        return nullptr;
+    int fd = open_connection(deadline);
+    configure_socket(fd);
+    return std::make_unique<FramedChannel>(fd, max_message_size_);
+}
+
+void StreamTransport::close_client() {
+    if (client_fd_ != -1) {
+        ::close(client_fd_);
+        client_fd_ = -1;
+    }
+}
+
+std::string StreamTransport::send(const std::string &data) {
+    return send_until(data, kNoDeadline);
+}
+
+std::string StreamTransport::send_until(const std::string &data,
+                                        Deadline deadline) {
+    check_outgoing(data.size(), max_message_size_);
+
+    if (framing_ == Framing::Raw) {
+        int client_fd = open_connection(deadline);
+
+        // The server closes the connection after its response, so read to
+        // EOF rather than trusting a single read() to return everything.
+        std::string response;
+        bool ok;
+        try {
+            if (!write_all(client_fd, data.data(), data.size(), deadline))
+                throw std::runtime_error("Failed to send request");
+            ok = read_raw_message(client_fd, response, max_message_size_,
+                                  nullptr, deadline);
+        } catch (const std::exception &) {
+            ::close(client_fd);
+            throw;
+        }
         ::close(client_fd);
-        throw std::runtime_error("Failed to read request");
+        if (!ok)
+            throw std::runtime_error("Failed to read response");
+        return response;
     }
 
-    client_id = std::to_string(client_fd);
-    return std::string(buffer, len);
+    // A reused connection may have been closed by the server while idle; in
+    // that case reconnect once and resend before giving up.
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        bool fresh = client_fd_ == -1;
+        if (fresh) {
+            client_fd_ = open_connection(deadline);
+            configure_socket(client_fd_);
+        }
+
+        // A frame cut short by the deadline leaves the connection out of
+        // step, so any failure closes it.
+        std::uint32_t tag = ++next_tag_;
+        FrameHeader header;
+        std::string payload;
+        bool ok;
+        try {
+            if (!write_frame(client_fd_, tag, data.data(), data.size(),
+                             deadline)) {
+                close_client();
+                if (fresh)
+                    throw std::runtime_error("Failed to send request frame");
+                continue;
+            }
+            while ((ok = read_frame(client_fd_, header, payload,
+                                    max_message_size_, deadline)) &&
+                   header.tag != tag) {
+                // Stale response to an earlier, abandoned request; skip it.
+            }
+        } catch (const std::exception &) {
+            close_client();
+            throw;
+        }
+        if (ok)
+            return payload;
+
+        close_client();
+        if (fresh)
+            throw std::runtime_error("Failed to read response frame");
+    }
+    throw std::runtime_error("Connection closed by server");
 }
 
-void UnixSocketTransport::send(const std::string &data,
-                               const std::string &client_id) {
-    int client_fd = std::stoi(client_id);
-    write(client_fd, data.c_str(), data.size());
-    ::close(client_fd);
+void StreamTransport::close() {
+    closed_ = true;
+    if (wake_fd_ != -1) {
+        std::uint64_t one = 1;
+        (void)!::write(wake_fd_, &one, sizeof(one));
+    }
+    close_listeners();
+    {
+        std::lock_guard<std::mutex> lock(connections_mutex_);
+        connections_.clear();
+    }
+    close_client();
+}
+
+// ==========================
+// UnixSocketTransport
+// ==========================
+
+UnixSocketTransport::UnixSocketTransport(const std::string &socket_path,
+                                         Framing framing)
+    : StreamTransport(framing), socket_path_(socket_path) {}
+
+int UnixSocketTransport::open_listener() {
+    return listen_unix(socket_path_, 0, 5, inode_);
+}
+
+void UnixSocketTransport::adopt_listeners(std::vector<int> fds) {
+    StreamTransport::adopt_listeners(std::move(fds));
+    inode_ = unix_path_inode(socket_path_); // now this server's to remove
 }
 
-std::string UnixSocketTransport::send(const std::string &data) {
+int UnixSocketTransport::open_connection(Deadline deadline) {
     int client_fd = socket(AF_UNIX, SOCK_STREAM, 0);
     if (client_fd == -1)
         throw std::runtime_error("Failed to create UNIX client socket");
@@ -69,33 +715,27 @@ std::string UnixSocketTransport::send(const std::string &data) {
     std::strncpy(addr.sun_path, socket_path_.c_str(),
                  sizeof(addr.sun_path) - 1);
 
-    if (connect(client_fd, (sockaddr *)&addr, sizeof(addr)) == -1) {
-        ::close(client_fd);
-        throw std::runtime_error("Failed to connect to UNIX socket");
-    }
-
-    if (write(client_fd, data.c_str(), data.size()) == -1) {
+    bool connected;
+    try {
+        connected = connect_until(client_fd, (sockaddr *)&addr, sizeof(addr),
+                                  deadline);
+    } catch (...) {
         ::close(client_fd);
-        throw std::runtime_error("Failed to send data to UNIX socket");
+        throw;
     }
-
-    char buffer[2048] = {};
-    ssize_t len = read(client_fd, buffer, sizeof(buffer) - 1);
-    if (len <= 0) {
+    if (!connected) {
         ::close(client_fd);
-        throw std::runtime_error("Failed to read response from UNIX socket");
+        throw std::runtime_error("Failed to connect to UNIX socket");
     }
-
-    ::close(client_fd);
-    return std::string(buffer, len);
+    return client_fd;
 }
 
 void UnixSocketTransport::close() {
-    if (server_fd_ != -1) {
-        ::close(server_fd_);
-        unlink(socket_path_.c_str());
-        server_fd_ = -1;
-    }
+    StreamTransport::close();
+    // Left in place for the process the socket was handed to.
+    if (!shared())
+        remove_unix_path(socket_path_, inode_);
+    inode_ = 0;
 }
 
 // ==========================
@@ -107,7 +747,37 @@ UdpTransport::UdpTransport(int port) : port_(port), ip_("127.0.0.1") {}
 UdpTransport::UdpTransport(const std::string &ip, int port)
     : port_(port), ip_(ip) {}
 
+UdpTransport::~UdpTransport() {
+    close();
+    if (sock_ != -1)
+        ::close(sock_);
+    if (adopted_ != -1)
+        ::close(adopted_);
+    if (wake_fd_ != -1)
+        ::close(wake_fd_);
+}
+
 void UdpTransport::bind() {
+    if (wake_fd_ == -1) {
+        wake_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (wake_fd_ == -1)
+            throw std::runtime_error("Failed to create wake eventfd");
+    }
+    std::uint64_t pending;
+    (void)!::read(wake_fd_, &pending, sizeof(pending)); // reset after close()
+    closed_ = false;
+    accepting_ = true;
+    if (sock_ != -1) {
+        // Left open by close() for late responses; the server has stopped
+        // receiving and sending on it by now.
+        ::close(sock_);
+        sock_ = -1;
+    }
+    if (adopted_ != -1) {
+        sock_ = std::exchange(adopted_, -1);
+        return;
+    }
+
     sock_ = socket(AF_INET, SOCK_DGRAM, 0);
     if (sock_ == -1)
         throw std::runtime_error("Failed to create UDP socket");
@@ -121,39 +791,125 @@ void UdpTransport::bind() {
         throw std::runtime_error("Failed to bind UDP socket");
 }
 
-std::string UdpTransport::receive(std::string &client_id) {
+std::vector<char> &
+UdpTransport::datagram_buffer(std::vector<char> &buffer) const {
+    constexpr size_t max_datagram = 65507;
+    size_t size = std::min(max_message_size_, max_datagram) + 1;
+    if (buffer.size() != size)
+        buffer.resize(size);
+    return buffer;
+}
+
+size_t UdpTransport::receive_datagram(std::string &client_id) {
     sockaddr_in client_addr{};
-    socklen_t addr_len = sizeof(client_addr);
-    char buffer[2048] = {};
+    socklen_t addr_len;
+    auto &buffer = datagram_buffer(receive_buffer_);
 
-    ssize_t len = recvfrom(sock_, buffer, sizeof(buffer) - 1, 0,
-                           (sockaddr *)&client_addr, &addr_len);
-    if (len <= 0)
+    ssize_t len;
+    while (true) {
+        if (closed_)
+            throw std::runtime_error("Transport closed");
+        if (accepting_) {
+            // Under load a datagram is usually waiting, and this is the
+            // only system call. MSG_TRUNC makes recvfrom report the full
+            // datagram length, so anything that did not fit is detected
+            // instead of silently cut short.
+            addr_len = sizeof(client_addr);
+            len = recvfrom(sock_, buffer.data(), buffer.size(),
+                           MSG_TRUNC | MSG_DONTWAIT, (sockaddr *)&client_addr,
+                           &addr_len);
+            if (len != -1)
+                break;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                throw std::runtime_error("Failed to receive from UDP socket");
+        }
+
+        // Wait here rather than in recvfrom(), so that close() and
+        // stop_listening() can wake the thread without shutting the socket
+        // down: a replacement process may be serving on it too.
+        pollfd fds[2] = {{wake_fd_, POLLIN, 0}, {sock_, POLLIN, 0}};
+        if (poll(fds, accepting_ ? 2 : 1, -1) == -1 && errno != EINTR)
+            throw std::runtime_error("Failed to poll UDP socket");
+        if (fds[0].revents != 0) {
+            std::uint64_t pending;
+            (void)!::read(wake_fd_, &pending, sizeof(pending));
+        }
+    }
+    if (len == 0)
         throw std::runtime_error("Failed to receive from UDP socket");
+    if (static_cast<size_t>(len) > max_message_size_)
+        throw oversized(len, max_message_size_);
 
-    client_id = std::string(inet_ntoa(client_addr.sin_addr)) + ":" +
-                std::to_string(ntohs(client_addr.sin_port));
-    return std::string(buffer, len);
+    // Formatted on the stack and assigned once, so client_id's storage is
+    // reused from one datagram to the next.
+    char id[INET_ADDRSTRLEN + 6];
+    inet_ntop(AF_INET, &client_addr.sin_addr, id, INET_ADDRSTRLEN);
+    char *cursor = id + std::strlen(id);
+    *cursor++ = ':';
+    cursor = std::to_chars(cursor, id + sizeof(id),
+                           ntohs(client_addr.sin_port))
+                 .ptr;
+    client_id.assign(id, cursor);
+    return static_cast<size_t>(len);
+}
+
+std::string UdpTransport::receive(std::string &client_id) {
+    size_t len = receive_datagram(client_id);
+    return std::string(receive_buffer_.data(), len);
+}
+
+Buffer UdpTransport::receive_buffer(std::string &client_id) {
+    // recvfrom needs room for the largest datagram, so it lands in the
+    // reusable scratch buffer; the pooled copy is sized to the message.
+    size_t len = receive_datagram(client_id);
+    return Buffer(receive_buffer_.data(), len);
 }
 
 void UdpTransport::send(const std::string &data, const std::string &client_id) {
-    size_t delim = client_id.find(":");
-    if (delim == std::string::npos)
+    send_datagram(data.data(), data.size(), client_id);
+}
+
+void UdpTransport::send_buffer(const Buffer &data,
+                               const std::string &client_id) {
+    send_datagram(data.data(), data.size(), client_id);
+}
+
+void UdpTransport::send_datagram(const char *data, size_t size,
+                                 const std::string &client_id) {
+    check_outgoing(size, max_message_size_);
+
+    // Parse "ip:port" in place; the address is copied to a stack buffer
+    // only to terminate it for inet_pton().
+    size_t delim = client_id.find(':');
+    char ip[INET_ADDRSTRLEN];
+    if (delim == std::string::npos || delim >= sizeof(ip))
         return;
+    std::memcpy(ip, client_id.data(), delim);
+    ip[delim] = '\0';
 
-    std::string ip = client_id.substr(0, delim);
-    int port = std::stoi(client_id.substr(delim + 1));
+    std::uint16_t port = 0;
+    const char *end = client_id.data() + client_id.size();
+    if (std::from_chars(client_id.data() + delim + 1, end, port).ptr != end)
+        return;
 
     sockaddr_in client_addr{};
     client_addr.sin_family = AF_INET;
     client_addr.sin_port = htons(port);
-    inet_pton(AF_INET, ip.c_str(), &client_addr.sin_addr);
+    if (inet_pton(AF_INET, ip, &client_addr.sin_addr) != 1)
+        return;
 
-    sendto(sock_, data.c_str(), data.size(), 0, (sockaddr *)&client_addr,
+    sendto(sock_, data, size, 0, (sockaddr *)&client_addr,
            sizeof(client_addr));
 }
 
 std::string UdpTransport::send(const std::string &data) {
+    return send_until(data, kNoDeadline);
+}
+
+std::string UdpTransport::send_until(const std::string &data,
+                                     Deadline deadline) {
+    check_outgoing(data.size(), max_message_size_);
+
     int client_fd = socket(AF_INET, SOCK_DGRAM, 0);
     if (client_fd == -1)
         throw std::runtime_error("Failed to create UDP client socket");
@@ -163,30 +919,92 @@ std::string UdpTransport::send(const std::string &data) {
     server_addr.sin_addr.s_addr = inet_addr(ip_.c_str());
     server_addr.sin_port = htons(port_);
 
-    if (sendto(client_fd, data.c_str(), data.size(), 0,
-               (sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
-        ::close(client_fd);
-        throw std::runtime_error("Failed to send UDP packet");
+    // A lost datagram is only noticed by its response not arriving, so
+    // the wait is bounded by the deadline and, with retries, by the
+    // backoff after which the request goes out again.
+    std::chrono::milliseconds backoff = backoff_;
+    for (std::size_t attempt = 0;; ++attempt) {
+        if (sendto(client_fd, data.c_str(), data.size(), 0,
+                   (sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+            ::close(client_fd);
+            throw std::runtime_error("Failed to send UDP packet");
+        }
+        Deadline until = deadline;
+        if (retries_ > 0) {
+            until = std::min(deadline,
+                             std::chrono::steady_clock::now() + backoff);
+        }
+        bool ready;
+        try {
+            ready = wait_ready(client_fd, POLLIN, until);
+        } catch (...) {
+            ::close(client_fd);
+            throw;
+        }
+        if (ready)
+            break;
+        if (attempt == retries_ ||
+            std::chrono::steady_clock::now() >= deadline) {
+            ::close(client_fd);
+            throw RequestTimeout();
+        }
+        backoff *= 2;
     }
 
-    char buffer[2048] = {};
-    sockaddr_in from{};
-    socklen_t from_len = sizeof(from);
-    ssize_t len = recvfrom(client_fd, buffer, sizeof(buffer) - 1, 0,
-                           (sockaddr *)&from, &from_len);
-    if (len <= 0) {
-        ::close(client_fd);
-        throw std::runtime_error("Failed to receive UDP response");
+    // Peek at the length first (MSG_TRUNC reports all of it), so that the
+    // response lands straight in the string returned: no scratch buffer to
+    // share between concurrent callers, and no copy out of one.
+    ssize_t len = recv(client_fd, nullptr, 0,
+                       MSG_PEEK | MSG_TRUNC | MSG_DONTWAIT);
+    std::string response;
+    if (len > 0 && static_cast<size_t>(len) <= max_message_size_) {
+        response.resize(static_cast<size_t>(len));
+        len = recv(client_fd, response.data(), response.size(), MSG_DONTWAIT);
     }
-
     ::close(client_fd);
-    return std::string(buffer, len);
+    if (len <= 0)
+        throw std::runtime_error("Failed to receive UDP response");
+    if (static_cast<size_t>(len) > max_message_size_)
+        throw oversized(len, max_message_size_);
+
+    return response;
 }
 
 void UdpTransport::close() {
-    if (sock_ != -1) {
-        ::close(sock_);
-        sock_ = -1;
+    // The eventfd wakes a thread waiting in poll(). The socket stays open
+    // until destruction or the next bind(), so the receiving thread never
+    // sees it change and late sends from workers cannot reach a reused
+    // descriptor.
+    closed_ = true;
+    if (wake_fd_ != -1) {
+        std::uint64_t one = 1;
+        (void)!::write(wake_fd_, &one, sizeof(one));
+    }
+}
+
+std::vector<int> UdpTransport::share_listeners() {
+    if (sock_ == -1)
+        return {};
+    return duplicate_sockets({sock_});
+}
+
+void UdpTransport::adopt_listeners(std::vector<int> fds) {
+    if (fds.size() != 1) {
+        for (int fd : fds)
+            ::close(fd);
+        throw std::runtime_error("UdpTransport adopts exactly one socket");
+    }
+    if (adopted_ != -1)
+        ::close(adopted_);
+    adopted_ = fds[0];
+}
+
+void UdpTransport::stop_listening() {
+    // The socket stays open for the responses still to be sent.
+    accepting_ = false;
+    if (wake_fd_ != -1) {
+        std::uint64_t one = 1;
+        (void)!::write(wake_fd_, &one, sizeof(one));
     }
 }
 
@@ -194,54 +1012,40 @@ void UdpTransport::close() {
 // TcpTransport
 // ==========================
 
-TcpTransport::TcpTransport(int port) : port_(port), ip_("127.0.0.1") {}
+TcpTransport::TcpTransport(int port, Framing framing)
+    : StreamTransport(framing), port_(port), ip_("127.0.0.1") {}
 
-TcpTransport::TcpTransport(const std::string &ip, int port)
-    : port_(port), ip_(ip) {}
+TcpTransport::TcpTransport(const std::string &ip, int port, Framing framing)
+    : StreamTransport(framing), port_(port), ip_(ip) {}
 
-void TcpTransport::bind() {
-    server_fd_ = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd_ == -1)
+int TcpTransport::open_listener() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
         throw std::runtime_error("Failed to create TCP socket");
 
+    // A restarted server must not wait for its predecessor's closed
+    // connections to leave TIME_WAIT.
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
     sockaddr_in server_addr{};
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
     server_addr.sin_port = htons(port_);
 
-    if (::bind(server_fd_, (sockaddr *)&server_addr, sizeof(server_addr)) == -1)
+    if (::bind(fd, (sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+        ::close(fd);
         throw std::runtime_error("Failed to bind TCP socket");
+    }
 
-    if (listen(server_fd_, 5) == -1)
+    if (listen(fd, 5) == -1) {
+        ::close(fd);
         throw std::runtime_error("Failed to listen on TCP socket");
-}
-
-std::string TcpTransport::receive(std::string &client_id) {
-    sockaddr_in client_addr{};
-    socklen_t addr_len = sizeof(client_addr);
-
-    int client_fd = accept(server_fd_, (sockaddr *)&client_addr, &addr_len);
-    if (client_fd == -1)
-        throw std::runtime_error("Failed to accept TCP connection");
-
-    char buffer[2048] = {};
-    ssize_t len = read(client_fd, buffer, sizeof(buffer) - 1);
-    if (len <= 0) {
-        ::close(client_fd);
-        throw std::runtime_error("Failed to read from TCP client");
     }
-
-    client_id = std::to_string(client_fd);
-    return std::string(buffer, len);
+    return fd;
 }
 
-void TcpTransport::send(const std::string &data, const std::string &client_id) {
-    int client_fd = std::stoi(client_id);
-    write(client_fd, data.c_str(), data.size());
-    ::close(client_fd);
-}
-
-std::string TcpTransport::send(const std::string &data) {
+int TcpTransport::open_connection(Deadline deadline) {
     int client_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (client_fd == -1)
         throw std::runtime_error("Failed to create TCP client socket");
@@ -251,32 +1055,27 @@ std::string TcpTransport::send(const std::string &data) {
     server_addr.sin_port = htons(port_);
     server_addr.sin_addr.s_addr = inet_addr(ip_.c_str());
 
-    if (connect(client_fd, (sockaddr *)&server_addr, sizeof(server_addr)) ==
-        -1) {
-        ::close(client_fd);
-        throw std::runtime_error("Failed to connect to TCP server");
-    }
-
-    if (write(client_fd, data.c_str(), data.size()) == -1) {
+    bool connected;
+    try {
+        connected = connect_until(client_fd, (sockaddr *)&server_addr,
+                                  sizeof(server_addr), deadline);
+    } catch (...) {
         ::close(client_fd);
-        throw std::runtime_error("Failed to write to TCP server");
+        throw;
     }
-
-    char buffer[2048] = {};
-    ssize_t len = read(client_fd, buffer, sizeof(buffer) - 1);
-    if (len <= 0) {
+    if (!connected) {
         ::close(client_fd);
-        throw std::runtime_error("Failed to read from TCP server");
+        throw std::runtime_error("Failed to connect to TCP server");
     }
-
-    ::close(client_fd);
-    return std::string(buffer, len);
+    return client_fd;
 }
 
-void TcpTransport::close() {
-    if (server_fd_ != -1) {
-        ::close(server_fd_);
-        server_fd_ = -1;
+void TcpTransport::configure_socket(int fd) {
+    // Keep-alive connections carry many small request/response frames;
+    // don't let Nagle hold them back waiting for ACKs.
+    if (framing() == Framing::LengthPrefixed) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
     }
 }
 
@@ -1,6 +1,18 @@
 #pragma once
 
+#include "buffer.hpp"
+#include "framing.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 /**
  * @file transport.hpp
@@ -13,6 +25,37 @@
 
 namespace Socks {
 
+/// Default upper bound on the size of a single message (16 MiB).
+constexpr std::size_t kDefaultMaxMessageSize = 16 * 1024 * 1024;
+
+/// When a client request must have its response (see
+/// Transport::send_until()).
+using Deadline = std::chrono::steady_clock::time_point;
+
+/// No deadline: wait as long as it takes.
+constexpr Deadline kNoDeadline = Deadline::max();
+
+/**
+ * @brief Thrown when a request's deadline passes before its response
+ * arrives.
+ */
+struct RequestTimeout : std::runtime_error {
+    RequestTimeout() : std::runtime_error("Request timed out") {}
+};
+
+/**
+ * @brief Thrown when a request fails before any of it was sent, e.g.
+ * because no connection to the server could be opened.
+ *
+ * Unlike other failures, the server cannot have seen the request, so it is
+ * always safe to send it again.
+ */
+struct RequestNotSent : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+class FramedChannel;
+
 /**
  * @class Transport
  * @brief Abstract base class for communication transports.
@@ -49,6 +92,21 @@ class Transport {
      */
     virtual std::string receive(std::string &client_id) = 0;
 
+    /**
+     * @brief Receive a message into a pooled buffer.
+     *
+     * Behaves like receive(), but the message is read directly into a
+     * Buffer that the caller can pass on without copying. Server uses this
+     * instead of receive(). The default implementation copies the result of
+     * receive(); the built-in transports read into the buffer directly.
+     *
+     * @param[out] client_id A unique identifier for the client, used later in
+     * send() or send_buffer().
+     * @return The raw message.
+     * @throws std::runtime_error if receiving fails.
+     */
+    virtual Buffer receive_buffer(std::string &client_id);
+
     /**
      * @brief Send a response back to a client (server-side).
      *
@@ -62,6 +120,22 @@ class Transport {
     virtual void send(const std::string &data,
                       const std::string &client_id) = 0;
 
+    /**
+     * @brief Send a response held in a buffer back to a client.
+     *
+     * Behaves like send(data, client_id). The built-in transports write the
+     * buffer together with any frame header in a single writev-style call; a
+     * transport that must keep the bytes (to finish the write later) shares
+     * the buffer instead of copying it where it can. The default
+     * implementation copies the buffer into a string and calls send().
+     *
+     * @param data The encoded response.
+     * @param client_id The identifier of the target client.
+     * @throws std::runtime_error if sending fails.
+     */
+    virtual void send_buffer(const Buffer &data,
+                             const std::string &client_id);
+
     /**
      * @brief Send a message to the server and receive the response
      * (client-side).
@@ -75,12 +149,322 @@ class Transport {
      */
     virtual std::string send(const std::string &data) = 0;
 
+    /**
+     * @brief Like send(data), but give up at `deadline` (client-side).
+     *
+     * The built-in transports wait with non-blocking I/O and poll() rather
+     * than blocking in a system call, and a keep-alive connection left
+     * with half a frame is closed instead of reused. The default ignores
+     * the deadline and calls send(data).
+     *
+     * @throws RequestTimeout once the deadline has passed.
+     * @throws std::runtime_error if sending or receiving fails.
+     */
+    virtual std::string send_until(const std::string &data,
+                                   Deadline deadline) {
+        (void)deadline;
+        return send(data);
+    }
+
     /**
      * @brief Clean up and close the transport.
      *
      * Should release any socket/file descriptors or other resources.
      */
     virtual void close() = 0;
+
+    /**
+     * @brief Set the largest message this transport accepts.
+     *
+     * Incoming messages above the limit are rejected as soon as their size is
+     * known (from the frame header, the datagram length, or once the limit is
+     * crossed while reading) instead of being buffered and parsed. Outgoing
+     * messages above the limit are refused before anything is written.
+     *
+     * @param bytes Maximum payload size in bytes.
+     */
+    void set_max_message_size(std::size_t bytes) { max_message_size_ = bytes; }
+
+    /**
+     * @brief The largest message this transport accepts, in bytes.
+     */
+    std::size_t max_message_size() const { return max_message_size_; }
+
+    /**
+     * @brief Whether messages may contain arbitrary bytes.
+     *
+     * False for transports that find the end of a message by scanning JSON
+     * syntax (stream transports in Framing::Raw mode); those can only carry
+     * Codec::Json.
+     */
+    virtual bool binary_safe() const { return true; }
+
+    /**
+     * @brief Whether open_channel() is supported.
+     */
+    virtual bool supports_channels() const { return false; }
+
+    /**
+     * @brief Open a new persistent framed connection to the server
+     * (client-side).
+     *
+     * Unlike send(data), which performs one round trip at a time, a channel
+     * lets the caller pipeline several tagged requests and match the
+     * responses by tag. Each call opens a separate connection.
+     *
+     * @param deadline When to stop waiting for the connection.
+     * @return The connected channel, or nullptr if the transport does not
+     * support channels (see supports_channels()).
+     * @throws RequestTimeout if the deadline passes first.
+     * @throws std::runtime_error if the connection cannot be established.
+     */
+    virtual std::unique_ptr<FramedChannel>
+    open_channel(Deadline deadline = kNoDeadline) {
+        (void)deadline;
+        return nullptr;
+    }
+
+    /**
+     * @brief Whether a client_id names one request on a persistent
+     * connection, so that several messages can be sent to it
+     * (server-side).
+     *
+     * True for the epoll transports in Framing::LengthPrefixed mode,
+     * where the client_id carries the frame tag and sends to a slow
+     * connection are queued rather than blocking the sender. Server push
+     * (see Stream) needs it.
+     */
+    virtual bool supports_streams() const { return false; }
+
+    /**
+     * @brief Ask to be told when everything sent to `client_id` has left
+     * (server-side).
+     *
+     * Transports that queue what the socket cannot take yet call
+     * `callback` once, from their own thread, when the queue is empty or
+     * the connection goes away. The default has nothing queued once send()
+     * returns.
+     *
+     * @return Whether `callback` will be called; false if nothing is
+     * queued, in which case it never is.
+     */
+    virtual bool notify_drained(const std::string &client_id,
+                                std::function<void()> callback) {
+        (void)client_id;
+        (void)callback;
+        return false;
+    }
+
+    /**
+     * @brief Duplicates of the sockets bind() opened to take connections
+     * or datagrams, for a replacement process (see Server::hand_off()).
+     *
+     * The caller owns the returned descriptors. Once they have been
+     * shared, the transport leaves a Unix socket's path in place when it
+     * closes, since the other process serves on it. Empty for transports
+     * that cannot hand their sockets off.
+     */
+    virtual std::vector<int> share_listeners() { return {}; }
+
+    /**
+     * @brief Serve on sockets taken over from the process being replaced
+     * instead of opening new ones in bind() (see Server::take_over()).
+     *
+     * Takes ownership of `fds`, which another transport of the same kind
+     * returned from share_listeners(). Must be called before bind().
+     *
+     * @throws std::logic_error if the transport cannot adopt sockets (the
+     * descriptors are closed).
+     */
+    virtual void adopt_listeners(std::vector<int> fds);
+
+    /**
+     * @brief Stop taking new requests, while responses to requests already
+     * received can still be sent (see Server::drain()).
+     *
+     * The listening sockets are closed and open connections are no longer
+     * read. Requests a client has sent but the server has not read stay
+     * unanswered until close(); a client seeing its pooled connection
+     * close retries on a new one. Transports that do not support this keep
+     * receiving until close().
+     */
+    virtual void stop_listening() {}
+
+  protected:
+    std::size_t max_message_size_ =
+        kDefaultMaxMessageSize; ///< Limit enforced on every message
+};
+
+/**
+ * @class FramedChannel
+ * @brief A client connection carrying length-prefixed, tagged frames.
+ *
+ * write() may be called from several threads at once; frames are written
+ * whole under an internal lock. read() is meant for a single reader thread,
+ * which shutdown() wakes from any thread.
+ */
+class FramedChannel {
+  public:
+    /**
+     * @brief Take ownership of a connected socket.
+     * @param fd Connected stream socket.
+     * @param max_message_size Largest frame accepted in either direction.
+     */
+    FramedChannel(int fd, std::size_t max_message_size);
+
+    /**
+     * @brief Close the socket.
+     */
+    ~FramedChannel();
+
+    FramedChannel(const FramedChannel &) = delete;
+    FramedChannel &operator=(const FramedChannel &) = delete;
+
+    /**
+     * @brief Write one frame.
+     * @param tag Tag the server will echo in its response.
+     * @param payload Frame payload.
+     * @return false if the connection is broken.
+     * @throws std::runtime_error if the payload exceeds the size limit.
+     */
+    bool write(std::uint32_t tag, const std::string &payload);
+
+    /**
+     * @brief Block until the next frame arrives.
+     * @param[out] tag Tag of the received frame.
+     * @param[out] payload Payload of the received frame.
+     * @return false on EOF, a short frame or after shutdown().
+     * @throws std::runtime_error if the frame exceeds the size limit.
+     */
+    bool read(std::uint32_t &tag, std::string &payload);
+
+    /**
+     * @brief Shut the connection down in both directions, waking read().
+     */
+    void shutdown();
+
+  private:
+    int fd_;
+    std::size_t max_message_size_;
+    std::mutex write_mutex_; ///< Keeps concurrent frames from interleaving
+};
+
+/**
+ * @class StreamTransport
+ * @brief Shared implementation of the connection-oriented transports.
+ *
+ * Handles accepting, reading and writing on stream sockets, either with one
+ * request per connection (Framing::Raw) or with persistent connections that
+ * carry many length-prefixed frames (Framing::LengthPrefixed, see
+ * framing.hpp). Derived classes only decide how sockets are opened.
+ *
+ * In length-prefixed mode the server keeps every accepted connection open
+ * and polls it for further frames, assembling each frame from whatever has
+ * arrived so that a slow sender holds up only its own connection; the
+ * client side keeps a single connection open across send() calls and
+ * reconnects once if the server closed it in the meantime. open_channel()
+ * opens additional connections for pipelined use.
+ *
+ * Messages of any size up to max_message_size() are read in full: frames by
+ * their length header, raw requests until the JSON document closes, and raw
+ * responses until the server closes the connection.
+ */
+class StreamTransport : public Transport {
+  public:
+    ~StreamTransport() override;
+
+    void bind() override;
+    std::string receive(std::string &client_id) override;
+    Buffer receive_buffer(std::string &client_id) override;
+    void send(const std::string &data, const std::string &client_id) override;
+    void send_buffer(const Buffer &data,
+                     const std::string &client_id) override;
+    std::string send(const std::string &data) override;
+    std::string send_until(const std::string &data,
+                           Deadline deadline) override;
+    void close() override;
+
+    /**
+     * @brief The framing mode this transport was constructed with.
+     */
+    Framing framing() const { return framing_; }
+
+    bool binary_safe() const override {
+        return framing_ == Framing::LengthPrefixed;
+    }
+
+    bool supports_channels() const override {
+        return framing_ == Framing::LengthPrefixed;
+    }
+
+    std::unique_ptr<FramedChannel>
+    open_channel(Deadline deadline = kNoDeadline) override;
+
+    std::vector<int> share_listeners() override;
+    void adopt_listeners(std::vector<int> fds) override;
+    void stop_listening() override;
+
+  protected:
+    /**
+     * @brief Construct the shared stream machinery.
+     * @param framing Wire framing used on every connection.
+     */
+    explicit StreamTransport(Framing framing);
+
+    /**
+     * @brief Create, bind and listen on the server socket.
+     * @return The listening file descriptor.
+     * @throws std::runtime_error if any step fails.
+     */
+    virtual int open_listener() = 0;
+
+    /**
+     * @brief Create a client socket connected to the configured server.
+     * @param deadline When to stop waiting for the connection.
+     * @return The connected file descriptor.
+     * @throws RequestTimeout if the deadline passes first.
+     * @throws std::runtime_error if the connection cannot be established.
+     */
+    virtual int open_connection(Deadline deadline) = 0;
+
+    /**
+     * @brief Hook to apply socket options to accepted and opened sockets.
+     * @param fd The connection file descriptor.
+     */
+    virtual void configure_socket(int fd) { (void)fd; }
+
+    /**
+     * @brief Whether share_listeners() has been called.
+     */
+    bool shared() const { return shared_; }
+
+  private:
+    struct Connection;
+
+    void send_bytes(const char *data, std::size_t size,
+                    const std::string &client_id);
+    std::shared_ptr<Connection> accept_connection(int listener);
+    void close_listeners();
+    std::shared_ptr<Connection> find_connection(std::uint64_t id);
+    void drop_connection(std::uint64_t id);
+    void close_client();
+
+    Framing framing_;
+    std::vector<int> listeners_; ///< Listening sockets (server side)
+    std::vector<int> adopted_;   ///< Taken over; used by the next bind()
+    int wake_fd_ = -1; ///< eventfd used to interrupt receive() on close()
+    std::atomic<bool> closed_ = false;
+    std::atomic<bool> accepting_ = true; ///< Cleared by stop_listening()
+    std::atomic<bool> shared_ = false;
+
+    std::mutex connections_mutex_; ///< Protects connections_, listeners_
+    std::unordered_map<std::uint64_t, std::shared_ptr<Connection>>
+        connections_; ///< Accepted connections keyed by connection id
+    std::uint64_t next_connection_id_ = 1;
+    std::size_t poll_cursor_ = 0; ///< Rotates which connection is read first
+
+    int client_fd_ = -1;         ///< Persistent connection (client side)
+    std::uint32_t next_tag_ = 0; ///< Tag for the next client frame
 };
 
 /**
@@ -90,23 +474,27 @@ class Transport {
  * Uses a local file path (e.g., /tmp/socks.sock) for interprocess
  * communication.
  */
-class UnixSocketTransport : public Transport {
+class UnixSocketTransport : public StreamTransport {
   public:
     /**
      * @brief Construct a new UnixSocketTransport using a UNIX socket path.
      * @param socket_path Filesystem path for the UNIX socket.
+     * @param framing Raw (one request per connection) or length-prefixed
+     * keep-alive connections.
      */
-    explicit UnixSocketTransport(const std::string &socket_path);
+    explicit UnixSocketTransport(const std::string &socket_path,
+                                 Framing framing = Framing::Raw);
 
-    void bind() override;
-    std::string receive(std::string &client_id) override;
-    void send(const std::string &data, const std::string &client_id) override;
-    std::string send(const std::string &data) override;
+    void adopt_listeners(std::vector<int> fds) override;
     void close() override;
 
+  protected:
+    int open_listener() override;
+    int open_connection(Deadline deadline) override;
+
   private:
     std::string socket_path_;
-    int server_fd_ = -1;
+    std::uint64_t inode_ = 0; ///< Socket file to remove on close(), if any
 };
 
 /**
@@ -114,6 +502,8 @@ class UnixSocketTransport : public Transport {
  * @brief UDP implementation of the Transport interface.
  *
  * Allows both server-side message reception and client-side message sending.
+ * A message must fit in a single datagram (at most 65507 bytes over IPv4);
+ * larger datagrams are detected and rejected rather than truncated.
  */
 class UdpTransport : public Transport {
   public:
@@ -131,16 +521,57 @@ class UdpTransport : public Transport {
      */
     UdpTransport(const std::string &ip, int port);
 
+    ~UdpTransport() override;
+
     void bind() override;
     std::string receive(std::string &client_id) override;
+    Buffer receive_buffer(std::string &client_id) override;
     void send(const std::string &data, const std::string &client_id) override;
+    void send_buffer(const Buffer &data,
+                     const std::string &client_id) override;
     std::string send(const std::string &data) override;
+    std::string send_until(const std::string &data,
+                           Deadline deadline) override;
     void close() override;
 
+    std::vector<int> share_listeners() override;
+    void adopt_listeners(std::vector<int> fds) override;
+    void stop_listening() override;
+
+    /**
+     * @brief Resend a client request whose response has not arrived
+     * (client-side).
+     *
+     * The first resend goes out after `backoff`, and each wait after that
+     * is twice as long. Once the wait after the last resend is over,
+     * send() gives up with RequestTimeout. Without retries (the default)
+     * send() waits until its deadline, if any. A lost response makes the
+     * server run the request again, so retry only requests that are safe
+     * to repeat.
+     */
+    void set_retries(std::size_t retries,
+                     std::chrono::milliseconds backoff =
+                         std::chrono::milliseconds(50)) {
+        retries_ = retries;
+        backoff_ = backoff;
+    }
+
   private:
+    std::vector<char> &datagram_buffer(std::vector<char> &buffer) const;
+    std::size_t receive_datagram(std::string &client_id);
+    void send_datagram(const char *data, std::size_t size,
+                       const std::string &client_id);
+
     int port_;
     std::string ip_ = "127.0.0.1";
     int sock_ = -1;
+    int adopted_ = -1; ///< Taken over; used by the next bind()
+    int wake_fd_ = -1; ///< eventfd used to interrupt receive()
+    std::atomic<bool> closed_ = false;
+    std::atomic<bool> accepting_ = true; ///< Cleared by stop_listening()
+    std::vector<char> receive_buffer_; ///< Reused by receive()
+    std::size_t retries_ = 0;           ///< Resends of a client request
+    std::chrono::milliseconds backoff_{50}; ///< Wait before the first resend
 };
 
 /**
@@ -149,32 +580,35 @@ class UdpTransport : public Transport {
  *
  * Allows both server-side message reception and client-side message sending.
  */
-class TcpTransport : public Transport {
+class TcpTransport : public StreamTransport {
   public:
     /**
      * @brief Construct a server-side TcpTransport that binds to a local port.
      * @param port Port number to bind.
+     * @param framing Raw (one request per connection) or length-prefixed
+     * keep-alive connections.
      */
-    explicit TcpTransport(int port);
+    explicit TcpTransport(int port, Framing framing = Framing::Raw);
 
     /**
      * @brief Construct a client-side TcpTransport that connects to a remote IP
      * and port.
      * @param ip Destination IPv4 address (e.g., "127.0.0.1").
      * @param port Destination port number.
+     * @param framing Raw (one request per connection) or length-prefixed
+     * keep-alive connections.
      */
-    TcpTransport(const std::string &ip, int port);
+    TcpTransport(const std::string &ip, int port,
+                 Framing framing = Framing::Raw);
 
-    void bind() override;
-    std::string receive(std::string &client_id) override;
-    void send(const std::string &data, const std::string &client_id) override;
-    std::string send(const std::string &data) override;
-    void close() override;
+  protected:
+    int open_listener() override;
+    int open_connection(Deadline deadline) override;
+    void configure_socket(int fd) override;
 
   private:
     int port_;
     std::string ip_ = "127.0.0.1";
-    int server_fd_ = -1;
 };
 
 } // namespace Socks
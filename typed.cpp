@@ -0,0 +1,402 @@
+#include "typed.hpp"
+
+namespace Socks {
+namespace typed_detail {
+
+namespace {
+
+const char *kind_name(Scalar::Kind kind) {
+    switch (kind) {
+    case Scalar::Kind::Null:
+        return "null";
+    case Scalar::Kind::Boolean:
+        return "boolean";
+    case Scalar::Kind::Integer:
+    case Scalar::Kind::Unsigned:
+        return "integer";
+    case Scalar::Kind::Float:
+        return "number";
+    case Scalar::Kind::String:
+        return "string";
+    case Scalar::Kind::Binary:
+        return "binary";
+    }
+    return "unknown";
+}
+
+/// A json value holding a Scalar.
+json to_json_value(Scalar &value) {
+    switch (value.kind) {
+    case Scalar::Kind::Null:
+        return nullptr;
+    case Scalar::Kind::Boolean:
+        return value.boolean;
+    case Scalar::Kind::Integer:
+        return value.integer;
+    case Scalar::Kind::Unsigned:
+        return value.unsigned_integer;
+    case Scalar::Kind::Float:
+        return value.number;
+    case Scalar::Kind::String:
+        return std::move(*value.string);
+    case Scalar::Kind::Binary:
+        return json::binary(std::move(*value.binary));
+    }
+    return nullptr;
+}
+
+/**
+ * @brief SAX consumer that fills a described struct.
+ *
+ * Keeps a stack of the containers being read. A value event is stored in
+ * the slot the innermost container offers next: the field named by the
+ * last key, a new array element, or nothing for fields the struct does
+ * not list. Values bound for a json member are built into a tree.
+ */
+class Decoder : public nlohmann::json_sax<json> {
+  public:
+    Decoder(Child root, std::string &error) : root_(root), error_(error) {}
+
+    bool null() override {
+        Scalar value;
+        return scalar(value);
+    }
+
+    bool boolean(bool flag) override {
+        Scalar value;
+        value.kind = Scalar::Kind::Boolean;
+        value.boolean = flag;
+        return scalar(value);
+    }
+
+    bool number_integer(number_integer_t number) override {
+        Scalar value;
+        value.kind = Scalar::Kind::Integer;
+        value.integer = number;
+        return scalar(value);
+    }
+
+    bool number_unsigned(number_unsigned_t number) override {
+        Scalar value;
+        value.kind = Scalar::Kind::Unsigned;
+        value.unsigned_integer = number;
+        return scalar(value);
+    }
+
+    bool number_float(number_float_t number, const string_t &) override {
+        Scalar value;
+        value.kind = Scalar::Kind::Float;
+        value.number = number;
+        return scalar(value);
+    }
+
+    bool string(string_t &text) override {
+        Scalar value;
+        value.kind = Scalar::Kind::String;
+        value.string = &text;
+        return scalar(value);
+    }
+
+    bool binary(binary_t &bytes) override {
+        Scalar value;
+        value.kind = Scalar::Kind::Binary;
+        value.binary = &bytes;
+        return scalar(value);
+    }
+
+    bool start_object(std::size_t) override { return open(true); }
+    bool end_object() override { return close(); }
+    bool start_array(std::size_t) override { return open(false); }
+    bool end_array() override { return close(); }
+
+    bool key(string_t &name) override {
+        Frame &top = stack_.back();
+        if (top.kind == Frame::Kind::Object) {
+            top.pending = top.child.reader->find(name);
+        } else if (top.kind == Frame::Kind::Tree) {
+            top.key = std::move(name);
+        }
+        return true;
+    }
+
+    bool parse_error(std::size_t, const std::string &,
+                     const nlohmann::detail::exception &e) override {
+        if (error_.empty())
+            error_ = std::string("Invalid request: ") + e.what();
+        return false;
+    }
+
+  private:
+    struct Frame {
+        enum class Kind { Object, Array, Tree, Skip };
+        Kind kind;
+        Child child;          ///< Object and Array: what is being filled
+        json *tree = nullptr; ///< Tree: the container being built
+        std::size_t pending = std::string_view::npos; ///< Object: field
+        std::uint64_t seen = 0;   ///< Object: fields present
+        std::size_t count = 0;    ///< Array: elements; Skip: depth
+        std::string key;          ///< Tree: key of the next member
+    };
+
+    /// Where the next value goes.
+    struct Slot {
+        enum class Kind { Skip, Member, Tree };
+        Kind kind = Kind::Skip;
+        Child child;
+        json *tree = nullptr;
+    };
+
+    Slot next_slot() {
+        Slot slot;
+        if (stack_.empty()) {
+            slot.kind = Slot::Kind::Member;
+            slot.child = root_;
+            return slot;
+        }
+        Frame &top = stack_.back();
+        switch (top.kind) {
+        case Frame::Kind::Object:
+            if (top.pending != std::string_view::npos) {
+                slot.kind = Slot::Kind::Member;
+                slot.child = top.child.reader->field(top.child.target,
+                                                     top.pending);
+                top.seen |= std::uint64_t(1) << top.pending;
+            }
+            break;
+        case Frame::Kind::Array:
+            slot.kind = Slot::Kind::Member;
+            slot.child = top.child.reader->element(top.child.target);
+            ++top.count;
+            break;
+        case Frame::Kind::Tree:
+            slot.kind = Slot::Kind::Tree;
+            if (top.tree->is_array()) {
+                top.tree->push_back(nullptr);
+                slot.tree = &top.tree->back();
+            } else {
+                slot.tree = &(*top.tree)[top.key];
+            }
+            break;
+        case Frame::Kind::Skip:
+            break;
+        }
+        return slot;
+    }
+
+    /// Step into optionals: a null value empties the optional and
+    /// returns false; anything else is read into its value.
+    static bool unwrap(Child &child, bool is_null) {
+        while (child.reader->kind == Reader::Kind::Optional) {
+            if (is_null) {
+                child.reader->reset(child.target);
+                return false;
+            }
+            child = child.reader->element(child.target);
+        }
+        return true;
+    }
+
+    bool scalar(Scalar &value) {
+        Slot slot = next_slot();
+        if (slot.kind == Slot::Kind::Skip)
+            return true;
+        if (slot.kind == Slot::Kind::Tree) {
+            *slot.tree = to_json_value(value);
+            return true;
+        }
+        if (stack_.empty())
+            return fail_not_object();
+        Child child = slot.child;
+        if (!unwrap(child, value.kind == Scalar::Kind::Null))
+            return true;
+        if (child.reader->kind == Reader::Kind::Any) {
+            *static_cast<json *>(child.target) = to_json_value(value);
+            return true;
+        }
+        if (child.reader->kind != Reader::Kind::Scalar)
+            return fail_type(child.reader->type_name, kind_name(value.kind));
+        switch (child.reader->assign(child.target, value)) {
+        case Assigned::Ok:
+            return true;
+        case Assigned::WrongType:
+            return fail_type(child.reader->type_name, kind_name(value.kind));
+        case Assigned::OutOfRange:
+            error_ = "Value out of range for key '" + path() + "'";
+            return false;
+        }
+        return false;
+    }
+
+    bool open(bool object) {
+        const char *got = object ? "object" : "array";
+        if (!stack_.empty() && stack_.back().kind == Frame::Kind::Skip) {
+            ++stack_.back().count;
+            return true;
+        }
+        bool root = stack_.empty();
+        Slot slot = next_slot();
+        Frame frame;
+        if (slot.kind == Slot::Kind::Skip) {
+            frame.kind = Frame::Kind::Skip;
+            frame.count = 1;
+            stack_.push_back(std::move(frame));
+            return true;
+        }
+        if (slot.kind == Slot::Kind::Member) {
+            unwrap(slot.child, false);
+            if (slot.child.reader->kind == Reader::Kind::Any) {
+                slot.kind = Slot::Kind::Tree;
+                slot.tree = static_cast<json *>(slot.child.target);
+            }
+        }
+        if (slot.kind == Slot::Kind::Tree) {
+            *slot.tree = object ? json::object() : json::array();
+            frame.kind = Frame::Kind::Tree;
+            frame.tree = slot.tree;
+            stack_.push_back(std::move(frame));
+            return true;
+        }
+
+        Reader::Kind wanted =
+            object ? Reader::Kind::Object : Reader::Kind::Array;
+        if (slot.child.reader->kind != wanted) {
+            if (root)
+                return fail_not_object();
+            return fail_type(slot.child.reader->type_name, got);
+        }
+        frame.kind = object ? Frame::Kind::Object : Frame::Kind::Array;
+        frame.child = slot.child;
+        stack_.push_back(std::move(frame));
+        return true;
+    }
+
+    bool close() {
+        Frame &top = stack_.back();
+        if (top.kind == Frame::Kind::Skip && --top.count > 0)
+            return true;
+        if (top.kind == Frame::Kind::Object) {
+            std::uint64_t missing = top.child.reader->required & ~top.seen;
+            if (missing != 0) {
+                std::size_t index = 0;
+                while (!(missing & (std::uint64_t(1) << index)))
+                    ++index;
+                top.pending = std::string_view::npos;
+                std::string prefix = path();
+                if (!prefix.empty())
+                    prefix += '.';
+                error_ = "Missing key: " + prefix +
+                         top.child.reader->field_name(index);
+                return false;
+            }
+        }
+        stack_.pop_back();
+        return true;
+    }
+
+    /// Dotted path of the value being read, e.g. "items[2].x".
+    std::string path() const {
+        std::string out;
+        for (const Frame &frame : stack_) {
+            if (frame.kind == Frame::Kind::Object &&
+                frame.pending != std::string_view::npos) {
+                if (!out.empty())
+                    out += '.';
+                out += frame.child.reader->field_name(frame.pending);
+            } else if (frame.kind == Frame::Kind::Array && frame.count > 0) {
+                out += '[' + std::to_string(frame.count - 1) + ']';
+            }
+        }
+        return out;
+    }
+
+    bool fail_type(const char *expected, const char *got) {
+        error_ = "Wrong type for key '" + path() + "' (expected " + expected +
+                 ", got " + got + ")";
+        return false;
+    }
+
+    bool fail_not_object() {
+        error_ = "Top-level JSON must be an object.";
+        return false;
+    }
+
+    Child root_;
+    std::string &error_;
+    std::vector<Frame> stack_;
+};
+
+} // namespace
+
+bool decode_object(std::string_view data, Child root, std::string &error) {
+    error.clear();
+    Decoder decoder(root, error);
+    const char *begin = data.data();
+    const char *end = begin + data.size();
+    bool ok = false;
+    try {
+        switch (detect_codec(data)) {
+        case Codec::MessagePack:
+            ok = json::sax_parse(begin + 1, end, &decoder,
+                                 json::input_format_t::msgpack);
+            break;
+        case Codec::Cbor:
+            ok = json::sax_parse(begin + 1, end, &decoder,
+                                 json::input_format_t::cbor);
+            break;
+        case Codec::Json:
+            ok = json::sax_parse(begin, end, &decoder);
+            break;
+        }
+    } catch (const std::exception &e) {
+        // e.g. a value the member cannot hold, thrown while building json
+        error = std::string("Invalid request: ") + e.what();
+        return false;
+    }
+    if (!ok && error.empty())
+        error = "Invalid request";
+    return ok;
+}
+
+void write_string(Buffer &out, std::string_view value) {
+    static const char hex[] = "0123456789abcdef";
+    out.push_back('"');
+    std::size_t run = 0; // start of the bytes not yet copied
+    for (std::size_t i = 0; i < value.size(); ++i) {
+        auto c = static_cast<unsigned char>(value[i]);
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+        out.append(value.data() + run, i - run);
+        run = i + 1;
+        out.push_back('\\');
+        switch (c) {
+        case '"':
+        case '\\':
+            out.push_back(static_cast<char>(c));
+            break;
+        case '\b':
+            out.push_back('b');
+            break;
+        case '\f':
+            out.push_back('f');
+            break;
+        case '\n':
+            out.push_back('n');
+            break;
+        case '\r':
+            out.push_back('r');
+            break;
+        case '\t':
+            out.push_back('t');
+            break;
+        default:
+            write_literal(out, "u00");
+            out.push_back(hex[c >> 4]);
+            out.push_back(hex[c & 0xf]);
+        }
+    }
+    out.append(value.data() + run, value.size() - run);
+    out.push_back('"');
+}
+
+} // namespace typed_detail
+} // namespace Socks
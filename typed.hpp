@@ -0,0 +1,553 @@
+#pragma once
+
+#include "buffer.hpp"
+#include "codec.hpp"
+
+#include <charconv>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/**
+ * @file typed.hpp
+ * @brief Typed handlers: requests decoded straight into C++ structs and
+ * responses encoded straight from them.
+ *
+ * A struct becomes a request or response type by listing its fields with
+ * SOCKS_FIELDS next to it:
+ * @code
+ * struct FiboRequest {
+ *     int n;
+ *     std::optional<bool> verbose;
+ * };
+ * SOCKS_FIELDS(FiboRequest, n, verbose)
+ *
+ * struct FiboResponse {
+ *     std::int64_t result;
+ * };
+ * SOCKS_FIELDS(FiboResponse, result)
+ *
+ * server.add_handler<FiboRequest, FiboResponse>(
+ *     "fibo", [](const FiboRequest &req) { return FiboResponse{fib(req.n)}; });
+ * @endcode
+ *
+ * The request is read with nlohmann's SAX interface in any codec, so no
+ * json tree is built: each value goes straight into its member. The struct
+ * is the schema. Every field is required unless it is a std::optional,
+ * values must have the member's type (integers must also fit it), and
+ * fields the struct does not list, including `_cmd`, are skipped. A
+ * request that does not match is answered with an error naming the field,
+ * worded like CompiledSchema's, and the handler is not called.
+ *
+ * Fields can be bool, integers, floating point, std::string, std::vector
+ * and std::optional of field types, other described structs, and json for
+ * anything else (that one value is parsed into a tree).
+ *
+ * JSON responses are written field by field into the response buffer;
+ * MessagePack and CBOR responses go through a json tree.
+ *
+ * SOCKS_FIELDS also defines to_json() and from_json(), so described types
+ * convert to and from json as well, e.g. for Client calls.
+ */
+
+namespace Socks {
+
+/**
+ * @brief A member of a described struct and its name on the wire.
+ */
+template <typename Owner, typename T> struct Field {
+    using type = T;
+    const char *name;
+    T Owner::*member;
+};
+
+template <typename Owner, typename T>
+constexpr Field<Owner, T> field(const char *name, T Owner::*member) {
+    return {name, member};
+}
+
+namespace typed_detail {
+
+// ==========================
+// Type traits
+// ==========================
+
+template <typename T, typename = void>
+struct is_described : std::false_type {};
+
+// Found by argument-dependent lookup in T's namespace, like to_json().
+template <typename T>
+struct is_described<
+    T, std::void_t<decltype(socks_fields(static_cast<const T *>(nullptr)))>>
+    : std::true_type {};
+
+template <typename T> struct is_optional : std::false_type {};
+template <typename T> struct is_optional<std::optional<T>> : std::true_type {};
+
+template <typename T> struct is_vector : std::false_type {};
+template <typename T, typename A>
+struct is_vector<std::vector<T, A>> : std::true_type {};
+
+template <typename> constexpr bool dependent_false = false;
+
+template <typename T> constexpr auto fields_of() {
+    return socks_fields(static_cast<const T *>(nullptr));
+}
+
+// ==========================
+// Readers
+// ==========================
+
+/**
+ * @brief One SAX event carrying a value.
+ */
+struct Scalar {
+    enum class Kind { Null, Boolean, Integer, Unsigned, Float, String, Binary };
+    Kind kind = Kind::Null;
+    bool boolean = false;
+    std::int64_t integer = 0;
+    std::uint64_t unsigned_integer = 0;
+    double number = 0;
+    std::string *string = nullptr;     ///< May be moved from
+    json::binary_t *binary = nullptr;  ///< May be moved from
+};
+
+/// Outcome of storing a Scalar in a member.
+enum class Assigned { Ok, WrongType, OutOfRange };
+
+struct Reader;
+
+/// A member to be filled and how to fill it.
+struct Child {
+    void *target = nullptr;
+    const Reader *reader = nullptr;
+};
+
+/**
+ * @brief How the decoder fills values of one C++ type: a table of
+ * functions, one per described type, shared by every request.
+ */
+struct Reader {
+    enum class Kind { Scalar, Object, Array, Optional, Any };
+    Kind kind = Kind::Scalar;
+    const char *type_name = ""; ///< For error messages
+
+    // Kind::Scalar
+    Assigned (*assign)(void *target, Scalar &value) = nullptr;
+
+    // Kind::Object
+    std::size_t (*find)(std::string_view key) = nullptr; ///< npos if none
+    Child (*field)(void *target, std::size_t index) = nullptr;
+    const char *(*field_name)(std::size_t index) = nullptr;
+    std::uint64_t required = 0; ///< Bit i: field i must be present
+
+    // Kind::Array (element) and Kind::Optional (value)
+    Child (*element)(void *target) = nullptr;
+
+    // Kind::Optional
+    void (*reset)(void *target) = nullptr;
+};
+
+template <typename T> struct ReaderOf;
+
+template <typename T> Child child_of(T &value) {
+    return {&value, &ReaderOf<T>::value};
+}
+
+template <typename T> Assigned assign_scalar(void *target, Scalar &value) {
+    T &out = *static_cast<T *>(target);
+    using Kind = Scalar::Kind;
+    if constexpr (std::is_same_v<T, bool>) {
+        if (value.kind != Kind::Boolean)
+            return Assigned::WrongType;
+        out = value.boolean;
+    } else if constexpr (std::is_integral_v<T>) {
+        using Limits = std::numeric_limits<T>;
+        if (value.kind == Kind::Integer) {
+            if constexpr (std::is_signed_v<T>) {
+                if (value.integer < Limits::min() ||
+                    value.integer > Limits::max())
+                    return Assigned::OutOfRange;
+            } else {
+                if (value.integer < 0 ||
+                    static_cast<std::uint64_t>(value.integer) > Limits::max())
+                    return Assigned::OutOfRange;
+            }
+            out = static_cast<T>(value.integer);
+        } else if (value.kind == Kind::Unsigned) {
+            if (value.unsigned_integer >
+                static_cast<std::uint64_t>(Limits::max()))
+                return Assigned::OutOfRange;
+            out = static_cast<T>(value.unsigned_integer);
+        } else {
+            return Assigned::WrongType;
+        }
+    } else if constexpr (std::is_floating_point_v<T>) {
+        if (value.kind == Kind::Float) {
+            out = static_cast<T>(value.number);
+        } else if (value.kind == Kind::Integer) {
+            out = static_cast<T>(value.integer);
+        } else if (value.kind == Kind::Unsigned) {
+            out = static_cast<T>(value.unsigned_integer);
+        } else {
+            return Assigned::WrongType;
+        }
+    } else {
+        if (value.kind != Kind::String)
+            return Assigned::WrongType;
+        out = std::move(*value.string);
+    }
+    return Assigned::Ok;
+}
+
+template <typename T> struct ObjectOps {
+    static constexpr auto fields = fields_of<T>();
+    static constexpr std::size_t count = std::tuple_size_v<decltype(fields)>;
+    using Indices = std::make_index_sequence<count>;
+    static_assert(count <= 64, "A described struct has at most 64 fields");
+
+    template <std::size_t I>
+    using member_t = typename std::decay_t<decltype(std::get<I>(fields))>::type;
+
+    template <std::size_t... I>
+    static std::size_t find_in(std::string_view key,
+                               std::index_sequence<I...>) {
+        std::size_t index = std::string_view::npos;
+        ((key == std::get<I>(fields).name ? (index = I, true) : false) || ...);
+        return index;
+    }
+    static std::size_t find(std::string_view key) {
+        return find_in(key, Indices());
+    }
+
+    template <std::size_t... I>
+    static Child field_in(T &object, std::size_t index,
+                          std::index_sequence<I...>) {
+        Child child;
+        ((index == I ? (child = child_of(object.*(std::get<I>(fields).member)),
+                        true)
+                     : false) ||
+         ...);
+        return child;
+    }
+    static Child field(void *target, std::size_t index) {
+        return field_in(*static_cast<T *>(target), index, Indices());
+    }
+
+    template <std::size_t... I>
+    static const char *name_in(std::size_t index, std::index_sequence<I...>) {
+        const char *names[] = {std::get<I>(fields).name...};
+        return names[index];
+    }
+    static const char *field_name(std::size_t index) {
+        return name_in(index, Indices());
+    }
+
+    template <std::size_t... I>
+    static constexpr std::uint64_t required_in(std::index_sequence<I...>) {
+        return (std::uint64_t(0) | ... |
+                (is_optional<member_t<I>>::value ? std::uint64_t(0)
+                                                 : std::uint64_t(1) << I));
+    }
+};
+
+template <typename T> constexpr Reader make_reader() {
+    Reader reader;
+    if constexpr (std::is_same_v<T, json>) {
+        reader.kind = Reader::Kind::Any;
+        reader.type_name = "any";
+    } else if constexpr (is_optional<T>::value) {
+        using Value = typename T::value_type;
+        reader.kind = Reader::Kind::Optional;
+        reader.type_name = ReaderOf<Value>::value.type_name;
+        reader.element = [](void *target) {
+            return child_of(static_cast<T *>(target)->emplace());
+        };
+        reader.reset = [](void *target) { static_cast<T *>(target)->reset(); };
+    } else if constexpr (is_vector<T>::value) {
+        using Value = typename T::value_type;
+        static_assert(!std::is_same_v<Value, bool>,
+                      "std::vector<bool> fields are not supported");
+        reader.kind = Reader::Kind::Array;
+        reader.type_name = "array";
+        reader.element = [](void *target) {
+            return child_of(static_cast<T *>(target)->emplace_back());
+        };
+    } else if constexpr (is_described<T>::value) {
+        reader.kind = Reader::Kind::Object;
+        reader.type_name = "object";
+        reader.find = &ObjectOps<T>::find;
+        reader.field = &ObjectOps<T>::field;
+        reader.field_name = &ObjectOps<T>::field_name;
+        reader.required =
+            ObjectOps<T>::required_in(typename ObjectOps<T>::Indices());
+    } else if constexpr (std::is_same_v<T, bool>) {
+        reader.type_name = "boolean";
+        reader.assign = &assign_scalar<T>;
+    } else if constexpr (std::is_integral_v<T>) {
+        reader.type_name = "integer";
+        reader.assign = &assign_scalar<T>;
+    } else if constexpr (std::is_floating_point_v<T>) {
+        reader.type_name = "number";
+        reader.assign = &assign_scalar<T>;
+    } else if constexpr (std::is_same_v<T, std::string>) {
+        reader.type_name = "string";
+        reader.assign = &assign_scalar<T>;
+    } else {
+        static_assert(dependent_false<T>,
+                      "Unsupported typed field: use bool, a number, "
+                      "std::string, std::vector, std::optional, json or a "
+                      "struct described with SOCKS_FIELDS");
+    }
+    return reader;
+}
+
+template <typename T> struct ReaderOf {
+    static constexpr Reader value = make_reader<T>();
+};
+
+/**
+ * @brief Decode `data`, in any codec, into the object `root` describes.
+ * @return false, with `error` set, if it does not match.
+ */
+bool decode_object(std::string_view data, Child root, std::string &error);
+
+// ==========================
+// Writers
+// ==========================
+
+/**
+ * @brief Append `value` to `out` as a JSON string literal.
+ */
+void write_string(Buffer &out, std::string_view value);
+
+inline void write_literal(Buffer &out, std::string_view text) {
+    out.append(text.data(), text.size());
+}
+
+template <typename T> void write_value(Buffer &out, const T &value);
+
+template <typename T> void write_fields(Buffer &out, const T &object,
+                                        bool first) {
+    constexpr auto fields = fields_of<T>();
+    std::apply(
+        [&](const auto &...field) {
+            auto one = [&](const auto &f) {
+                const auto &member = object.*(f.member);
+                using Member = std::decay_t<decltype(member)>;
+                if constexpr (is_optional<Member>::value) {
+                    if (!member)
+                        return; // absent, as from_json() expects
+                }
+                if (!first)
+                    out.push_back(',');
+                first = false;
+                out.push_back('"');
+                write_literal(out, f.name);
+                write_literal(out, "\":");
+                write_value(out, member);
+            };
+            (one(field), ...);
+        },
+        fields);
+}
+
+template <typename T> void write_value(Buffer &out, const T &value) {
+    if constexpr (std::is_same_v<T, json>) {
+        write_literal(out, value.dump());
+    } else if constexpr (is_optional<T>::value) {
+        if (value) {
+            write_value(out, *value);
+        } else {
+            write_literal(out, "null");
+        }
+    } else if constexpr (is_vector<T>::value) {
+        out.push_back('[');
+        bool first = true;
+        for (const auto &element : value) {
+            if (!first)
+                out.push_back(',');
+            first = false;
+            write_value(out, element);
+        }
+        out.push_back(']');
+    } else if constexpr (is_described<T>::value) {
+        out.push_back('{');
+        write_fields(out, value, true);
+        out.push_back('}');
+    } else if constexpr (std::is_same_v<T, bool>) {
+        write_literal(out, value ? "true" : "false");
+    } else if constexpr (std::is_integral_v<T>) {
+        char digits[24];
+        auto end = std::to_chars(digits, digits + sizeof(digits), value).ptr;
+        out.append(digits, static_cast<std::size_t>(end - digits));
+    } else if constexpr (std::is_floating_point_v<T>) {
+        if (!std::isfinite(value)) {
+            write_literal(out, "null"); // as json::dump() does
+            return;
+        }
+        char digits[32];
+        auto end = std::to_chars(digits, digits + sizeof(digits),
+                                 static_cast<double>(value))
+                       .ptr;
+        std::string_view text(digits, static_cast<std::size_t>(end - digits));
+        out.append(text.data(), text.size());
+        // Keep it a float on the other side, like json::dump() ("1.0").
+        if (text.find_first_of(".e") == std::string_view::npos)
+            write_literal(out, ".0");
+    } else {
+        write_string(out, value);
+    }
+}
+
+template <typename Json, typename T> void to_dom(Json &out, const T &value) {
+    if constexpr (is_optional<T>::value) {
+        if (value) {
+            to_dom(out, *value);
+        } else {
+            out = nullptr;
+        }
+    } else if constexpr (is_vector<T>::value) {
+        out = Json::array();
+        for (const auto &element : value) {
+            Json item;
+            to_dom(item, element);
+            out.push_back(std::move(item));
+        }
+    } else if constexpr (is_described<T>::value) {
+        out = Json::object();
+        std::apply(
+            [&](const auto &...field) {
+                auto one = [&](const auto &f) {
+                    const auto &member = value.*(f.member);
+                    if constexpr (is_optional<
+                                      std::decay_t<decltype(member)>>::value) {
+                        if (!member)
+                            return;
+                    }
+                    to_dom(out[f.name], member);
+                };
+                (one(field), ...);
+            },
+            fields_of<T>());
+    } else {
+        out = value;
+    }
+}
+
+template <typename Json, typename T>
+void from_dom(const Json &in, T &value) {
+    if constexpr (is_optional<T>::value) {
+        if (in.is_null()) {
+            value.reset();
+        } else {
+            from_dom(in, value.emplace());
+        }
+    } else if constexpr (is_vector<T>::value) {
+        if (!in.is_array())
+            throw std::runtime_error("Expected array");
+        value.clear();
+        for (const auto &element : in)
+            from_dom(element, value.emplace_back());
+    } else if constexpr (is_described<T>::value) {
+        if (!in.is_object())
+            throw std::runtime_error("Expected object");
+        std::apply(
+            [&](const auto &...field) {
+                auto one = [&](const auto &f) {
+                    auto &member = value.*(f.member);
+                    auto found = in.find(f.name);
+                    if (found == in.end()) {
+                        if constexpr (!is_optional<
+                                          std::decay_t<decltype(member)>>::
+                                          value) {
+                            throw std::runtime_error(
+                                std::string("Missing key: ") + f.name);
+                        }
+                        return;
+                    }
+                    from_dom(*found, member);
+                };
+                (one(field), ...);
+            },
+            fields_of<T>());
+    } else {
+        in.get_to(value);
+    }
+}
+
+} // namespace typed_detail
+
+/**
+ * @brief Decode a request into a described struct without building a
+ * json tree.
+ *
+ * @param data An encoded message in any codec (see codec.hpp).
+ * @param out Filled in; fields the message lacks keep their values.
+ * @param error Set to the reason when the message does not match.
+ * @return Whether the message matched the struct.
+ */
+template <typename T>
+bool decode_typed(std::string_view data, T &out, std::string &error) {
+    static_assert(typed_detail::is_described<T>::value,
+                  "Requests must be described with SOCKS_FIELDS");
+    return typed_detail::decode_object(data, typed_detail::child_of(out),
+                                       error);
+}
+
+/**
+ * @brief Encode a described struct as a successful response: its fields
+ * plus `_success: true`.
+ */
+template <typename T>
+void encode_typed(const T &response, Codec codec, Buffer &out) {
+    static_assert(typed_detail::is_described<T>::value,
+                  "Responses must be described with SOCKS_FIELDS");
+    out.clear();
+    if (codec == Codec::Json) {
+        typed_detail::write_literal(out, "{\"_success\":true");
+        typed_detail::write_fields(out, response, false);
+        out.push_back('}');
+        return;
+    }
+    json tree;
+    typed_detail::to_dom(tree, response);
+    tree["_success"] = true;
+    encode(tree, codec, out);
+}
+
+} // namespace Socks
+
+/// One SOCKS_FIELDS entry.
+#define SOCKS_FIELD_ENTRY(member)                                              \
+    , std::make_tuple(::Socks::field(#member, &SocksSelf::member))
+
+/**
+ * @brief Describe a struct's fields for typed handlers (see typed.hpp).
+ *
+ * Use at namespace scope, in the struct's namespace, listing up to 63
+ * members by name. Defines socks_fields(), to_json() and from_json().
+ */
+#define SOCKS_FIELDS(Type, ...)                                                \
+    [[maybe_unused]] constexpr auto socks_fields(const Type *) {               \
+        using SocksSelf = Type;                                                \
+        return std::tuple_cat(std::tuple<>() NLOHMANN_JSON_EXPAND(             \
+            NLOHMANN_JSON_PASTE(SOCKS_FIELD_ENTRY, __VA_ARGS__)));             \
+    }                                                                          \
+    template <typename BasicJsonType>                                          \
+    void to_json(BasicJsonType &socks_json, const Type &socks_value) {         \
+        ::Socks::typed_detail::to_dom(socks_json, socks_value);                \
+    }                                                                          \
+    template <typename BasicJsonType>                                          \
+    void from_json(const BasicJsonType &socks_json, Type &socks_value) {       \
+        ::Socks::typed_detail::from_dom(socks_json, socks_value);              \
+    }